@@ -0,0 +1,150 @@
+#include "znzlib/znzlib.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <boost/version.hpp>
+#if BOOST_VERSION < 108000
+#define BOOST_NO_CXX98_FUNCTION_BASE
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+
+BOOST_AUTO_TEST_SUITE(test_bgzf)
+
+
+static std::string tmpname(const std::string& name)
+{
+    return "/tmp/test_bgzf_" + std::to_string(getpid()) + "_" + name;
+}
+
+// About 1MB, i.e. many 64kB blocks, that is neither constant nor random
+static std::vector<unsigned char> make_data()
+{
+    std::vector<unsigned char> d(1000003);
+    unsigned int state = 4711;
+    for (size_t i = 0; i < d.size(); i++) {
+        state = 1103515245u*state + 12345u;
+        d[i] = (i % 3) ? static_cast<unsigned char>(i / 1000) : static_cast<unsigned char>(state >> 24);
+    }
+    return d;
+}
+
+// Writes d in pieces of varying size, none of them aligned with the blocks
+static void write_file(const std::string& fname, const char *mode, const std::vector<unsigned char>& d)
+{
+    znzFile fp = znzopen(fname.c_str(), mode, 1);
+    BOOST_REQUIRE(!znz_isnull(fp));
+    size_t pos = 0, chunk = 7;
+    while (pos < d.size()) {
+        size_t m = std::min(chunk, d.size() - pos);
+        BOOST_REQUIRE_EQUAL(znzwrite(&d[pos], 1, m, fp), m);
+        pos += m;
+        chunk = (3*chunk + 1) % 200003;
+    }
+    znzclose(fp);
+}
+
+// Number of gzip members, from the BSIZE fields of the BGZF headers
+static unsigned int count_blocks(const std::string& fname)
+{
+    FILE *fp = std::fopen(fname.c_str(), "rb");
+    BOOST_REQUIRE(fp);
+    unsigned int n = 0;
+    unsigned char hdr[18];
+    while (std::fread(hdr, 1, 18, fp) == 18) {
+        BOOST_REQUIRE(hdr[0] == 31 && hdr[1] == 139 && (hdr[3] & 4));
+        BOOST_REQUIRE(hdr[12] == 'B' && hdr[13] == 'C');
+        long bsize = hdr[16] | (hdr[17] << 8);
+        std::fseek(fp, bsize + 1 - 18, SEEK_CUR);
+        n++;
+    }
+    std::fclose(fp);
+    return n;
+}
+
+BOOST_AUTO_TEST_CASE(round_trip)
+{
+    std::vector<unsigned char> d = make_data();
+    std::string fname = tmpname("a.gz");
+    for (const char *threads : {"1", "4"}) {
+        BOOST_TEST_CONTEXT("FSL_GZIP_THREADS = " << threads) {
+            setenv("FSL_GZIP_THREADS", threads, 1);
+            write_file(fname, "wbB", d);
+            BOOST_CHECK_GE(count_blocks(fname), d.size()/65536);
+            znzFile fp = znzopen(fname.c_str(), "rb", 1);
+            BOOST_REQUIRE(!znz_isnull(fp));
+            BOOST_CHECK_EQUAL(znz_isbgzf(fp), 1);
+            std::vector<unsigned char> buf(d.size() + 10);
+            BOOST_CHECK_EQUAL(znzread(&buf[0], 1, buf.size(), fp), d.size());
+            BOOST_CHECK(std::memcmp(&buf[0], &d[0], d.size()) == 0);
+            znzclose(fp);
+        }
+    }
+    // FSL_GZIP_BLOCKS does the same without the 'B'
+    setenv("FSL_GZIP_BLOCKS", "1", 1);
+    write_file(fname, "wb", d);
+    unsetenv("FSL_GZIP_BLOCKS");
+    BOOST_CHECK_GT(count_blocks(fname), 1u);
+    std::remove(fname.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(readable_as_plain_gzip)
+{
+    std::vector<unsigned char> d = make_data();
+    std::string fname = tmpname("b.gz");
+    write_file(fname, "wbB", d);
+    gzFile gz = gzopen(fname.c_str(), "rb");
+    BOOST_REQUIRE(gz);
+    std::vector<unsigned char> buf(d.size() + 10);
+    BOOST_CHECK_EQUAL(gzread(gz, &buf[0], buf.size()), static_cast<int>(d.size()));
+    BOOST_CHECK(std::memcmp(&buf[0], &d[0], d.size()) == 0);
+    gzclose(gz);
+    // And an ordinary gzip file is still read through zlib
+    write_file(fname, "wb", d);
+    znzFile fp = znzopen(fname.c_str(), "rb", 1);
+    BOOST_CHECK_EQUAL(znz_isbgzf(fp), 0);
+    BOOST_CHECK_EQUAL(znzread(&buf[0], 1, buf.size(), fp), d.size());
+    BOOST_CHECK(std::memcmp(&buf[0], &d[0], d.size()) == 0);
+    znzclose(fp);
+    std::remove(fname.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(seek_and_read)
+{
+    std::vector<unsigned char> d = make_data();
+    std::string fname = tmpname("c.gz");
+    write_file(fname, "wbB", d);
+    znzFile fp = znzopen(fname.c_str(), "rb", 1);
+    BOOST_REQUIRE(znz_isbgzf(fp));
+    std::vector<unsigned char> buf(300000);
+    // Within a block, across block boundaries, backwards and up to the end
+    long offs[] = {65530, 10, 900000, 65536, 0, 500001, 131071, long(d.size()) - 5};
+    size_t sizes[] = {12, 1, 99999, 300000, 65536, 3, 200000, 5};
+    for (int i = 0; i < 8; i++) {
+        BOOST_TEST_CONTEXT("offset = " << offs[i]) {
+            BOOST_REQUIRE_EQUAL(znzseek(fp, offs[i], SEEK_SET), offs[i]);   // As gzseek
+            BOOST_CHECK_EQUAL(znztell(fp), offs[i]);
+            BOOST_REQUIRE_EQUAL(znzread(&buf[0], 1, sizes[i], fp), sizes[i]);
+            BOOST_CHECK(std::memcmp(&buf[0], &d[offs[i]], sizes[i]) == 0);
+            BOOST_CHECK_EQUAL(znztell(fp), offs[i] + long(sizes[i]));
+        }
+    }
+    // Relative seek, and getc at the end
+    znzseek(fp, 1000, SEEK_SET);
+    znzseek(fp, 70000, SEEK_CUR);
+    BOOST_CHECK_EQUAL(znzgetc(fp), d[71000]);
+    znzseek(fp, long(d.size()) - 1, SEEK_SET);
+    BOOST_CHECK_EQUAL(znzgetc(fp), d.back());
+    BOOST_CHECK_EQUAL(znzgetc(fp), EOF);
+    znzclose(fp);
+    std::remove(fname.c_str());
+}
+
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,171 @@
+#include "NewNifti/NewNifti.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include <boost/version.hpp>
+#if BOOST_VERSION < 108000
+#define BOOST_NO_CXX98_FUNCTION_BASE
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+
+BOOST_AUTO_TEST_SUITE(test_imageio)
+
+
+using namespace NiftiIO;
+
+static std::string tmpname(const std::string& name)
+{
+    return "/tmp/test_imageio_" + std::to_string(getpid()) + "_" + name;
+}
+
+static void remove_image(const std::string& fname)
+{
+    std::remove(fname.c_str());
+    if (fname.size() > 4 && fname.substr(fname.size()-4) == ".hdr") {
+        std::remove((fname.substr(0, fname.size()-4) + ".img").c_str());
+    }
+}
+
+static NiftiHeader make_header(int nx, int ny, int nz, int nt, char version, bool singlefile)
+{
+    NiftiHeader hdr;
+    hdr.dim[0] = (nt > 1) ? 4 : 3;
+    hdr.dim[1] = nx; hdr.dim[2] = ny; hdr.dim[3] = nz; hdr.dim[4] = nt;
+    for (int i = 5; i < 8; i++) hdr.dim[i] = 1;
+    for (int i = 0; i < 8; i++) hdr.pixdim[i] = 1.0;
+    hdr.pixdim[1] = 2.0; hdr.pixdim[2] = 2.5; hdr.pixdim[3] = 3.0;
+    hdr.datatype = DT_FLOAT;
+    hdr.bitsPerVoxel = 32;
+    hdr.setNiftiVersion(version, singlefile);
+    return hdr;
+}
+
+static std::vector<float> make_data(size_t n)
+{
+    std::vector<float> d(n);
+    for (size_t i = 0; i < n; i++) d[i] = 0.5f*float(i) - 1000.0f*float(i % 7);
+    return d;
+}
+
+static std::vector<NiftiExtension> make_extensions()
+{
+    NiftiExtension ext;
+    ext.ecode = 6;  // NIFTI_ECODE_COMMENT
+    ext.edata = std::vector<char>(24, 'x');
+    ext.esize = ext.extensionSize();
+    return std::vector<NiftiExtension>(1, ext);
+}
+
+// Writes data with ImageWriter in chunks of varying size (none of them
+// a whole slice) and checks that loadImage returns the same thing.
+static void check_write(const std::string& fname, char version, bool singlefile, bool compressed)
+{
+    BOOST_TEST_CONTEXT(fname) {
+        int nx = 13, ny = 11, nz = 9, nt = 3;
+        size_t n = size_t(nx)*ny*nz*nt;
+        std::vector<float> data = make_data(n);
+        std::vector<NiftiExtension> exts = singlefile ? make_extensions() : std::vector<NiftiExtension>();
+        {
+            ImageWriter writer(fname, exts, make_header(nx, ny, nz, nt, version, singlefile), compressed);
+            size_t pos = 0, chunk = 1;
+            while (pos < n) {
+                size_t m = std::min(chunk, n - pos);
+                writer.write(&data[pos], m*sizeof(float));
+                pos += m;
+                chunk = 3*chunk + 1;
+            }
+            BOOST_CHECK_EQUAL(writer.bytesRemaining(), 0u);
+            writer.close();
+        }
+        char *buf = nullptr;
+        std::vector<NiftiExtension> rexts;
+        NiftiHeader hdr = loadImage(fname, buf, rexts);
+        BOOST_CHECK_EQUAL(hdr.niftiVersion(), version);
+        BOOST_CHECK_EQUAL(hdr.dim[4], nt);
+        BOOST_CHECK_EQUAL(hdr.pixdim[2], 2.5);
+        BOOST_CHECK_EQUAL(rexts.size(), exts.size());
+        if (rexts.size()) BOOST_CHECK(rexts[0].edata == exts[0].edata);
+        BOOST_CHECK(std::memcmp(buf, &data[0], n*sizeof(float)) == 0);
+        delete[] buf;
+        remove_image(fname);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(writer_same_as_saveimage)
+{
+    check_write(tmpname("a.nii"), 1, true, false);
+    check_write(tmpname("a.nii.gz"), 1, true, true);
+    check_write(tmpname("b.nii"), 2, true, false);
+    check_write(tmpname("c.hdr"), 1, false, false);
+}
+
+// Reads slabs in file order, backwards and at random offsets with one
+// ImageReader, and checks each against the data that were saved.
+static void check_read(const std::string& fname, bool compressed)
+{
+    BOOST_TEST_CONTEXT(fname) {
+        int nx = 17, ny = 12, nz = 10, nt = 2;
+        size_t ssz = size_t(nx)*ny, n = ssz*nz*nt;
+        std::vector<float> data = make_data(n);
+        saveImage(fname, reinterpret_cast<const char *>(&data[0]), make_extensions(), make_header(nx, ny, nz, nt, 1, true), compressed);
+        ImageReader reader(fname);
+        BOOST_CHECK_EQUAL(reader.header().nElements(), n);
+        BOOST_CHECK_EQUAL(reader.extensions().size(), 1u);
+        std::vector<float> buf(n);
+        // Slabs of three slices in file order, the last one short
+        for (size_t z = 0; z < size_t(nz)*nt; z += 3) {
+            size_t nsl = std::min(size_t(3), size_t(nz)*nt - z);
+            reader.read(&buf[0], z*ssz*sizeof(float), nsl*ssz*sizeof(float));
+            BOOST_REQUIRE(std::memcmp(&buf[0], &data[z*ssz], nsl*ssz*sizeof(float)) == 0);
+        }
+        // Backwards, one slice at a time
+        for (int z = nz*nt-1; z >= 0; z--) {
+            reader.read(&buf[0], z*ssz*sizeof(float), ssz*sizeof(float));
+            BOOST_REQUIRE(std::memcmp(&buf[0], &data[z*ssz], ssz*sizeof(float)) == 0);
+        }
+        // Odd offsets and sizes, not aligned with slices
+        size_t offs[] = {n-1, 5, 1234, 0, n/2 + 3};
+        for (size_t o : offs) {
+            size_t m = std::min(size_t(301), n - o);
+            reader.read(&buf[0], o*sizeof(float), m*sizeof(float));
+            BOOST_REQUIRE(std::memcmp(&buf[0], &data[o], m*sizeof(float)) == 0);
+        }
+        remove_image(fname);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(reader_slabs_and_seeks)
+{
+    check_read(tmpname("d.nii"), false);
+    check_read(tmpname("d.nii.gz"), true);
+}
+
+BOOST_AUTO_TEST_CASE(misuse_throws)
+{
+    std::string fname = tmpname("e.nii");
+    std::vector<float> data = make_data(4*4*4);
+    {
+        ImageWriter writer(fname, std::vector<NiftiExtension>(), make_header(4, 4, 4, 1, 1, true), false);
+        writer.write(&data[0], 60*sizeof(float));
+        BOOST_CHECK_THROW(writer.write(&data[0], 5*sizeof(float)), NiftiException);
+        BOOST_CHECK_THROW(writer.close(), NiftiException);   // 4 voxels short
+        BOOST_CHECK_THROW(writer.write(&data[0], sizeof(float)), NiftiException);
+    }
+    saveImage(fname, reinterpret_cast<const char *>(&data[0]), std::vector<NiftiExtension>(), make_header(4, 4, 4, 1, 1, true), false);
+    ImageReader reader(fname);
+    std::vector<float> buf(64);
+    BOOST_CHECK_THROW(reader.read(&buf[0], 60*sizeof(float), 5*sizeof(float)), NiftiException);
+    BOOST_CHECK_THROW(reader.read(&buf[0], 2, sizeof(float)), NiftiException);
+    BOOST_CHECK_NO_THROW(reader.read(&buf[0], 60*sizeof(float), 4*sizeof(float)));
+    BOOST_CHECK(std::memcmp(&buf[0], &data[60], 4*sizeof(float)) == 0);
+    std::remove(fname.c_str());
+}
+
+
+BOOST_AUTO_TEST_SUITE_END()
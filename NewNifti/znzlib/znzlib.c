@@ -39,6 +39,434 @@ znzlib.c  (zipped or non-zipped library)
 */
 
 
+/*
+  Block gzip (BGZF) streams
+
+  Each block is a complete gzip member whose header carries an extra
+  field ('B','C',BSIZE) giving the total size of the block. That means
+  the blocks of a file can be located without decompressing it, and
+  then be (de)compressed independently of each other by several
+  threads at once. A stream is terminated by an empty block.
+*/
+
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define ZNZ_BGZF_HDR_SIZE    18            /* gzip header incl. BC extra field */
+#define ZNZ_BGZF_FTR_SIZE    8             /* crc32 + isize */
+#define ZNZ_BGZF_MAX_BLOCK   65536         /* Max size of compressed block */
+#define ZNZ_BGZF_MAX_DATA    65280         /* Max data per block, leaves room for stored (incompressible) data */
+#define ZNZ_BGZF_BATCH       16            /* # of blocks compressed per thread and batch */
+#define ZNZ_BGZF_PAR_MIN     4             /* Smallest # of blocks that are decompressed in parallel */
+#define ZNZ_BGZF_MAX_THREADS 64
+#define ZNZ_GZ_BUFFER        (1<<18)       /* zlib buffer size for ordinary gzip files */
+
+struct znz_bgzf {
+  int             writing;
+  int             nthreads;
+  int             level;
+  int             error;
+  /* Reading */
+  int             fd;
+  size_t          nblocks;
+  off_t          *coff;      /* nblocks+1 offsets into compressed file */
+  size_t         *uoff;      /* nblocks+1 offsets into uncompressed data */
+  size_t          upos;      /* Current position in uncompressed data */
+  size_t          cached;    /* Index of block in cache, nblocks if none */
+  unsigned char  *cache;
+  unsigned char  *ctmp;
+  /* Writing */
+  FILE           *fp;
+  unsigned char  *wbuf;      /* Data waiting to be compressed */
+  size_t          wlen;
+  size_t          wcap;
+  size_t          wtot;      /* # of bytes already compressed and written */
+  unsigned char  *cbuf;      /* Compressed blocks, ZNZ_BGZF_MAX_BLOCK bytes apart */
+  size_t         *clen;
+};
+
+struct znz_bgzf_job {
+  struct znz_bgzf *bz;
+  size_t           first;    /* First block */
+  size_t           last;     /* One past last block */
+  size_t           start;    /* Range of uncompressed data that goes into dst */
+  size_t           end;
+  unsigned char   *dst;
+  int              error;
+};
+
+static int znz_bgzf_nthreads(void)
+{
+  const char *s = getenv("FSL_GZIP_THREADS");
+  int n = (s != NULL) ? atoi(s) : 0;
+  if (n < 1) {
+    long np = sysconf(_SC_NPROCESSORS_ONLN);
+    n = (np > 0) ? (int)np : 1;
+  }
+  return (n > ZNZ_BGZF_MAX_THREADS) ? ZNZ_BGZF_MAX_THREADS : n;
+}
+
+static int znz_bgzf_requested(const char *mode)
+{
+  const char *s = getenv("FSL_GZIP_BLOCKS");
+  if (strchr(mode,'r') != NULL || strchr(mode,'a') != NULL) return 0;
+  if (strchr(mode,'B') != NULL) return 1;
+  return (s != NULL && atoi(s) != 0);
+}
+
+static int znz_bgzf_level(const char *mode)
+{
+  for (; *mode; mode++) if (*mode >= '0' && *mode <= '9') return *mode - '0';
+  return Z_DEFAULT_COMPRESSION;
+}
+
+static unsigned long znz_get_le32(const unsigned char *p)
+{
+  return (unsigned long)p[0] | ((unsigned long)p[1]<<8) | ((unsigned long)p[2]<<16) | ((unsigned long)p[3]<<24);
+}
+
+static void znz_put_le32(unsigned char *p, unsigned long v)
+{
+  p[0] = v & 0xff; p[1] = (v>>8) & 0xff; p[2] = (v>>16) & 0xff; p[3] = (v>>24) & 0xff;
+}
+
+static int znz_bgzf_header_ok(const unsigned char *h)
+{
+  return (h[0] == 31 && h[1] == 139 && h[2] == 8 && (h[3] & 4) &&
+          h[10] == 6 && h[11] == 0 && h[12] == 'B' && h[13] == 'C' && h[14] == 2 && h[15] == 0);
+}
+
+static void znz_bgzf_free(struct znz_bgzf *bz)
+{
+  free(bz->coff); free(bz->uoff); free(bz->cache); free(bz->ctmp);
+  free(bz->wbuf); free(bz->cbuf); free(bz->clen);
+  free(bz);
+}
+
+/* Compresses slen bytes from src into a complete block at dst. Returns size of block, 0 on error. */
+static size_t znz_bgzf_deflate_block(const unsigned char *src, size_t slen, unsigned char *dst, int level)
+{
+  static const unsigned char hdr[ZNZ_BGZF_HDR_SIZE] = {31,139,8,4,0,0,0,0,0,255,6,0,'B','C',2,0,0,0};
+  z_stream zs;
+  size_t bsize;
+  int ret;
+
+  for (;;) {
+    memset(&zs,0,sizeof(zs));
+    if (deflateInit2(&zs,level,Z_DEFLATED,-15,8,Z_DEFAULT_STRATEGY) != Z_OK) return 0;
+    zs.next_in = (Bytef *)src;
+    zs.avail_in = (uInt)slen;
+    zs.next_out = dst + ZNZ_BGZF_HDR_SIZE;
+    zs.avail_out = ZNZ_BGZF_MAX_BLOCK - ZNZ_BGZF_HDR_SIZE - ZNZ_BGZF_FTR_SIZE;
+    ret = deflate(&zs,Z_FINISH);
+    deflateEnd(&zs);
+    if (ret == Z_STREAM_END) break;
+    if (level == 0) return 0;
+    level = 0;  /* Data expanded, store it instead */
+  }
+  bsize = ZNZ_BGZF_HDR_SIZE + zs.total_out + ZNZ_BGZF_FTR_SIZE;
+  memcpy(dst,hdr,ZNZ_BGZF_HDR_SIZE);
+  dst[16] = (bsize-1) & 0xff;
+  dst[17] = ((bsize-1)>>8) & 0xff;
+  znz_put_le32(dst+bsize-8,crc32(crc32(0L,Z_NULL,0),src,(uInt)slen));
+  znz_put_le32(dst+bsize-4,(unsigned long)slen);
+  return bsize;
+}
+
+/* Decompresses block b into dst, which must hold all of it. tmp must hold ZNZ_BGZF_MAX_BLOCK bytes. */
+static int znz_bgzf_inflate_block(const struct znz_bgzf *bz, size_t b, unsigned char *dst, unsigned char *tmp)
+{
+  size_t csize = (size_t)(bz->coff[b+1] - bz->coff[b]);
+  size_t usize = bz->uoff[b+1] - bz->uoff[b];
+  z_stream zs;
+  int ret;
+
+  if (pread(bz->fd,tmp,csize,bz->coff[b]) != (ssize_t)csize) return -1;
+  memset(&zs,0,sizeof(zs));
+  if (inflateInit2(&zs,-15) != Z_OK) return -1;
+  zs.next_in = tmp + ZNZ_BGZF_HDR_SIZE;
+  zs.avail_in = (uInt)(csize - ZNZ_BGZF_HDR_SIZE - ZNZ_BGZF_FTR_SIZE);
+  zs.next_out = dst;
+  zs.avail_out = (uInt)usize;
+  ret = inflate(&zs,Z_FINISH);
+  inflateEnd(&zs);
+  if (ret != Z_STREAM_END || zs.total_out != usize) return -1;
+  if (crc32(crc32(0L,Z_NULL,0),dst,(uInt)usize) != znz_get_le32(tmp+csize-8)) return -1;
+  return 0;
+}
+
+static void *znz_bgzf_deflate_worker(void *arg)
+{
+  struct znz_bgzf_job *job = (struct znz_bgzf_job *) arg;
+  struct znz_bgzf *bz = job->bz;
+  size_t b, slen;
+
+  for (b=job->first; b<job->last; b++) {
+    slen = bz->wlen - b*ZNZ_BGZF_MAX_DATA;
+    if (slen > ZNZ_BGZF_MAX_DATA) slen = ZNZ_BGZF_MAX_DATA;
+    bz->clen[b] = znz_bgzf_deflate_block(bz->wbuf + b*ZNZ_BGZF_MAX_DATA,slen,bz->cbuf + b*ZNZ_BGZF_MAX_BLOCK,bz->level);
+    if (bz->clen[b] == 0) job->error = 1;
+  }
+  return NULL;
+}
+
+static void *znz_bgzf_inflate_worker(void *arg)
+{
+  struct znz_bgzf_job *job = (struct znz_bgzf_job *) arg;
+  const struct znz_bgzf *bz = job->bz;
+  unsigned char *tmp = (unsigned char *) malloc(2*ZNZ_BGZF_MAX_BLOCK);
+  size_t b, lo, hi;
+
+  if (tmp == NULL) { job->error = 1; return NULL; }
+  for (b=job->first; b<job->last && !job->error; b++) {
+    lo = (job->start > bz->uoff[b]) ? job->start : bz->uoff[b];
+    hi = (job->end < bz->uoff[b+1]) ? job->end : bz->uoff[b+1];
+    if (lo == bz->uoff[b] && hi == bz->uoff[b+1]) {  /* Whole block, straight into destination */
+      if (znz_bgzf_inflate_block(bz,b,job->dst + (lo - job->start),tmp)) job->error = 1;
+    }
+    else if (znz_bgzf_inflate_block(bz,b,tmp + ZNZ_BGZF_MAX_BLOCK,tmp)) job->error = 1;
+    else memcpy(job->dst + (lo - job->start),tmp + ZNZ_BGZF_MAX_BLOCK + (lo - bz->uoff[b]),hi - lo);
+  }
+  free(tmp);
+  return NULL;
+}
+
+/* Runs worker on blocks [first,last), divided into contiguous ranges over up to bz->nthreads threads */
+static int znz_bgzf_run(struct znz_bgzf *bz, void *(*worker)(void *), size_t first, size_t last,
+                        size_t start, size_t end, unsigned char *dst)
+{
+  struct znz_bgzf_job jobs[ZNZ_BGZF_MAX_THREADS];
+  pthread_t threads[ZNZ_BGZF_MAX_THREADS];
+  int started[ZNZ_BGZF_MAX_THREADS];
+  size_t nb = last - first;
+  int nt = (nb < (size_t)bz->nthreads) ? (int)nb : bz->nthreads;
+  int i, error = 0;
+
+  for (i=0; i<nt; i++) {
+    jobs[i].bz = bz;
+    jobs[i].first = first + (i*nb)/nt;
+    jobs[i].last = first + ((i+1)*nb)/nt;
+    jobs[i].start = start;
+    jobs[i].end = end;
+    jobs[i].dst = dst;
+    jobs[i].error = 0;
+  }
+  for (i=1; i<nt; i++) started[i] = (pthread_create(&threads[i],NULL,worker,&jobs[i]) == 0);
+  if (nt > 0) worker(&jobs[0]);
+  for (i=1; i<nt; i++) {
+    if (started[i]) pthread_join(threads[i],NULL);
+    else worker(&jobs[i]);  /* Could not get a thread, do it here instead */
+  }
+  for (i=0; i<nt; i++) error |= jobs[i].error;
+  return error;
+}
+
+/* Returns a stream if path is a block gzip file, NULL otherwise */
+static struct znz_bgzf *znz_bgzf_open_read(const char *path)
+{
+  struct znz_bgzf *bz;
+  unsigned char h[ZNZ_BGZF_HDR_SIZE];
+  unsigned char isize[4];
+  struct stat st;
+  off_t off = 0;
+  size_t cap = 0, bsize;
+  int fd;
+
+  if ((fd = open(path,O_RDONLY)) < 0) return NULL;
+  if (pread(fd,h,ZNZ_BGZF_HDR_SIZE,0) != ZNZ_BGZF_HDR_SIZE || !znz_bgzf_header_ok(h) || fstat(fd,&st)) {
+    close(fd);
+    return NULL;
+  }
+  if ((bz = (struct znz_bgzf *) calloc(1,sizeof(struct znz_bgzf))) == NULL) { close(fd); return NULL; }
+  bz->fd = fd;
+  bz->nthreads = znz_bgzf_nthreads();
+  /* Index all blocks. Anything that doesn't look like BGZF is left to zlib. */
+  while (off < st.st_size) {
+    if (bz->nblocks+2 > cap) {
+      off_t *coff;
+      size_t *uoff;
+      cap = (cap) ? 2*cap : 1024;
+      if ((coff = (off_t *) realloc(bz->coff,cap*sizeof(off_t))) != NULL) bz->coff = coff;
+      if ((uoff = (size_t *) realloc(bz->uoff,cap*sizeof(size_t))) != NULL) bz->uoff = uoff;
+      if (coff == NULL || uoff == NULL) break;
+      if (bz->nblocks == 0) bz->uoff[0] = 0;
+    }
+    if (pread(fd,h,ZNZ_BGZF_HDR_SIZE,off) != ZNZ_BGZF_HDR_SIZE || !znz_bgzf_header_ok(h)) break;
+    bsize = ((size_t)h[16] | ((size_t)h[17]<<8)) + 1;
+    if (bsize < ZNZ_BGZF_HDR_SIZE + ZNZ_BGZF_FTR_SIZE || off + (off_t)bsize > st.st_size) break;
+    if (pread(fd,isize,4,off+bsize-4) != 4 || znz_get_le32(isize) > ZNZ_BGZF_MAX_BLOCK) break;
+    bz->coff[bz->nblocks] = off;
+    bz->uoff[bz->nblocks+1] = bz->uoff[bz->nblocks] + znz_get_le32(isize);
+    bz->nblocks++;
+    off += bsize;
+  }
+  if (off != st.st_size || (bz->cache = (unsigned char *) malloc(ZNZ_BGZF_MAX_BLOCK)) == NULL ||
+      (bz->ctmp = (unsigned char *) malloc(ZNZ_BGZF_MAX_BLOCK)) == NULL) {
+    close(fd);
+    znz_bgzf_free(bz);
+    return NULL;
+  }
+  bz->coff[bz->nblocks] = off;
+  bz->cached = bz->nblocks;
+  return bz;
+}
+
+static struct znz_bgzf *znz_bgzf_open_write(const char *path, const char *mode)
+{
+  struct znz_bgzf *bz;
+  size_t nb;
+
+  if ((bz = (struct znz_bgzf *) calloc(1,sizeof(struct znz_bgzf))) == NULL) return NULL;
+  bz->writing = 1;
+  bz->fd = -1;
+  bz->nthreads = znz_bgzf_nthreads();
+  bz->level = znz_bgzf_level(mode);
+  nb = bz->nthreads * ZNZ_BGZF_BATCH;
+  bz->wcap = nb * ZNZ_BGZF_MAX_DATA;
+  bz->wbuf = (unsigned char *) malloc(bz->wcap);
+  bz->cbuf = (unsigned char *) malloc(nb * ZNZ_BGZF_MAX_BLOCK);
+  bz->clen = (size_t *) malloc(nb * sizeof(size_t));
+  if (bz->wbuf == NULL || bz->cbuf == NULL || bz->clen == NULL || (bz->fp = fopen(path,"wb")) == NULL) {
+    znz_bgzf_free(bz);
+    return NULL;
+  }
+  return bz;
+}
+
+/* Compresses and writes everything that has been buffered */
+static int znz_bgzf_flush(struct znz_bgzf *bz)
+{
+  size_t nb, b;
+
+  if (bz->wlen == 0 || bz->error) return bz->error;
+  nb = (bz->wlen + ZNZ_BGZF_MAX_DATA - 1) / ZNZ_BGZF_MAX_DATA;
+  bz->error = znz_bgzf_run(bz,znz_bgzf_deflate_worker,0,nb,0,0,NULL);
+  for (b=0; b<nb && !bz->error; b++) {
+    if (fwrite(bz->cbuf + b*ZNZ_BGZF_MAX_BLOCK,1,bz->clen[b],bz->fp) != bz->clen[b]) bz->error = 1;
+  }
+  bz->wtot += bz->wlen;
+  bz->wlen = 0;
+  return bz->error;
+}
+
+static size_t znz_bgzf_write(struct znz_bgzf *bz, const void *buf, size_t len)
+{
+  const unsigned char *cbuf = (const unsigned char *) buf;
+  size_t done = 0, n;
+
+  if (!bz->writing) return 0;
+  while (done < len && !bz->error) {
+    n = (len - done < bz->wcap - bz->wlen) ? len - done : bz->wcap - bz->wlen;
+    memcpy(bz->wbuf + bz->wlen,cbuf + done,n);
+    bz->wlen += n;
+    done += n;
+    if (bz->wlen == bz->wcap) znz_bgzf_flush(bz);
+  }
+  return (bz->error) ? 0 : done;
+}
+
+/* Returns index of the block that contains uncompressed position pos */
+static size_t znz_bgzf_find_block(const struct znz_bgzf *bz, size_t pos)
+{
+  size_t lo = 0, hi = bz->nblocks, mid;
+  while (hi - lo > 1) {
+    mid = (lo + hi) / 2;
+    if (bz->uoff[mid] <= pos) lo = mid;
+    else hi = mid;
+  }
+  return lo;
+}
+
+static size_t znz_bgzf_read(struct znz_bgzf *bz, void *buf, size_t len)
+{
+  unsigned char *dst = (unsigned char *) buf;
+  size_t total = bz->uoff[bz->nblocks];
+  size_t start = bz->upos, end, first, last, b, lo, hi;
+
+  if (bz->writing || bz->error || start >= total || len == 0) return 0;
+  end = (len < total - start) ? start + len : total;
+  first = znz_bgzf_find_block(bz,start);
+  last = znz_bgzf_find_block(bz,end-1) + 1;
+  if (last - first >= ZNZ_BGZF_PAR_MIN && bz->nthreads > 1) {
+    bz->error = znz_bgzf_run(bz,znz_bgzf_inflate_worker,first,last,start,end,dst);
+  }
+  else {  /* Small reads (headers etc) go through a single block cache */
+    for (b=first; b<last && !bz->error; b++) {
+      lo = (start > bz->uoff[b]) ? start : bz->uoff[b];
+      hi = (end < bz->uoff[b+1]) ? end : bz->uoff[b+1];
+      if (lo == bz->uoff[b] && hi == bz->uoff[b+1] && b != bz->cached) {
+        bz->error = znz_bgzf_inflate_block(bz,b,dst + (lo - start),bz->ctmp);
+      }
+      else {
+        if (b != bz->cached) {
+          bz->cached = b;
+          if (znz_bgzf_inflate_block(bz,b,bz->cache,bz->ctmp)) { bz->cached = bz->nblocks; bz->error = 1; break; }
+        }
+        memcpy(dst + (lo - start),bz->cache + (lo - bz->uoff[b]),hi - lo);
+      }
+    }
+  }
+  if (bz->error) {
+    fprintf(stderr,"** znzread: corrupt block gzip data\n");
+    return 0;
+  }
+  bz->upos = end;
+  return end - start;
+}
+
+static long znz_bgzf_seek(struct znz_bgzf *bz, long offset, int whence)
+{
+  static const unsigned char zeros[1024] = {0};
+  long pos, cur;
+
+  if (bz->writing) {  /* Only forward seeks, filling with zeros */
+    cur = (long)(bz->wtot + bz->wlen);
+    pos = (whence == SEEK_CUR) ? cur + offset : offset;
+    if (whence == SEEK_END || pos < cur) return -1;
+    for (; cur < pos && !bz->error; cur = (long)(bz->wtot + bz->wlen)) {
+      znz_bgzf_write(bz,zeros,(pos - cur < (long)sizeof(zeros)) ? (size_t)(pos - cur) : sizeof(zeros));
+    }
+    return (bz->error) ? -1 : pos;
+  }
+  if (whence == SEEK_SET) pos = offset;
+  else if (whence == SEEK_CUR) pos = (long)bz->upos + offset;
+  else pos = (long)bz->uoff[bz->nblocks] + offset;
+  if (pos < 0) return -1;
+  bz->upos = (size_t)pos;
+  return pos;
+}
+
+static long znz_bgzf_tell(const struct znz_bgzf *bz)
+{
+  return (bz->writing) ? (long)(bz->wtot + bz->wlen) : (long)bz->upos;
+}
+
+static int znz_bgzf_close(struct znz_bgzf *bz)
+{
+  int retval = 0;
+  size_t n;
+
+  if (bz->writing) {
+    znz_bgzf_flush(bz);
+    n = znz_bgzf_deflate_block(bz->wbuf,0,bz->cbuf,bz->level);  /* End-of-file marker */
+    if (bz->error || n == 0 || fwrite(bz->cbuf,1,n,bz->fp) != n) retval = -1;
+    if (fclose(bz->fp)) retval = -1;
+  }
+  else close(bz->fd);
+  znz_bgzf_free(bz);
+  return retval;
+}
+
+
+int znz_isbgzf(znzFile file)
+{
+  return (file != NULL && file->bzfptr != NULL);
+}
+
+
 /* Note extra argument (use_compression) where 
    use_compression==0 is no compression
    use_compression!=0 uses zlib (gzip) compression
@@ -55,12 +483,25 @@ znzFile znzopen(const char *path, const char *mode, int use_compression)
 
   file->nzfptr = NULL;
   file->zfptr = NULL;
+  file->bzfptr = NULL;
 
   if (use_compression) {
     file->withz = 1;
-    if((file->zfptr = gzopen(path,mode)) == NULL) {
+    if (znz_bgzf_requested(mode)) {
+      if((file->bzfptr = znz_bgzf_open_write(path,mode)) == NULL) {
+        free(file);
+        file = NULL;
+      }
+    } else if (strchr(mode,'r') != NULL && (file->bzfptr = znz_bgzf_open_read(path)) != NULL) {
+      /* Block compressed file, read in parallel */
+    } else if((file->zfptr = gzopen(path,mode)) == NULL) {
         free(file);
         file = NULL;
+    } else {
+#if ZLIB_VERNUM >= 0x1240
+      /* Larger buffer means fewer, larger, inflate calls */
+      gzbuffer(file->zfptr,ZNZ_GZ_BUFFER);
+#endif
     }
   } else {
 
@@ -101,6 +542,7 @@ int Xznzclose(znzFile * file)
   if (*file!=NULL) {
     if ((*file)->zfptr!=NULL)  { retval = gzclose((*file)->zfptr); }
     if ((*file)->nzfptr!=NULL) { retval = fclose((*file)->nzfptr); }
+    if ((*file)->bzfptr!=NULL) { retval = znz_bgzf_close((*file)->bzfptr); }
                                                                                 
     free(*file);
     *file = NULL;
@@ -121,6 +563,9 @@ size_t znzread(void* buf, size_t size, size_t nmemb, znzFile file)
   int        nread;
 
   if (file==NULL) { return 0; }
+  if (file->bzfptr!=NULL) {
+    return (size) ? znz_bgzf_read(file->bzfptr,buf,size*nmemb)/size : 0;
+  }
   if (file->zfptr!=NULL) {
     /* gzread/write take unsigned int length, so maybe read in int pieces
        (noted by M Hanke, example given by M Adler)   6 July 2010 [rickr] */
@@ -153,6 +598,9 @@ size_t znzwrite(const void* buf, size_t size, size_t nmemb, znzFile file)
   int        nwritten;
 
   if (file==NULL) { return 0; }
+  if (file->bzfptr!=NULL) {
+    return (size) ? znz_bgzf_write(file->bzfptr,buf,size*nmemb)/size : 0;
+  }
   if (file->zfptr!=NULL) {
     while( remain > 0 ) {
        n2write = (remain < ZNZ_MAX_BLOCK_SIZE) ? remain : ZNZ_MAX_BLOCK_SIZE;
@@ -180,6 +628,7 @@ size_t znzwrite(const void* buf, size_t size, size_t nmemb, znzFile file)
 long znzseek(znzFile file, long offset, int whence)
 {
   if (file==NULL) { return 0; }
+  if (file->bzfptr!=NULL) return znz_bgzf_seek(file->bzfptr,offset,whence);
   if (file->zfptr!=NULL) return (long) gzseek(file->zfptr,offset,whence);
   return fseek(file->nzfptr,offset,whence);
 }
@@ -193,6 +642,7 @@ int znzrewind(znzFile stream)
      if (stream->zfptr!=NULL) return gzrewind(stream->zfptr);
   */
 
+  if (stream->bzfptr!=NULL) return (int)znz_bgzf_seek(stream->bzfptr, 0L, SEEK_SET);
   if (stream->zfptr!=NULL) return (int)gzseek(stream->zfptr, 0L, SEEK_SET);
   rewind(stream->nzfptr);
   return 0;
@@ -201,6 +651,7 @@ int znzrewind(znzFile stream)
 long znztell(znzFile file)
 {
   if (file==NULL) { return 0; }
+  if (file->bzfptr!=NULL) return znz_bgzf_tell(file->bzfptr);
   if (file->zfptr!=NULL) return (long) gztell(file->zfptr);
   return ftell(file->nzfptr);
 }
@@ -208,6 +659,7 @@ long znztell(znzFile file)
 int znzputs(const char * str, znzFile file)
 {
   if (file==NULL) { return 0; }
+  if (file->bzfptr!=NULL) return (int)znz_bgzf_write(file->bzfptr,str,strlen(str));
   if (file->zfptr!=NULL) return gzputs(file->zfptr,str);
   return fputs(str,file->nzfptr);
 }
@@ -216,6 +668,13 @@ int znzputs(const char * str, znzFile file)
 char * znzgets(char* str, int size, znzFile file)
 {
   if (file==NULL) { return NULL; }
+  if (file->bzfptr!=NULL) {
+    int n = 0;
+    while (n < size-1 && znz_bgzf_read(file->bzfptr,str+n,1) == 1 && str[n++] != '\n') ;
+    if (n == 0 || size < 1) return NULL;
+    str[n] = '\0';
+    return str;
+  }
   if (file->zfptr!=NULL) return gzgets(file->zfptr,str,size);
   return fgets(str,size,file->nzfptr);
 }
@@ -224,6 +683,7 @@ char * znzgets(char* str, int size, znzFile file)
 int znzflush(znzFile file)
 {
   if (file==NULL) { return 0; }
+  if (file->bzfptr!=NULL) return znz_bgzf_flush(file->bzfptr);
   if (file->zfptr!=NULL) return gzflush(file->zfptr,Z_SYNC_FLUSH);
   return fflush(file->nzfptr);
 }
@@ -232,6 +692,7 @@ int znzflush(znzFile file)
 int znzeof(znzFile file)
 {
   if (file==NULL) { return 0; }
+  if (file->bzfptr!=NULL) return (!file->bzfptr->writing && file->bzfptr->upos >= file->bzfptr->uoff[file->bzfptr->nblocks]);
   if (file->zfptr!=NULL) return gzeof(file->zfptr);
   return feof(file->nzfptr);
 }
@@ -240,6 +701,10 @@ int znzeof(znzFile file)
 int znzputc(int c, znzFile file)
 {
   if (file==NULL) { return 0; }
+  if (file->bzfptr!=NULL) {
+    unsigned char uc = (unsigned char)c;
+    return (znz_bgzf_write(file->bzfptr,&uc,1) == 1) ? (int)uc : -1;
+  }
   if (file->zfptr!=NULL) return gzputc(file->zfptr,c);
   return fputc(c,file->nzfptr);
 }
@@ -248,6 +713,10 @@ int znzputc(int c, znzFile file)
 int znzgetc(znzFile file)
 {
   if (file==NULL) { return 0; }
+  if (file->bzfptr!=NULL) {
+    unsigned char uc;
+    return (znz_bgzf_read(file->bzfptr,&uc,1) == 1) ? (int)uc : -1;
+  }
   if (file->zfptr!=NULL) return gzgetc(file->zfptr);
   return fgetc(file->nzfptr);
 }
@@ -260,7 +729,7 @@ int znzprintf(znzFile stream, const char *format, ...)
   va_list va;
   if (stream==NULL) { return 0; }
   va_start(va, format);
-  if (stream->zfptr!=NULL) {
+  if (stream->zfptr!=NULL || stream->bzfptr!=NULL) {
     int size;  /* local to HAVE_ZLIB block */
     size = strlen(format) + 1000000;  /* overkill I hope */
     tmpstr = (char *)calloc(1, size);
@@ -269,7 +738,8 @@ int znzprintf(znzFile stream, const char *format, ...)
        return retval;
     }
     vsprintf(tmpstr,format,va);
-    retval=gzprintf(stream->zfptr,"%s",tmpstr);
+    if (stream->bzfptr!=NULL) retval=(int)znz_bgzf_write(stream->bzfptr,tmpstr,strlen(tmpstr));
+    else retval=gzprintf(stream->zfptr,"%s",tmpstr);
     free(tmpstr);
   } else 
   {
@@ -26,7 +26,7 @@ namespace BASISFIELD {
 // Constructor, assignement and destructor
 
 basisfield::basisfield(const std::vector<unsigned int>& psz, const std::vector<double>& pvxs)
-: ndim(psz.size()), sz(3,1), vxs(3,0.0), coef(), futd(4,false), field(4)
+: ndim(psz.size()), sz(3,1), vxs(3,0.0), coef(), futd(4,false), field(4), version(0)
 {
   if (psz.size()<1 || psz.size()>3) {throw BasisfieldException("basisfield::basisfield::Invalid dimensionality of field");}
   if (psz.size() != pvxs.size()) {throw BasisfieldException("basisfield::basisfield:: Dimensionality mismatch between psz and pvxs");}
@@ -38,7 +38,7 @@ basisfield::basisfield(const std::vector<unsigned int>& psz, const std::vector<d
 }
 
 basisfield::basisfield(const basisfield& inf)
-: ndim(inf.ndim), sz(3,1), vxs(3,0.0), coef(), futd(4,false), field(4)
+: ndim(inf.ndim), sz(3,1), vxs(3,0.0), coef(), futd(4,false), field(4), version(0)
 {
   assign_basisfield(inf);
 }
@@ -111,6 +111,7 @@ void basisfield::SetCoef(const ColumnVector& pcoef)
   if (!coef) {coef = std::shared_ptr<NEWMAT::ColumnVector>(new NEWMAT::ColumnVector(pcoef));}
   else {*coef = pcoef;}
   futd.assign(4,false);
+  version++;
 }
 
 /////////////////////////////////////////////////////////////////////
@@ -193,6 +194,7 @@ void basisfield::assign_basisfield(const basisfield& inf) // Helper function for
   vxs = inf.vxs;
   sz = inf.sz;
   coef = std::shared_ptr<NEWMAT::ColumnVector>(new NEWMAT::ColumnVector(*(inf.coef)));
+  version++;
   for (int i=0; i<int(inf.field.size()); i++) {
     if (inf.field[i]) {field[i] = std::shared_ptr<NEWMAT::ColumnVector>(new NEWMAT::ColumnVector(*(inf.field[i])));}
     else {field[i] = inf.field[i];}
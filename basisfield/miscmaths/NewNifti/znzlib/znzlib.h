@@ -33,6 +33,19 @@ are required:
  
 NB: seeks for writable files with compression are quite restricted
 
+Block gzip (BGZF) files:
+ - a compressed file can also be written as a series of independent gzip
+   members, each holding at most 64kB of data (the BGZF layout used by
+   e.g. samtools/htslib). The result is still a valid gzip file that
+   can be read by gunzip, but it can be compressed and decompressed in
+   parallel and it allows random access when reading.
+ - block compression is used for writing when the environment variable
+   FSL_GZIP_BLOCKS is set to a non-zero value, or when the mode passed to
+   znzopen contains a 'B' (e.g. "wbB").
+ - block compressed files are detected automatically when reading.
+ - the number of threads used is given by FSL_GZIP_THREADS, defaulting
+   to the number of online processors.
+
 */
 
 
@@ -50,10 +63,13 @@ extern "C" {
 #include "zlib.h"
 
 
+struct znz_bgzf;  /* Block gzip stream, defined in znzlib.c */
+
 struct znzptr {
   int withz;
   FILE* nzfptr;
   gzFile zfptr;
+  struct znz_bgzf* bzfptr;
 } ;
 
 /* the type for all file pointers */
@@ -96,6 +112,11 @@ int znzeof(znzFile file);
 
 int znzgetc(znzFile file);
 
+int znzflush(znzFile file);
+
+/* returns 1 if file is a block gzip (BGZF) stream, 0 otherwise */
+int znz_isbgzf(znzFile file);
+
 #if !defined(WIN32)
 int znzprintf(znzFile stream, const char *format, ...);
 #endif
@@ -229,6 +229,29 @@ int readGeneralVolume(volume<T>& target, const string& filename,
 
   NiftiHeader header;
   char *buffer;
+  // If requested, and possible, alias the data of an uncompressed file through mmap rather than reading it.
+  if ( getenv("FSL_MMAP_NIFTI") && atoi(getenv("FSL_MMAP_NIFTI")) != 0 && x0<=0 && y0<=0 && z0<=0 && t0<=0 && d50<=0 && d60<=0 && d70<=0 &&
+       x1<0 && y1<0 && z1<0 && t1<0 && d51<0 && d61<0 && d71<0 ) {
+    std::shared_ptr<void> mapping;
+    try {
+      header = mapImage(return_validimagefilename(filename),buffer,mapping,target.extensions);
+    } catch ( exception& e ) { imthrow("Failed to read volume "+filename+"\nError : "+e.what(),22); }
+    bool noscaling( fabs(header.sclSlope)<1e-30 || (fabs(header.sclSlope-1.0)<=1e-30 && fabs(header.sclInter)<=1e-30) );
+    if ( buffer && header.datatype==NEWIMAGE::dtype((const T *) 0) && noscaling && !header.isAnalyze() ) {
+      if ( ! ( getenv("FSL_LOAD_NIFTI_EXTENSIONS") && atoi(getenv("FSL_LOAD_NIFTI_EXTENSIONS")) != 0 ) ) {
+        target.extensions.clear();
+      }
+      for ( int i = 1; i <= header.dim[0]; i++ )
+        header.pixdim[i] = header.pixdim[i] == 0 ? 1 : fabs(header.pixdim[i]);
+      target.initialize(header.dim[1],header.dim[2],header.dim[3],header.dim[4],header.dim[5],header.dim[6],header.dim[7],(T *) buffer,false,nthreads);
+      target.data_keeper = mapping;
+      set_volume_properties(header,target);
+      dtype = header.datatype;
+      if (swap2radiological && !target.RadiologicalFile) target.makeradiological();
+      return 0;
+    }
+    target.extensions.clear();  // Fall through to normal read
+  }
   try {
     header = loadImageROI(return_validimagefilename(filename),buffer,target.extensions,x0,x1,y0,y1,z0,z1,t0,t1,d50,d51,d60,d61,d70,d71);
   } catch ( exception& e ) { imthrow("Failed to read volume "+filename+"\nError : "+e.what(),22); }
@@ -319,10 +342,12 @@ template int readGeneralVolume(volume<double>& target, const string& filename,
                                const bool readAs4D);
 
 template <class V>
-int save_unswapped_vol(const V& source, const string& filename, int filetype,int bitsPerVoxel)
+int save_unswapped_vol(const V& source, const string& filename, int filetype,int bitsPerVoxel, float slope=1.0, float intercept=0.0)
 {
   NiftiHeader header;
   set_fsl_hdr(source,header);
+  header.sclSlope=slope;
+  header.sclInter=intercept;
   if ( filetype<0 )
     filetype=FslGetEnvOutputType();
   header.description=BUILDSTRING;
@@ -367,6 +392,57 @@ template int save_basic_volume(const volume<float>& source, const string& filena
 template int save_basic_volume(const volume<double>& source, const string& filename,
 				 int filetype, bool save_orig);
 
+template <class T>
+int save_volume_int16(const volume<T>& source, const string& filename, double *maxerr,
+		      int filetype, bool noSwapping)
+{
+  if (source.tsize()<1) return -1;
+  const T *sp = source.fbegin();
+  int64_t n = source.totalElements();
+  // There is no int16 value that could stand in for NaN or Inf, and they
+  // would also make the range meaningless. So refuse rather than write
+  // something that cannot be read back as what was saved.
+  double vmin = 0.0, vmax = 0.0;
+  int64_t nbad = 0;
+  bool first = true;
+  for (int64_t i=0; i<n; i++) {
+    double v = double(sp[i]);
+    if (!std::isfinite(v)) { nbad++; continue; }
+    if (first) { vmin = vmax = v; first = false; }
+    else { vmin = std::min(vmin,v); vmax = std::max(vmax,v); }
+  }
+  if (nbad) imthrow("save_volume_int16: "+filename+" not written, since "+num2str(nbad)+" non-finite values cannot be stored as int16",23);
+  // Map [vmin,vmax] onto [-32767,32767]. The reader scales in float, so we do too.
+  float slope = float((vmax-vmin)/65534.0), intercept = float(0.5*(vmax+vmin));
+  if (!(slope > 0.0)) slope = 1.0;  // Constant volume
+  volume<short> qvol(source.xsize(),source.ysize(),source.zsize(),source.tsize(),source.size5(),source.size6(),source.size7());
+  copybasicproperties(source,qvol);
+  short *qp = qvol.nsfbegin();
+  float err = 0.0;
+  for (int64_t i=0; i<n; i++) {
+    float q = std::round((float(sp[i]) - intercept) / slope);
+    q = std::min(32767.0f,std::max(-32767.0f,q));
+    qp[i] = static_cast<short>(q);
+    err = std::max(err,std::fabs(float(qp[i])*slope + intercept - float(sp[i])));
+  }
+  if (maxerr) *maxerr = err;
+  bool currently_rad = qvol.left_right_order()==FSL_RADIOLOGICAL;
+  if (!noSwapping && !qvol.RadiologicalFile && currently_rad) qvol.makeneurological();
+  save_unswapped_vol(qvol,filename,filetype,16,slope,intercept);
+  return 0;
+}
+
+template int save_volume_int16(const volume<char>& source, const string& filename, double *maxerr,
+			       int filetype, bool save_orig);
+template int save_volume_int16(const volume<short>& source, const string& filename, double *maxerr,
+			       int filetype, bool save_orig);
+template int save_volume_int16(const volume<int>& source, const string& filename, double *maxerr,
+			       int filetype, bool save_orig);
+template int save_volume_int16(const volume<float>& source, const string& filename, double *maxerr,
+			       int filetype, bool save_orig);
+template int save_volume_int16(const volume<double>& source, const string& filename, double *maxerr,
+			       int filetype, bool save_orig);
+
 mat44 newmat2mat44(const Matrix& nmat)
 {
   mat44 ret;
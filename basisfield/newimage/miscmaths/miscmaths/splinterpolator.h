@@ -14,6 +14,7 @@
 #include <vector>
 #include <string>
 #include <cmath>
+#include <algorithm>
 #include <thread>
 #include <iomanip>
 #include "armawrap/newmat.h"
@@ -24,6 +25,15 @@ namespace SPLINTERPOLATOR {
 
 enum ExtrapolationType {Zeros, Constant, Mirror, Periodic};
 
+// Suggested number of threads for deconvolving nvox voxels. Small
+// volumes are not worth starting threads for.
+inline unsigned int DefaultNoOfDeconvThreads(unsigned long nvox)
+{
+  if (nvox < 32768) return(1);
+  unsigned int nthr = std::thread::hardware_concurrency();
+  return((nthr > 0) ? std::min(nthr,static_cast<unsigned int>(nvox/16384)) : 1);
+}
+
 class SplinterpolatorException: public std::exception
 {
 public:
@@ -76,6 +86,14 @@ public:
     Set(data,dim,vet,order,copy_low_order,prec);
   }
 
+  // Set precomputed coefficients, e.g. from a cache, instead of data.
+  // The coefficients are copied and no deconvolution is performed.
+  void SetCoef(const T *coef, const std::vector<unsigned int>& dim, const std::vector<ExtrapolationType>& et, unsigned int order=3, double prec=1e-8)
+  {
+    if (_own_coef) delete [] _coef;
+    common_construction(coef,dim,order,prec,et,true,false);
+  }
+
   // Return interpolated value
   T operator()(const std::vector<float>&  coord) const;
   T operator()(double x, double y=0, double z=0, double t=0) const
@@ -142,6 +160,7 @@ public:
   }
   T Coef(std::vector<unsigned int> indx) const;
   NEWMAT::ReturnMatrix CoefAsNewmatMatrix() const;
+  const T *CoefPtr() const { return(_valid ? coef_ptr() : 0); }  // All coefficients, first index fastest
   NEWMAT::ReturnMatrix KernelAsNewmatMatrix(double sp=0.1, unsigned int deriv=0) const;
 
   //
@@ -204,9 +223,9 @@ private:
   //
   // Private helper-functions
   //
-  void common_construction(const T *data, const std::vector<unsigned int>& dim, unsigned int order, double prec, const std::vector<ExtrapolationType>& et, bool copy);
+  void common_construction(const T *data, const std::vector<unsigned int>& dim, unsigned int order, double prec, const std::vector<ExtrapolationType>& et, bool copy, bool deconv=true);
   void assign(const Splinterpolator<T>& src);
-  bool calc_coef(const T *data, bool copy);
+  bool calc_coef(const T *data, bool copy, bool deconv=true);
   void deconv_along(unsigned int dim);
   void deconv_along_mt_helper(unsigned int dim, unsigned int mdim, unsigned int mstep, unsigned int offset, unsigned int step, 
 			      const std::vector<unsigned int>& rdim, const std::vector<unsigned int>& rstep);						
@@ -1337,7 +1356,7 @@ unsigned int Splinterpolator<T>::n_nonzero(const unsigned int *vec) const
 /////////////////////////////////////////////////////////////////////
 
 template<class T>
-void Splinterpolator<T>::common_construction(const T *data, const std::vector<unsigned int>& dim, unsigned int order, double prec, const std::vector<ExtrapolationType>& et, bool copy)
+void Splinterpolator<T>::common_construction(const T *data, const std::vector<unsigned int>& dim, unsigned int order, double prec, const std::vector<ExtrapolationType>& et, bool copy, bool deconv)
 {
   if (!dim.size()) throw SplinterpolatorException("common_construction: data has zeros dimensions");
   if (dim.size() > 5) throw SplinterpolatorException("common_construction: data cannot have more than 5 dimensions");
@@ -1353,7 +1372,7 @@ void Splinterpolator<T>::common_construction(const T *data, const std::vector<un
   _ndim = dim.size();
   for (unsigned int i=0; i<5; i++) _dim[i]  = (i < dim.size()) ? dim[i] : 1;
 
-  _own_coef = calc_coef(data,copy);
+  _own_coef = calc_coef(data,copy,deconv);
 
   _valid = true;
 }
@@ -1393,7 +1412,7 @@ void Splinterpolator<T>::assign(const Splinterpolator<T>& src)
 /////////////////////////////////////////////////////////////////////
 
 template<class T>
-bool Splinterpolator<T>::calc_coef(const T *data, bool copy)
+bool Splinterpolator<T>::calc_coef(const T *data, bool copy, bool deconv)
 {
   if (_order < 2 && !copy) { _cptr = data; return(false); }
 
@@ -1404,7 +1423,7 @@ bool Splinterpolator<T>::calc_coef(const T *data, bool copy)
   _coef = new T[ts];
   memcpy(_coef,data,ts*sizeof(T));
 
-  if (_order < 2) return(true);  // If nearest neighbour or linear, that's all we need
+  if (_order < 2 || !deconv) return(true);  // If nearest neighbour or linear, or data already are coefficients
 
   // Loop over all non-singleton dimensions and deconvolve along them
   //
@@ -1462,7 +1481,7 @@ void Splinterpolator<T>::deconv_along(unsigned int dim)
   else { // We are running multi-threaded
     std::vector<std::thread> threads(_nthr-1); // + main thread makes _nthr
     for (unsigned int t=0; t<_nthr-1; t++) {
-      threads[t] = std::thread(&Splinterpolator::deconv_along_mt_helper,this,dim,mdim,mstep,t,_nthr,std::ref(rdim),std::ref(rstep));
+      threads[t] = std::thread(&Splinterpolator::deconv_along_mt_helper,this,dim,mdim,mstep,t,_nthr,std::cref(rdim),std::cref(rstep));
     }
     deconv_along_mt_helper(dim,mdim,mstep,_nthr-1,_nthr,rdim,rstep);
     std::for_each(threads.begin(),threads.end(),std::mem_fn(&std::thread::join)); // Join the threads
@@ -1480,14 +1499,32 @@ void Splinterpolator<T>::deconv_along_mt_helper(unsigned int
 						const std::vector<unsigned int>& rstep)
 {
   SplineColumn  col(mdim,mstep);          // Column helps us do the job
-  for (unsigned int l=0; l<rdim[3]; l++) {
-    for (unsigned int k=0; k<rdim[2]; k++) {
-      for (unsigned int j=0; j<rdim[1]; j++) {
-	T *dp = _coef + l*rstep[3] + k*rstep[2] + j*rstep[1] + offset*rstep[0];
-	for (unsigned int i=offset; i<rdim[0]; i+=step, dp+=step*rstep[0]) {
- 	  col.Get(dp);                          // Extract a column from the volume
-	  col.Deconv(_order,_et[dim],_prec);    // Deconvolve it
-	  col.Set(dp);                          // Put back the deconvolved column
+  unsigned int nouter = rdim[1]*rdim[2]*rdim[3];
+  if (nouter >= step) { // Each thread gets a contiguous range of outer indicies, avoids false sharing
+    unsigned int first = (offset*nouter)/step;
+    unsigned int last = ((offset+1)*nouter)/step;
+    for (unsigned int n=first; n<last; n++) {
+      unsigned int j = n % rdim[1];
+      unsigned int k = (n / rdim[1]) % rdim[2];
+      unsigned int l = n / (rdim[1]*rdim[2]);
+      T *dp = _coef + l*rstep[3] + k*rstep[2] + j*rstep[1];
+      for (unsigned int i=0; i<rdim[0]; i++, dp+=rstep[0]) {
+	col.Get(dp);                          // Extract a column from the volume
+	col.Deconv(_order,_et[dim],_prec);    // Deconvolve it
+	col.Set(dp);                          // Put back the deconvolved column
+      }
+    }
+  }
+  else { // Too few, so interleave along first remaining dimension
+    for (unsigned int l=0; l<rdim[3]; l++) {
+      for (unsigned int k=0; k<rdim[2]; k++) {
+	for (unsigned int j=0; j<rdim[1]; j++) {
+	  T *dp = _coef + l*rstep[3] + k*rstep[2] + j*rstep[1] + offset*rstep[0];
+	  for (unsigned int i=offset; i<rdim[0]; i+=step, dp+=step*rstep[0]) {
+	    col.Get(dp);                          // Extract a column from the volume
+	    col.Deconv(_order,_et[dim],_prec);    // Deconvolve it
+	    col.Set(dp);                          // Put back the deconvolved column
+	  }
 	}
       }
     }
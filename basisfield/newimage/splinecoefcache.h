@@ -0,0 +1,248 @@
+// Declarations and template bodies for a cache of spline coefficients
+//
+// splinecoefcache.h
+//
+// Calculating the spline coefficients of a volume (the deconvolution
+// done by Splinterpolator) is the first thing that happens when a
+// volume is spline-interpolated, and all threads that interpolate
+// it wait for it to finish. When the same volume (e.g. an object
+// smoothed with the same FWHM at consecutive levels, or the same
+// object in a batch of runs) is interpolated again the coefficients
+// can be taken from a SplineCoefCache instead.
+//
+// Entries are keyed on a hash of the voxel values together with the
+// matrix size, spline order, extrapolation and a user supplied tag
+// (e.g. the FWHM that was used to produce the volume). Entries are kept
+// in memory up to a total size in bytes, least recently used first out. If a
+// directory is given entries are also written to, and looked for in,
+// that directory so that they survive between runs. A second, and
+// independently calculated, hash of the voxel values is stored in
+// each entry and file and has to match too before an entry is used.
+//
+/*  CCOPYRIGHT  */
+
+#ifndef splinecoefcache_h
+#define splinecoefcache_h
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <sstream>
+#include <iomanip>
+#include <unistd.h>
+#include "newimage.h"
+
+namespace NEWIMAGE {
+
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+//
+// Class SplineCoefCache:
+//
+// Adopt() looks for coefficients for a volume and, if found, hands
+// them to the volume. Store() makes sure the volume has coefficients,
+// deconvolving with the given number of threads if it has not, and
+// keeps a copy of them. Prepare() does one or the other. An entry
+// larger than the whole budget is not kept in memory.
+// All member functions are thread safe.
+//
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+
+template <class T>
+class SplineCoefCache
+{
+public:
+  static const uint64_t DefaultMaxBytes = 256ULL << 20;
+
+  SplineCoefCache(uint64_t maxbytes=DefaultMaxBytes, const std::string& dir=std::string("")) : _maxbytes(maxbytes), _bytes(0), _dir(dir), _nhit(0), _nmiss(0) {}
+
+  void SetDirectory(const std::string& dir) { std::lock_guard<std::mutex> lg(_mtx); _dir = dir; }
+  const std::string& Directory() const { return(_dir); }
+  unsigned int NHits() const { return(_nhit); }
+  unsigned int NMisses() const { return(_nmiss); }
+  uint64_t MaxBytes() const { return(_maxbytes); }
+  uint64_t Bytes() const { std::lock_guard<std::mutex> lg(_mtx); return(_bytes); }
+  unsigned int NEntries() const { std::lock_guard<std::mutex> lg(_mtx); return(static_cast<unsigned int>(_entries.size())); }
+
+  bool Adopt(const volume<T>& vol, double tag=0.0) const;
+  void Store(const volume<T>& vol, double tag=0.0, Utilities::NoOfThreads nthr=Utilities::NoOfThreads(1));
+  // Adopt if possible, else calculate and store. Returns true if adopted.
+  bool Prepare(const volume<T>& vol, double tag=0.0, Utilities::NoOfThreads nthr=Utilities::NoOfThreads(1)) {
+    if (Adopt(vol,tag)) return(true);
+    Store(vol,tag,nthr);
+    return(false);
+  }
+  void Clear() { std::lock_guard<std::mutex> lg(_mtx); _entries.clear(); _bytes = 0; }
+
+  // 64-bit hash of all voxel values (xxHash64 style rounds, one per 8 bytes)
+  static uint64_t ContentHash(const volume<T>& vol) { uint64_t h, c; content_hashes(vol,h,c); return(h); }
+  // Independent 64-bit hash of the same (murmur3 finalizer applied per 8 bytes)
+  static uint64_t ContentCheck(const volume<T>& vol) { uint64_t h, c; content_hashes(vol,h,c); return(c); }
+
+private:
+  struct Key {
+    uint64_t  hash;
+    uint64_t  check;
+    int64_t   sz[3];
+    int       order;
+    int       ep;
+    double    tag;
+    bool operator==(const Key& k) const {
+      return(hash==k.hash && check==k.check && sz[0]==k.sz[0] && sz[1]==k.sz[1] && sz[2]==k.sz[2] && order==k.order && ep==k.ep && tag==k.tag);
+    }
+  };
+  typedef std::pair<Key,std::shared_ptr<const std::vector<T> > > Entry;
+
+  uint64_t                   _maxbytes; // Max total size of coefficients kept in memory
+  mutable uint64_t           _bytes;    // Current total size
+  std::string                _dir;      // Directory for persistent entries, "" if none
+  mutable std::list<Entry>   _entries;  // Most recently used first
+  mutable std::mutex         _mtx;
+  mutable std::atomic<unsigned int>  _nhit;
+  mutable std::atomic<unsigned int>  _nmiss;
+
+  static uint64_t rotl(uint64_t x, int r) { return((x << r) | (x >> (64-r))); }
+  static uint64_t fmix(uint64_t x) { x ^= x >> 33; x *= 0xff51afd7ed558ccdULL; x ^= x >> 33; x *= 0xc4ceb9fe1a85ec53ULL; x ^= x >> 33; return(x); }
+  static void content_hashes(const volume<T>& vol, uint64_t& hash, uint64_t& check);
+  Key make_key(const volume<T>& vol, double tag) const;
+  std::string file_name(const Key& key) const;
+  std::shared_ptr<const std::vector<T> > read_file(const Key& key) const;
+  void write_file(const Key& key, const std::vector<T>& coef) const;
+  void insert(const Key& key, std::shared_ptr<const std::vector<T> > coef) const;
+};
+
+// Both hashes mix each word before it is combined with the state, so
+// unlike e.g. word-wise FNV-1a there are no simple bit patterns (such
+// as flipping the sign bit of two words) that cancel.
+template <class T>
+void SplineCoefCache<T>::content_hashes(const volume<T>& vol, uint64_t& hash, uint64_t& check)
+{
+  const uint64_t P1 = 0x9e3779b185ebca87ULL, P2 = 0xc2b2ae3d27d4eb4fULL, P4 = 0x85ebca77c2b2ae63ULL, P5 = 0x27d4eb2f165667c5ULL;
+  const unsigned char *p = reinterpret_cast<const unsigned char *>(vol.fbegin());
+  uint64_t nbytes = static_cast<uint64_t>(vol.nvoxels())*sizeof(T);
+  hash = P5 + nbytes;
+  check = 0x5bd1e9955bd1e995ULL ^ nbytes;
+  for (uint64_t i=0; i<nbytes; i+=8) {
+    uint64_t w = 0;
+    std::memcpy(&w,p+i,std::min<uint64_t>(8,nbytes-i));  // Last word zero padded
+    hash ^= rotl(w*P2,31)*P1;
+    hash = rotl(hash,27)*P1 + P4;
+    check = fmix(check ^ (w + i*P1));
+  }
+  hash = fmix(hash);
+  check = fmix(check + nbytes);
+}
+
+template <class T>
+typename SplineCoefCache<T>::Key SplineCoefCache<T>::make_key(const volume<T>& vol, double tag) const
+{
+  Key key;
+  content_hashes(vol,key.hash,key.check);
+  key.sz[0] = vol.xsize(); key.sz[1] = vol.ysize(); key.sz[2] = vol.zsize();
+  key.order = vol.getsplineorder();
+  key.ep = static_cast<int>(vol.getextrapolationmethod());
+  key.tag = tag;
+  return(key);
+}
+
+template <class T>
+bool SplineCoefCache<T>::Adopt(const volume<T>& vol, double tag) const
+{
+  Key key = make_key(vol,tag);
+  std::shared_ptr<const std::vector<T> > coef;
+  {
+    std::lock_guard<std::mutex> lg(_mtx);
+    for (auto it=_entries.begin(); it!=_entries.end(); ++it) {
+      if (it->first == key) { coef = it->second; _entries.splice(_entries.begin(),_entries,it); break; }
+    }
+  }
+  if (!coef && _dir.length()) {
+    if ((coef = read_file(key))) insert(key,coef);
+  }
+  if (!coef) { _nmiss++; return(false); }
+  vol.adoptsplinecoefficients(&((*coef)[0]));
+  _nhit++;
+  return(true);
+}
+
+template <class T>
+void SplineCoefCache<T>::Store(const volume<T>& vol, double tag, Utilities::NoOfThreads nthr)
+{
+  Key key = make_key(vol,tag);
+  const T *cptr = vol.splinecoefficients(nthr);
+  if (!cptr) return;
+  std::shared_ptr<const std::vector<T> > coef(new std::vector<T>(cptr,cptr+vol.nvoxels()));
+  insert(key,coef);
+  if (_dir.length()) write_file(key,*coef);
+}
+
+template <class T>
+void SplineCoefCache<T>::insert(const Key& key, std::shared_ptr<const std::vector<T> > coef) const
+{
+  uint64_t nbytes = coef->size()*sizeof(T);
+  std::lock_guard<std::mutex> lg(_mtx);
+  for (auto it=_entries.begin(); it!=_entries.end(); ++it) {
+    if (it->first == key) { _bytes -= it->second->size()*sizeof(T); _entries.erase(it); break; }
+  }
+  if (nbytes > _maxbytes) return;
+  while (_bytes + nbytes > _maxbytes) { _bytes -= _entries.back().second->size()*sizeof(T); _entries.pop_back(); }
+  _entries.push_front(Entry(key,coef));
+  _bytes += nbytes;
+}
+
+template <class T>
+std::string SplineCoefCache<T>::file_name(const Key& key) const
+{
+  uint64_t tagbits;
+  std::memcpy(&tagbits,&key.tag,sizeof(tagbits));
+  std::ostringstream os;
+  os << _dir << "/splcoef_" << std::hex << std::setfill('0') << std::setw(16) << key.hash << "_" << std::setw(16) << tagbits
+     << std::dec << "_" << key.sz[0] << "x" << key.sz[1] << "x" << key.sz[2] << "_o" << key.order << "_e" << key.ep << "_" << sizeof(T) << ".bin";
+  return(os.str());
+}
+
+// The file is a 16 byte magic, followed by the check hash of the volume and
+// the coefficients in native byte order. Everything else is encoded in the
+// file name, and a file whose check hash differs from that of the volume
+// is ignored (and eventually overwritten).
+
+template <class T>
+std::shared_ptr<const std::vector<T> > SplineCoefCache<T>::read_file(const Key& key) const
+{
+  std::shared_ptr<std::vector<T> > coef;
+  FILE *fp = std::fopen(file_name(key).c_str(),"rb");
+  if (!fp) return(coef);
+  char magic[16];
+  uint64_t check = 0;
+  size_t n = static_cast<size_t>(key.sz[0]*key.sz[1]*key.sz[2]);
+  coef = std::shared_ptr<std::vector<T> >(new std::vector<T>(n));
+  if (std::fread(magic,1,16,fp) != 16 || std::memcmp(magic,"FSLSPLINECOEF02\n",16) || std::fread(&check,sizeof(check),1,fp) != 1 ||
+      check != key.check || std::fread(&((*coef)[0]),sizeof(T),n,fp) != n) coef.reset();
+  std::fclose(fp);
+  return(coef);
+}
+
+template <class T>
+void SplineCoefCache<T>::write_file(const Key& key, const std::vector<T>& coef) const
+{
+  // Write to a temporary and rename, so that concurrent runs never see half a file
+  std::string fname = file_name(key);
+  std::ostringstream tmpname;
+  tmpname << fname << ".tmp" << getpid();
+  FILE *fp = std::fopen(tmpname.str().c_str(),"wb");
+  if (!fp) return;  // Failing to cache is not an error
+  bool ok = (std::fwrite("FSLSPLINECOEF02\n",1,16,fp) == 16 && std::fwrite(&key.check,sizeof(key.check),1,fp) == 1 &&
+	     std::fwrite(&coef[0],sizeof(T),coef.size(),fp) == coef.size());
+  ok = (std::fclose(fp) == 0) && ok;
+  if (!ok || std::rename(tmpname.str().c_str(),fname.c_str())) std::remove(tmpname.str().c_str());
+}
+
+} // End namespace NEWIMAGE
+
+#endif // End #ifndef splinecoefcache_h
@@ -0,0 +1,89 @@
+#include "newimage/newimageall.h"
+#include <cmath>
+#include <tuple>
+
+#include <boost/version.hpp>
+#if BOOST_VERSION < 108000
+#define BOOST_NO_CXX98_FUNCTION_BASE
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+
+BOOST_AUTO_TEST_SUITE(test_edt)
+
+
+using namespace NEWIMAGE;
+
+// Scattered samples (about one voxel in 40) on an anisotropic grid, with
+// a smooth function as data
+static void make_samples(volume<double>& isSample, volume<double>& data)
+{
+    isSample.reinitialize(37, 31, 23);
+    isSample.setdims(1.5, 2.0, 3.0);
+    data = isSample;
+    unsigned int state = 12345;
+    for (int k = 0; k < 23; k++) for (int j = 0; j < 31; j++) for (int i = 0; i < 37; i++) {
+        state = 1103515245u*state + 12345u;
+        isSample(i, j, k) = ((state >> 16) % 40 == 0) ? 1.0 : 0.0;
+        data(i, j, k) = 10.0*std::sin(0.2*i)*std::cos(0.15*j) + 0.5*k;
+    }
+}
+
+template <class T>
+static double maxdiff(const volume<T>& a, const volume<T>& b)
+{
+    BOOST_REQUIRE(samesize(a, b));
+    double md = 0.0;
+    for (int k = 0; k < a.zsize(); k++) for (int j = 0; j < a.ysize(); j++) for (int i = 0; i < a.xsize(); i++) {
+        md = std::max(md, std::fabs(double(a(i, j, k)) - double(b(i, j, k))));
+    }
+    return md;
+}
+
+BOOST_AUTO_TEST_CASE(threaded_same_as_serial)
+{
+    volume<double> isSample, data;
+    make_samples(isSample, data);
+    volume<double> dist = euclideanDistanceTransform(isSample);
+    volume<double> nearest;
+    std::tie(std::ignore, nearest) = euclideanDistanceTransform(isSample, data);
+    volume<double> sinterp = sparseInterpolate(data, isSample);
+    BOOST_REQUIRE_GT(dist.max(), 3.0);
+    for (unsigned int nt : {1u, 2u, 5u, 64u}) {
+        BOOST_TEST_CONTEXT("nthr = " << nt) {
+            Utilities::NoOfThreads nthr(nt);
+            BOOST_CHECK_EQUAL(maxdiff(euclideanDistanceTransform(isSample, nthr), dist), 0.0);
+            volume<double> tdist, tnearest;
+            std::tie(tdist, tnearest) = euclideanDistanceTransform(isSample, data, nthr);
+            BOOST_CHECK_EQUAL(maxdiff(tdist, dist), 0.0);
+            BOOST_CHECK_EQUAL(maxdiff(tnearest, nearest), 0.0);
+            BOOST_CHECK_EQUAL(maxdiff(sparseInterpolate(data, isSample, 3.0, nthr), sinterp), 0.0);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(float_same_as_double)
+{
+    volume<double> isSample, data;
+    make_samples(isSample, data);
+    volume<double> dist = euclideanDistanceTransform(isSample);
+    volume<double> sinterp = sparseInterpolate(data, isSample);
+    volume<float> fisSample, fdata;
+    copyconvert(isSample, fisSample);
+    copyconvert(data, fdata);
+    for (unsigned int nt : {1u, 3u}) {
+        BOOST_TEST_CONTEXT("nthr = " << nt) {
+            volume<float> fdist = euclideanDistanceTransformFloat(isSample, Utilities::NoOfThreads(nt));
+            volume<double> ddist;
+            copyconvert(fdist, ddist);
+            BOOST_CHECK_LT(maxdiff(ddist, dist), 1e-5*dist.max());
+            volume<double> dinterp;
+            copyconvert(sparseInterpolate(fdata, fisSample, 3.0, Utilities::NoOfThreads(nt)), dinterp);
+            BOOST_CHECK_LT(maxdiff(dinterp, sinterp), 1e-5*(sinterp.max() - sinterp.min()));
+        }
+    }
+}
+
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,148 @@
+#include "newimage/newimageall.h"
+#include "newimage/recursivesmooth.h"
+#include <cmath>
+
+#include <boost/version.hpp>
+#if BOOST_VERSION < 108000
+#define BOOST_NO_CXX98_FUNCTION_BASE
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+
+BOOST_AUTO_TEST_SUITE(test_recursivesmooth)
+
+
+using namespace NEWIMAGE;
+
+// Smooth image with edges, 2mm voxels
+static volume<float> make_volume()
+{
+    volume<float> v(40, 36, 30);
+    v.setdims(2.0, 2.0, 2.0);
+    for (int k = 0; k < 30; k++) for (int j = 0; j < 36; j++) for (int i = 0; i < 40; i++) {
+        v(i, j, k) = 100.0 + 50.0*std::sin(0.3*i)*std::cos(0.2*j) + 3.0*k + ((i/5 + j/5 + k/5) % 2)*40.0;
+    }
+    return v;
+}
+
+static volume<char> make_mask(const volume<float>& v)
+{
+    volume<char> m(v.xsize(), v.ysize(), v.zsize());
+    copybasicproperties(v, m);
+    for (int k = 0; k < v.zsize(); k++) for (int j = 0; j < v.ysize(); j++) for (int i = 0; i < v.xsize(); i++) {
+        double x = (i - v.xsize()/2.0) / (0.4*v.xsize());
+        double y = (j - v.ysize()/2.0) / (0.4*v.ysize());
+        double z = (k - v.zsize()/2.0) / (0.4*v.zsize());
+        m(i, j, k) = (x*x + y*y + z*z < 1.0) ? 1 : 0;
+    }
+    return m;
+}
+
+// Masked smoothing as done by convolution in fnirt
+static volume<float> masked_smooth(const volume<float>& vol, const volume<char>& mask, float sigma)
+{
+    volume<float> tv = vol, tm = vol;
+    for (int k = 0; k < vol.zsize(); k++) for (int j = 0; j < vol.ysize(); j++) for (int i = 0; i < vol.xsize(); i++) {
+        tv(i, j, k) = mask(i, j, k) ? vol(i, j, k) : 0.0;
+        tm(i, j, k) = mask(i, j, k) ? 1.0 : 0.0;
+    }
+    tm = smooth(tm, sigma);
+    tv = smooth(tv, sigma);
+    for (int k = 0; k < vol.zsize(); k++) for (int j = 0; j < vol.ysize(); j++) for (int i = 0; i < vol.xsize(); i++) {
+        tv(i, j, k) = mask(i, j, k) ? tv(i, j, k) / tm(i, j, k) : 0.0;
+    }
+    return tv;
+}
+
+// Largest difference relative to the range of v, and RMS difference relative to RMS of b
+static void differences(const volume<float>& a, const volume<float>& b, const volume<float>& v, double& maxrel, double& rmsrel)
+{
+    BOOST_REQUIRE(samesize(a, b));
+    double mx = 0.0, se = 0.0, ss = 0.0;
+    for (int k = 0; k < a.zsize(); k++) for (int j = 0; j < a.ysize(); j++) for (int i = 0; i < a.xsize(); i++) {
+        double d = a(i, j, k) - b(i, j, k);
+        mx = std::max(mx, std::fabs(d));
+        se += d*d;
+        ss += double(b(i, j, k))*b(i, j, k);
+    }
+    maxrel = mx / (v.max() - v.min());
+    rmsrel = std::sqrt(se / ss);
+}
+
+BOOST_AUTO_TEST_CASE(narrow_kernels_same_as_smooth)
+{
+    // sigma < 1 voxel uses the same explicit kernel as smooth
+    volume<float> v = make_volume();
+    volume<char> m = make_mask(v);
+    for (double fwhm : {2.0, 3.0, 4.0}) {
+        float sigma = fwhm / std::sqrt(8.0*std::log(2.0));
+        double maxrel, rmsrel;
+        differences(smooth_recursive(v, sigma, Utilities::NoOfThreads(2)), smooth(v, sigma), v, maxrel, rmsrel);
+        BOOST_CHECK_SMALL(maxrel, 1e-5);
+        differences(masked_smooth_recursive(v, m, sigma, Utilities::NoOfThreads(2)), masked_smooth(v, m, sigma), v, maxrel, rmsrel);
+        BOOST_CHECK_SMALL(maxrel, 1e-5);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(wide_kernels_close_to_smooth)
+{
+    // The recursive filter approximates a Gaussian, whereas smooth uses a
+    // Gaussian truncated at 2*floor(sigma)+3 voxels. The differences are
+    // largest at the edge of the FOV, where smooth zero-pads a truncated
+    // kernel. Masked smoothing divides out most of that.
+    volume<float> v = make_volume();
+    volume<char> m = make_mask(v);
+    for (double fwhm : {6.0, 8.0, 12.0, 20.0}) {
+        BOOST_TEST_CONTEXT("fwhm = " << fwhm) {
+            float sigma = fwhm / std::sqrt(8.0*std::log(2.0));
+            double maxrel, rmsrel;
+            differences(smooth_recursive(v, sigma, Utilities::NoOfThreads(2)), smooth(v, sigma), v, maxrel, rmsrel);
+            BOOST_CHECK_LT(maxrel, 0.1);
+            BOOST_CHECK_LT(rmsrel, 0.035);
+            differences(masked_smooth_recursive(v, m, sigma, Utilities::NoOfThreads(2)), masked_smooth(v, m, sigma), v, maxrel, rmsrel);
+            BOOST_CHECK_LT(maxrel, 0.035);
+            BOOST_CHECK_LT(rmsrel, 0.015);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(threads_do_not_change_result)
+{
+    volume<float> v = make_volume();
+    float sigma = 8.0 / std::sqrt(8.0*std::log(2.0));
+    volume<float> a = smooth_recursive(v, sigma, Utilities::NoOfThreads(1));
+    volume<float> b = smooth_recursive(v, sigma, Utilities::NoOfThreads(3));
+    double maxrel, rmsrel;
+    differences(a, b, v, maxrel, rmsrel);
+    BOOST_CHECK_EQUAL(maxrel, 0.0);
+}
+
+BOOST_AUTO_TEST_CASE(double_images_smoothed_in_double)
+{
+    // Smoothing is linear, so smoothing an image with a large offset and
+    // subtracting the smoothed offset should give the smoothed image. In
+    // float most of the image would be lost, so this checks that a double
+    // image is not smoothed in float. Masked smoothing divides out the
+    // offset directly.
+    volume<float> fv = make_volume();
+    volume<double> v, vo;
+    copyconvert(fv, v);
+    vo = v + 1e7;
+    volume<double> c = v;
+    c = 1e7;
+    volume<char> m = make_mask(fv);
+    float sigma = 8.0 / std::sqrt(8.0*std::log(2.0));
+    volume<double> a = smooth_recursive(v, sigma), b = smooth_recursive(vo, sigma) - smooth_recursive(c, sigma);
+    volume<double> ma = masked_smooth_recursive(v, m, sigma), mb = masked_smooth_recursive(vo, m, sigma);
+    double md = 0.0, mmd = 0.0;
+    for (int k = 0; k < v.zsize(); k++) for (int j = 0; j < v.ysize(); j++) for (int i = 0; i < v.xsize(); i++) {
+        md = std::max(md, std::fabs(a(i, j, k) - b(i, j, k)));
+        if (m(i, j, k)) mmd = std::max(mmd, std::fabs(ma(i, j, k) - (mb(i, j, k) - 1e7)));
+    }
+    BOOST_CHECK_LT(md, 1e-4);
+    BOOST_CHECK_LT(mmd, 1e-4);
+}
+
+
+BOOST_AUTO_TEST_SUITE_END()
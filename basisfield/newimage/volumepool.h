@@ -0,0 +1,109 @@
+// Declarations for a pool of aligned memory blocks for volume data
+//
+// volumepool.h
+//
+// Code that creates and throws away many full size temporary volumes
+// (e.g. once per cost-function evaluation) spends a lot of time in the
+// allocator, and for large volumes in page faults and the zeroing of
+// fresh pages by the OS. A VolumeDataPool keeps blocks that have been
+// released and hands them out again for allocations of the same size
+// class.
+//
+// A volume gets its data from a pool if one has been set for that
+// volume with volume<T>::setdatapool, or else if a VolumeDataPoolScope
+// is alive on the calling thread. In all other cases new T[] is used,
+// as before.
+//
+// All blocks are aligned on 64 byte boundaries.
+//
+/*  CCOPYRIGHT  */
+
+#ifndef volumepool_h
+#define volumepool_h
+
+#include <cstddef>
+#include <map>
+#include <vector>
+#include <memory>
+#include <mutex>
+
+namespace NEWIMAGE {
+
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+//
+// Class VolumeDataPool:
+//
+// Allocate() returns a block of at least nbytes bytes. When the last
+// copy of the returned pointer goes away the block is returned to the
+// pool, or freed if the pool no longer exists or if it already
+// retains MaxRetained() bytes. Sizes are rounded up to size classes
+// that are at most 25% larger than the request, so that volumes of
+// similar (not only identical) size can share blocks.
+// Pools are created with Create() and are thread safe.
+//
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+
+class VolumeDataPool : public std::enable_shared_from_this<VolumeDataPool>
+{
+public:
+  static const size_t Alignment = 64;
+
+  static std::shared_ptr<VolumeDataPool> Create(size_t maxretained=static_cast<size_t>(512)*1024*1024);
+  ~VolumeDataPool();
+
+  std::shared_ptr<void> Allocate(size_t nbytes);
+  void Trim();  // Free all blocks currently held by the pool
+
+  size_t MaxRetained() const { return(_maxret); }
+  size_t Retained() const { std::lock_guard<std::mutex> lg(_mtx); return(_nret); }
+  unsigned int NHits() const { std::lock_guard<std::mutex> lg(_mtx); return(_nhit); }
+  unsigned int NMisses() const { std::lock_guard<std::mutex> lg(_mtx); return(_nmiss); }
+
+  // Pool set by the innermost VolumeDataPoolScope on this thread, null if none
+  static std::shared_ptr<VolumeDataPool> Current() { return(_current); }
+
+  static size_t SizeClass(size_t nbytes);
+
+private:
+  friend class VolumeDataPoolScope;
+  VolumeDataPool(size_t maxretained) : _maxret(maxretained), _nret(0), _nhit(0), _nmiss(0) {}
+  VolumeDataPool(const VolumeDataPool&) = delete;
+  VolumeDataPool& operator=(const VolumeDataPool&) = delete;
+
+  void release(void *blk, size_t csz);
+
+  size_t                                 _maxret;  // Max # of bytes in free blocks
+  size_t                                 _nret;    // Current # of bytes in free blocks
+  unsigned int                           _nhit;
+  unsigned int                           _nmiss;
+  std::map<size_t,std::vector<void *> >  _free;    // Free blocks, by size class
+  mutable std::mutex                     _mtx;
+
+  static thread_local std::shared_ptr<VolumeDataPool>  _current;
+};
+
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+//
+// Class VolumeDataPoolScope:
+//
+// Makes a pool the source of data for all volumes allocated on the
+// calling thread for as long as the object is alive. Scopes can be
+// nested, and passing a null pool turns pooling off for the scope.
+//
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+
+class VolumeDataPoolScope
+{
+public:
+  explicit VolumeDataPoolScope(std::shared_ptr<VolumeDataPool> pool) : _prev(VolumeDataPool::_current) { VolumeDataPool::_current = pool; }
+  ~VolumeDataPoolScope() { VolumeDataPool::_current = _prev; }
+private:
+  VolumeDataPoolScope(const VolumeDataPoolScope&) = delete;
+  VolumeDataPoolScope& operator=(const VolumeDataPoolScope&) = delete;
+
+  std::shared_ptr<VolumeDataPool>  _prev;
+};
+
+} // End namespace NEWIMAGE
+
+#endif // End #ifndef volumepool_h
@@ -1,4 +1,4 @@
-//  
+//
 //  Declarations for helper class dilator.h
 //
 //  dilator.h
@@ -9,45 +9,78 @@
 //
 // Jesper Andersson, FMRIB Image Analysis Group
 //
-// Copyright (C) 2010 University of Oxford 
+// Copyright (C) 2010 University of Oxford
 //
 /*  CCOPYRIGHT  */
 
 #ifndef dilator_h
 #define dilator_h
 
+#include <vector>
+#include <cstdint>
+
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+//
+// Fill() replaces all undefined (nan) voxels by the average of their
+// defined neighbours, in order of distance from the defined voxels.
+// This is the same result as one would get from calling Dilate()
+// until it returns zero, but instead of sweeping the whole volume
+// once per "layer" it keeps a list of the voxels on the current
+// front so that every voxel is only visited a few times.
+// If all volumes of a 4D image have the same undefined voxels (as
+// is the case for the components of an inverse field) the front is
+// only calculated once for all of them.
+//
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+
 class Dilator
 {
 public:
   Dilator(const NEWIMAGE::volume<float>& ima) : _ima(ima) {}
-  unsigned int Dilate(float nan = -999);
+  unsigned int Dilate(float nan = -999);  // Single sweep
+  unsigned int Fill(float nan = -999);    // Until there is nothing more to fill
   const NEWIMAGE::volume<float>& Get() const { return(_ima); }
 
 private:
   NEWIMAGE::volume<float> _ima;
+
+  bool same_nans(float nan) const;
+  unsigned int fill(const std::vector<int64_t>& vols, float nan);
+  // The neighbours that are used for averaging in voxel i,j,k. N.B. that
+  // it is >1 (rather than >0) for the "lower" neighbours. That is how
+  // it has always been, and it is kept so as not to change any results.
+  void neighbours(int64_t i, int64_t j, int64_t k, int64_t nb[6]) const
+  {
+    int64_t nx = _ima.xsize(), nxy = _ima.xsize()*_ima.ysize(), indx = k*nxy + j*nx + i;
+    nb[0] = (i>1) ? indx-1 : -1;                       nb[1] = (i<(_ima.xsize()-1)) ? indx+1 : -1;
+    nb[2] = (j>1) ? indx-nx : -1;                      nb[3] = (j<(_ima.ysize()-1)) ? indx+nx : -1;
+    nb[4] = (k>1) ? indx-nxy : -1;                     nb[5] = (k<(_ima.zsize()-1)) ? indx+nxy : -1;
+  }
 };
 
 unsigned int Dilator::Dilate(float nan)
 {
   NEWIMAGE::volume<float> tmp=_ima;
   unsigned int cnt=0;
-  for (int k=0; k<_ima.zsize(); k++) {
-    for (int j=0; j<_ima.ysize(); j++) {
-      for (int i=0; i<_ima.xsize(); i++) {
-        if (tmp(i,j,k)==nan) { // If it is a zero
-          float val=0.0;
-          float sum=0.0;
-          unsigned int n=0;
-          if (i>1 && (val=tmp.value(i-1,j,k))!=nan) { sum+=val; n++; }
-          if (i<(_ima.xsize()-1) && (val=tmp.value(i+1,j,k))!=nan) { sum+=val; n++; }
-          if (j>1 && (val=tmp.value(i,j-1,k))!=nan) { sum+=val; n++; }
-          if (j<(_ima.ysize()-1) && (val=tmp.value(i,j+1,k))!=nan) { sum+=val; n++; }
-          if (k>1 && (val=tmp.value(i,j,k-1))!=nan) { sum+=val; n++; }
-          if (k<(_ima.zsize()-1) && (val=tmp.value(i,j,k+1))!=nan) { sum+=val; n++; }
-          if (n) {
-            _ima(i,j,k) = sum/float(n);
-            cnt++;
-          }
+  for (int t=0; t<_ima.tsize(); t++) {
+    for (int k=0; k<_ima.zsize(); k++) {
+      for (int j=0; j<_ima.ysize(); j++) {
+	for (int i=0; i<_ima.xsize(); i++) {
+	  if (tmp(i,j,k,t)==nan) { // If it is a zero
+	    float val=0.0;
+	    float sum=0.0;
+	    unsigned int n=0;
+	    if (i>1 && (val=tmp(i-1,j,k,t))!=nan) { sum+=val; n++; }
+	    if (i<(_ima.xsize()-1) && (val=tmp(i+1,j,k,t))!=nan) { sum+=val; n++; }
+	    if (j>1 && (val=tmp(i,j-1,k,t))!=nan) { sum+=val; n++; }
+	    if (j<(_ima.ysize()-1) && (val=tmp(i,j+1,k,t))!=nan) { sum+=val; n++; }
+	    if (k>1 && (val=tmp(i,j,k-1,t))!=nan) { sum+=val; n++; }
+	    if (k<(_ima.zsize()-1) && (val=tmp(i,j,k+1,t))!=nan) { sum+=val; n++; }
+	    if (n) {
+	      _ima(i,j,k,t) = sum/float(n);
+	      cnt++;
+	    }
+	  }
 	}
       }
     }
@@ -55,4 +88,110 @@ unsigned int Dilator::Dilate(float nan)
   return(cnt);
 }
 
+unsigned int Dilator::Fill(float nan)
+{
+  std::vector<int64_t> vols;
+  if (same_nans(nan)) {
+    for (int64_t t=0; t<_ima.tsize(); t++) vols.push_back(t);
+    return(fill(vols,nan));
+  }
+  unsigned int cnt=0;
+  for (int64_t t=0; t<_ima.tsize(); t++) {
+    vols.assign(1,t);
+    cnt += fill(vols,nan);
+  }
+  return(cnt);
+}
+
+bool Dilator::same_nans(float nan) const
+{
+  int64_t nvox = _ima.nvoxels();
+  const float *ptr = _ima.fbegin();
+  for (int64_t t=1; t<_ima.tsize(); t++) {
+    for (int64_t i=0; i<nvox; i++) {
+      if ((ptr[i]==nan) != (ptr[t*nvox+i]==nan)) return(false);
+    }
+  }
+  return(true);
+}
+
+/////////////////////////////////////////////////////////////////////
+//
+// Fills the volumes in vols, which are known to have the same
+// undefined voxels. The undefined voxels are first labelled with
+// the "layer" (i.e. the call to Dilate()) in which they would be
+// filled, starting with those that have a defined neighbour. The
+// candidates for the next layer are then the undefined neighbours
+// of the current layer. A voxel in a given layer can only have
+// defined neighbours from the previous layers, so all values of a
+// layer are calculated before any of them are written back.
+// Sums are formed in the same order as in Dilate(), so the result
+// is identical to that of repeated calls to Dilate().
+//
+/////////////////////////////////////////////////////////////////////
+
+unsigned int Dilator::fill(const std::vector<int64_t>& vols, float nan)
+{
+  int64_t nvox = _ima.nvoxels();
+  int64_t nx = _ima.xsize(), ny = _ima.ysize(), nz = _ima.zsize();
+  float *ptr = _ima.nsfbegin();
+  const float *ref = ptr + vols[0]*nvox;         // Used to decide what is defined
+  std::vector<char> queued(nvox,0);
+  std::vector<int64_t> front;                    // Voxels in current layer
+  std::vector<float> vals;
+  int64_t nb[6];
+
+  // Seed the front with undefined voxels that have a defined neighbour
+  for (int64_t k=0, indx=0; k<nz; k++) {
+    for (int64_t j=0; j<ny; j++) {
+      for (int64_t i=0; i<nx; i++, indx++) {
+	if (ref[indx]==nan) {
+	  neighbours(i,j,k,nb);
+	  for (unsigned int n=0; n<6; n++) {
+	    if (nb[n]>=0 && ref[nb[n]]!=nan) { front.push_back(indx); queued[indx]=1; break; }
+	  }
+	}
+      }
+    }
+  }
+
+  unsigned int cnt=0;
+  std::vector<int64_t> next;
+  while (front.size()) {
+    // Calculate averages for the current layer
+    vals.resize(front.size()*vols.size());
+    for (unsigned int f=0; f<front.size(); f++) {
+      int64_t indx = front[f];
+      neighbours(indx%nx,(indx/nx)%ny,indx/(nx*ny),nb);
+      for (unsigned int v=0; v<vols.size(); v++) {
+	const float *vptr = ptr + vols[v]*nvox;
+	float val=0.0;
+	float sum=0.0;
+	unsigned int n=0;
+	for (unsigned int m=0; m<6; m++) {
+	  if (nb[m]>=0 && (val=vptr[nb[m]])!=nan) { sum+=val; n++; }
+	}
+	vals[f*vols.size()+v] = sum/float(n);
+      }
+    }
+    // Write them, and find the undefined voxels that see them
+    next.clear();
+    for (unsigned int f=0; f<front.size(); f++) {
+      int64_t indx = front[f];
+      for (unsigned int v=0; v<vols.size(); v++) ptr[vols[v]*nvox+indx] = vals[f*vols.size()+v];
+      int64_t i = indx%nx, j = (indx/nx)%ny, k = indx/(nx*ny);
+      // Voxels that have indx among their neighbours
+      int64_t cand[6] = { (i>=1) ? indx-1 : -1,          (i+1<nx && i>=1) ? indx+1 : -1,
+			  (j>=1) ? indx-nx : -1,         (j+1<ny && j>=1) ? indx+nx : -1,
+			  (k>=1) ? indx-nx*ny : -1,      (k+1<nz && k>=1) ? indx+nx*ny : -1 };
+      for (unsigned int m=0; m<6; m++) {
+	if (cand[m]>=0 && !queued[cand[m]] && ref[cand[m]]==nan) { next.push_back(cand[m]); queued[cand[m]]=1; }
+      }
+    }
+    cnt += front.size()*vols.size();
+    front.swap(next);
+  }
+  return(cnt);
+}
+
 #endif // End #ifndef dilator_h
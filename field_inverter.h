@@ -0,0 +1,208 @@
+//
+//  Declarations and definitions of functions for inverting fields
+//
+//  field_inverter.h
+//
+//  Splits the inversion of a displacement field over z-slabs of the
+//  inverse field, each inverted by its own Tetrahedron (and optionally
+//  a NewtonInverter) in its own thread. Used by invwarp.
+//
+/*  CCOPYRIGHT  */
+
+#ifndef field_inverter_h
+#define field_inverter_h
+
+#include <vector>
+#include <thread>
+#include <memory>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+#include "armawrap/newmat.h"
+#include "utils/threading.h"
+#include "newimage/newimageall.h"
+#include "warpfns/warpfns.h"
+#include "tetrahedron.h"
+#include "newton_inverter.h"
+
+namespace FNIRT {
+
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+//
+// Inverts the field for slices first to (one past) last. Every row
+// starts from the affine guess, and the Tetrahedron then walks
+// along the row starting from where it found the previous point.
+// Since nothing is carried over from one row to the next (the
+// Tetrahedron resets its plane order in SetFirstPoint) the slabs
+// can be processed in parallel, with one Tetrahedron per thread,
+// without affecting the results.
+// If a NewtonInverter is passed it is used for all voxels in a row
+// first, and the Tetrahedron only for those where it failed. The
+// number of such voxels is returned in ntet.
+//
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+
+inline void invert_slab(unsigned int               first,
+                        unsigned int               last,
+                        const NEWMAT::Matrix&      B,
+                        Tetrahedron&               tet,
+                        const NewtonInverter       *ninv,
+                        NEWIMAGE::volume4D<float>& invwarp,
+                        unsigned int&              ntet)
+{
+  double b11, b12, b13, b14;
+  double b21, b22, b23, b24;
+  double b31, b32, b33, b34;
+  b11=B(1,1); b12=B(1,2); b13=B(1,3); b14=B(1,4);
+  b21=B(2,1); b22=B(2,2); b23=B(2,3); b24=B(2,4);
+  b31=B(3,1); b32=B(3,2); b33=B(3,3); b34=B(3,4);
+
+  bool found_it = false;
+  std::vector<double> y[3], x[3];
+  std::vector<char> ok(invwarp.xsize(),0);
+  for (unsigned int d=0; d<3; d++) { y[d].resize(invwarp.xsize()); x[d].resize(invwarp.xsize()); }
+  ntet = 0;
+  for (int k=int(first); k<int(last); k++) {
+    for (int j=0; j<invwarp.ysize(); j++) {
+      if (ninv) {
+	for (int i=0; i<invwarp.xsize(); i++) {
+	  y[0][i] = i; y[1][i] = j; y[2][i] = k;
+	  x[0][i] = b11*i+b12*j+b13*k+b14;
+	  x[1][i] = b21*i+b22*j+b23*k+b24;
+	  x[2][i] = b31*i+b32*j+b33*k+b34;
+	}
+	ninv->Invert(y,x,ok);
+      }
+      for (int i=0; i<invwarp.xsize(); i++) {
+        double ox, oy, oz;
+        double ax = b11*i+b12*j+b13*k+b14;
+        double ay = b21*i+b22*j+b23*k+b24;
+        double az = b31*i+b32*j+b33*k+b34;
+        if (ninv && ok[i]) {
+          invwarp(i,j,k,0) = x[0][i]-ax;
+          invwarp(i,j,k,1) = x[1][i]-ay;
+          invwarp(i,j,k,2) = x[2][i]-az;
+          found_it = false;  // Tetrahedron starts from the affine guess at next failure
+          continue;
+        }
+        ntet++;
+        if (!i || !found_it) {
+	  tet.SetFirstPoint(int(ax),int(ay),int(az));
+	}
+        if (tet.FindPoint(double(i),double(j),double(k),ox,oy,oz)) {
+          invwarp(i,j,k,0) = ox-ax;
+          invwarp(i,j,k,1) = oy-ay;
+          invwarp(i,j,k,2) = oz-az;
+          found_it = true;
+	}
+        else { // Indicates singularity.
+          invwarp(i,j,k,0) = -999; // NaN
+          invwarp(i,j,k,1) = -999; // NaN
+          invwarp(i,j,k,2) = -999; // NaN
+          found_it = false;
+        }
+      }
+    }
+  }
+}
+
+// Adds the affine component (A) back in for slices first to (one past) last
+
+inline void add_affine_slab(unsigned int               first,
+                            unsigned int               last,
+                            const NEWMAT::Matrix&      M,
+                            const NEWMAT::Matrix&      A,
+                            NEWIMAGE::volume4D<float>& invwarp)
+{
+  double m11, m12, m13, m14;
+  double m21, m22, m23, m24;
+  double m31, m32, m33, m34;
+  m11=M(1,1); m12=M(1,2); m13=M(1,3); m14=M(1,4);
+  m21=M(2,1); m22=M(2,2); m23=M(2,3); m24=M(2,4);
+  m31=M(3,1); m32=M(3,2); m33=M(3,3); m34=M(3,4);
+  double a11, a12, a13, a14;
+  double a21, a22, a23, a24;
+  double a31, a32, a33, a34;
+  a11=A(1,1); a12=A(1,2); a13=A(1,3); a14=A(1,4);
+  a21=A(2,1); a22=A(2,2); a23=A(2,3); a24=A(2,4);
+  a31=A(3,1); a32=A(3,2); a33=A(3,3); a34=A(3,4);
+  for (int k=int(first); k<int(last); k++) {
+    for (int j=0; j<invwarp.ysize(); j++) {
+      for (int i=0; i<invwarp.xsize(); i++) {
+        double mmx = m11*i+m12*j+m13*k+m14;
+        double mmy = m21*i+m22*j+m23*k+m24;
+        double mmz = m31*i+m32*j+m33*k+m34;
+        double ax = a11*mmx+a12*mmy+a13*mmz+a14;
+        double ay = a21*mmx+a22*mmy+a23*mmz+a24;
+        double az = a31*mmx+a32*mmy+a33*mmz+a34;
+        invwarp(i,j,k,0) += ax-mmx;
+        invwarp(i,j,k,1) += ay-mmy;
+        invwarp(i,j,k,2) += az-mmz;
+      }
+    }
+  }
+}
+
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+//
+// Inverts warpvol (displacements in voxels of invwarp) into invwarp,
+// using B (invwarp voxels -> warpvol voxels) as initial guess. The
+// z-slabs are divided over nthr threads. Voxels where the inversion
+// fails are set to -999. Returns the number of voxels that were
+// inverted by tetrahedra. If verbose is set the main thread reports
+// the number of slabs that have been completed.
+//
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+
+inline unsigned int invert_field(const std::shared_ptr<NEWIMAGE::volume4D<float> >& warpvol,
+                                 const NEWMAT::Matrix&                              B,
+                                 const NewtonInverter                               *ninv,
+                                 NEWIMAGE::volume4D<float>&                         invwarp,
+                                 Utilities::NoOfThreads                             nthr,
+                                 bool                                               verbose=false)
+{
+  unsigned int nt = std::max(1u,std::min(static_cast<unsigned int>(nthr._n),static_cast<unsigned int>(invwarp.zsize())));
+  std::vector<unsigned int> nslc = RGT_UTILS::rows_per_thread(static_cast<unsigned int>(invwarp.zsize()),nt);
+  // The guys doing the work. SetIgnoreFOV sets the extrapolation of the
+  // (shared) field, so is done here before any threads are started.
+  NEWMAT::Matrix iB = B.i();
+  std::vector<Tetrahedron> tets(nt,Tetrahedron(0,0,0,warpvol,iB));
+  for (unsigned int t=0; t<nt; t++) tets[t].SetIgnoreFOV();
+  std::vector<unsigned int> ntet(nt,0);
+  std::vector<std::thread> threads(nt-1); // + main thread makes nt
+  for (unsigned int t=0; t<nt-1; t++) {
+    threads[t] = std::thread(invert_slab,nslc[t],nslc[t+1],std::cref(B),std::ref(tets[t]),ninv,std::ref(invwarp),std::ref(ntet[t]));
+  }
+  invert_slab(nslc[nt-1],nslc[nt],B,tets[nt-1],ninv,invwarp,ntet[nt-1]);
+  // Only the main thread writes to cout
+  if (verbose) { std::cout << "Slabs done: " << 1 << " of " << nt; std::cout.flush(); }
+  for (unsigned int t=0; t<nt-1; t++) {
+    threads[t].join();
+    if (verbose) { std::cout << "\rSlabs done: " << t+2 << " of " << nt; std::cout.flush(); }
+  }
+  if (verbose) std::cout << std::endl;
+  unsigned int n = 0;
+  for (unsigned int t=0; t<nt; t++) n += ntet[t];
+  return(n);
+}
+
+// Adds the affine component A back into invwarp, with M the voxel->mm matrix of invwarp
+
+inline void add_affine(const NEWMAT::Matrix&      M,
+                       const NEWMAT::Matrix&      A,
+                       NEWIMAGE::volume4D<float>& invwarp,
+                       Utilities::NoOfThreads     nthr)
+{
+  unsigned int nt = std::max(1u,std::min(static_cast<unsigned int>(nthr._n),static_cast<unsigned int>(invwarp.zsize())));
+  std::vector<unsigned int> nslc = RGT_UTILS::rows_per_thread(static_cast<unsigned int>(invwarp.zsize()),nt);
+  std::vector<std::thread> threads(nt-1); // + main thread makes nt
+  for (unsigned int t=0; t<nt-1; t++) {
+    threads[t] = std::thread(add_affine_slab,nslc[t],nslc[t+1],std::cref(M),std::cref(A),std::ref(invwarp));
+  }
+  add_affine_slab(nslc[nt-1],nslc[nt],M,A,invwarp);
+  std::for_each(threads.begin(),threads.end(),std::mem_fn(&std::thread::join));
+}
+
+} // End namespace FNIRT
+
+#endif // End #ifndef field_inverter_h
@@ -115,7 +115,14 @@ int main(int   argc,
     cf->SetLevel(1);
     cf->SetIntensityMappingFixed(!clp->EstimateIntensity(1));
     cf->SetHessianPrecision(clp->HessianPrecision());
+    cf->SetHessianReordering(clp->HessianReordering());
+    cf->SetMixedPrecisionSolve(clp->MixedPrecisionSolve());
     cf->SetInterpolationModel(clp->InterpolationModel());
+    cf->SetObjectPyramid(clp->ObjectPyramid());
+    cf->SetRecursiveSmoothing(clp->RecursiveSmoothing());
+    if (clp->SplineCacheDir().length()) cf->SetSplineCacheDir(clp->SplineCacheDir());
+    cf->SetFieldStorage(clp->OutputStorage());
+    cf->SetCoefStorage(clp->CoefStorage());
     if (clp->WeightLambdaBySSD()) cf->WeightLambdaBySSD();
     if (clp->UseRefDeriv()) cf->UseRefDerivs();
     if (clp->Debug()) cf->SetDebug(clp->Debug());
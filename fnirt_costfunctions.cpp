@@ -9,11 +9,13 @@
 /*  CCOPYRIGHT  */
 
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <string>
 #include <vector>
 #include <time.h>
 #include <memory>
+#include <thread>
 #include "NewNifti/NewNifti.h"
 #include "armawrap/newmat.h"
 #ifndef EXPOSE_TREACHEROUS
@@ -98,25 +100,25 @@ void fnirt_CF::common_construction(std::vector<std::shared_ptr<BASISFIELD::basis
   // datamask is a mask returned by general_transform with 1 when a voxel fall within the FOV and 0 otherwise
   datamask = std::shared_ptr<NEWIMAGE::volume<char> >(new NEWIMAGE::volume<char>(RefSz_x(),RefSz_y(),RefSz_z()));
   copybasicproperties(*ssvref,*datamask);
-  // df is a volume representation of the field
-  df = std::shared_ptr<NEWIMAGE::volume<float> >(new NEWIMAGE::volume<float>(RefSz_x(),RefSz_y(),RefSz_z(),df_field.size()));
-  df->copyproperties(*ssvref); //for header info
-  for (unsigned int i=0; i<df_field.size(); i++) {
-    NEWIMAGE::ShadowVolume<float> tmpVol((*df)[i]);
-    //(*df)[i] = 0.0;
-    tmpVol=0.0;
-    df_field[i]->AsVolume(tmpVol);
-    //df_field[i]->AsVolume((*df)[i]);
-  }
   // Various optional fields that have not yet been defined
   ref_fwhm = 0.0;                               // No smoothing yet
   obj_fwhm = 0.0;                               // No smoothing yet
+  objdec = std::vector<unsigned int>(3,1);      // No decimation yet
+  obj_pyramid = false;                          // Don't decimate smoothed object unless told to
+  rec_smooth = false;                           // Smooth by convolution with (truncated) Gaussian
+  svobj_updated = true;                         // svobj = vobj
+  splcache = std::shared_ptr<NEWIMAGE::SplineCoefCache<float> >(new NEWIMAGE::SplineCoefCache<float>());
+  vpool = NEWIMAGE::VolumeDataPool::Create();
   subsamp = std::vector<unsigned int>(3,1);     // No sub-sampling yet
   latest_ssd = 0.0;                             // No history
   lambda = 0.0;                                 // lambda not set
   mpl_lambda = 0.0;                             // Lambda for landmarks not set.
   use_ref_derivs = false;                       // Use "exact" derivatives as default
   hess_prec = BFMatrixDoublePrecision;          // Represent Hessian in double precision
+  hess_reord = BFMatrixNoReordering;            // Solve with Hessian in natural order
+  hess_mixed = false;                           // Solve in the precision of the Hessian
+  field_storage = NEWIMAGE::FloatStorage;       // Save coefficients and fields as float
+  coef_storage = NEWIMAGE::FloatStorage;        // ... in NIfTI files
   verbose = false;                              // Don't volunteer information
   debug = 0;                                    // Don't write debug info unless explicitly told to
   level = iter = attempt = 0;                   // Initilise debug info state variables
@@ -144,7 +146,8 @@ void fnirt_CF::SaveDefFields(std::string fname) const
 {
   if (Verbose()) cout << "Saving Displacement fields to " << fname << endl;
 
-  NEWIMAGE::FnirtFileWriter  write_it(fname,Ref(),DefFieldAsVol(0),DefFieldAsVol(1),DefFieldAsVol(2),AffineMat());
+  NEWIMAGE::FnirtFileWriter  write_it(fname,Ref(),DefFieldAsVol(0),DefFieldAsVol(1),DefFieldAsVol(2),AffineMat(),field_storage);
+  if (Verbose() && field_storage != NEWIMAGE::FloatStorage) cout << "Max error from int16 storage is " << write_it.MaxError() << " mm" << endl;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////
@@ -171,7 +174,8 @@ void fnirt_CF::SaveDefCoefs(const std::string &fname) const
 {
   if (Verbose()) cout << "Saving Coefficient fields to " << fname << endl;
 
-  NEWIMAGE::FnirtFileWriter  write_it(fname,DefField(0),DefField(1),DefField(2),AffineMat());
+  NEWIMAGE::FnirtFileWriter  write_it(fname,DefField(0),DefField(1),DefField(2),AffineMat(),coef_storage);
+  if (Verbose() && coef_storage == NEWIMAGE::Int16Storage) cout << "Max error from int16 storage is " << write_it.MaxError() << " (coefficients)" << endl;
 }
 
 void fnirt_CF::SaveRobj(const std::string &fname) const
@@ -256,19 +260,18 @@ void fnirt_CF::SaveObjMask(const std::string &fname) const
 
 std::pair<double,double> fnirt_CF::JacobianRange() const
 {
-  NEWIMAGE::volume<float>   jac(RefSz_x(),RefSz_y(),RefSz_z());
-  jac = Ref();        // To get header-info
-  jac = 0.0;          // Blank it
-  deffield2jacobian(DefField(0),DefField(1),DefField(2),AffineMat(),jac); // Defined in fnirt_file_reader.h
+  // Defined in fnirt_file_reader.h. The bounds are not used here.
+  NEWMAT::ColumnVector stats = NEWIMAGE::jacobian_range(DefField(0),DefField(1),DefField(2),AffineMat(),0.0,0.0,smoothing_threads());
   std::pair<double,double>  rng;
-  rng.first = jac.min();
-  rng.second = jac.max();
+  rng.first = stats(1);
+  rng.second = stats(2);
 
   return(rng);
 }
 
 void fnirt_CF::ForceJacobianRange(double minj, double maxj) const
 {
+  NEWIMAGE::VolumeDataPoolScope  pscope(VolumePool());   // Temporaries recycled between calls
   // To speed things up the field will be extended outside
   // the "valid" FOV to a size that allows for a fast FFT.
   unsigned int Nx, Ny, Nz;
@@ -296,7 +299,7 @@ void fnirt_CF::ForceJacobianRange(double minj, double maxj) const
     add_affine_part(AffineMat(),i,tmpVol);
   }
   convertwarp_rel2abs(defvol);
-  constrain_topology(defvol,minj,maxj);
+  constrain_topology(defvol,minj,maxj,smoothing_threads());
   convertwarp_abs2rel(defvol);
   for (unsigned int i=0; i<3; i++) {
     NEWIMAGE::ShadowVolume<float> tmpVol(defvol[i]);
@@ -344,14 +347,6 @@ void fnirt_CF::SubsampleRef(const std::vector<unsigned int>& ss)
     // Inform intensity-mapper of new dimensions
     imap->NewSubSampling(ss2ms(ss),ss2vxs(ss),ss,subsamp);
 
-    // Resize volume representation of field
-    df = std::shared_ptr<NEWIMAGE::volume4D<float> >(new NEWIMAGE::volume4D<float>(RefSz_x(),RefSz_y(),RefSz_z(),df_field.size()));
-    copybasicproperties(*ssvref,(*df));
-    for (unsigned int i=0; i<df_field.size(); i++) {
-      NEWIMAGE::ShadowVolume<float>tmpVol ((*df)[i]);
-      df_field[i]->AsVolume(tmpVol);
-    }
-
     // Resize robj, robjmask and datamask
     robj = std::shared_ptr<NEWIMAGE::volume<float> >(new NEWIMAGE::volume<float>(RefSz_x(),RefSz_y(),RefSz_z()));
     robj->copyproperties(*ssvref);
@@ -376,6 +371,9 @@ void fnirt_CF::SubsampleRef(const std::vector<unsigned int>& ss)
     }
 
     subsamp = ss;
+
+    // Decimation of object depends on subsampling of reference
+    if (obj_decimation() != objdec) {svobj_updated = false; robj_updated = false;}
   }
 }
 
@@ -387,7 +385,8 @@ void fnirt_CF::SmoothRef(double fwhm)
       svref = vref;
     }
     else {
-      svref = std::shared_ptr<NEWIMAGE::volume<float> >(new NEWIMAGE::volume<float>(smooth(*vref,fwhm/sqrt(8.0*log(2.0)))));
+      if (rec_smooth) svref = std::shared_ptr<NEWIMAGE::volume<float> >(new NEWIMAGE::volume<float>(smooth_recursive(*vref,fwhm/sqrt(8.0*log(2.0)),smoothing_threads())));
+      else svref = std::shared_ptr<NEWIMAGE::volume<float> >(new NEWIMAGE::volume<float>(smooth(*vref,fwhm/sqrt(8.0*log(2.0)))));
     }
     if (subsamp[0]!=1 || subsamp[1]!=1 || subsamp[2]!=1) {
       // Resample reference image and reference mask
@@ -403,10 +402,7 @@ void fnirt_CF::IntensityScaleObj(double sfac)
 {
   *vobj *= sfac;      // Scale
 
-  if (obj_fwhm) {     // If there is a smoothed version, smooth scaled image
-    svobj = masked_smoothing(*vobj,obj_fwhm,objmask);
-    // svobj = std::shared_ptr<NEWIMAGE::volume<float> >(new NEWIMAGE::volume<float>(smooth(*vobj,obj_fwhm/sqrt(8.0*log(2.0)))));
-  }
+  if (obj_fwhm) svobj_updated = false;   // If there is a smoothed version, smooth scaled image
   robj_updated = false;
 }
 
@@ -414,13 +410,7 @@ void fnirt_CF::SmoothObj(double fwhm)
 {
   if (fwhm != obj_fwhm) {
     obj_fwhm = fwhm;
-    if (!fwhm) {
-      svobj = vobj;
-    }
-    else {
-      svobj = masked_smoothing(*vobj,fwhm,objmask);
-      // svobj = std::shared_ptr<NEWIMAGE::volume<float> >(new NEWIMAGE::volume<float>(smooth(*vobj,fwhm/sqrt(8.0*log(2.0)))));
-    }
+    svobj_updated = false;
     robj_updated = false;
   }
 
@@ -464,7 +454,7 @@ void fnirt_CF::SetObjMask(const std::shared_ptr<NEWIMAGE::volume<char> > mask)
   }
   objmask = mask;
   copybasicproperties(*vobj,*objmask);
-  if (obj_fwhm) svobj = masked_smoothing(*vobj,obj_fwhm,objmask);
+  if (obj_fwhm) {svobj_updated = false; robj_updated = false;}
   robjmask = std::shared_ptr<NEWIMAGE::volume<char> >(new NEWIMAGE::volume<char>(RefSz_x(),RefSz_y(),RefSz_z()));
   copybasicproperties(*ssvref,*robjmask);
   robjmask_updated = false;
@@ -498,11 +488,12 @@ NEWMAT::ColumnVector fnirt_CF::GetScaleParams() const
 
 void fnirt_CF::update_robj() const
 {
+  update_svobj();
   if (!robj_updated) {
     if (translate_interp_type(svobj->getinterpolationmethod()) != InterpolationType()) {
       svobj->setinterpolationmethod(translate_interp_type(InterpolationType()));
     }
-    general_transform(*svobj,aff,*df,*robj,*datamask);
+    general_transform(*svobj,aff,df_view(),*robj,*datamask);
     robj_updated = true;
     totmask_updated = false;
   }
@@ -512,7 +503,7 @@ void fnirt_CF::update_robjmask() const
 {
   if (objmask && !robjmask_updated) {
     if (objmask->getinterpolationmethod() != NEWIMAGE::trilinear) objmask->setinterpolationmethod(NEWIMAGE::trilinear);
-    general_transform(*objmask,aff,*df,*robjmask);
+    general_transform(*objmask,aff,df_view(),*robjmask);
     robjmask_updated = true;
     totmask_updated = false;
   }
@@ -531,16 +522,17 @@ const NEWIMAGE::volume4D<float>& fnirt_CF::RobjDeriv() const
     robj_deriv->copyproperties(*ssvref);
     robj_deriv_updated = false;
   }
+  update_svobj();
   if (!robj_deriv_updated) { // If the derivatives doesn't reflect current df field
     // When we are doing this we might as well update robj
     // and data mask as well.
     if (translate_interp_type(svobj->getinterpolationmethod()) != InterpolationType()) {
       svobj->setinterpolationmethod(translate_interp_type(InterpolationType()));
     }
-    general_transform_3partial(*svobj,aff,*df,*robj,*robj_deriv,*datamask);
-    (*robj_deriv)[0] /= ObjVxs_x();
-    (*robj_deriv)[1] /= ObjVxs_y();
-    (*robj_deriv)[2] /= ObjVxs_z();
+    general_transform_3partial(*svobj,aff,df_view(),*robj,*robj_deriv,*datamask);
+    (*robj_deriv)[0] /= svobj->xdim();   // svobj may be decimated
+    (*robj_deriv)[1] /= svobj->ydim();
+    (*robj_deriv)[2] /= svobj->zdim();
     if (!robj_updated) {robj_updated=true; totmask_updated=false;}
     robj_deriv_updated = true;
   }
@@ -626,8 +618,6 @@ void fnirt_CF::SetDefField(const NEWIMAGE::volume4D<float>& vfield) const
   // Might want to introduce check for equality in future
   for (unsigned int i=0; i<df_field.size(); i++) {
     df_field[i]->Set(vfield[i]);
-    NEWIMAGE::ShadowVolume<float> tmpVol((*df)[i]);
-    df_field[i]->AsVolume(tmpVol);   // N.B. may not be identical to vfield[i]
   }
   robj_updated = false;
   robj_deriv_updated = false;
@@ -640,18 +630,20 @@ void fnirt_CF::SetDefField(const NEWIMAGE::volume4D<float>& vfield) const
 void fnirt_CF::SetDefFieldParams(const NEWMAT::ColumnVector& p) const
 {
   if (p.Nrows() != 3*int(DefCoefSz())) {throw FnirtException("fnirt_CF::SetDefFieldParams: Mismatch between field and parameter vector");}
+  // Only fields whose coefficients differ are updated (which bumps their
+  // version). Optimisers often evaluate cost, gradient and Hessian at the same p.
+  const double *pp = static_cast<const double *>(p.Store());
   bool sameasold = true;
   for (unsigned int i=0; i<df_field.size(); i++) {
     std::shared_ptr<NEWMAT::ColumnVector>  oldp = df_field[i]->GetCoef();  // Shared ptr must be named variable
-    if (*oldp != p.Rows(i*DefCoefSz()+1,(i+1)*DefCoefSz())) {sameasold = false;}
+    const double *newp = pp + i*DefCoefSz();
+    if (!oldp || std::memcmp(oldp->Store(),newp,DefCoefSz()*sizeof(double))) {
+      df_field[i]->SetCoef(p.Rows(i*DefCoefSz()+1,(i+1)*DefCoefSz()));
+      sameasold = false;
+    }
   }
 
   if (!sameasold) {
-    for (int i=0; i<int(df_field.size()); i++) {
-      df_field[i]->SetCoef(p.Rows(i*DefCoefSz()+1,(i+1)*DefCoefSz()));
-      NEWIMAGE::ShadowVolume<float> tmpVol((*df)[i]);
-      df_field[i]->AsVolume(tmpVol);
-    }
     robj_updated = false;
     robj_deriv_updated = false;
     if (objmask) {
@@ -736,10 +728,14 @@ void fnirt_CF::subsample_refmask(const std::vector<unsigned int>  nms,
 
 std::shared_ptr<NEWIMAGE::volume<float> > fnirt_CF::masked_smoothing(const NEWIMAGE::volume<float>&              vol,
                                                                        double                                      fwhm,
-                                                                       std::shared_ptr<NEWIMAGE::volume<char> >  mask)
+                                                                       std::shared_ptr<NEWIMAGE::volume<char> >  mask) const
 {
   std::shared_ptr<NEWIMAGE::volume<float> > tmpvol = std::shared_ptr<NEWIMAGE::volume<float> >(new NEWIMAGE::volume<float>(vol));
-  if (mask) {
+  if (mask && rec_smooth) {
+    // Smooth image (zeroed outside mask) and mask in one pass, and re-normalize within mask
+    *tmpvol = masked_smooth_recursive(vol,*mask,fwhm/sqrt(8.0*log(2.0)),smoothing_threads());
+  }
+  else if (mask) {
     NEWIMAGE::volume<float> tmpmask = vol;
     // Copy mask to float representation and set
     // everything outside mask to zero in image.
@@ -763,12 +759,111 @@ std::shared_ptr<NEWIMAGE::volume<float> > fnirt_CF::masked_smoothing(const NEWIM
       }
     }
   }
+  else if (rec_smooth) {
+    *tmpvol = smooth_recursive(vol,fwhm/sqrt(8.0*log(2.0)),smoothing_threads());
+  }
   else {
     *tmpvol = smooth(vol,fwhm/sqrt(8.0*log(2.0)));
   }
   return(tmpvol);
 }
 
+NEWIMAGE::DisplacementFieldView fnirt_CF::df_view() const
+{
+  return(NEWIMAGE::DisplacementFieldView(*df_field[0],*df_field[1],*df_field[2]));
+}
+
+std::vector<unsigned int> fnirt_CF::obj_decimation() const
+{
+  std::vector<unsigned int> dec(3,1);
+  if (!obj_pyramid || !obj_fwhm) return(dec);
+  std::vector<double> rvxs = ss2vxs(subsamp);
+  double ovxs[] = {ObjVxs_x(), ObjVxs_y(), ObjVxs_z()};
+  unsigned int osz[] = {ObjSz_x(), ObjSz_y(), ObjSz_z()};
+  for (unsigned int i=0; i<3; i++) {
+    // At least two samples per FWHM, and never coarser than the points we sample it at
+    double maxvxs = std::min(obj_fwhm/2.0,rvxs[i]);
+    dec[i] = std::max(1u,static_cast<unsigned int>(std::floor(maxvxs/ovxs[i] + 1e-6)));
+    dec[i] = std::min(dec[i],std::max(1u,osz[i]/8));  // Leave thin volumes alone
+  }
+  return(dec);
+}
+
+void fnirt_CF::update_svobj() const
+{
+  if (svobj_updated) return;
+  objdec = obj_decimation();
+  if (!obj_fwhm) svobj = vobj;
+  else {
+    svobj = masked_smoothing(*vobj,obj_fwhm,objmask);
+    if (objdec[0]>1 || objdec[1]>1 || objdec[2]>1) svobj = decimate(*svobj,objdec);
+  }
+  svobj->setinterpolationmethod(translate_interp_type(interp));
+  // Consecutive levels often use the same FWHM, so coefficients may already be known
+  if (interp == SplineInterp) splcache->Prepare(*svobj,obj_fwhm,Utilities::NoOfThreads(SPLINTERPOLATOR::DefaultNoOfDeconvThreads(svobj->nvoxels())));
+  svobj_updated = true;
+  robj_updated = false;
+  robj_deriv_updated = false;
+  if (Verbose() && obj_fwhm) cout << "Object decimated by: " << objdec[0] << " " << objdec[1] << " " << objdec[2] << endl;
+}
+
+std::shared_ptr<NEWIMAGE::volume<float> > fnirt_CF::decimate(const NEWIMAGE::volume<float>&    vol,
+                                                             const std::vector<unsigned int>&  dec) const
+{
+  // The first and last voxel of the decimated volume coincide with those of
+  // vol, so that it covers the same FOV. The spacing is therefore dec voxels
+  // when dec divides size-1, and a little less when it doesn't.
+  int osz[] = {static_cast<int>(vol.xsize()), static_cast<int>(vol.ysize()), static_cast<int>(vol.zsize())};
+  int dsz[3];
+  double step[3];
+  std::vector<int> i0[3];          // Voxel to the "left" of each decimated voxel
+  std::vector<float> w[3];         // Weight of the voxel to the "right"
+  for (unsigned int d=0; d<3; d++) {
+    dsz[d] = (osz[d] > 1) ? (osz[d]-2)/static_cast<int>(dec[d]) + 2 : 1;
+    step[d] = (dsz[d] > 1) ? double(osz[d]-1)/double(dsz[d]-1) : 1.0;
+    i0[d].resize(dsz[d]); w[d].resize(dsz[d]);
+    for (int i=0; i<dsz[d]; i++) {
+      double x = (i == dsz[d]-1) ? double(osz[d]-1) : i*step[d];
+      i0[d][i] = std::min(static_cast<int>(std::floor(x)),std::max(0,osz[d]-2));
+      w[d][i] = static_cast<float>(x - i0[d][i]);
+    }
+  }
+  std::shared_ptr<NEWIMAGE::volume<float> > dvol(new NEWIMAGE::volume<float>(dsz[0],dsz[1],dsz[2]));
+  dvol->copyproperties(vol);
+  dvol->setdims(step[0]*vol.xdim(),step[1]*vol.ydim(),step[2]*vol.zdim());
+
+  // Voxel [0 0 0] maps to the same point as before, in mm and in world space.
+  NEWMAT::Matrix M(4,4);
+  M  = 0.0;
+  M(1,1) = step[0]; M(2,2) = step[1]; M(3,3) = step[2]; M(4,4) = 1.0;
+  if (vol.sform_code() != NIFTI_XFORM_UNKNOWN) dvol->set_sform(vol.sform_code(),vol.sform_mat() * M);
+  if (vol.qform_code() != NIFTI_XFORM_UNKNOWN) dvol->set_qform(vol.qform_code(),vol.qform_mat() * M);
+
+  // No integration needed since vol has already been smoothed to (at least) the new resolution.
+  // Voxels that fall between the original ones are linearly interpolated, the others are copied.
+  for (int k=0; k<dsz[2]; k++) {
+    int k0 = i0[2][k], k1 = (w[2][k] > 0.0) ? k0+1 : k0;
+    for (int j=0; j<dsz[1]; j++) {
+      int j0 = i0[1][j], j1 = (w[1][j] > 0.0) ? j0+1 : j0;
+      for (int i=0; i<dsz[0]; i++) {
+        int ii0 = i0[0][i], ii1 = (w[0][i] > 0.0) ? ii0+1 : ii0;
+        float wx = w[0][i], wy = w[1][j], wz = w[2][k];
+        float v00 = (1.0f-wx)*vol(ii0,j0,k0) + wx*vol(ii1,j0,k0);
+        float v10 = (1.0f-wx)*vol(ii0,j1,k0) + wx*vol(ii1,j1,k0);
+        float v01 = (1.0f-wx)*vol(ii0,j0,k1) + wx*vol(ii1,j0,k1);
+        float v11 = (1.0f-wx)*vol(ii0,j1,k1) + wx*vol(ii1,j1,k1);
+        (*dvol)(i,j,k) = (1.0f-wz)*((1.0f-wy)*v00 + wy*v10) + wz*((1.0f-wy)*v01 + wy*v11);
+      }
+    }
+  }
+  return(dvol);
+}
+
+Utilities::NoOfThreads fnirt_CF::smoothing_threads() const
+{
+  return(Utilities::NoOfThreads(std::max(1u,std::thread::hardware_concurrency())));
+}
+
 unsigned int fnirt_CF::good_fft_size(unsigned int isz) const
 {
   // This is a set of numbers that can be factorised into small integers, and wich I have
@@ -807,6 +902,7 @@ NEWMAT::ReturnMatrix SSD_fnirt_CF::Par() const
 
 double SSD_fnirt_CF::cf(const NEWMAT::ColumnVector& p) const
 {
+  NEWIMAGE::VolumeDataPoolScope  pscope(VolumePool());   // Temporaries recycled between calls
   if (p.Nrows() != NPar()) {
     throw FnirtException("SSD_fnirt_CF::cf: Mismatch between field and parameter vector");
   }
@@ -891,6 +987,7 @@ double SSD_fnirt_CF::cf(const NEWMAT::ColumnVector& p) const
 
 NEWMAT::ReturnMatrix SSD_fnirt_CF::grad(const NEWMAT::ColumnVector& p) const
 {
+  NEWIMAGE::VolumeDataPoolScope  pscope(VolumePool());   // Temporaries recycled between calls
   if (p.Nrows() != NPar()) {
     throw FnirtException("SSD_fnirt_CF::cf: Mismatch between field and parameter vector");
   }
@@ -952,6 +1049,7 @@ NEWMAT::ReturnMatrix SSD_fnirt_CF::grad(const NEWMAT::ColumnVector& p) const
 std::shared_ptr<MISCMATHS::BFMatrix> SSD_fnirt_CF::hess(const NEWMAT::ColumnVector&             p,
                                                           std::shared_ptr<MISCMATHS::BFMatrix>  iptr) const
 {
+  NEWIMAGE::VolumeDataPoolScope  pscope(VolumePool());   // Temporaries recycled between calls
   //
   // See if there is an old Hessian, and if we can reuse it
   //
@@ -1011,7 +1109,7 @@ std::shared_ptr<MISCMATHS::BFMatrix> SSD_fnirt_CF::hess(const NEWMAT::ColumnVect
     if (reg) reg->Clear();
     if (RegularisationModel() == MembraneEnergy) reg = DefField(0).MemEnergyHess(HessianPrecision());
     else if (RegularisationModel() == BendingEnergy) reg = DefField(0).BendEnergyHess(HessianPrecision());
-    if (Debug() > 2) reg->Print(string("FnirtDebugRegHess_")+DebugString()+string(".txt"));
+    SaveDebugHessian(*reg,string("FnirtDebugRegHess_"));
   }
   dxTdx->AddToMe(*reg,Lambda()/double(n));
   dyTdy->AddToMe(*reg,Lambda()/double(n));
@@ -1021,13 +1119,13 @@ std::shared_ptr<MISCMATHS::BFMatrix> SSD_fnirt_CF::hess(const NEWMAT::ColumnVect
   if (MPL()) {
     std::shared_ptr<MISCMATHS::BFMatrix> mplH = MPL()->SSD_Hessian(0,DefField(0),HessianPrecision());
     dxTdx->AddToMe(*mplH,MatchingPointsLambda());
-    if (Debug() > 2) mplH->Print(string("FnirtDebugMPL_x_Hess_")+DebugString()+string(".txt"));
+    SaveDebugHessian(*mplH,string("FnirtDebugMPL_x_Hess_"));
     mplH = MPL()->SSD_Hessian(1,DefField(1),HessianPrecision());
     dyTdy->AddToMe(*mplH,MatchingPointsLambda());
-    if (Debug() > 2) mplH->Print(string("FnirtDebugMPL_y_Hess_")+DebugString()+string(".txt"));
+    SaveDebugHessian(*mplH,string("FnirtDebugMPL_y_Hess_"));
     mplH = MPL()->SSD_Hessian(2,DefField(2),HessianPrecision());
     dzTdz->AddToMe(*mplH,MatchingPointsLambda());
-    if (Debug() > 2) mplH->Print(string("FnirtDebugMPL_z_Hess_")+DebugString()+string(".txt"));
+    SaveDebugHessian(*mplH,string("FnirtDebugMPL_z_Hess_"));
   }
 
   // Put all the bits together, and lets put them all in dxTdx.
@@ -1069,9 +1167,11 @@ std::shared_ptr<MISCMATHS::BFMatrix> SSD_fnirt_CF::hess(const NEWMAT::ColumnVect
   dxTdx->HorConcat2MyRight(*xCross);
   xCross->Clear();
 
+  dxTdx->SetReordering(HessianReordering());
+  dxTdx->SetMixedPrecisionSolve(MixedPrecisionSolve());
   if (UsingRefDeriv()) last_hess = dxTdx;
 
-  if (Debug() > 2) dxTdx->Print(string("FnirtDebugHessian_")+DebugString()+string(".txt"));
+  SaveDebugHessian(*dxTdx,string("FnirtDebugHessian_"));
 
   return(dxTdx);
 }
@@ -21,9 +21,14 @@
 #include "basisfield/basisfield.h"
 #include "basisfield/splinefield.h"
 #include "basisfield/dctfield.h"
+#include "warpfns/fnirt_file_writer.h"
 #include "intensity_mappers.h"
 #include "matching_points.h"
 
+namespace NEWIMAGE {
+class DisplacementFieldView;
+}
+
 namespace FNIRT {
 
 enum FnirtInterpolationType {LinearInterp, SplineInterp, UnknownInterp};
@@ -109,6 +114,20 @@ public:
   virtual void SetLevel(unsigned int plevel=0) {level=plevel; iter=0; attempt=0;}
   // Set precision for representation of Hessian
   virtual void SetHessianPrecision(MISCMATHS::BFMatrixPrecisionType prec) {hess_prec=prec;}
+  // Set reordering used when solving with the Hessian
+  virtual void SetHessianReordering(MISCMATHS::BFMatrixReorderingType reord) {hess_reord=reord;}
+  // Solve with single precision iterations and double precision refinement
+  virtual void SetMixedPrecisionSolve(bool flag=true) {hess_mixed=flag;}
+  // Decimate the smoothed object volume to a resolution matched to FWHM and subsampling
+  virtual void SetObjectPyramid(bool flag=true) {if (flag != obj_pyramid) {obj_pyramid=flag; svobj_updated=false; robj_updated=false;}}
+  // Smooth with recursive (IIR) Gaussian rather than convolution. Faster, but not identical. Set before smoothing.
+  virtual void SetRecursiveSmoothing(bool flag=true) {if (flag != rec_smooth) {rec_smooth=flag; svobj_updated=false; robj_updated=false;}}
+  // Directory where spline coefficients of the smoothed object are kept between runs
+  virtual void SetSplineCacheDir(const std::string& dir) {splcache->SetDirectory(dir);}
+  // Set how coefficient and field files are stored (float or scaled int16)
+  virtual void SetFieldStorage(NEWIMAGE::FnirtFileStorage st) {field_storage=st; coef_storage=st;}
+  // Set how the coefficient file alone is stored (e.g. in a warp container)
+  virtual void SetCoefStorage(NEWIMAGE::FnirtFileStorage st) {coef_storage=st;}
   // Set list of matching points/landmarks to be included in matching.
   virtual void SetMatchingPoints(const MatchingPoints& pmpl) {mpl = std::shared_ptr<MatchingPoints>(new MatchingPoints(pmpl));}
   virtual void SetMatchingPointsLambda(double pl) {mpl_lambda = pl;}
@@ -173,11 +192,14 @@ public:
     SaveLocalIntensityMapping(fname);
   }
 
-  // Access displacement field as volume
-  virtual const NEWIMAGE::ShadowVolume<float> DefFieldAsVol(int index) const
+  // Access displacement field as volume. N.B. creates a new volume on every call.
+  virtual NEWIMAGE::volume<float> DefFieldAsVol(int index) const
   {
     if (index<0 || index >2) {throw FnirtException("fnirt_CF::DefFieldAsVol: index must be 0, 1 or 2");}
-    return((*df)[index]);
+    NEWIMAGE::volume<float> vol(RefSz_x(),RefSz_y(),RefSz_z());
+    copybasicproperties(*ssvref,vol);
+    df_field[index]->AsVolume(vol);
+    return(vol);
   }
 
   // Access displacement field as field class
@@ -295,6 +317,21 @@ protected:
   // Find out what precision to use for Hessian
   virtual MISCMATHS::BFMatrixPrecisionType HessianPrecision() const {return(hess_prec);}
 
+  // Find out what reordering to use when solving with Hessian
+  virtual MISCMATHS::BFMatrixReorderingType HessianReordering() const {return(hess_reord);}
+
+  // Find out if solving with Hessian should use mixed precision
+  virtual bool MixedPrecisionSolve() const {return(hess_mixed);}
+
+  // Find out if images are smoothed with recursive Gaussian
+  virtual bool RecursiveSmoothing() const {return(rec_smooth);}
+
+  // Find out if smoothed object volume is decimated
+  virtual bool ObjectPyramid() const {return(obj_pyramid);}
+
+  // Pool that full-size temporaries are taken from
+  std::shared_ptr<NEWIMAGE::VolumeDataPool> VolumePool() const {return(vpool);}
+
   // Find out if debug info should be saved
   virtual unsigned int Debug() const {return(debug);}
 
@@ -305,6 +342,12 @@ protected:
   virtual unsigned int Iter() const {return(iter);}
   virtual unsigned int Attempt() const {return(attempt);}
   virtual std::string DebugString() const {char c_str[256]; sprintf(c_str,"level%02d_iter%02d_attempt%02d",Level(),Iter(),Attempt()); return(std::string(c_str));}
+  // Level 3 prints Hessians as text (fname.txt), level 4 saves them in binary SpMat format (fname.bin)
+  virtual void SaveDebugHessian(const MISCMATHS::BFMatrix& H, const std::string& fname) const
+  {
+    if (Debug() > 3) H.Save(fname+DebugString()+std::string(".bin"));
+    else if (Debug() > 2) H.Print(fname+DebugString()+std::string(".txt"));
+  }
 
 private:
   // Hide auto generated functions
@@ -319,8 +362,14 @@ private:
   std::vector<unsigned int>                                subsamp;            // Subsampling of subsampled reference volume
 
   const std::shared_ptr<NEWIMAGE::volume<float> >        vobj;       // Object volume, i.e. volume to be warped to vref
-  std::shared_ptr<NEWIMAGE::volume<float> >              svobj;      // Smoothed object volume
+  mutable std::shared_ptr<NEWIMAGE::volume<float> >      svobj;      // Smoothed (and possibly decimated) object volume
   double                                                   obj_fwhm;   // FWHM of smoothed object volume
+  mutable std::vector<unsigned int>                        objdec;     // Decimation of svobj w.r.t. vobj
+  bool                                                     obj_pyramid; // Decimate svobj when smoothing allows it
+  bool                                                     rec_smooth; // Smooth vobj and vref with recursive Gaussian
+  mutable bool                                             svobj_updated; // True if svobj reflects vobj, obj_fwhm and objdec
+  std::shared_ptr<NEWIMAGE::SplineCoefCache<float> >      splcache;   // Spline coefficients of recent svobj's
+  std::shared_ptr<NEWIMAGE::VolumeDataPool>               vpool;      // Recycles full-size temporaries between evaluations
 
   const NEWMAT::Matrix                                     aff;        // Affine transformation matrix
 
@@ -343,7 +392,11 @@ private:
   bool                                                     ssd_lambda;         // Set if lambda is to be multiplied by latest ssd
   bool                                                     use_ref_derivs;     // Use derivatives of reference image
   MISCMATHS::BFMatrixPrecisionType                         hess_prec;          // Can be float or double
+  MISCMATHS::BFMatrixReorderingType                        hess_reord;         // Can be none or rcm
+  bool                                                     hess_mixed;         // Float CG with double refinement
   FnirtInterpolationType                                   interp;             // Interpolation model trilinear/spline
+  NEWIMAGE::FnirtFileStorage                               field_storage;      // Data type for field files
+  NEWIMAGE::FnirtFileStorage                               coef_storage;       // Data type/format for coefficient files
   mutable bool                                             verbose;            // Print diagnostic information
   unsigned int                                             debug;              // Level of debug info to save
 
@@ -364,7 +417,6 @@ private:
   mutable std::shared_ptr<NEWIMAGE::volume<float> >   robj;                // Resampled version of object volume
   mutable std::shared_ptr<NEWIMAGE::volume<char> >    datamask;            // One where robj reflects "true" interpolated intensity
   mutable bool                                          robj_updated;        // True if robj accurately reflects df
-  mutable std::shared_ptr<NEWIMAGE::volume4D<float> > df;                  // Volume representation of displacement field
   mutable std::shared_ptr<NEWIMAGE::volume<char> >    robjmask;            // Resampled version of objmask
   mutable bool                                          robjmask_updated;    // True if robjmask accurately reflects df
   mutable std::shared_ptr<NEWIMAGE::volume<char> >    totmask;             // Total mask, only used if refmask and/or objmask is set.
@@ -403,7 +455,23 @@ private:
 
   std::shared_ptr<NEWIMAGE::volume<float> > masked_smoothing(const NEWIMAGE::volume<float>&              vol,
                                                                double                                      fwhm,
-                                                               std::shared_ptr<NEWIMAGE::volume<char> >  mask);
+                                                               std::shared_ptr<NEWIMAGE::volume<char> >  mask) const;
+
+  // Decimation factors for svobj given current FWHM and subsampling
+  std::vector<unsigned int> obj_decimation() const;
+
+  // Smooth, and decimate, vobj into svobj
+  void update_svobj() const;
+
+  // Sample vol every ~dec:th voxel, spanning the same FOV, with header adjusted to keep the mm-coordinates
+  std::shared_ptr<NEWIMAGE::volume<float> > decimate(const NEWIMAGE::volume<float>&    vol,
+                                                     const std::vector<unsigned int>&  dec) const;
+
+  // Light-weight view of df_field for use by general_transform
+  NEWIMAGE::DisplacementFieldView df_view() const;
+
+  // Number of threads used when smoothing images
+  Utilities::NoOfThreads smoothing_threads() const;
 
   unsigned int good_fft_size(unsigned int isz) const;
 
@@ -23,6 +23,7 @@
 #include "miscmaths/miscmaths.h"
 #include "newimage/newimageall.h"
 #include "warpfns/fnirt_file_reader.h"
+#include "warpfns/warp_container.h"
 #include "warpfns/point_list.h"
 #include "intensity_mappers.h"
 #include "fnirtfns.h"
@@ -80,13 +81,20 @@ fnirt_clp::fnirt_clp(const Utilities::Option<string>&                     pref,
                      const Utilities::Option<bool>&                       pverbose,
                      const Utilities::Option<int>&                        pdebug,
                      const Utilities::Option<string>&                     p_hess_prec,
-                     const Utilities::Option<string>&                     p_interp_type)
+                     const Utilities::Option<string>&                     p_interp_type,
+                     const Utilities::Option<string>&                     p_hess_reord,
+                     const Utilities::Option<string>&                     p_splcache,
+                     const Utilities::Option<string>&                     p_outprec,
+                     const Utilities::Option<string>&                     p_coutfmt,
+                     const Utilities::Option<int>&                        p_objpyramid,
+                     const Utilities::Option<string>&                     p_smoothmodel)
   : ref(pref.value()), obj(pobj.value()), inwarp(pinwarp.value()), in_int(pin_int.value()), coef(pcoef.value()), objo(pobjo.value()),
     fieldo(pfieldo.value()), jaco(pjaco.value()), refo(prefo.value()), into(pinto.value()), logo(plogo.value()),
     refm(prefm.value()), objm(pobjm.value()), ref_pl(pref_pl.value()), obj_pl(pobj_pl.value()), rimf((primf.value()==0) ? false : true),
     rimv(primv.value()), oimf((poimf.value()==0) ? false : true), oimv(poimv.value()), spordr(static_cast<unsigned int>(pspordr.value())),
     ssqlambda((pssqlambda.value()==0) ? false : true), jacrange(pjacrange.value()), userefderiv((puserefderiv.value()==0) ? false : true),
-    verbose(pverbose.value()), debug(static_cast<unsigned int>(pdebug.value()))
+    verbose(pverbose.value()), debug(static_cast<unsigned int>(pdebug.value())), splcache(p_splcache.value()),
+    obj_pyramid((p_objpyramid.value()==0) ? false : true)
 {
   // Parse and assert input
 
@@ -157,20 +165,45 @@ fnirt_clp::fnirt_clp(const Utilities::Option<string>&                     pref,
 
 
   // Assert the categorical parameters
+  hess_mixed = false;
   if (p_hess_prec.value() == "float") hess_prec = BFMatrixFloatPrecision;
   else if (p_hess_prec.value() == "double") hess_prec = BFMatrixDoublePrecision;
-  else throw fnirt_error("fnirt_clp: --numprec takes values float or double");
+  else if (p_hess_prec.value() == "mixed") { hess_prec = BFMatrixFloatPrecision; hess_mixed = true; }
+  else throw fnirt_error("fnirt_clp: --numprec takes values float, double or mixed");
+  if (p_hess_reord.value() == "none") hess_reord = BFMatrixNoReordering;
+  else if (p_hess_reord.value() == "rcm") hess_reord = BFMatrixRCMReordering;
+  else throw fnirt_error("fnirt_clp: --hessorder takes values none or rcm");
   if (p_interp_type.value() == "linear") interp_type = LinearInterp;
   else if (p_interp_type.value() == "spline") interp_type = SplineInterp;
   else throw fnirt_error("fnirt_clp: --interp takes values linear or spline");
-  if (debug > 3) throw fnirt_error("fnirt_clp: --debug takes values 0, 1, 2 or 3");
+  if (p_outprec.value() == "float") out_storage = NEWIMAGE::FloatStorage;
+  else if (p_outprec.value() == "int16") out_storage = NEWIMAGE::Int16Storage;
+  else throw fnirt_error("fnirt_clp: --outprec takes values float or int16");
+  coef_storage = out_storage;
+  string coutfmt = p_coutfmt.value();
+  string fwc = NEWIMAGE::WarpContainer::Extension();
+  if (!p_coutfmt.set() && coef.size() > fwc.size() && coef.compare(coef.size()-fwc.size(),fwc.size(),fwc) == 0) coutfmt = "fwc";
+  if (coutfmt == "fwc") coef_storage = NEWIMAGE::ContainerStorage;
+  else if (coutfmt == "fwcfield") coef_storage = NEWIMAGE::ContainerWithFieldStorage;
+  else if (coutfmt != "nifti") throw fnirt_error("fnirt_clp: --coutfmt takes values nifti, fwc or fwcfield");
+  if (out_storage == NEWIMAGE::Int16Storage && coef_storage != NEWIMAGE::Int16Storage) {
+    throw fnirt_error("fnirt_clp: --outprec=int16 cannot be used with --coutfmt=fwc/fwcfield, which are always stored as float");
+  }
+  if (p_smoothmodel.value() == "conv") rec_smooth = false;
+  else if (p_smoothmodel.value() == "recursive") rec_smooth = true;
+  else throw fnirt_error("fnirt_clp: --smoothmodel takes values conv or recursive");
+  if (debug > 4) throw fnirt_error("fnirt_clp: --debug takes values 0, 1, 2, 3 or 4");
   if (pcf.value() == "ssd") cf = SSD;
   else throw fnirt_error("fnirt_clp: Invalid cost-function option");
   if (pbf.value() == "spline") bf = Spline;
   else if (pbf.value() == "dct") bf = DCT;
   else throw fnirt_error("fnirt_clp: Invalid basis option");
+  if (bf != Spline && (coef_storage == NEWIMAGE::ContainerStorage || coef_storage == NEWIMAGE::ContainerWithFieldStorage)) {
+    throw fnirt_error("fnirt_clp: --coutfmt=fwc/fwcfield can only be used with --basis=spline");
+  }
   if (pnlm.value() == "lm") nlm = NL_LM;
   else if (pnlm.value() == "scg") nlm = NL_SCG;
+  else if (pnlm.value() == "lbfgs") nlm = NL_LBFGS;
   else throw fnirt_error("fnirt_clp: Invalid minimisation option");
   if (pregmod.value() == "membrane_energy") regmod = MembraneEnergy;
   else if (pregmod.value() == "bending_energy") regmod = BendingEnergy;
@@ -276,6 +309,7 @@ fnirt_clp::fnirt_clp(const Utilities::Option<string>&                     pref,
   // Make sure we are not trying to estimate intensities with Scaled Conjugate-gradient.
   //
   if (nlm == NL_SCG) for (unsigned int i=0; i<nlev; i++) if (estint[i]) throw fnirt_error("fnirt_clp: Cannot estimate intensity mapping with Scaled Conjugate Gradient method");
+  if (nlm == NL_LBFGS) for (unsigned int i=0; i<nlev; i++) if (estint[i]) throw fnirt_error("fnirt_clp: Cannot estimate intensity mapping with L-BFGS method");
 
   //
   // Assert and parse parameters pertaining to intensity mapping.
@@ -453,7 +487,7 @@ std::shared_ptr<fnirt_clp> parse_fnirt_command_line(unsigned int   narg,
       string("Value to mask out in --in image. Default =0.0"),false, Utilities::requires_argument);
 
   Utilities::Option<string> minimisationmethod(string("--minmet"), string("lm"),
-      string("non-linear minimisation method [lm | scg] (Levenberg-Marquardt or Scaled Conjugate Gradient)"),
+      string("non-linear minimisation method [lm | scg | lbfgs] (Levenberg-Marquardt, Scaled Conjugate Gradient or limited memory BFGS)"),
       false, Utilities::requires_argument);
 
   vector<int> maxiterdefault(4,0);
@@ -528,11 +562,29 @@ std::shared_ptr<fnirt_clp> parse_fnirt_command_line(unsigned int   narg,
       string("Estimate intensity-mapping if set, default 1 (true)"),false,Utilities::requires_argument);
 
   Utilities::Option<string> numprec(string("--numprec"),string("double"),
-      string("Precision for representing Hessian, double or float. Default double"),false,Utilities::requires_argument);
+      string("Precision for representing Hessian, double, float or mixed (float Hessian solved to full accuracy). Default double"),false,Utilities::requires_argument);
+
+  Utilities::Option<string> hessorder(string("--hessorder"),string("none"),
+      string("Reordering of Hessian when solving, none or rcm (Reverse Cuthill-McKee). Default none"),false,Utilities::requires_argument);
 
   Utilities::Option<string> interpolation(string("--interp"),string("linear"),
       string("Image interpolation model, linear or spline. Default linear"),false,Utilities::requires_argument);
 
+  Utilities::Option<string> splinecache(string("--splinecache"),string(""),
+      string("Directory where spline coefficients of smoothed input image are kept for re-use by later runs"),false,Utilities::requires_argument);
+
+  Utilities::Option<string> outprec(string("--outprec"),string("float"),
+      string("Data type of --cout and --fout files, float or int16 (scaled, half the size). int16 requires --coutfmt=nifti. Default float"),false,Utilities::requires_argument);
+
+  Utilities::Option<string> coutfmt(string("--coutfmt"),string("nifti"),
+      string("Format of --cout file, nifti, fwc (memory mappable warp container) or fwcfield (container that also holds the field). Default nifti, or fwc if --cout ends in .fwc"),false,Utilities::requires_argument);
+
+  Utilities::Option<int> objpyramid(string("--objpyramid"),0,
+      string("If =1, smoothed in-image is decimated to a resolution matched to smoothing and sub-sampling. Faster, but results differ slightly. Default =0"),false,Utilities::requires_argument);
+
+  Utilities::Option<string> smoothmodel(string("--smoothmodel"),string("conv"),
+      string("Model for smoothing --in and --ref, conv (convolution) or recursive (faster for large FWHM, results differ slightly). Default conv"),false,Utilities::requires_argument);
+
   Utilities::Option<string> configfile(string("--config"),string(""),
       string("Name of configuration field with settings for some/all fnirt parameters"),false,Utilities::requires_argument);
 
@@ -543,7 +595,7 @@ std::shared_ptr<fnirt_clp> parse_fnirt_command_line(unsigned int   narg,
       string("Print diagnostic information while running"), false, Utilities::no_argument);
 
   Utilities::HiddenOption<int> debug(string("--debug"), 0,
-      string("Save debug information while running, levels 0 (no info), 1 (some info), 2 (little more info) or 3 (LOTS of info)"), false, Utilities::requires_argument);
+      string("Save debug information while running, levels 0 (no info), 1 (some info), 2 (little more info), 3 (LOTS of info) or 4 (as 3, but Hessians saved in binary format)"), false, Utilities::requires_argument);
 
   // Some explanatory text
 
@@ -603,7 +655,13 @@ std::shared_ptr<fnirt_clp> parse_fnirt_command_line(unsigned int   narg,
     options.add(biasfieldlambda);
     options.add(estimateintensity);
     options.add(numprec);
+    options.add(hessorder);
     options.add(interpolation);
+    options.add(splinecache);
+    options.add(outprec);
+    options.add(coutfmt);
+    options.add(objpyramid);
+    options.add(smoothmodel);
     options.add(verbose);
     options.add(debug);
     options.add(help);
@@ -657,7 +715,8 @@ std::shared_ptr<fnirt_clp> parse_fnirt_command_line(unsigned int   narg,
                                                      basis,minimisationmethod,maxiter,subsampling,warpres,splineorder,objsmoothing,
                                                      refsmoothing,regularisationmodel,lambda,ssqlambda,mpl_lambda,jacrange,userefderiv,intensitymodel,
                                                      estimateintensity,intensityorder,biasfieldres,biasfieldregmod,
-                                                     biasfieldlambda,verbose,debug,numprec,interpolation));
+                                                     biasfieldlambda,verbose,debug,numprec,interpolation,hessorder,splinecache,outprec,coutfmt,
+                                                     objpyramid,smoothmodel));
   }
   catch(fnirt_error& e) {
     options.usage();
@@ -706,7 +765,13 @@ std::shared_ptr<fnirt_clp> parse_fnirt_command_line(unsigned int   narg,
     logfs << biasfieldres << endl;
     logfs << biasfieldlambda << endl;
     logfs << numprec << endl;
+    logfs << hessorder << endl;
     logfs << interpolation << endl;
+    if (splinecache.set()) logfs << splinecache << endl;
+    logfs << outprec << endl;
+    if (coutfmt.set()) logfs << coutfmt << endl;
+    if (objpyramid.set()) logfs << objpyramid << endl;
+    if (smoothmodel.set()) logfs << smoothmodel << endl;
     logfs << userefderiv << endl;
     logfs.close();
   }
@@ -992,6 +1057,9 @@ void set_nlpars(NonlinParam&  nlp)
   }
   else if (nlp.Method() == NL_SCG) {
   }
+  else if (nlp.Method() == NL_LBFGS) {
+    nlp.SetLBFGSHistory(10);
+  }
 }
 
 // Combine an inclusive/exclusive explicit mask with an implicit mask
@@ -1106,6 +1174,8 @@ void write_self_results(const fnirt_clp&                clp,
   std::vector<std::shared_ptr<basisfield> >   field = init_warpfield(clp);
   std::shared_ptr<IntensityMapper>            intmap = init_intensity_mapper(clp);
   std::shared_ptr<SSD_fnirt_CF>   cf = std::shared_ptr<SSD_fnirt_CF>(new SSD_fnirt_CF(ref,ref,IdentityMatrix(4),field,intmap));
+  cf->SetFieldStorage(clp.OutputStorage());
+  cf->SetCoefStorage(clp.CoefStorage());
 
   cf->SaveDefCoefs(clp.CoefFname());                                      // Coefficients
   if (clp.FieldFname().length()) cf->SaveDefFields(clp.FieldFname());     // Field
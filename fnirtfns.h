@@ -106,7 +106,14 @@ private:
   bool                                         verbose;
   unsigned int                                 debug;
   MISCMATHS::BFMatrixPrecisionType             hess_prec;
+  MISCMATHS::BFMatrixReorderingType            hess_reord;
+  bool                                         hess_mixed;
   FnirtInterpolationType                       interp_type;
+  std::string                                  splcache;
+  NEWIMAGE::FnirtFileStorage                   out_storage;
+  NEWIMAGE::FnirtFileStorage                   coef_storage;
+  bool                                         obj_pyramid;
+  bool                                         rec_smooth;
 
 public:
   fnirt_clp(const Utilities::Option<std::string>&                     pref,
@@ -155,7 +162,13 @@ public:
             const Utilities::Option<bool>&                            pverbose,
             const Utilities::Option<int>&                             pdebug,
             const Utilities::Option<std::string>&                     p_hess_prec,
-            const Utilities::Option<std::string>&                     p_interp_type);
+            const Utilities::Option<std::string>&                     p_interp_type,
+            const Utilities::Option<std::string>&                     p_hess_reord,
+            const Utilities::Option<std::string>&                     p_splcache,
+            const Utilities::Option<std::string>&                     p_outprec,
+            const Utilities::Option<std::string>&                     p_coutfmt,
+            const Utilities::Option<int>&                             p_objpyramid,
+            const Utilities::Option<std::string>&                     p_smoothmodel);
   ~fnirt_clp() {}
   const std::string& Obj() const {return(obj);}
   const std::string& Ref() const {return(ref);}
@@ -188,7 +201,14 @@ public:
   CostFunctionType CostFunction() const {return(cf);}
   BasisFieldType Basis() const {return(bf);}
   MISCMATHS::BFMatrixPrecisionType HessianPrecision() const {return(hess_prec);}
+  MISCMATHS::BFMatrixReorderingType HessianReordering() const {return(hess_reord);}
+  bool MixedPrecisionSolve() const {return(hess_mixed);}
   FnirtInterpolationType InterpolationModel() const {return(interp_type);}
+  const std::string& SplineCacheDir() const {return(splcache);}
+  NEWIMAGE::FnirtFileStorage OutputStorage() const {return(out_storage);}
+  NEWIMAGE::FnirtFileStorage CoefStorage() const {return(coef_storage);}
+  bool ObjectPyramid() const {return(obj_pyramid);}
+  bool RecursiveSmoothing() const {return(rec_smooth);}
   unsigned int SplineOrder() const {return(spordr);}
   MISCMATHS::NLMethod MinimisationMethod() const {return(nlm);}
   const NEWMAT::Matrix& Affine() const {return(aff);}
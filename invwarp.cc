@@ -9,12 +9,16 @@
 
 /*  CCOPYRIGHT  */
 
+#include <vector>
 #include "utils/options.h"
+#include "utils/threading.h"
 #include "miscmaths/miscmaths.h"
 #include "warpfns/warpfns.h"
 #include "warpfns/fnirt_file_reader.h"
 #include "warpfns/fnirt_file_writer.h"
 #include "tetrahedron.h"
+#include "newton_inverter.h"
+#include "field_inverter.h"
 #include "dilator.h"
 
 #define _GNU_SOURCE 1
@@ -65,9 +69,18 @@ Option<string> outname(string("-o,--out"), string(""),
 Option<string> warpname(string("-w,--warp"), string(""),
 			string("filename for warp/shiftmap transform (volume)"),
 			true, requires_argument);
+Option<string> outprec(string("--outprec"), string("float"),
+		       string("Data type of output field, float or int16 (scaled, half the size). Default float"),
+		       false, requires_argument);
 Option<string> extrapolation(string("-e,--extrap"), string("affine"),
 			     string("Extrapolation method to use outside FOV [affine | fancy], default affine"),
 			     true, requires_argument);
+Option<bool> newton(string("--newton"), false,
+		  string("invert by Newton iterations on the spline coefficients, using tetrahedra only where that fails. Requires a coefficient file"),
+		  false, no_argument);
+Option<int> nthr(string("--nthr"), 1,
+		 string("Number of threads to use, default 1. Result does not depend on this"),
+		 false, requires_argument);
 
 int new_invwarp()
 {
@@ -101,12 +114,6 @@ int new_invwarp()
   // use within tetrahedron and for use as
   // initial guess.
   NEWMAT::Matrix B = warpvol->sampling_mat().i()*aff*ref.sampling_mat();      // For initial guess
-  double b11, b12, b13, b14;
-  double b21, b22, b23, b24;
-  double b31, b32, b33, b34;
-  b11=B(1,1); b12=B(1,2); b13=B(1,3); b14=B(1,4);
-  b21=B(2,1); b22=B(2,2); b23=B(2,3); b24=B(2,4);
-  b31=B(3,1); b32=B(3,2); b33=B(3,3); b34=B(3,4);
 
   // Rescale displacement fields mm->voxels_in_ref_space
   (*warpvol)[0] /= ref.xdim();
@@ -118,47 +125,28 @@ int new_invwarp()
     cout << "Inverting field" << endl;
   }
   NEWMAT::Matrix iB = B.i();
-  Tetrahedron  tet(0,0,0,warpvol,iB); // The guy doing the work
-  tet.SetIgnoreFOV();
-  bool found_it = false;
-  for (int k=0; k<invwarp.zsize(); k++) {
-    if (verbose.value()) { cout << "\b\b\b\b\b\b\b\b\b\b" << "Slice: " << k+1; cout.flush(); }
-    for (int j=0; j<invwarp.ysize(); j++) {
-      for (int i=0; i<invwarp.xsize(); i++) {
-        double ox, oy, oz;
-        double ax = b11*i+b12*j+b13*k+b14;
-        double ay = b21*i+b22*j+b23*k+b24;
-        double az = b31*i+b32*j+b33*k+b34;
-        if (!i || !found_it) {
-	  tet.SetFirstPoint(int(ax),int(ay),int(az));
-	}
-        if (tet.FindPoint(double(i),double(j),double(k),ox,oy,oz)) {
-          invwarp(i,j,k,0) = ox-ax;
-          invwarp(i,j,k,1) = oy-ay;
-          invwarp(i,j,k,2) = oz-az;
-          found_it = true;
-	}
-        else { // Indicates singularity.
-          invwarp(i,j,k,0) = -999; // NaN
-          invwarp(i,j,k,1) = -999; // NaN
-          invwarp(i,j,k,2) = -999; // NaN
-          found_it = false;
-        }
-      }
+  NoOfThreads nt(static_cast<unsigned int>(std::max(1,nthr.value())));
+  std::shared_ptr<NewtonInverter> ninv;
+  if (newton.value()) {
+    if (fnirtfile.Type() == FnirtSplineDispType) {
+      std::vector<double> s = {ref.xdim(), ref.ydim(), ref.zdim()};
+      ninv = std::make_shared<NewtonInverter>(fnirtfile.FieldAsSplinefield(0),fnirtfile.FieldAsSplinefield(1),
+					      fnirtfile.FieldAsSplinefield(2),iB,s);
     }
+    else cout << "--newton needs a coefficient file, using tetrahedra for all voxels" << endl;
+  }
+  unsigned int ntet = invert_field(warpvol,B,ninv.get(),invwarp,nt,verbose.value());
+  if (verbose.value() && ninv) {
+    cout << "Newton iterations failed for " << ntet << " voxels, which were inverted using tetrahedra" << endl;
   }
-  if (verbose.value()) cout << endl;
 
   // Perform dilations to replace NaNs
   // with average of non-NaN neighbours.
   if (verbose.value()) cout << "Fudging values at edge of FOV" << endl;
-  for (int i=0; i<3; i++) {
-    Dilator dil(invwarp[i]);
-    unsigned int n = dil.Dilate();
-    while (n) {
-      n = dil.Dilate();
-    }
-    invwarp[i] = dil.Get();
+  {
+    Dilator dil(invwarp);
+    dil.Fill();
+    invwarp = dil.Get();
   }
 
   // Convert back to mm
@@ -166,41 +154,13 @@ int new_invwarp()
   invwarp[0] *= vxs[0]; invwarp[1] *= vxs[1]; invwarp[2] *= vxs[2];
 
   // Add affine component back in
-  NEWMAT::Matrix M = ref.sampling_mat();
-  double m11, m12, m13, m14;
-  double m21, m22, m23, m24;
-  double m31, m32, m33, m34;
-  m11=M(1,1); m12=M(1,2); m13=M(1,3); m14=M(1,4);
-  m21=M(2,1); m22=M(2,2); m23=M(2,3); m24=M(2,4);
-  m31=M(3,1); m32=M(3,2); m33=M(3,3); m34=M(3,4);
-  NEWMAT::Matrix A = aff;
-  double a11, a12, a13, a14;
-  double a21, a22, a23, a24;
-  double a31, a32, a33, a34;
-  a11=A(1,1); a12=A(1,2); a13=A(1,3); a14=A(1,4);
-  a21=A(2,1); a22=A(2,2); a23=A(2,3); a24=A(2,4);
-  a31=A(3,1); a32=A(3,2); a33=A(3,3); a34=A(3,4);
-  for (int k=0; k<invwarp.zsize(); k++) {
-    for (int j=0; j<invwarp.ysize(); j++) {
-      for (int i=0; i<invwarp.xsize(); i++) {
-        double mmx = m11*i+m12*j+m13*k+m14;
-        double mmy = m21*i+m22*j+m23*k+m24;
-        double mmz = m31*i+m32*j+m33*k+m34;
-        double ax = a11*mmx+a12*mmy+a13*mmz+a14;
-        double ay = a21*mmx+a22*mmy+a23*mmz+a24;
-        double az = a31*mmx+a32*mmy+a33*mmz+a34;
-        invwarp(i,j,k,0) += ax-mmx;
-        invwarp(i,j,k,1) += ay-mmy;
-        invwarp(i,j,k,2) += az-mmz;
-      }
-    }
-  }
+  add_affine(ref.sampling_mat(),aff,invwarp,nt);
 
   // Constrain range of Jacobians of inverse field
   if (!nojaccon.value()) {
     if (verbose.value()) cout << "Constraining range of Jacobians in inverse field" << endl;
     convertwarp_rel2abs(invwarp);
-    constrain_topology(invwarp,jmin.value(),jmax.value());
+    constrain_topology(invwarp,jmin.value(),jmax.value(),nt);
     convertwarp_abs2rel(invwarp);
   }
 
@@ -208,7 +168,11 @@ int new_invwarp()
   // from "old" invwarp. The advantage is that now the field is
   // "in the system" and we can make assumptions about it.
   if (verbose.value()) cout << "Saving inverted field" << endl;
-  FnirtFileWriter(outname.value(),ref,invwarp);
+  if (outprec.value() == "int16") {
+    FnirtFileWriter  wrt(outname.value(),ref,invwarp,IdentityMatrix(4),Int16Storage);
+    if (verbose.value()) cout << "Max error from int16 storage is " << wrt.MaxError() << " mm" << endl;
+  }
+  else FnirtFileWriter(outname.value(),ref,invwarp);
 
   return(EXIT_SUCCESS);
 }
@@ -236,6 +200,9 @@ int main(int argc, char *argv[])
     options.add(nojaccon);
     options.add(jmin);
     options.add(jmax);
+    options.add(outprec);
+    options.add(newton);
+    options.add(nthr);
     options.add(debug);
     options.add(verbose);
     options.add(help);
@@ -265,6 +232,10 @@ int main(int argc, char *argv[])
     cerr << "--abs and --rel flags cannot both be set" << endl;
     exit(EXIT_FAILURE);
   }
+  if (outprec.value() != "float" && outprec.value() != "int16") {
+    cerr << "--outprec takes values float or int16" << endl;
+    exit(EXIT_FAILURE);
+  }
 
   volume4D<float>   warpvol;
   try {
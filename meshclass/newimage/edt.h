@@ -31,4 +31,20 @@ namespace NEWIMAGE {
 
   template<class T>
   NEWIMAGE::volume<T> sparseInterpolate(const NEWIMAGE::volume<T>& data, const NEWIMAGE::volume<T>& isSample, const double sigma=3);
+
+  //As above, but the 3D transforms are separable and the lines along each dimension are shared out between nthr threads.
+  //The results do not depend on nthr.
+
+  template <class T>
+  NEWIMAGE::volume<double> euclideanDistanceTransform(const NEWIMAGE::volume<T>& input, Utilities::NoOfThreads nthr);
+
+  template <typename T>
+  std::tuple<NEWIMAGE::volume<double>,NEWIMAGE::volume<T>> euclideanDistanceTransform(const NEWIMAGE::volume<T>& binary, const NEWIMAGE::volume<T>& data, Utilities::NoOfThreads nthr);
+
+  template<class T>
+  NEWIMAGE::volume<T> sparseInterpolate(const NEWIMAGE::volume<T>& data, const NEWIMAGE::volume<T>& isSample, const double sigma, Utilities::NoOfThreads nthr);
+
+  //Same as euclideanDistanceTransform but calculated, and returned, in single precision
+  template <class T>
+  NEWIMAGE::volume<float> euclideanDistanceTransformFloat(const NEWIMAGE::volume<T>& input, Utilities::NoOfThreads nthr=Utilities::NoOfThreads(1));
 }
\ No newline at end of file
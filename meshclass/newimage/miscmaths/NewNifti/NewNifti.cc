@@ -11,6 +11,11 @@
 #include <sstream>
 #include <iomanip>
 #include <algorithm>
+#include <memory>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "NewNifti.h"
 
@@ -804,6 +809,38 @@ namespace NiftiIO {
   }
 
 
+  NiftiHeader mapImage(const string filename, char*& buffer, shared_ptr<void>& mapping, vector<NiftiExtension>& extensions)
+  {
+    buffer = NULL;
+    mapping.reset();
+    fileIO reader(filename,true);
+    NiftiHeader header=reader.readHeader();
+    fill(header.dim.begin()+header.dim[0]+1,header.dim.end(),1);  // As loadImageROI, unused dims may hold anything
+    reader.readExtensions(header, extensions );
+    reader.reset();
+    size_t nBytes(header.nElements()*header.datumByteWidth());
+    if ( !header.singleFile() || header.wasWrongEndian || nBytes == 0 || header.vox_offset % header.datumByteWidth() )
+      return header;
+    int fd = open(filename.c_str(), O_RDONLY);
+    if ( fd < 0 )
+      return header;
+    struct stat st;
+    unsigned char gzMagic[2] = {0,0};
+    if ( fstat(fd,&st) || (size_t)st.st_size < header.vox_offset+nBytes || pread(fd,gzMagic,2,0) != 2 || (gzMagic[0] == 0x1f && gzMagic[1] == 0x8b) ) {
+      close(fd);
+      return header;
+    }
+    size_t mapSize(st.st_size);
+    void *base = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if ( base == MAP_FAILED )
+      return header;
+    mapping = shared_ptr<void>(base, [mapSize](void *p) { munmap(p,mapSize); });
+    buffer = static_cast<char *>(base) + header.vox_offset;
+    return header;
+  }
+
+
   NiftiHeader loadHeader(const string filename)
   {
     fileIO reader(filename,true);
@@ -840,6 +877,84 @@ namespace NiftiIO {
   }
 
 
+  ImageWriter::ImageWriter(string filename, const vector<NiftiExtension>& extensions, NiftiHeader header, const bool useCompression) : bytesLeft(0)
+  {
+    //Header and extensions are written as by saveImage
+    writer.reset(new fileIO(filename, false, useCompression));
+    size_t sizeOfExtensions(4);
+    header.vox_offset=header.sizeof_hdr;
+    for ( unsigned int i(0); i < extensions.size(); i++ )
+      sizeOfExtensions+=extensions[i].extensionSize();
+    header.vox_offset+=sizeOfExtensions;
+    if ( !header.singleFile() )
+      header.vox_offset=0;
+    writer->writeHeader(header);
+    if ( !header.isAnalyze() )
+      writer->writeExtensions(header,extensions);
+    if ( !header.singleFile() )
+      writer.reset(new fileIO(filename.replace(filename.rfind(".hdr"),4,".img"), false, useCompression));
+    bytesLeft=header.nElements()*header.datumByteWidth();
+  }
+
+
+  ImageWriter::~ImageWriter()
+  {
+    writer.reset(); //Never throw from destructor, an incomplete file is left as it is
+  }
+
+
+  void ImageWriter::write(const void* buffer, size_t nBytes)
+  {
+    if ( !writer )
+      throw NiftiException("Error: write to closed ImageWriter");
+    if ( nBytes > bytesLeft )
+      throw NiftiException("Error: ImageWriter given more data than specified by header");
+    writer->writeRawBytes(buffer, nBytes);
+    bytesLeft-=nBytes;
+  }
+
+
+  void ImageWriter::close()
+  {
+    writer.reset();
+    if ( bytesLeft )
+      throw NiftiException("Error: ImageWriter closed before all data was written, output file will be truncated");
+  }
+
+
+  ImageReader::ImageReader(string filename) : position(0)
+  {
+    //Header, extensions and data file are found as by loadImageROI
+    reader.reset(new fileIO(filename, true));
+    hdr=reader->readHeader();
+    fill(hdr.dim.begin()+hdr.dim[0]+1,hdr.dim.end(),1);
+    reader->readExtensions(hdr, exts);
+    if ( !hdr.singleFile() ) {
+      reader.reset(new fileIO(filename, true, false));
+      nifti_1_header truncatedHeader;
+      reader->readRawBytes( &truncatedHeader, (size_t)sizeof(truncatedHeader.sizeof_hdr) );
+      bool wasCompressed( (NIFTI2_VERSION(truncatedHeader)) == 0 );
+      reader.reset(new fileIO(filename.replace(filename.rfind(".hdr"),4,".img"), true, wasCompressed));
+    }
+    reader->seek(hdr.nominalVoxOffset(), SEEK_SET);
+  }
+
+
+  void ImageReader::read(void* buffer, size_t byteOffset, size_t nBytes)
+  {
+    if ( byteOffset+nBytes > hdr.nElements()*hdr.datumByteWidth() )
+      throw NiftiException("Error: ImageReader asked for data beyond end of image");
+    if ( byteOffset % hdr.datumByteWidth() || nBytes % hdr.datumByteWidth() )
+      throw NiftiException("Error: ImageReader asked for part of a voxel");
+    if ( byteOffset != position )
+      reader->seek(hdr.nominalVoxOffset()+byteOffset, SEEK_SET);
+    reader->readRawBytes(buffer, nBytes);
+    position=byteOffset+nBytes;
+    if ( hdr.wasWrongEndian )
+      byteSwap( hdr.datumByteWidth(), buffer, nBytes/hdr.datumByteWidth() );
+  }
+
+
   template <class T>
   HeaderType headerType(const T& header) {
     int version2(NIFTI2_VERSION(header));
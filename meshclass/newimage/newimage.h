@@ -15,6 +15,7 @@
 #include <cstdlib>
 #include <iostream>
 #include <limits>
+#include <memory>
 #include <stdexcept>
 #include <string>
 #include <type_traits>
@@ -27,6 +28,7 @@
 #include "miscmaths/kernel.h"
 #include "miscmaths/splinterpolator.h"
 #include "utils/threading.h"
+#include "volumepool.h"
 
 
 namespace NEWIMAGE {
@@ -102,6 +104,8 @@ int readGeneralVolume(volume<T>& target, const std::string& filename,
     T* Data;
     T* DataEnd;
     mutable bool data_owner;
+    std::shared_ptr<void> data_keeper;  // Keeps non-owned Data alive when it lives in e.g. a mapped file
+    std::shared_ptr<VolumeDataPool> datapool;  // Pool to allocate Data from, overrides any VolumeDataPoolScope
     mutable double maskDelimiter;
     int64_t nElements;
     int64_t nThreads;
@@ -212,6 +216,9 @@ int readGeneralVolume(volume<T>& target, const std::string& filename,
     NEWMAT::Matrix qform_mat() const { return RigidBodyCoordMat; }
     int qform_code() const { return RigidBodyTypeCode; }
     void set_data_owner(bool d_owner) const { data_owner=d_owner; }
+    // Take data from pool for all subsequent (re)allocations. A null pool means new T[].
+    void setdatapool(std::shared_ptr<VolumeDataPool> pool) { datapool=pool; }
+    std::shared_ptr<VolumeDataPool> getdatapool() const { return datapool; }
     public:
     typedef T* nonsafe_fast_iterator;
     inline nonsafe_fast_iterator nsfbegin()
@@ -524,7 +531,15 @@ int readGeneralVolume(volume<T>& target, const std::string& filename,
     void setsplineorder(int order) const;
     inline void invalidateSplines() const { splineuptodate = false; }
     int getsplineorder() const { return(splineorder); }
-    void forcesplinecoefcalculation() const;
+    void forcesplinecoefcalculation() const { forcesplinecoefcalculation(Utilities::NoOfThreads(this->nthreads())); }
+    void forcesplinecoefcalculation(Utilities::NoOfThreads nthr) const;
+    // Spline coefficients for the current data, spline order and extrapolation
+    // (calculated, with nthr threads, if not up to date), and adoption of
+    // coefficients calculated previously, e.g. kept in a SplineCoefCache,
+    // for identical data.
+    const T *splinecoefficients() const { return(splinecoefficients(Utilities::NoOfThreads(this->nthreads()))); }
+    const T *splinecoefficients(Utilities::NoOfThreads nthr) const;
+    void adoptsplinecoefficients(const T *coef) const;
     void setextrapolationvalidity(bool xv, bool yv, bool zv) const { ep_valid[0]=xv; ep_valid[1]=yv; ep_valid[2]=zv; }
     std::vector<bool> getextrapolationvalidity() const { return(ep_valid); }
     void defineuserinterpolation(float (*interp)(
@@ -823,12 +838,13 @@ public:
   template <class S, class D>
   void convertbuffer(const S* source, D* dest, size_t len, float slope, float intercept)
   {
+    // Indexed loops, so that the compiler can vectorise them
     if ( slope == 1.0 && intercept == 0.0)
-     for (const S* sptr=source; sptr<(source+len); sptr++)
-      *(dest++) = (D) *sptr;
+     for (size_t i=0; i<len; i++)
+      dest[i] = (D) source[i];
     else
-     for (const S* sptr=source; sptr<(source+len); sptr++)
-      *(dest++) = (D) ((*sptr) * slope + intercept);
+     for (size_t i=0; i<len; i++)
+      dest[i] = (D) (source[i] * slope + intercept);
   }
 
   template <class S1, class S2>
@@ -15,5 +15,7 @@
 #include "newimagefns.h"
 #include "complexvolume.h"
 #include "imfft.h"
+#include "recursivesmooth.h"
+#include "splinecoefcache.h"
 
 #endif
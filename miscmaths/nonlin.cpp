@@ -10,6 +10,7 @@
 #include <iomanip>
 #include <string>
 #include <vector>
+#include <deque>
 #include <cmath>
 #include "armawrap/newmat.h"
 #include "armawrap/newmatio.h"
@@ -43,6 +44,9 @@ NonlinOut levmar(const NonlinParam& p, const NonlinCF& cfo);
 // Main routine for amoeba (Nelder-Mead) optimisation
 NonlinOut amoeba(const NonlinParam& p, const NonlinCF& cfo);
 
+// Main routine for limited memory BFGS optimisation
+NonlinOut lbfgs(const NonlinParam& p, const NonlinCF& cfo);
+
 LinOut linsrch(// Input
                const ColumnVector&  pdir,    // Search direction
                const ColumnVector&  p0,      // Current parameter values
@@ -78,6 +82,23 @@ LinOut linmin(// Input
               // Output
               pair<double,double>   *x);    // Best point
 
+LinOut wolfe_linsrch(// Input
+                    const ColumnVector&  pdir,    // Search direction
+                    const ColumnVector&  p0,      // Current parameter values
+                    const ColumnVector&  grad,    // Gradient at p0
+                    const NonlinCF&      cfo,     // Cost-function object
+                    double               f0,      // Current cost-function value
+                    double               lambda0, // First step length to try
+                    double               c1,      // Sufficient decrease parameter
+                    double               c2,      // Curvature parameter
+                    int                  maxiter, // Max # of cost-function evaluations
+                    double               ptol,    // Tolerance in parameter space
+                    // Output
+                    double               *lambda, // Resulting step length
+                    double               *of,     // Value of cost-function on output
+                    ColumnVector         *np,     // New parameters
+                    ColumnVector         *ng);    // Gradient at new parameters
+
 pair<double,double> bracket(// Input
                             const ColumnVector& p,      // Current parameter values
                             const ColumnVector& pdir,   // Search direction
@@ -330,6 +351,9 @@ NonlinOut nonlin(const NonlinParam& p, const NonlinCF& cfo)
   case NL_NM:
     status = amoeba(p,cfo);
     break;
+  case NL_LBFGS:
+    status = lbfgs(p,cfo);
+    break;
   }
 
   return(status);
@@ -729,6 +753,86 @@ NonlinOut varmet(const NonlinParam& p, const NonlinCF& cfo)
   return(p.Status());
 }
 
+// Main routine for limited memory BFGS optimisation. Instead of
+// an explicit (inverse) Hessian it keeps the m latest pairs of
+// steps and gradient differences and uses the two-loop recursion
+// (Nocedal & Wright, Algorithm 7.4) to get the search direction.
+// Memory use is hence 2*m*npar, which makes it feasible for very
+// large problems. Each step is found by a line search that
+// satisfies the strong Wolfe conditions, which guarantees that
+// y'*s>0 so that the implied inverse Hessian stays positive definite.
+
+NonlinOut lbfgs(const NonlinParam& np, const NonlinCF& cfo)
+{
+  np.SetCF(cfo.cf(np.Par()));
+  ColumnVector             grad = cfo.grad(np.Par());
+  ColumnVector             pdir = -grad;
+  std::deque<ColumnVector> s_hist;    // Steps
+  std::deque<ColumnVector> y_hist;    // Gradient differences
+  std::deque<double>       rho_hist;  // 1/(y'*s)
+
+  while (np.NextIter()) {
+    if (zero_grad_conv(np.Par(),grad,np.CF(),np.FractionalGradientTolerance())) {
+      np.SetStatus(NL_GRADCONV); return(np.Status());
+    }
+    double dg = DotProduct(grad,pdir);
+    if (dg >= 0.0) {              // Not a descent direction, forget history
+      s_hist.clear(); y_hist.clear(); rho_hist.clear();
+      pdir = -grad;
+    }
+    // Without history we have no idea of the scale, so cap first step at stepmax
+    double lambda0 = 1.0;
+    if (!s_hist.size()) lambda0 = std::min(1.0,np.LineSearchMaxStep()/std::sqrt(DotProduct(pdir,pdir)));
+    double       lambda = 0.0;
+    double       newcf = 0.0;
+    ColumnVector newpar, newgrad;
+    LinOut status = wolfe_linsrch(pdir,np.Par(),grad,cfo,np.CF(),lambda0,np.VariableMetricAlpha(),
+                                  np.WolfeCurvatureParameter(),np.LineSearchMaxIterations(),
+                                  np.FractionalParameterTolerance(),&lambda,&newcf,&newpar,&newgrad);
+    if (status == LM_MAXITER) {np.SetStatus(NL_LM_MAXITER); return(np.Status());}
+    else if (status == LM_LAMBDA_NILL) {
+      if (s_hist.size()) {        // Retry along negative gradient
+        s_hist.clear(); y_hist.clear(); rho_hist.clear();
+        pdir = -grad;
+        continue;
+      }
+      else {np.SetStatus(NL_PARCONV); return(np.Status());}
+    }
+    ColumnVector step = newpar - np.Par();
+    ColumnVector gdiff = newgrad - grad;
+    double oldcf = np.CF();
+    np.SetPar(newpar);
+    np.SetCF(newcf);
+    grad = newgrad;
+    if (zero_cf_diff_conv(oldcf,newcf,np.FractionalCFTolerance())) {np.SetStatus(NL_CFCONV); return(np.Status());}
+    if (zero_par_step_conv(np.Par(),step,np.FractionalParameterTolerance())) {np.SetStatus(NL_PARCONV); return(np.Status());}
+    // Update history, skipping pairs that would destroy positive definiteness
+    double ys = DotProduct(gdiff,step);
+    if (ys > EPS*DotProduct(gdiff,gdiff)) {
+      s_hist.push_back(step); y_hist.push_back(gdiff); rho_hist.push_back(1.0/ys);
+      if (int(s_hist.size()) > np.LBFGSHistory()) {s_hist.pop_front(); y_hist.pop_front(); rho_hist.pop_front();}
+    }
+    // Two-loop recursion for new search direction
+    ColumnVector        q = grad;
+    std::vector<double> a(s_hist.size());
+    for (int i=int(s_hist.size())-1; i>=0; i--) {
+      a[i] = rho_hist[i]*DotProduct(s_hist[i],q);
+      q -= a[i]*y_hist[i];
+    }
+    if (s_hist.size()) q *= 1.0 / (rho_hist.back()*DotProduct(y_hist.back(),y_hist.back()));
+    for (unsigned int i=0; i<s_hist.size(); i++) {
+      double b = rho_hist[i]*DotProduct(y_hist[i],q);
+      q += (a[i]-b)*s_hist[i];
+    }
+    pdir = -q;
+  }
+
+  // If we get here we have exceeded the allowed # of iterations
+  np.SetStatus(NL_MAXITER);
+
+  return(np.Status());
+}
+
 LinOut linsrch(// Input
                const ColumnVector&  dir,    // Search direction
                const ColumnVector&  p0,      // Current parameter values
@@ -826,6 +930,86 @@ LinOut linsrch(// Input
   return(LM_MAXITER);
 }
 
+// Line search that finds a step length satisfying the strong Wolfe
+// conditions, i.e. sufficient decrease (c1) and small directional
+// derivative (c2). It follows Algorithms 3.5 and 3.6 of Nocedal &
+// Wright. The bracketing phase doubles the step until the conditions
+// are met or a minimum is bracketed, and the zoom phase then uses
+// safeguarded quadratic interpolation within the bracket.
+
+LinOut wolfe_linsrch(// Input
+                     const ColumnVector&  pdir,    // Search direction
+                     const ColumnVector&  p0,      // Current parameter values
+                     const ColumnVector&  grad,    // Gradient at p0
+                     const NonlinCF&      cfo,     // Cost-function object
+                     double               f0,      // Current cost-function value
+                     double               lambda0, // First step length to try
+                     double               c1,      // Sufficient decrease parameter
+                     double               c2,      // Curvature parameter
+                     int                  maxiter, // Max # of cost-function evaluations
+                     double               ptol,    // Tolerance in parameter space
+                     // Output
+                     double               *lambda, // Resulting step length
+                     double               *of,     // Value of cost-function on output
+                     ColumnVector         *np,     // New parameters
+                     ColumnVector         *ng)     // Gradient at new parameters
+{
+  double df0 = DotProduct(grad,pdir);
+
+  // Smallest meaningful lambda given the parameter tolerance
+  double almin=0.0;
+  for (int i=0; i<p0.Nrows(); i++) {
+    almin = std::max(almin,std::abs(pdir.element(i))/std::max(std::abs(p0.element(i)),1.0));
+  }
+  almin = ptol / almin;
+
+  // Bracketing phase
+  double       l_lo = 0.0, f_lo = f0, df_lo = df0;  // Best point so far (satisfies sufficient decrease)
+  double       l_hi = 0.0, f_hi = f0;               // Other end of bracket
+  ColumnVector p_lo = p0, g_lo = grad;
+  double       l = lambda0;
+  bool         bracketed = false;
+  int          iter = 0;
+  for ( ; iter<maxiter; iter++) {
+    (*np) = p0 + l*pdir;
+    double f = cfo.cf(*np);
+    if (f > f0 + c1*l*df0 || (iter && f >= f_lo)) {l_hi = l; f_hi = f; bracketed = true; break;}
+    (*ng) = cfo.grad(*np);
+    double df = DotProduct(*ng,pdir);
+    if (std::abs(df) <= -c2*df0) {*lambda = l; *of = f; return(LM_CONV);}
+    if (df >= 0.0) {l_hi = l_lo; f_hi = f_lo; l_lo = l; f_lo = f; df_lo = df; p_lo = *np; g_lo = *ng; bracketed = true; break;}
+    l_lo = l; f_lo = f; df_lo = df; p_lo = *np; g_lo = *ng;
+    l *= 2.0;
+  }
+  if (!bracketed) {*lambda = l_lo; *of = f_lo; *np = p_lo; *ng = g_lo; return(LM_MAXITER);}
+
+  // Zoom phase
+  for (iter++; iter<maxiter; iter++) {
+    double width = l_hi - l_lo;
+    if (std::abs(width) < almin) break;
+    // Minimum of quadratic through f_lo, df_lo and f_hi
+    double denom = 2.0*(f_hi - f_lo - df_lo*width);
+    double lj = (denom > 0.0) ? l_lo - df_lo*width*width/denom : l_lo + 0.5*width;
+    double a = std::min(l_lo,l_hi), b = std::max(l_lo,l_hi);
+    if (!(lj > a + 0.1*(b-a) && lj < b - 0.1*(b-a))) lj = l_lo + 0.5*width;  // Safeguard, bisect
+    (*np) = p0 + lj*pdir;
+    double f = cfo.cf(*np);
+    if (f > f0 + c1*lj*df0 || f >= f_lo) {l_hi = lj; f_hi = f;}
+    else {
+      (*ng) = cfo.grad(*np);
+      double df = DotProduct(*ng,pdir);
+      if (std::abs(df) <= -c2*df0) {*lambda = lj; *of = f; return(LM_CONV);}
+      if (df*(l_hi-l_lo) >= 0.0) {l_hi = l_lo; f_hi = f_lo;}
+      l_lo = lj; f_lo = f; df_lo = df; p_lo = *np; g_lo = *ng;
+    }
+  }
+
+  // Interval too small or too many iterations. Settle for best point if it is any good.
+  *lambda = l_lo; *of = f_lo; *np = p_lo; *ng = g_lo;
+  if (l_lo == 0.0) return((iter<maxiter) ? LM_LAMBDA_NILL : LM_MAXITER);
+  return(LM_CONV);
+}
+
 // Will try and find a scale factor for the cost-function such that
 // the step length (lambda) for the first iteration of the variable-
 // metric method is ~0.25. Empricially I have found that such a scaling
@@ -0,0 +1,102 @@
+#include "miscmaths/SpMat.h"
+#include "miscmaths/bfmatrix.h"
+#include <cmath>
+#include <vector>
+
+#include <boost/version.hpp>
+#if BOOST_VERSION < 108000
+#define BOOST_NO_CXX98_FUNCTION_BASE
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+
+BOOST_AUTO_TEST_SUITE(test_bfmatrix)
+
+
+using namespace MISCMATHS;
+
+// 7-point Laplacian (plus diagonal shift) on an nx*ny*nz grid, with
+// the grid points numbered in a scrambled order so that the natural
+// order has a large bandwidth. scale changes the values, but not the
+// sparsity.
+static SpMat<double> make_matrix(unsigned int nx, unsigned int ny, unsigned int nz, double scale)
+{
+  unsigned int n = nx*ny*nz;
+  std::vector<unsigned int> num(n);
+  for (unsigned int i=0; i<n; i++) num[i] = (i*7919) % n;   // 7919 is prime, and n not a multiple of it
+  SpMat<double> A(n,n);
+  for (unsigned int k=0; k<nz; k++) for (unsigned int j=0; j<ny; j++) for (unsigned int i=0; i<nx; i++) {
+    unsigned int r = num[(k*ny + j)*nx + i] + 1;
+    A.Set(r,r,6.5*scale + 0.01*((i+j+k) % 3));
+    if (i) A.Set(r,num[(k*ny + j)*nx + i-1]+1,-scale);
+    if (i<nx-1) A.Set(r,num[(k*ny + j)*nx + i+1]+1,-scale);
+    if (j) A.Set(r,num[(k*ny + j-1)*nx + i]+1,-scale);
+    if (j<ny-1) A.Set(r,num[(k*ny + j+1)*nx + i]+1,-scale);
+    if (k) A.Set(r,num[((k-1)*ny + j)*nx + i]+1,-scale);
+    if (k<nz-1) A.Set(r,num[((k+1)*ny + j)*nx + i]+1,-scale);
+  }
+  return A;
+}
+
+static NEWMAT::ColumnVector make_vector(unsigned int n)
+{
+  NEWMAT::ColumnVector b(n);
+  for (unsigned int i=1; i<=n; i++) b(i) = std::sin(0.37*i) + 0.5;
+  return b;
+}
+
+static double reldiff(const NEWMAT::ColumnVector& a, const NEWMAT::ColumnVector& b)
+{
+  return(NEWMAT::ColumnVector(a-b).MaximumAbsoluteValue() / b.MaximumAbsoluteValue());
+}
+
+BOOST_AUTO_TEST_CASE(permute_values_same_as_permute)
+{
+  SpMat<double> A = make_matrix(9,8,7,1.0);
+  std::vector<unsigned int> perm = A.RCMPermutation();
+  SpMat<double> pA = A.SymmetricPermute(perm);
+  BOOST_CHECK_LT(pA.Bandwidth(), A.Bandwidth());
+  SpMat<double> B = make_matrix(9,8,7,2.0);
+  BOOST_CHECK_EQUAL(A.StructureHash(), B.StructureHash());
+  BOOST_REQUIRE(B.SymmetricPermuteValues(perm,pA));
+  SpMat<double> pB = B.SymmetricPermute(perm);
+  BOOST_CHECK_EQUAL(NEWMAT::Matrix(pA.AsNEWMAT() - pB.AsNEWMAT()).MaximumAbsoluteValue(), 0.0);
+  // Different sparsity is detected
+  B.Set(1,2,-0.5); B.Set(2,1,-0.5);
+  BOOST_CHECK_NE(A.StructureHash(), B.StructureHash());
+  BOOST_CHECK(!B.SymmetricPermuteValues(perm,pA));
+}
+
+BOOST_AUTO_TEST_CASE(reordered_solve_same_as_natural_order)
+{
+  SpMat<double> A = make_matrix(9,8,7,1.0);
+  NEWMAT::ColumnVector b = make_vector(A.Nrows());
+  SparseBFMatrix<double> nat(A), rcm(A);
+  rcm.SetReordering(BFMatrixRCMReordering);
+  NEWMAT::ColumnVector xn = nat.SolveForx(b,SYM_POSDEF,1e-10,500);
+  NEWMAT::ColumnVector xr = rcm.SolveForx(b,SYM_POSDEF,1e-10,500);
+  BOOST_CHECK_SMALL(reldiff(xr,xn), 1e-8);
+  BOOST_CHECK_SMALL(reldiff(A*xr,b), 1e-8);
+
+  // New values, same sparsity. The cached permutation is reused and the
+  // permuted matrix must be refilled with the new values.
+  SpMat<double> A2 = make_matrix(9,8,7,3.0);
+  nat.SetMatrix(A2); rcm.SetMatrix(A2);
+  xn = nat.SolveForx(b,SYM_POSDEF,1e-10,500);
+  xr = rcm.SolveForx(b,SYM_POSDEF,1e-10,500);
+  BOOST_CHECK_SMALL(reldiff(xr,xn), 1e-8);
+  BOOST_CHECK_SMALL(reldiff(A2*xr,b), 1e-8);
+
+  // New sparsity, the permutation has to be recalculated
+  SpMat<double> A3 = make_matrix(9,8,7,1.0);
+  A3.Set(3,400,-0.2); A3.Set(400,3,-0.2);
+  nat.SetMatrix(A3); rcm.SetMatrix(A3);
+  xn = nat.SolveForx(b,SYM_POSDEF,1e-10,500);
+  xr = rcm.SolveForx(b,SYM_POSDEF,1e-10,500);
+  BOOST_CHECK_SMALL(reldiff(xr,xn), 1e-8);
+  BOOST_CHECK_SMALL(reldiff(A3*xr,b), 1e-8);
+}
+
+
+BOOST_AUTO_TEST_SUITE_END()
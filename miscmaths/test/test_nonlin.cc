@@ -0,0 +1,113 @@
+#include "miscmaths/nonlin.h"
+#include <cmath>
+
+#include <boost/version.hpp>
+#if BOOST_VERSION < 108000
+#define BOOST_NO_CXX98_FUNCTION_BASE
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+
+BOOST_AUTO_TEST_SUITE(test_nonlin)
+
+
+using namespace MISCMATHS;
+
+// Extended Rosenbrock function, minimum 0 at all ones
+class Rosenbrock : public NonlinCF
+{
+public:
+  double cf(const NEWMAT::ColumnVector& p) const {
+    double f = 0.0;
+    for (int i=1; i<p.Nrows(); i++) f += 100.0*std::pow(p(i+1)-p(i)*p(i),2) + std::pow(1.0-p(i),2);
+    return(f);
+  }
+  NEWMAT::ReturnMatrix grad(const NEWMAT::ColumnVector& p) const {
+    NEWMAT::ColumnVector g(p.Nrows());
+    g = 0.0;
+    for (int i=1; i<p.Nrows(); i++) {
+      double d = p(i+1)-p(i)*p(i);
+      g(i) += -400.0*p(i)*d - 2.0*(1.0-p(i));
+      g(i+1) += 200.0*d;
+    }
+    g.Release();
+    return(g);
+  }
+};
+
+// Quadratic 0.5*x'Ax - b'x with a diagonal A of condition number 1000
+class Quadratic : public NonlinCF
+{
+public:
+  Quadratic(int n) : _a(n), _b(n) {
+    for (int i=1; i<=n; i++) { _a(i) = std::pow(1000.0,double(i-1)/(n-1)); _b(i) = std::sin(double(i)); }
+  }
+  double cf(const NEWMAT::ColumnVector& p) const {
+    return(0.5*NEWMAT::SP(_a,NEWMAT::SP(p,p)).Sum() - NEWMAT::DotProduct(_b,p));
+  }
+  NEWMAT::ReturnMatrix grad(const NEWMAT::ColumnVector& p) const {
+    NEWMAT::ColumnVector g = NEWMAT::SP(_a,p) - _b;
+    g.Release();
+    return(g);
+  }
+  NEWMAT::ColumnVector Solution() const {
+    NEWMAT::ColumnVector x(_a.Nrows());
+    for (int i=1; i<=x.Nrows(); i++) x(i) = _b(i)/_a(i);
+    return(x);
+  }
+private:
+  NEWMAT::ColumnVector _a, _b;
+};
+
+BOOST_AUTO_TEST_CASE(lbfgs_minimises_rosenbrock)
+{
+  Rosenbrock cfo;
+  for (int n : {2, 20}) {
+    BOOST_TEST_CONTEXT("npar = " << n) {
+      NEWMAT::ColumnVector p0(n);
+      for (int i=1; i<=n; i++) p0(i) = (i % 2) ? -1.2 : 1.0;
+      NonlinParam par(n,NL_LBFGS,p0);
+      par.SetMaxIter(2000);
+      NonlinOut status = nonlin(par,cfo);
+      BOOST_CHECK(par.Success());
+      BOOST_CHECK(status != NL_MAXITER);
+      NEWMAT::ColumnVector ones(n);
+      ones = 1.0;
+      BOOST_CHECK_SMALL(NEWMAT::ColumnVector(par.Par()-ones).MaximumAbsoluteValue(), 1e-3);
+      BOOST_CHECK_SMALL(par.CF(), 1e-6);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(lbfgs_history_length)
+{
+  // Any history length converges on a quadratic, and a longer history
+  // needs fewer iterations than a history of one.
+  int n = 200;
+  Quadratic cfo(n);
+  NEWMAT::ColumnVector p0(n);
+  p0 = 0.0;
+  int niter[2];
+  int m[2] = {1, 10};
+  for (int i=0; i<2; i++) {
+    BOOST_TEST_CONTEXT("m = " << m[i]) {
+      NonlinParam par(n,NL_LBFGS,p0,true);
+      par.SetLBFGSHistory(m[i]);
+      par.SetMaxIter(5000);
+      par.SetFractionalGradientTolerance(1e-12);
+      par.SetFractionalCFTolerance(1e-14);
+      nonlin(par,cfo);
+      BOOST_CHECK(par.Success());
+      BOOST_CHECK_SMALL(NEWMAT::ColumnVector(par.Par()-cfo.Solution()).MaximumAbsoluteValue(), 1e-4);
+      niter[i] = par.CFHistory().size();
+    }
+  }
+  BOOST_CHECK_LT(niter[1], niter[0]);
+  NonlinParam par(n,NL_LBFGS,p0);
+  BOOST_CHECK_THROW(par.SetLBFGSHistory(0), NonlinException);
+  BOOST_CHECK_THROW(par.SetWolfeCurvatureParameter(1.0), NonlinException);
+}
+
+
+BOOST_AUTO_TEST_SUITE_END()
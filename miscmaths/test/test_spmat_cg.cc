@@ -0,0 +1,158 @@
+#include "miscmaths/SpMat.h"
+#include "miscmaths/bfmatrix.h"
+#include <atomic>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+#include <boost/version.hpp>
+#if BOOST_VERSION < 108000
+#define BOOST_NO_CXX98_FUNCTION_BASE
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+
+BOOST_AUTO_TEST_SUITE(test_spmat_cg)
+
+
+using namespace MISCMATHS;
+
+// 7-point Laplacian on an nx*ny*nz grid with a diagonal shift (that
+// determines the condition number) and a varying diagonal, so that
+// the diagonal preconditioner does something.
+template<class T>
+static SpMat<T> make_matrix(unsigned int nx, unsigned int ny, unsigned int nz, double shift)
+{
+  unsigned int n = nx*ny*nz;
+  SpMat<T> A(n,n);
+  for (unsigned int k=0; k<nz; k++) for (unsigned int j=0; j<ny; j++) for (unsigned int i=0; i<nx; i++) {
+    unsigned int r = (k*ny + j)*nx + i + 1;
+    double s = 1.0 + 0.5*std::sin(0.3*r);
+    A.Set(r,r,s*(6.0 + shift));
+    if (i<nx-1) { A.Set(r,r+1,-1.0); A.Set(r+1,r,-1.0); }
+    if (j<ny-1) { A.Set(r,r+nx,-1.0); A.Set(r+nx,r,-1.0); }
+    if (k<nz-1) { A.Set(r,r+nx*ny,-1.0); A.Set(r+nx*ny,r,-1.0); }
+  }
+  return A;
+}
+
+static NEWMAT::ColumnVector make_vector(unsigned int n)
+{
+  NEWMAT::ColumnVector b(n);
+  for (unsigned int i=1; i<=n; i++) b(i) = std::sin(0.37*i) + 0.5;
+  return b;
+}
+
+static double reldiff(const NEWMAT::ColumnVector& a, const NEWMAT::ColumnVector& b)
+{
+  return(NEWMAT::ColumnVector(a-b).MaximumAbsoluteValue() / b.MaximumAbsoluteValue());
+}
+
+BOOST_AUTO_TEST_CASE(barrier_separates_phases)
+{
+  // Each thread marks its slot for the current phase, waits, and then
+  // checks that all threads have marked theirs. Without the barrier
+  // (or with one that is not re-usable) some thread would see a slot
+  // that lags behind.
+  const unsigned int nt = 6, nphase = 200;
+  ThreadBarrier barrier(nt);
+  std::vector<std::atomic<unsigned int> > slot(nt);
+  for (auto& s : slot) s = 0;
+  std::atomic<unsigned int> nbad(0);
+  auto worker = [&](unsigned int tid) {
+    for (unsigned int ph=1; ph<=nphase; ph++) {
+      slot[tid] = ph;
+      barrier.Wait();
+      for (unsigned int t=0; t<nt; t++) if (slot[t] < ph) nbad++;
+      barrier.Wait();   // Nobody starts the next phase until everyone has checked
+    }
+  };
+  std::vector<std::thread> threads;
+  for (unsigned int t=0; t<nt; t++) threads.push_back(std::thread(worker,t));
+  for (auto& th : threads) th.join();
+  BOOST_CHECK_EQUAL(nbad.load(), 0u);
+  for (unsigned int t=0; t<nt; t++) BOOST_CHECK_EQUAL(slot[t].load(), nphase);
+}
+
+BOOST_AUTO_TEST_CASE(pipelined_cg_same_as_direct_solve)
+{
+  SpMat<double> A = make_matrix<double>(10,9,8,0.05);
+  NEWMAT::ColumnVector b = make_vector(A.Nrows());
+  NEWMAT::ColumnVector xd = A.AsNEWMAT().i() * b;
+  for (unsigned int nt : {1u, 2u, 3u, 8u}) {
+    BOOST_TEST_CONTEXT("nthr = " << nt) {
+      A.SetNthreads(nt);
+      NEWMAT::ColumnVector x = A.SolveForx(b,SYM_POSDEF,1e-12,1000);
+      BOOST_CHECK_SMALL(reldiff(x,xd), 1e-9);
+      BOOST_CHECK_SMALL(reldiff(A*x,b), 1e-10);
+    }
+  }
+  // Starting from an initial guess converges to the same
+  NEWMAT::ColumnVector x0 = xd + 0.01*make_vector(A.Nrows());
+  A.SetNthreads(4);
+  NEWMAT::ColumnVector x = A.SolveForx(b,SYM_POSDEF,1e-12,1000,x0);
+  BOOST_CHECK_SMALL(reldiff(x,xd), 1e-9);
+}
+
+BOOST_AUTO_TEST_CASE(pipelined_cg_stops_at_tolerance)
+{
+  // A loose tolerance or few iterations gives a correspondingly rough
+  // answer, i.e. it stops where it should rather than running on.
+  SpMat<double> A = make_matrix<double>(10,9,8,0.05);
+  NEWMAT::ColumnVector b = make_vector(A.Nrows());
+  A.SetNthreads(3);
+  NEWMAT::ColumnVector xtight = A.SolveForx(b,SYM_POSDEF,1e-12,1000);
+  NEWMAT::ColumnVector xloose = A.SolveForx(b,SYM_POSDEF,1e-3,1000);
+  double rloose = NEWMAT::ColumnVector(A*xloose-b).NormFrobenius() / b.NormFrobenius();
+  BOOST_CHECK_LT(rloose, 1e-3);
+  BOOST_CHECK_GT(reldiff(xloose,xtight), 1e-8);
+  NEWMAT::ColumnVector x3 = A.SolveForx(b,SYM_POSDEF,1e-12,3);
+  BOOST_CHECK_GT(NEWMAT::ColumnVector(A*x3-b).NormFrobenius() / b.NormFrobenius(), 1e-3);
+}
+
+BOOST_AUTO_TEST_CASE(mixed_precision_reaches_double_accuracy)
+{
+  // Single precision CG alone stalls at a relative residual of ~1e-7,
+  // so reaching 1e-11 means that the refinement works. Also for a
+  // matrix stored as float, and for a poorly conditioned matrix.
+  for (double shift : {0.05, 0.001}) {
+    BOOST_TEST_CONTEXT("shift = " << shift) {
+      SpMat<double> A = make_matrix<double>(10,9,8,shift);
+      SpMat<float> fA = make_matrix<float>(10,9,8,shift);
+      NEWMAT::ColumnVector b = make_vector(A.Nrows());
+      NEWMAT::ColumnVector xd = A.AsNEWMAT().i() * b;
+      NEWMAT::ColumnVector fxd = fA.AsNEWMAT().i() * b;
+      A.MixedPrecisionSolveOn();
+      fA.MixedPrecisionSolveOn();
+      for (unsigned int nt : {1u, 3u}) {
+        BOOST_TEST_CONTEXT("nthr = " << nt) {
+          A.SetNthreads(nt);
+          fA.SetNthreads(nt);
+          NEWMAT::ColumnVector x = A.SolveForx(b,SYM_POSDEF,1e-11,2000);
+          BOOST_CHECK_LT(NEWMAT::ColumnVector(A*x-b).NormFrobenius() / b.NormFrobenius(), 1e-11);
+          BOOST_CHECK_SMALL(reldiff(x,xd), 1e-8);
+          NEWMAT::ColumnVector fx = fA.SolveForx(b,SYM_POSDEF,1e-11,2000);
+          BOOST_CHECK_LT(NEWMAT::ColumnVector(fA*fx-b).NormFrobenius() / b.NormFrobenius(), 1e-11);
+          BOOST_CHECK_SMALL(reldiff(fx,fxd), 1e-8);
+        }
+      }
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(mixed_precision_through_bfmatrix)
+{
+  SpMat<double> A = make_matrix<double>(10,9,8,0.05);
+  NEWMAT::ColumnVector b = make_vector(A.Nrows());
+  SparseBFMatrix<double> dbl(A), mixed(A);
+  mixed.SetMixedPrecisionSolve(true);
+  BOOST_CHECK(mixed.MixedPrecisionSolve());
+  BOOST_CHECK(!dbl.MixedPrecisionSolve());
+  NEWMAT::ColumnVector xd = dbl.SolveForx(b,SYM_POSDEF,1e-10,1000);
+  NEWMAT::ColumnVector xm = mixed.SolveForx(b,SYM_POSDEF,1e-10,1000);
+  BOOST_CHECK_SMALL(reldiff(xm,xd), 1e-8);
+}
+
+
+BOOST_AUTO_TEST_SUITE_END()
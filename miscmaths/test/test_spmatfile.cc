@@ -0,0 +1,120 @@
+#include "miscmaths/SpMat.h"
+#include "miscmaths/SpMatFile.h"
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <unistd.h>
+
+#include <boost/version.hpp>
+#if BOOST_VERSION < 108000
+#define BOOST_NO_CXX98_FUNCTION_BASE
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+
+BOOST_AUTO_TEST_SUITE(test_spmatfile)
+
+
+using namespace MISCMATHS;
+
+static std::string tmpname(const std::string& name)
+{
+    return "/tmp/test_spmatfile_" + std::to_string(getpid()) + "_" + name;
+}
+
+// Non-symmetric sparse matrix with an empty column
+static SpMat<double> make_matrix(unsigned int m, unsigned int n)
+{
+    SpMat<double> A(m, n);
+    for (unsigned int c = 1; c <= n; c++) {
+        if (c == 3) continue;
+        for (unsigned int r = 1; r <= m; r++) {
+            if ((r*7 + c*3) % 5 == 0 || r == c) A.Set(r, c, std::sin(double(r)) + 0.1*c);
+        }
+    }
+    return A;
+}
+
+static NEWMAT::ColumnVector make_vector(unsigned int n)
+{
+    NEWMAT::ColumnVector x(n);
+    for (unsigned int i = 1; i <= n; i++) x(i) = std::cos(0.7*i);
+    return x;
+}
+
+BOOST_AUTO_TEST_CASE(write_map_multiply)
+{
+    SpMat<double> A = make_matrix(30, 25);
+    std::string fname = tmpname("A");
+    A.SaveBinary(fname);
+    {
+        MappedSpMat<double> M(fname);
+        BOOST_CHECK_EQUAL(M.Nrows(), 30u);
+        BOOST_CHECK_EQUAL(M.Ncols(), 25u);
+        BOOST_CHECK_EQUAL(M.NZ(), A.NZ());
+        BOOST_CHECK(M.VerifyChecksum());
+        for (unsigned int c = 1; c <= 25; c++) for (unsigned int r = 1; r <= 30; r++) {
+            BOOST_REQUIRE_EQUAL(M.Peek(r, c), A.Peek(r, c));
+        }
+        NEWMAT::ColumnVector x = make_vector(25), y = make_vector(30);
+        BOOST_CHECK_SMALL(NEWMAT::ColumnVector(M*x - A*x).MaximumAbsoluteValue(), 1e-12);
+        BOOST_CHECK_SMALL(NEWMAT::ColumnVector(M.trans_mult(y) - A.trans_mult(y)).MaximumAbsoluteValue(), 1e-12);
+        SpMat<double> B(M);
+        BOOST_CHECK_SMALL(NEWMAT::Matrix(B.AsNEWMAT() - A.AsNEWMAT()).MaximumAbsoluteValue(), 0.0);
+    }
+    // Read as the other precision through the file constructor
+    SpMat<float> F(fname);
+    BOOST_CHECK_SMALL(NEWMAT::Matrix(F.AsNEWMAT() - A.AsNEWMAT()).MaximumAbsoluteValue(), 1e-6);
+    BOOST_CHECK_THROW(MappedSpMat<float> Mf(fname), SpMatFileException);
+    std::remove(fname.c_str());
+}
+
+// Overwrites the value at byte offset pos in fname
+template<class V>
+static void poke(const std::string& fname, uint64_t pos, V val)
+{
+    std::fstream fs(fname.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+    fs.seekp(pos);
+    fs.write(reinterpret_cast<const char *>(&val), sizeof(val));
+}
+
+BOOST_AUTO_TEST_CASE(damaged_indices_rejected)
+{
+    SpMat<double> A = make_matrix(30, 25);
+    std::string fname = tmpname("B");
+    SpMatFileHeader hdr;
+    A.SaveBinary(fname);
+    {
+        MappedSpMat<double> M(fname);
+        hdr.m = M.Nrows(); hdr.n = M.Ncols(); hdr.nz = M.NZ(); hdr.precision = sizeof(double);
+    }
+
+    // Row index out of range. The checksum is not checked by default, so
+    // this has to be caught by the structural check.
+    poke<uint32_t>(fname, hdr.RowindOffset() + 5*sizeof(uint32_t), 1000);
+    BOOST_CHECK_THROW(MappedSpMat<double> M(fname), SpMatFileException);
+    BOOST_CHECK_THROW(SpMat<double> B(fname), SpMatFileException);
+
+    // Row indices out of order within a column
+    A.SaveBinary(fname);
+    poke<uint32_t>(fname, hdr.RowindOffset() + 1*sizeof(uint32_t), 0);
+    BOOST_CHECK_THROW(MappedSpMat<double> M(fname), SpMatFileException);
+
+    // Decreasing column pointers
+    A.SaveBinary(fname);
+    poke<uint64_t>(fname, hdr.ColptrOffset() + 4*sizeof(uint64_t), 0);
+    BOOST_CHECK_THROW(MappedSpMat<double> M(fname), SpMatFileException);
+
+    // A damaged value is only found when the checksum is checked
+    A.SaveBinary(fname);
+    poke<double>(fname, hdr.ValOffset(), 17.0);
+    BOOST_CHECK_NO_THROW(MappedSpMat<double> M(fname));
+    BOOST_CHECK_THROW(MappedSpMat<double> M(fname, true), SpMatFileException);
+    std::remove(fname.c_str());
+}
+
+
+BOOST_AUTO_TEST_SUITE_END()
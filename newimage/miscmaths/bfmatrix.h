@@ -54,6 +54,8 @@ public:
 
 enum BFMatrixPrecisionType {BFMatrixDoublePrecision, BFMatrixFloatPrecision};
 
+enum BFMatrixReorderingType {BFMatrixNoReordering, BFMatrixRCMReordering};
+
 class BFMatrixColumnIterator;
 
 class BFMatrix
@@ -81,8 +83,18 @@ public:
   virtual void SetNthreads(unsigned int nt) = 0;
   virtual unsigned int NZ() const = 0;
 
+  // Symmetric reordering applied (internally) when solving
+  virtual BFMatrixReorderingType Reordering() const = 0;
+  virtual void SetReordering(BFMatrixReorderingType ro) = 0;
+
+  // Single precision iterations with double precision refinement when solving
+  virtual bool MixedPrecisionSolve() const = 0;
+  virtual void SetMixedPrecisionSolve(bool flag) = 0;
+
   // Print matrix (for debugging)
   virtual void Print(const std::string fname=std::string("")) const = 0;
+  // Save matrix in binary format. Much faster than Print for large matrices.
+  virtual void Save(const std::string fname) const = 0;
 
   // Setting, deleting or resizing the whole sparse matrix.
   // virtual void SetMatrix(const MISCMATHS::SpMat<double>& M) = 0;
@@ -136,6 +148,13 @@ class SparseBFMatrix : public BFMatrix
 {
 private:
   std::shared_ptr<MISCMATHS::SpMat<T> >    mp;
+  BFMatrixReorderingType                   ro = BFMatrixNoReordering;  // Reordering used by SolveForx
+  // Cache for SolveForx with reordering. The permutation only depends on the sparsity of *mp,
+  // so it is kept for as long as that is the same (which it is between iterations in e.g. fnirt),
+  // and the permuted matrix is refilled with the new values in place.
+  mutable std::vector<unsigned int>             perm;                  // Permutation, perm[new]=old
+  mutable uint64_t                              perm_hash = 0;         // StructureHash() of *mp that perm was calculated for
+  mutable std::shared_ptr<MISCMATHS::SpMat<T> > pmp;                   // P*(*mp)*P'
 
 public:
   // Constructors, destructor and assignment
@@ -150,10 +169,14 @@ public:
   SparseBFMatrix(const NEWMAT::Matrix& M, Utilities::NoOfThreads nt=Utilities::NoOfThreads(1))
   : mp(std::shared_ptr<MISCMATHS::SpMat<T> >(new MISCMATHS::SpMat<T>(M,nt))) {}
   SparseBFMatrix(const SparseBFMatrix<T>& M)
-  : mp(std::shared_ptr<MISCMATHS::SpMat<T> >(new MISCMATHS::SpMat<T>(*(M.mp)))) {}
+  : mp(std::shared_ptr<MISCMATHS::SpMat<T> >(new MISCMATHS::SpMat<T>(*(M.mp)))), ro(M.ro) {}
+  SparseBFMatrix(const std::string& fname, Utilities::NoOfThreads nt=Utilities::NoOfThreads(1))      // Reads file written by Save or Print
+  : mp(std::shared_ptr<MISCMATHS::SpMat<T> >(new MISCMATHS::SpMat<T>(fname,nt))) {}
+  SparseBFMatrix(const MISCMATHS::MappedSpMat<T>& M, Utilities::NoOfThreads nt=Utilities::NoOfThreads(1))
+  : mp(std::shared_ptr<MISCMATHS::SpMat<T> >(new MISCMATHS::SpMat<T>(M,nt))) {}
   virtual ~SparseBFMatrix() {}
   virtual const SparseBFMatrix& operator=(const SparseBFMatrix<T>& M) {
-    mp = std::shared_ptr<MISCMATHS::SpMat<T> >(new MISCMATHS::SpMat<T>(*(M.mp))); return(*this);
+    mp = std::shared_ptr<MISCMATHS::SpMat<T> >(new MISCMATHS::SpMat<T>(*(M.mp))); ro = M.ro; return(*this);
   }
 
   friend class BFMatrixColumnIterator;
@@ -170,9 +193,14 @@ public:
   virtual unsigned int Nthreads() const {return(mp->Nthreads());}
   virtual void SetNthreads(unsigned int nt) {mp->SetNthreads(nt);}
   virtual unsigned int NZ() const {return(mp->NZ());}
+  virtual BFMatrixReorderingType Reordering() const {return(ro);}
+  virtual void SetReordering(BFMatrixReorderingType pro) {ro=pro;}
+  virtual bool MixedPrecisionSolve() const {return(mp->MixedPrecisionSolve());}
+  virtual void SetMixedPrecisionSolve(bool flag) {if (flag) mp->MixedPrecisionSolveOn(); else mp->MixedPrecisionSolveOff();}
 
   // Print matrix (for debugging)
   virtual void Print(const std::string fname=std::string("")) const {mp->Print(fname);}
+  virtual void Save(const std::string fname) const {mp->SaveBinary(fname);}
 
   // Setting, deleting or resizing the whole sparse matrix.
   virtual void SetMatrix(const MISCMATHS::SpMat<T>& M) {mp = std::shared_ptr<MISCMATHS::SpMat<T> >(new MISCMATHS::SpMat<T>(M));}
@@ -249,9 +277,14 @@ public:
   virtual unsigned int Nthreads() const {return(1);}
   virtual void SetNthreads(unsigned int nt) {} // Null function
   virtual unsigned int NZ() const {return(mp->Nrows()*mp->Ncols());}
+  virtual BFMatrixReorderingType Reordering() const {return(BFMatrixNoReordering);}
+  virtual void SetReordering(BFMatrixReorderingType pro) {} // Null function
+  virtual bool MixedPrecisionSolve() const {return(false);}
+  virtual void SetMixedPrecisionSolve(bool flag) {} // Null function
 
   // Print matrix (for debugging)
   virtual void Print(const std::string fname=std::string("")) const;
+  virtual void Save(const std::string fname) const;
 
   // Setting, deleting or resizing the whole matrix.
   virtual void SetMatrix(const MISCMATHS::SpMat<double>& M) {mp = std::shared_ptr<NEWMAT::Matrix>(new NEWMAT::Matrix(M.AsNEWMAT()));}
@@ -589,7 +622,25 @@ NEWMAT::ReturnMatrix SparseBFMatrix<T>::SolveForx(const NEWMAT::ColumnVector& b,
   if (b.Nrows() != int(Nrows())) {
     throw BFMatrixException("SparseBFMatrix::SolveForx: Matrix-vector size mismatch");
   }
-  NEWMAT::ColumnVector  x = mp->SolveForx(b,type,tol,miter);
+  if (ro == BFMatrixNoReordering) {
+    NEWMAT::ColumnVector  x = mp->SolveForx(b,type,tol,miter);
+    x.Release();
+    return(x);
+  }
+  // Solve P*A*P'*(P*x) = P*b, where P reduces the bandwidth of A. This
+  // improves locality of the matrix-vector products in the iterative solver.
+  // P and P*A*P' are reused from the previous call if the sparsity is the same.
+  uint64_t hash = mp->StructureHash();
+  if (!pmp || hash != perm_hash || !mp->SymmetricPermuteValues(perm,*pmp)) {
+    perm = mp->RCMPermutation();
+    pmp = std::shared_ptr<MISCMATHS::SpMat<T> >(new MISCMATHS::SpMat<T>(mp->SymmetricPermute(perm)));
+    perm_hash = hash;
+  }
+  NEWMAT::ColumnVector      pb(b.Nrows());
+  for (unsigned int i=0; i<perm.size(); i++) pb(i+1) = b(perm[i]+1);
+  NEWMAT::ColumnVector      px = pmp->SolveForx(pb,type,tol,miter);
+  NEWMAT::ColumnVector      x(b.Nrows());
+  for (unsigned int i=0; i<perm.size(); i++) x(perm[i]+1) = px(i+1);
   x.Release();
   return(x);
 }
@@ -0,0 +1,262 @@
+//
+//  Declarations/template-bodies for binary file format for SpMat
+//
+//  SpMatFile.h
+//
+//  Defines a versioned binary on-disk format for sparse matrices
+//  and a class MappedSpMat that gives read-only, zero-copy, access
+//  to a matrix stored in that format through mmap. The layout is
+//  (all in native byte order, all sections 8-byte aligned)
+//
+//  SpMatFileHeader                       (64 bytes)
+//  uint64_t  colptr[n+1]                 (Compressed Column pointers)
+//  uint32_t  rowind[nz] (+padding)       (Zero-offset row indicies)
+//  T         val[nz]                     (float or double, given by header)
+//
+//  The header contains an FNV-1a checksum of everything that
+//  follows it, which allows a reader to detect corrupted files.
+//
+/*  CCOPYRIGHT  */
+
+#ifndef SpMatFile_h
+#define SpMatFile_h
+
+#include <cstdint>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "armawrap/newmat.h"
+
+namespace MISCMATHS {
+
+class SpMatFileException: public std::exception
+{
+private:
+  std::string m_msg;
+public:
+  SpMatFileException(const std::string& msg) throw(): m_msg(std::string("SpMatFile::")+msg) {}
+
+  virtual const char * what() const throw() {
+    return(m_msg.c_str());
+  }
+
+  ~SpMatFileException() throw() {}
+};
+
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+//
+// Struct SpMatFileHeader:
+//
+// First 64 bytes of a binary SpMat file.
+//
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+
+struct SpMatFileHeader
+{
+  static const uint32_t CurrentVersion = 1;
+  static const char *Magic() { return("FSLSPMAT"); }
+
+  char      magic[8];      // "FSLSPMAT"
+  uint32_t  version;       // Format version
+  uint32_t  precision;     // sizeof() of value type, i.e. 4 (float) or 8 (double)
+  uint64_t  m;             // # of rows
+  uint64_t  n;             // # of columns
+  uint64_t  nz;            // # of explicitly represented elements
+  uint64_t  checksum;      // FNV-1a of everything after header
+  uint64_t  reserved[2];
+
+  // Offsets (in bytes from start of file) to the different sections
+  uint64_t ColptrOffset() const { return(sizeof(SpMatFileHeader)); }
+  uint64_t RowindOffset() const { return(ColptrOffset() + (n+1)*sizeof(uint64_t)); }
+  uint64_t ValOffset() const { return(RowindOffset() + padded(nz*sizeof(uint32_t))); }
+  uint64_t FileSize() const { return(ValOffset() + padded(nz*precision)); }
+  static uint64_t padded(uint64_t nbytes) { return(((nbytes+7)/8)*8); }
+};
+
+static_assert(sizeof(SpMatFileHeader) == 64, "SpMatFileHeader must be 64 bytes");
+
+// FNV-1a 64 bit hash. Can be called repeatedly to hash non-contiguous data.
+inline uint64_t spmat_file_checksum(const void *data, uint64_t nbytes, uint64_t hash=14695981039346656037ULL)
+{
+  const unsigned char *p = static_cast<const unsigned char *>(data);
+  for (uint64_t i=0; i<nbytes; i++) { hash ^= p[i]; hash *= 1099511628211ULL; }
+  return(hash);
+}
+
+// Returns true if fname starts with the SpMatFile magic number
+inline bool is_spmat_binary_file(const std::string& fname)
+{
+  char  magic[8];
+  FILE  *fp = std::fopen(fname.c_str(),"rb");
+  if (!fp) return(false);
+  bool ok = (std::fread(magic,1,8,fp) == 8 && !std::memcmp(magic,SpMatFileHeader::Magic(),8));
+  std::fclose(fp);
+  return(ok);
+}
+
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+//
+// Class MappedSpMat:
+//
+// Read-only view of a sparse matrix stored in a binary SpMat file.
+// The file is mmap-ed, so no data is read until it is accessed and
+// the pages are shared with any other process mapping the same file.
+// This is intended for e.g. precomputed regularisation Hessians.
+// T must match the precision the file was written with.
+// The header, the size of the file and the structure of the index arrays
+// (so that no index can point outside the matrix) are always checked. The
+// checksum is only checked if verify is set or when VerifyChecksum() is
+// called, so an unverified mapping may have wrong values but never
+// out-of-range indices.
+//
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+
+template<class T>
+class MappedSpMat
+{
+public:
+  MappedSpMat(const std::string& fname, bool verify=false);
+  ~MappedSpMat() { if (_base) munmap(_base,_size); }
+
+  unsigned int Nrows() const { return(static_cast<unsigned int>(_hdr.m)); }
+  unsigned int Ncols() const { return(static_cast<unsigned int>(_hdr.n)); }
+  unsigned long NZ() const { return(static_cast<unsigned long>(_hdr.nz)); }
+  unsigned int Version() const { return(_hdr.version); }
+
+  // Raw Compressed Column Storage arrays
+  const uint64_t *Colptr() const { return(_colptr); }
+  const uint32_t *Rowind() const { return(_rowind); }
+  const T *Val() const { return(_val); }
+
+  T Peek(unsigned int r, unsigned int c) const;                               // One offset
+  NEWMAT::ReturnMatrix operator*(const NEWMAT::ColumnVector& x) const;         // b = A*x
+  NEWMAT::ReturnMatrix trans_mult(const NEWMAT::ColumnVector& x) const;        // b = A'*x
+  bool VerifyChecksum() const;
+  // True if colptr is non-decreasing from 0 to nz and row indices are increasing and < m within each column
+  bool ValidStructure() const;
+
+private:
+  MappedSpMat(const MappedSpMat& M);             // Not allowed, would double unmap
+  MappedSpMat& operator=(const MappedSpMat& M);  // Not allowed
+
+  SpMatFileHeader   _hdr;
+  void              *_base;
+  size_t            _size;
+  const uint64_t    *_colptr;
+  const uint32_t    *_rowind;
+  const T           *_val;
+};
+
+template<class T>
+MappedSpMat<T>::MappedSpMat(const std::string& fname, bool verify) : _base(0), _size(0)
+{
+  int fd = open(fname.c_str(),O_RDONLY);
+  if (fd < 0) throw SpMatFileException("MappedSpMat: Cannot open file " + fname);
+  struct stat st;
+  if (fstat(fd,&st) || static_cast<uint64_t>(st.st_size) < sizeof(SpMatFileHeader)) {
+    close(fd);
+    throw SpMatFileException("MappedSpMat: File " + fname + " too short to be a SpMat file");
+  }
+  _size = static_cast<size_t>(st.st_size);
+  _base = mmap(0,_size,PROT_READ,MAP_SHARED,fd,0);
+  close(fd);
+  if (_base == MAP_FAILED) { _base = 0; throw SpMatFileException("MappedSpMat: Failed to mmap file " + fname); }
+  std::memcpy(&_hdr,_base,sizeof(_hdr));
+  if (std::memcmp(_hdr.magic,SpMatFileHeader::Magic(),8)) {
+    munmap(_base,_size); _base = 0;
+    throw SpMatFileException("MappedSpMat: File " + fname + " is not a binary SpMat file");
+  }
+  if (_hdr.version > SpMatFileHeader::CurrentVersion) {
+    munmap(_base,_size); _base = 0;
+    throw SpMatFileException("MappedSpMat: File " + fname + " written by newer version");
+  }
+  if (_hdr.precision != sizeof(T)) {
+    munmap(_base,_size); _base = 0;
+    throw SpMatFileException("MappedSpMat: Precision of file " + fname + " does not match requested type");
+  }
+  if (_hdr.FileSize() != _size) {
+    munmap(_base,_size); _base = 0;
+    throw SpMatFileException("MappedSpMat: Size of file " + fname + " inconsistent with header");
+  }
+  const char *cbase = static_cast<const char *>(_base);
+  _colptr = reinterpret_cast<const uint64_t *>(cbase + _hdr.ColptrOffset());
+  _rowind = reinterpret_cast<const uint32_t *>(cbase + _hdr.RowindOffset());
+  _val = reinterpret_cast<const T *>(cbase + _hdr.ValOffset());
+  if (!ValidStructure() || (verify && !VerifyChecksum())) {
+    munmap(_base,_size); _base = 0;
+    throw SpMatFileException("MappedSpMat: File " + fname + " is corrupt");
+  }
+}
+
+template<class T>
+bool MappedSpMat<T>::ValidStructure() const
+{
+  if (_hdr.m > UINT32_MAX || _hdr.n > UINT32_MAX || _colptr[0] != 0 || _colptr[_hdr.n] != _hdr.nz) return(false);
+  for (uint64_t c=0; c<_hdr.n; c++) {
+    if (_colptr[c] > _colptr[c+1]) return(false);
+    for (uint64_t i=_colptr[c]; i<_colptr[c+1]; i++) {
+      if (_rowind[i] >= _hdr.m || (i > _colptr[c] && _rowind[i] <= _rowind[i-1])) return(false);
+    }
+  }
+  return(true);
+}
+
+template<class T>
+bool MappedSpMat<T>::VerifyChecksum() const
+{
+  const char *cbase = static_cast<const char *>(_base);
+  return(spmat_file_checksum(cbase+sizeof(SpMatFileHeader),_size-sizeof(SpMatFileHeader)) == _hdr.checksum);
+}
+
+template<class T>
+T MappedSpMat<T>::Peek(unsigned int r, unsigned int c) const
+{
+  if (r<1 || r>_hdr.m || c<1 || c>_hdr.n) throw SpMatFileException("MappedSpMat::Peek: index out of range");
+  const uint32_t *first = _rowind + _colptr[c-1];
+  const uint32_t *last = _rowind + _colptr[c];
+  const uint32_t *pos = std::lower_bound(first,last,static_cast<uint32_t>(r-1));
+  if (pos != last && *pos == r-1) return(_val[pos-_rowind]);
+  return(static_cast<T>(0.0));
+}
+
+template<class T>
+NEWMAT::ReturnMatrix MappedSpMat<T>::operator*(const NEWMAT::ColumnVector& x) const
+{
+  if (_hdr.n != static_cast<uint64_t>(x.Nrows())) throw SpMatFileException("MappedSpMat::operator*: # of rows in vector must match # of columns in matrix");
+  NEWMAT::ColumnVector b(Nrows());
+  b = 0.0;
+  const double *xp = static_cast<const double *>(x.Store());
+  double       *bp = static_cast<double *>(b.Store());
+  for (uint64_t c=0; c<_hdr.n; c++) {
+    double wgt = xp[c];
+    for (uint64_t i=_colptr[c]; i<_colptr[c+1]; i++) bp[_rowind[i]] += wgt*_val[i];
+  }
+  b.Release();
+  return(b);
+}
+
+template<class T>
+NEWMAT::ReturnMatrix MappedSpMat<T>::trans_mult(const NEWMAT::ColumnVector& x) const
+{
+  if (_hdr.m != static_cast<uint64_t>(x.Nrows())) throw SpMatFileException("MappedSpMat::trans_mult: # of rows in vector must match # of rows in matrix");
+  NEWMAT::ColumnVector b(Ncols());
+  const double *xp = static_cast<const double *>(x.Store());
+  double       *bp = static_cast<double *>(b.Store());
+  for (uint64_t c=0; c<_hdr.n; c++) {
+    double res = 0.0;
+    for (uint64_t i=_colptr[c]; i<_colptr[c+1]; i++) res += _val[i]*xp[_rowind[i]];
+    bp[c] = res;
+  }
+  b.Release();
+  return(b);
+}
+
+} // End namespace MISCMATHS
+
+#endif // End #ifndef SpMatFile_h
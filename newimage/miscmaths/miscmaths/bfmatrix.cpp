@@ -44,6 +44,12 @@ void FullBFMatrix::Print(const std::string fname) const
   else write_ascii_matrix(fname,*mp);
 }
 
+void FullBFMatrix::Save(const std::string fname) const
+{
+  if (!fname.length()) throw BFMatrixException("FullBFMatrix::Save: Must specify filename");
+  if (write_binary_matrix(*mp,fname)) throw BFMatrixException("FullBFMatrix::Save: Failed to write to file " + fname);
+}
+
 std::shared_ptr<BFMatrix> FullBFMatrix::Transpose()
 const
 {
@@ -32,7 +32,8 @@ enum NLMethod {NL_VM,                               // Variable-Metric (see NRin
                NL_SCG,                              // Scaled Conjugate-Gradient (See Moller 1993).
                NL_LM,                               // Levenberg-Marquardt (see NRinC)
                NL_GD,                               // Gradient Descent
-               NL_NM};                              // Nelder-Mead simplex method (see NRinC)
+               NL_NM,                               // Nelder-Mead simplex method (see NRinC)
+               NL_LBFGS};                           // Limited memory BFGS (see Nocedal & Wright)
 
 enum LMType {LM_GN, LM_L, LM_LM};                   // Gauss-Newton, Levenberg or Levenberg-Marquardt
 
@@ -115,7 +116,7 @@ public:
     vmut(pvmut), alpha(palpha), stepmax(pstepmax), lm_maxiter(plm_maxiter),
     maxrestart(pmaxrestart), autoscale(pautoscale), cgut(pcgut),
     lm_ftol(plm_ftol), lmtype(plmtype), ltol(pltol), cg_maxiter(pcg_maxiter),
-    cg_tol(pcg_tol), lambda(), cf(), par(), niter(0),
+    cg_tol(pcg_tol), lbfgs_m(10), wolfe_c2(0.9), lambda(), cf(), par(), niter(0),
     nrestart(0), status(NL_UNDEFINED)
   {
     lambda.push_back(plambda);
@@ -152,6 +153,8 @@ public:
   double LambdaConvergenceCriterion() const {return(ltol);}
   int EquationSolverMaxIter() const {return(cg_maxiter);}
   double EquationSolverTol() const {return(cg_tol);}
+  int LBFGSHistory() const {return(lbfgs_m);}
+  double WolfeCurvatureParameter() const {return(wolfe_c2);}
   NEWMAT::ColumnVector GetAmoebaStart() const {return(amoeba_start);}
   bool LoggingParameters() const {return(logpar);}
   bool LoggingCostFunction() const {return(logcf);}
@@ -225,6 +228,14 @@ public:
   }
   void SetEquationSolverMaxIter(int pcg_maxiter) {cg_maxiter = pcg_maxiter;}
   void SetEquationSolverTol(double pcg_tol) {cg_tol = pcg_tol;}
+  void SetLBFGSHistory(int plbfgs_m) {
+    if (plbfgs_m < 1) throw NonlinException("SetLBFGSHistory: History length must be at least one");
+    lbfgs_m = plbfgs_m;
+  }
+  void SetWolfeCurvatureParameter(double pwolfe_c2) {
+    if (pwolfe_c2 <= alpha || pwolfe_c2 >= 1.0) throw NonlinException("SetWolfeCurvatureParameter: Must be between alpha and 1");
+    wolfe_c2 = pwolfe_c2;
+  }
   void SetStartAmoeba(const NEWMAT::ColumnVector& l) {
     if (l.Nrows() != npar) throw NonlinException("SetStartAmoeba: npar and amoeba mismatch");
     else amoeba_start = l;
@@ -297,6 +308,11 @@ private:
   int                        cg_maxiter; // Maximum # of iterations for iterative "inverse" of Hessian
   double                     cg_tol;     // Tolerance for iterative "inverse" of Hessian
 
+  //         Parameters that apply to L-BFGS algorithm (alpha and lm_maxiter are shared with VM)
+
+  int                        lbfgs_m;    // # of correction pairs kept
+  double                     wolfe_c2;   // Curvature condition for strong Wolfe line search
+
   //         Parameters that apply to amoeba/simplex algorithm
 
   NEWMAT::ColumnVector       amoeba_start; // If set, specifies what the initial amoeba looks like.
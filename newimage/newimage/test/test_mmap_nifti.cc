@@ -0,0 +1,75 @@
+#include "newimage/newimageall.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <unistd.h>
+
+#include <boost/version.hpp>
+#if BOOST_VERSION < 108000
+#define BOOST_NO_CXX98_FUNCTION_BASE
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+
+BOOST_AUTO_TEST_SUITE(test_mmap_nifti)
+
+
+using namespace NEWIMAGE;
+
+// Writes a small 3D NIfTI file and then overwrites dim[4..7] of its
+// header with val, which is legal since dim[0]=3 says they are unused.
+static std::string write_3d_file(int16_t val)
+{
+    setenv("FSLOUTPUTTYPE", "NIFTI", 1);
+    std::string fname = "/tmp/test_mmap_nifti_" + std::to_string(getpid()) + ".nii";
+    volume<float> v(7, 5, 3);
+    for (int k = 0; k < 3; k++) for (int j = 0; j < 5; j++) for (int i = 0; i < 7; i++) v(i, j, k) = i + 10*j + 100*k;
+    save_volume(v, fname);
+    std::fstream fs(fname.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+    int16_t dim[8];
+    fs.seekg(40); fs.read(reinterpret_cast<char *>(dim), sizeof(dim));
+    BOOST_REQUIRE(dim[0] == 3);
+    for (int d = 4; d < 8; d++) dim[d] = val;
+    fs.seekp(40); fs.write(reinterpret_cast<const char *>(dim), sizeof(dim));
+    return fname;
+}
+
+static void check_mapped_read(int16_t val)
+{
+    std::string fname = write_3d_file(val);
+    volume<float> ref, mapped;
+    unsetenv("FSL_MMAP_NIFTI");
+    read_volume(ref, fname);
+    setenv("FSL_MMAP_NIFTI", "1", 1);
+    read_volume(mapped, fname);
+    unsetenv("FSL_MMAP_NIFTI");
+    std::remove(fname.c_str());
+
+    BOOST_CHECK_EQUAL(ref.xsize(), 7);
+    BOOST_CHECK_EQUAL(ref.tsize(), 1);
+    BOOST_CHECK(samesize(ref, mapped));
+    BOOST_CHECK_EQUAL(mapped.tsize(), 1);
+    BOOST_CHECK_EQUAL(mapped.nvoxels(), ref.nvoxels());
+    BOOST_CHECK_CLOSE(mapped.mean(), ref.mean(), 1e-4);
+    for (int k = 0; k < 3; k++) for (int j = 0; j < 5; j++) for (int i = 0; i < 7; i++) {
+        BOOST_CHECK_EQUAL(mapped(i, j, k), ref(i, j, k));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(mmap_nifti_zero_unused_dims)
+{
+    // dim[4..7]=0 must not give an empty volume
+    check_mapped_read(0);
+}
+
+BOOST_AUTO_TEST_CASE(mmap_nifti_garbage_unused_dims)
+{
+    // Values >1 in unused dims must not make the volume larger than the mapping
+    check_mapped_read(9);
+}
+
+
+BOOST_AUTO_TEST_SUITE_END()
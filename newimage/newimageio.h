@@ -109,6 +109,15 @@ int read_volume4D_hdr_only(volume<T>& target, const std::string& filename) {
 template <class T>
 int save_volume(const volume<T>& source, const std::string& filename, const int filetype=-1);
 
+// Saves as 16 bit integers with scl_slope/scl_inter set to map the range of
+// the data, i.e. half the size of float. It is read back (as float) by all the
+// read functions. If maxerr is given it returns the largest absolute difference
+// between source and what will be read back. Throws, without writing anything,
+// if source contains NaN or Inf.
+template <class T>
+int save_volume_int16(const volume<T>& source, const std::string& filename, double *maxerr=nullptr,
+		      const int filetype=-1, bool save_orig=false);
+
 int save_complexvolume(const volume<float>& realvol,
 		       const volume<float>& imagvol, const std::string& filename);
 int save_complexvolume(const complexvolume& vol, const std::string& filename);
@@ -0,0 +1,68 @@
+#include "newimage/newimageall.h"
+#include <cstdint>
+#include <memory>
+
+#include <boost/version.hpp>
+#if BOOST_VERSION < 108000
+#define BOOST_NO_CXX98_FUNCTION_BASE
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+
+BOOST_AUTO_TEST_SUITE(test_volume_pool)
+
+
+using namespace NEWIMAGE;
+
+BOOST_AUTO_TEST_CASE(volume_pool_reuses_blocks)
+{
+    // A volume released inside a scope should hand its
+    // (aligned) block to the next volume of the same size
+    std::shared_ptr<VolumeDataPool> pool = VolumeDataPool::Create();
+    VolumeDataPoolScope scope(pool);
+    const float *first = nullptr;
+    {
+        volume<float> v(20, 30, 40);
+        first = v.fbegin();
+        BOOST_CHECK(reinterpret_cast<uintptr_t>(first) % VolumeDataPool::Alignment == 0);
+    }
+    volume<float> w(20, 30, 40);
+    BOOST_CHECK(w.fbegin() == first);
+    BOOST_CHECK(pool->NHits() == 1);
+    BOOST_CHECK(pool->NMisses() == 1);
+}
+
+BOOST_AUTO_TEST_CASE(volume_pool_copies_and_outlives_pool)
+{
+    // Copies of pooled volumes are independent, and a volume
+    // may outlive the pool it got its data from
+    volume<float> keep;
+    {
+        std::shared_ptr<VolumeDataPool> pool = VolumeDataPool::Create();
+        volume<float> v(10, 10, 10);
+        v.setdatapool(pool);
+        v.reinitialize(10, 10, 10);
+        v = 2.0;
+        volume<float> c(v);
+        c = 3.0;
+        BOOST_CHECK(v(5, 5, 5) == 2.0);
+        keep.setdatapool(pool);
+        keep = c;
+    }
+    BOOST_CHECK(keep(5, 5, 5) == 3.0);
+}
+
+BOOST_AUTO_TEST_CASE(volume_pool_size_class)
+{
+    // Size classes are never smaller than, and at most 25%
+    // larger than, the request
+    for (size_t n = 1; n < 100000000; n = 3 * n + 7) {
+        size_t c = VolumeDataPool::SizeClass(n);
+        BOOST_CHECK(c >= n);
+        BOOST_CHECK(c % VolumeDataPool::Alignment == 0);
+        if (n > 4096) BOOST_CHECK(c <= n + n / 4);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
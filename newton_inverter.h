@@ -0,0 +1,237 @@
+//
+//  Declarations and definitions for class NewtonInverter
+//
+//  newton_inverter.h
+//
+//  Implements a class for inverting 3D warp-fields that are given
+//  as spline coefficients. Rather than searching for the tetrahedron
+//  that contains a point (see tetrahedron.h) it solves y = F(x) for
+//  x using Newton's method, evaluating the field and its analytical
+//  Jacobian directly from the spline coefficients. Points for which
+//  it does not converge (typically because the field folds there)
+//  are flagged so that they can be handed to a Tetrahedron instead.
+//
+/*  CCOPYRIGHT  */
+
+#ifndef newton_inverter_h
+#define newton_inverter_h
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "armawrap/newmat.h"
+#include "basisfield/fsl_splines.h"
+#include "basisfield/splinefield.h"
+
+namespace FNIRT {
+
+class NewtonInverterException: public std::exception
+{
+private:
+  std::string m_msg;
+public:
+  NewtonInverterException(const std::string& msg) throw(): m_msg(std::string("NewtonInverter::") + msg) {}
+
+  virtual const char * what() const throw() {
+    return m_msg.c_str();
+  }
+
+  ~NewtonInverterException() throw() {}
+};
+
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+//
+// The mapping that is inverted is
+//
+// F(x) = A*x + d(x)/s
+//
+// where x is a voxel index into the field, A is an affine matrix,
+// d is the displacement field (given by three splinefields) and s
+// is a scaling (e.g. the voxel size of the space F maps into). This
+// is the same mapping as is used by a Tetrahedron that has been
+// given an affine matrix.
+// Given y Invert() finds x such that F(x) = y by iterating
+//
+// x_{n+1} = x_n - J(x_n)^{-1} (F(x_n) - y)
+//
+// where J = A + (dd/dx)/s is the Jacobian of F. The initial guess
+// is whatever is passed in x. The work is done for many points at
+// the time, e.g. a whole row of the inverse field, with the points
+// that have converged being removed from the set after each
+// iteration. A point is flagged as failed if it has not converged
+// after MaxIter() iterations, if the Jacobian at it is not positive
+// or if the solution is outside the field.
+// Invert() is const and can be called from several threads.
+//
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+
+class NewtonInverter
+{
+public:
+  NewtonInverter(const BASISFIELD::splinefield& dx,
+                 const BASISFIELD::splinefield& dy,
+                 const BASISFIELD::splinefield& dz,
+                 const NEWMAT::Matrix&          A,
+                 const std::vector<double>&     s);
+  ~NewtonInverter() {}
+
+  void SetMaxIter(unsigned int n) { _miter = n; }
+  void SetTolerance(double tol) { _tol = tol; }
+  unsigned int MaxIter() const { return(_miter); }
+  double Tolerance() const { return(_tol); }
+
+  // Points are given by x[0][i], x[1][i], x[2][i] etc. x is the
+  // initial guess on input and the solution on output. Returns the
+  // number of points that converged, and ok[i] is set accordingly.
+  unsigned int Invert(const std::vector<double>  (&y)[3],
+                      std::vector<double>        (&x)[3],
+                      std::vector<char>&         ok) const;
+private:
+  static const unsigned int MAXS = 6;       // Max # of splines with support at a point, in one direction
+  unsigned int                         _miter; // Max # of iterations
+  double                               _tol;   // Convergence when all |F(x)-y| < _tol
+  double                               _maxstep; // Max step (voxels) in any one direction
+  double                               _a[3][4]; // Affine part
+  double                               _s[3];    // Scaling of displacements
+  unsigned int                         _fsz[3];  // Field size
+  unsigned int                         _csz[3];  // Coefficient size
+  std::vector<double>                  _coef[3]; // Coefficients for x-, y- and z-displacements
+  std::vector<BASISFIELD::Spline1D<double> >  _sp;   // Splines in x-, y- and z-directions
+  std::vector<BASISFIELD::Spline1D<double> >  _dsp;  // Derivatives of the same
+
+  void eval(const std::vector<unsigned int>& indx,
+            const std::vector<double>        (&x)[3],
+            std::vector<double>              (&d)[3],
+            std::vector<double>              (&J)[9]) const;
+};
+
+inline NewtonInverter::NewtonInverter(const BASISFIELD::splinefield& dx,
+                                      const BASISFIELD::splinefield& dy,
+                                      const BASISFIELD::splinefield& dz,
+                                      const NEWMAT::Matrix&          A,
+                                      const std::vector<double>&     s)
+  : _miter(20), _tol(1e-4), _maxstep(2.0)
+{
+  const BASISFIELD::splinefield *f[3] = {&dx, &dy, &dz};
+  for (unsigned int i=1; i<3; i++) {
+    if (f[i]->Order() != dx.Order() || f[i]->Ksp_x() != dx.Ksp_x() || f[i]->Ksp_y() != dx.Ksp_y() || f[i]->Ksp_z() != dx.Ksp_z() ||
+	f[i]->FieldSz_x() != dx.FieldSz_x() || f[i]->FieldSz_y() != dx.FieldSz_y() || f[i]->FieldSz_z() != dx.FieldSz_z()) {
+      throw NewtonInverterException("NewtonInverter: Mismatched fields");
+    }
+  }
+  if (A.Nrows() < 3 || A.Ncols() != 4 || s.size() != 3) throw NewtonInverterException("NewtonInverter: A must be 3x4 or 4x4 and s of length 3");
+  for (unsigned int r=0; r<3; r++) {
+    for (unsigned int c=0; c<4; c++) _a[r][c] = A(r+1,c+1);
+    _s[r] = s[r];
+  }
+  _fsz[0] = dx.FieldSz_x(); _fsz[1] = dx.FieldSz_y(); _fsz[2] = dx.FieldSz_z();
+  _csz[0] = dx.CoefSz_x(); _csz[1] = dx.CoefSz_y(); _csz[2] = dx.CoefSz_z();
+  unsigned int ksp[3] = {dx.Ksp_x(), dx.Ksp_y(), dx.Ksp_z()};
+  for (unsigned int i=0; i<3; i++) {
+    _sp.push_back(BASISFIELD::Spline1D<double>(dx.Order(),ksp[i],0));
+    _dsp.push_back(BASISFIELD::Spline1D<double>(dx.Order(),ksp[i],1));
+    std::shared_ptr<NEWMAT::ColumnVector> c = f[i]->GetCoef();
+    _coef[i].resize(c->Nrows());
+    for (int j=0; j<c->Nrows(); j++) _coef[i][j] = c->element(j);
+  }
+}
+
+/////////////////////////////////////////////////////////////////////
+//
+// Evaluates the displacements (d) and their derivatives (J, in
+// row-major order, i.e. J[3*i+j] is the derivative of d[i] w.r.t.
+// direction j) at the points given by indx.
+//
+/////////////////////////////////////////////////////////////////////
+inline void NewtonInverter::eval(const std::vector<unsigned int>& indx,
+                                 const std::vector<double>        (&x)[3],
+                                 std::vector<double>              (&d)[3],
+                                 std::vector<double>              (&J)[9]) const
+{
+  double w[3][MAXS], dw[3][MAXS];
+  unsigned int first[3], last[3];
+  for (unsigned int p=0; p<indx.size(); p++) {
+    unsigned int vi = indx[p];
+    for (unsigned int dir=0; dir<3; dir++) {
+      _sp[dir].RangeOfSplines(x[dir][vi],_csz[dir],first[dir],last[dir]);
+      if (last[dir] > first[dir]+MAXS) throw NewtonInverterException("eval: Too many splines at point");
+      for (unsigned int c=first[dir]; c<last[dir]; c++) {
+	w[dir][c-first[dir]] = _sp[dir].SplineValueAtVoxel(x[dir][vi],c);
+	dw[dir][c-first[dir]] = _dsp[dir].SplineValueAtVoxel(x[dir][vi],c);
+      }
+    }
+    double v[3][4] = {{0.0}};  // Value and derivatives in x, y and z for each of the three fields
+    for (unsigned int k=first[2]; k<last[2]; k++) {
+      double wz = w[2][k-first[2]], dwz = dw[2][k-first[2]];
+      for (unsigned int j=first[1]; j<last[1]; j++) {
+	double wy = w[1][j-first[1]], dwy = dw[1][j-first[1]];
+	unsigned int offs = (k*_csz[1] + j)*_csz[0];
+	for (unsigned int i=first[0]; i<last[0]; i++) {
+	  double wx = w[0][i-first[0]], dwx = dw[0][i-first[0]];
+	  double b = wx*wy*wz, bx = dwx*wy*wz, by = wx*dwy*wz, bz = wx*wy*dwz;
+	  for (unsigned int f=0; f<3; f++) {
+	    double c = _coef[f][offs+i];
+	    v[f][0] += c*b; v[f][1] += c*bx; v[f][2] += c*by; v[f][3] += c*bz;
+	  }
+	}
+      }
+    }
+    for (unsigned int f=0; f<3; f++) {
+      d[f][vi] = v[f][0];
+      for (unsigned int dir=0; dir<3; dir++) J[3*f+dir][vi] = v[f][dir+1];
+    }
+  }
+}
+
+inline unsigned int NewtonInverter::Invert(const std::vector<double>  (&y)[3],
+                                           std::vector<double>        (&x)[3],
+                                           std::vector<char>&         ok) const
+{
+  unsigned int n = y[0].size();
+  ok.assign(n,0);
+  std::vector<double> d[3], J[9];
+  for (unsigned int i=0; i<3; i++) d[i].resize(n);
+  for (unsigned int i=0; i<9; i++) J[i].resize(n);
+  std::vector<unsigned int> active(n);
+  for (unsigned int i=0; i<n; i++) active[i] = i;
+
+  unsigned int nconv = 0;
+  for (unsigned int iter=0; iter<=_miter && active.size(); iter++) {
+    eval(active,x,d,J);
+    unsigned int nact = 0;
+    for (unsigned int p=0; p<active.size(); p++) {
+      unsigned int vi = active[p];
+      double r[3], M[3][3];
+      for (unsigned int i=0; i<3; i++) {
+	r[i] = _a[i][0]*x[0][vi] + _a[i][1]*x[1][vi] + _a[i][2]*x[2][vi] + _a[i][3] + d[i][vi]/_s[i] - y[i][vi];
+	for (unsigned int j=0; j<3; j++) M[i][j] = _a[i][j] + J[3*i+j][vi]/_s[i];
+      }
+      double c00 = M[1][1]*M[2][2]-M[1][2]*M[2][1];
+      double c01 = M[1][2]*M[2][0]-M[1][0]*M[2][2];
+      double c02 = M[1][0]*M[2][1]-M[1][1]*M[2][0];
+      double det = M[0][0]*c00 + M[0][1]*c01 + M[0][2]*c02;
+      if (!(det > 0.0)) continue;  // Folded (or NaN), leave it to someone else
+      if (std::fabs(r[0]) < _tol && std::fabs(r[1]) < _tol && std::fabs(r[2]) < _tol) {
+	bool inside = true;
+	for (unsigned int i=0; i<3; i++) inside = inside && x[i][vi] >= 0.0 && x[i][vi] <= double(_fsz[i]-1);
+	if (inside) { ok[vi] = 1; nconv++; }
+	continue;
+      }
+      if (iter == _miter) continue;
+      // Solve M*dx = r by Cramer's rule
+      double dx[3];
+      dx[0] = (r[0]*c00 + M[0][1]*(M[1][2]*r[2]-r[1]*M[2][2]) + M[0][2]*(r[1]*M[2][1]-M[1][1]*r[2])) / det;
+      dx[1] = (M[0][0]*(r[1]*M[2][2]-M[1][2]*r[2]) + r[0]*c01 + M[0][2]*(M[1][0]*r[2]-r[1]*M[2][0])) / det;
+      dx[2] = (M[0][0]*(M[1][1]*r[2]-r[1]*M[2][1]) + M[0][1]*(r[1]*M[2][0]-M[1][0]*r[2]) + r[0]*c02) / det;
+      for (unsigned int i=0; i<3; i++) x[i][vi] -= std::max(-_maxstep,std::min(_maxstep,dx[i]));
+      active[nact++] = vi;
+    }
+    active.resize(nact);
+  }
+  return(nconv);
+}
+
+} // End namespace FNIRT
+
+#endif // End #ifndef newton_inverter_h
@@ -0,0 +1,123 @@
+#include "newimage/newimageall.h"
+#include "warpfns/warpfns.h"
+#include "field_inverter.h"
+#include "dilator.h"
+#include <cmath>
+#include <memory>
+
+#include <boost/version.hpp>
+#if BOOST_VERSION < 108000
+#define BOOST_NO_CXX98_FUNCTION_BASE
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+
+BOOST_AUTO_TEST_SUITE(test_invwarp)
+
+
+using namespace NEWIMAGE;
+using namespace FNIRT;
+
+// Smooth relative displacement field (in voxels) with displacements of a
+// few voxels, so that the tetrahedra have to walk and some points near
+// the edge of the FOV end up outside the field.
+static std::shared_ptr<volume4D<float> > make_field(int nx, int ny, int nz)
+{
+  std::shared_ptr<volume4D<float> > f(new volume4D<float>(nx, ny, nz, 3));
+  f->setdims(2.0, 2.0, 2.0, 1.0);
+  for (int k = 0; k < nz; k++) for (int j = 0; j < ny; j++) for (int i = 0; i < nx; i++) {
+    (*f)(i, j, k, 0) = 2.5*std::sin(2.0*M_PI*j/ny)*std::cos(M_PI*k/nz) + 1.0;
+    (*f)(i, j, k, 1) = 2.0*std::sin(2.0*M_PI*i/nx + 0.3) - 0.5;
+    (*f)(i, j, k, 2) = 1.5*std::cos(2.0*M_PI*(i+j)/(nx+ny));
+  }
+  return f;
+}
+
+static volume4D<float> invert(const std::shared_ptr<volume4D<float> >& f, unsigned int nthr, unsigned int& nfail)
+{
+  volume4D<float> inv(f->xsize(), f->ysize(), f->zsize(), 3);
+  inv.setdims(2.0, 2.0, 2.0, 1.0);
+  inv = 0.0f;
+  NEWMAT::IdentityMatrix B(4);
+  invert_field(f, B, nullptr, inv, Utilities::NoOfThreads(nthr));
+  nfail = 0;
+  for (int k = 0; k < inv.zsize(); k++) for (int j = 0; j < inv.ysize(); j++) for (int i = 0; i < inv.xsize(); i++) {
+    if (inv(i, j, k, 0) == -999) nfail++;
+  }
+  return inv;
+}
+
+static double maxdiff(const volume4D<float>& a, const volume4D<float>& b)
+{
+  double md = 0.0;
+  for (int t = 0; t < a.tsize(); t++) for (int k = 0; k < a.zsize(); k++) for (int j = 0; j < a.ysize(); j++) for (int i = 0; i < a.xsize(); i++) {
+    md = std::max(md, std::fabs(double(a(i, j, k, t)) - double(b(i, j, k, t))));
+  }
+  return md;
+}
+
+BOOST_AUTO_TEST_CASE(inverse_is_inverse)
+{
+  std::shared_ptr<volume4D<float> > f = make_field(40, 36, 30);
+  unsigned int nfail;
+  volume4D<float> inv = invert(f, 1, nfail);
+  BOOST_CHECK_GT(nfail, 0u);             // Some points map from outside the field
+  BOOST_CHECK_LT(nfail, 40u*36u*30u/10u);
+  // Check that x + f(x) = y where x = y + inv(y), away from the edges.
+  // The tetrahedra interpolate the field linearly, so this is only
+  // approximately true with a trilinearly interpolated f.
+  double md = 0.0;
+  for (int k = 4; k < 26; k++) for (int j = 4; j < 32; j++) for (int i = 4; i < 36; i++) {
+    if (inv(i, j, k, 0) == -999) continue;
+    double x[3] = {i + inv(i, j, k, 0), j + inv(i, j, k, 1), k + inv(i, j, k, 2)};
+    for (int d = 0; d < 3; d++) {
+      double fx = (*f)[d].interpolate(x[0], x[1], x[2]);
+      double y = (d == 0) ? i : ((d == 1) ? j : k);
+      md = std::max(md, std::fabs(x[d] + fx - y));
+    }
+  }
+  BOOST_CHECK_LT(md, 0.05);
+}
+
+BOOST_AUTO_TEST_CASE(result_does_not_depend_on_nthr)
+{
+  std::shared_ptr<volume4D<float> > f = make_field(40, 36, 30);
+  unsigned int nfail1, nfail;
+  volume4D<float> inv1 = invert(f, 1, nfail1);
+  for (unsigned int nt : {2u, 3u, 7u, 64u}) {
+    BOOST_TEST_CONTEXT("nthr = " << nt) {
+      volume4D<float> inv = invert(f, nt, nfail);
+      BOOST_CHECK_EQUAL(nfail, nfail1);
+      BOOST_CHECK_EQUAL(maxdiff(inv, inv1), 0.0);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(postprocessing_does_not_depend_on_nthr)
+{
+  // The remaining steps of invwarp: fill, add affine and constrain Jacobians
+  std::shared_ptr<volume4D<float> > f = make_field(40, 36, 30);
+  unsigned int nfail;
+  volume4D<float> inv = invert(f, 1, nfail);
+  Dilator dil(inv);
+  dil.Fill();
+  inv = dil.Get();
+  NEWMAT::Matrix A(4,4);
+  A << 1.05 << 0.02 << 0.0 << 1.0
+    << -0.02 << 0.97 << 0.01 << -2.0
+    << 0.0 << 0.0 << 1.02 << 0.5
+    << 0.0 << 0.0 << 0.0 << 1.0;
+  volume4D<float> ref;
+  for (unsigned int nt : {1u, 3u}) {
+    volume4D<float> w = inv;
+    add_affine(w[0].sampling_mat(), A, w, Utilities::NoOfThreads(nt));
+    convertwarp_rel2abs(w);
+    constrain_topology(w, 0.5, 2.0, Utilities::NoOfThreads(nt));
+    if (nt == 1) ref = w;
+    else BOOST_CHECK_EQUAL(maxdiff(w, ref), 0.0);
+  }
+}
+
+
+BOOST_AUTO_TEST_SUITE_END()
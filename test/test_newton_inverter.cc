@@ -0,0 +1,155 @@
+#include "basisfield/splinefield.h"
+#include "newton_inverter.h"
+#include <cmath>
+#include <vector>
+
+#include <boost/version.hpp>
+#if BOOST_VERSION < 108000
+#define BOOST_NO_CXX98_FUNCTION_BASE
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+
+BOOST_AUTO_TEST_SUITE(test_newton_inverter)
+
+
+using namespace FNIRT;
+using namespace BASISFIELD;
+
+static const unsigned int FSZ[3] = {30, 28, 24};
+static const double VXS = 2.0;
+
+// Three cubic spline fields (mm), with coefficients of size amp
+static std::vector<splinefield> make_fields(double amp)
+{
+  std::vector<unsigned int> sz(FSZ, FSZ+3), ksp = {5, 5, 5};
+  std::vector<double> vxs(3, VXS);
+  std::vector<splinefield> fields;
+  for (int i=0; i<3; i++) {
+    fields.push_back(splinefield(sz, vxs, ksp, 3));
+    NEWMAT::ColumnVector coef(fields[i].CoefSz());
+    for (int j=0; j<coef.Nrows(); j++) coef.element(j) = amp*std::sin(0.53*j + 2.1*i);
+    fields[i].SetCoef(coef);
+  }
+  return fields;
+}
+
+static NEWMAT::Matrix make_affine()
+{
+  NEWMAT::Matrix A = NEWMAT::IdentityMatrix(4);
+  A(1,1) = 1.03; A(1,2) = 0.02; A(2,1) = -0.02; A(2,2) = 0.98; A(3,3) = 1.01;
+  A(1,4) = 0.6; A(2,4) = -0.4; A(3,4) = 0.3;
+  return A;
+}
+
+// F(x) = A*x + d(x)/s, evaluated with splinefield::Peek
+static void forward(const std::vector<splinefield>& f, const NEWMAT::Matrix& A, const double x[3], double y[3])
+{
+  for (int i=0; i<3; i++) {
+    y[i] = A(i+1,1)*x[0] + A(i+1,2)*x[1] + A(i+1,3)*x[2] + A(i+1,4) + f[i].Peek(x[0],x[1],x[2]) / VXS;
+  }
+}
+
+// Jacobian determinant of F at x, by central differences
+static double jacobian(const std::vector<splinefield>& f, const NEWMAT::Matrix& A, const double x[3])
+{
+  double J[3][3], h = 1e-4;
+  for (int d=0; d<3; d++) {
+    double xp[3] = {x[0], x[1], x[2]}, xm[3] = {x[0], x[1], x[2]}, yp[3], ym[3];
+    xp[d] += h; xm[d] -= h;
+    forward(f, A, xp, yp); forward(f, A, xm, ym);
+    for (int i=0; i<3; i++) J[i][d] = (yp[i] - ym[i]) / (2.0*h);
+  }
+  return(J[0][0]*(J[1][1]*J[2][2]-J[1][2]*J[2][1]) - J[0][1]*(J[1][0]*J[2][2]-J[1][2]*J[2][0]) + J[0][2]*(J[1][0]*J[2][1]-J[1][1]*J[2][0]));
+}
+
+// Targets y on a regular grid, and the affine initial guess for each
+static void make_targets(const NEWMAT::Matrix& A, std::vector<double> (&y)[3], std::vector<double> (&x)[3])
+{
+  NEWMAT::Matrix iA = A.i();
+  for (int d=0; d<3; d++) { y[d].clear(); x[d].clear(); }
+  for (unsigned int k=0; k<FSZ[2]; k+=2) for (unsigned int j=0; j<FSZ[1]; j+=2) for (unsigned int i=0; i<FSZ[0]; i+=2) {
+    double p[3] = {double(i), double(j), double(k)};
+    for (int d=0; d<3; d++) {
+      y[d].push_back(p[d]);
+      x[d].push_back(iA(d+1,1)*p[0] + iA(d+1,2)*p[1] + iA(d+1,3)*p[2] + iA(d+1,4));
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(solutions_map_back_onto_targets)
+{
+  std::vector<splinefield> f = make_fields(1.5);
+  NEWMAT::Matrix A = make_affine();
+  NewtonInverter ninv(f[0], f[1], f[2], A, std::vector<double>(3, VXS));
+  ninv.SetTolerance(1e-6);
+  std::vector<double> y[3], x[3];
+  std::vector<char> ok;
+  make_targets(A, y, x);
+  unsigned int nconv = ninv.Invert(y, x, ok);
+  unsigned int n = y[0].size(), nok = 0;
+  BOOST_CHECK_GT(nconv, 0.8*n);   // Only points near the edge may map from outside the field
+  double md = 0.0;
+  for (unsigned int p=0; p<n; p++) {
+    if (!ok[p]) continue;
+    nok++;
+    double xp[3] = {x[0][p], x[1][p], x[2][p]}, yp[3];
+    forward(f, A, xp, yp);
+    for (int d=0; d<3; d++) md = std::max(md, std::fabs(yp[d] - y[d][p]));
+    for (int d=0; d<3; d++) BOOST_CHECK(xp[d] >= 0.0 && xp[d] <= FSZ[d]-1);
+  }
+  BOOST_CHECK_EQUAL(nok, nconv);
+  BOOST_CHECK_LT(md, 1e-5);
+}
+
+BOOST_AUTO_TEST_CASE(folded_and_outside_points_fail)
+{
+  // With large displacements the field folds. Every point that is
+  // reported as converged must still be a proper (non-folded) solution.
+  std::vector<splinefield> f = make_fields(12.0);
+  NEWMAT::Matrix A = make_affine();
+  NewtonInverter ninv(f[0], f[1], f[2], A, std::vector<double>(3, VXS));
+  std::vector<double> y[3], x[3];
+  std::vector<char> ok;
+  make_targets(A, y, x);
+  unsigned int n = y[0].size();
+  unsigned int nconv = ninv.Invert(y, x, ok);
+  BOOST_CHECK_LT(nconv, n);
+  for (unsigned int p=0; p<n; p++) {
+    if (!ok[p]) continue;
+    double xp[3] = {x[0][p], x[1][p], x[2][p]}, yp[3];
+    forward(f, A, xp, yp);
+    for (int d=0; d<3; d++) BOOST_CHECK_SMALL(yp[d] - y[d][p], 2e-4);
+    BOOST_CHECK_GT(jacobian(f, A, xp), 0.0);
+  }
+  // Targets far outside the field never converge to a point inside it
+  std::vector<double> yo[3], xo[3];
+  for (int d=0; d<3; d++) { yo[d].assign(5, -40.0 - d); xo[d].assign(5, 0.0); }
+  BOOST_CHECK_EQUAL(ninv.Invert(yo, xo, ok), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(max_iter_limits_work)
+{
+  std::vector<splinefield> f = make_fields(1.5);
+  NEWMAT::Matrix A = make_affine();
+  NewtonInverter ninv(f[0], f[1], f[2], A, std::vector<double>(3, VXS));
+  ninv.SetTolerance(1e-9);
+  std::vector<double> y[3], x[3], x0[3];
+  std::vector<char> ok;
+  make_targets(A, y, x0);
+  for (int d=0; d<3; d++) x[d] = x0[d];
+  ninv.SetMaxIter(0);
+  BOOST_CHECK_EQUAL(ninv.Invert(y, x, ok), 0u);   // The affine guess is not a solution
+  for (int d=0; d<3; d++) x[d] = x0[d];
+  ninv.SetMaxIter(20);
+  BOOST_CHECK_GT(ninv.Invert(y, x, ok), 0u);
+  // Mismatched fields are rejected
+  std::vector<splinefield> g = make_fields(1.5);
+  std::vector<unsigned int> sz = {20, 20, 20}, ksp = {5, 5, 5};
+  splinefield other(sz, std::vector<double>(3, VXS), ksp, 3);
+  BOOST_CHECK_THROW(NewtonInverter(g[0], g[1], other, A, std::vector<double>(3, VXS)), NewtonInverterException);
+}
+
+
+BOOST_AUTO_TEST_SUITE_END()
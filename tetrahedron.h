@@ -63,7 +63,7 @@ class Tetrahedron
 public:
   Tetrahedron(int x, int y, int z,
               unsigned int xs, unsigned int ys, unsigned int zs) :
-    _i1(x), _j1(y), _k1(z), _is(xs), _js(ys), _ks(zs), _miter(1000), _hasaff(false)
+    _i1(x), _j1(y), _k1(z), _is(xs), _js(ys), _ks(zs), _miter(1000), _ioob(false), _hasaff(false), _rstate(1)
   {
     populate_me();
     set_coordinates();
@@ -71,7 +71,7 @@ public:
   Tetrahedron(int x, int y, int z,
               const std::shared_ptr<NEWIMAGE::volume4D<float> >& def) :
               _i1(x), _j1(y), _k1(z), _is(def->xsize()), _js(def->ysize()),
-              _ks(def->zsize()), _miter(1000), _hasaff(false), _def(def)
+              _ks(def->zsize()), _miter(1000), _ioob(false), _hasaff(false), _rstate(1), _def(def)
   {
     populate_me();
     set_coordinates();
@@ -80,7 +80,7 @@ public:
               const std::shared_ptr<NEWIMAGE::volume4D<float> >& def,
               const NEWMAT::Matrix& aff) :
               _i1(x), _j1(y), _k1(z), _is(def->xsize()), _js(def->ysize()),
-              _ks(def->zsize()), _miter(1000), _hasaff(true), _def(def)
+              _ks(def->zsize()), _miter(1000), _ioob(false), _hasaff(true), _rstate(1), _def(def)
   {
     populate_me();
     set_affine(aff);
@@ -88,9 +88,15 @@ public:
   }
   ~Tetrahedron() {}
 
+  // N.B. that this also resets the sequence of random plane orders,
+  // which means that the result of FindPoint only depends on what
+  // has happened since the last call to SetFirstPoint. That is what
+  // makes it possible to have one Tetrahedron per thread and still
+  // get the same results regardless of number of threads.
   void SetFirstPoint(int x, int y, int z)
   {
     _i1 = x; _j1 = y; _k1 = z;
+    _rstate = 1;
     populate_me();
     set_coordinates();
   }
@@ -135,6 +141,8 @@ public:
   }
 private:
   void populate_me();
+  int random_plane() { _rstate = _rstate*1103515245 + 12345; return(static_cast<int>((_rstate >> 16) % 4) + 1); }
+  float def_val(int i, int j, int k, int t) const { return((_ioob && !_def->in_bounds(i,j,k)) ? 0.0f : (*_def)(i,j,k,t)); }
   void set_affine(const NEWMAT::Matrix& aff);
   void set_coordinates();
   void set_coordinates(int indx);
@@ -155,6 +163,7 @@ private:
   int          _miter;         // Max iterations, used to detect singularities.
   bool         _ioob;          // If set means we should ignore out-of-bounds
   bool         _hasaff;        // If set means that there is an explicit affine component
+  unsigned int _rstate;        // State of (per object) random number generator
   double       _a11, _a12, _a13, _a14;  // First row of affine matrix
   double       _a21, _a22, _a23, _a24;  // Second row of affine matrix
   double       _a31, _a32, _a33, _a34;  // Third row of affine matrix
@@ -173,7 +182,8 @@ private:
 // To decrease the changes of a tetrahedron getting stuck
 // in an area of singularity (in which case the tetrahedron
 // gets turned inside-out) the order in which the planes will
-// be random.
+// be random. The random sequence is specific to each object (rather
+// than coming from rand()) so that objects can be used in parallel.
 // If it finds it is outside a plane, but that a step in that
 // direction would take it outside the valid FOV it will go to
 // the next plane and test that. If it turns out that there is
@@ -185,7 +195,7 @@ private:
 /////////////////////////////////////////////////////////////////////
 bool Tetrahedron::is_point_in_tetrahedron(double x, double y, double z, int& indx)
 {
-  indx = (rand() % 4) + 1;  // Random value in range 1-4
+  indx = random_plane();  // Random value in range 1-4
   bool one_is_on_right_side = false;
   bool four_is_on_right_side = false;
   bool one_is_ok = false;
@@ -466,7 +476,7 @@ void Tetrahedron::set_coordinates(int indx)
       _z1 = _a31*_i1+_a32*_j1+_a33*_k1+_a34;
     }
     else { _x1=_i1; _y1=_j1; _z1=_k1; }
-    if (_def) { _x1 += (*_def)(_i1,_j1,_k1,0); _y1 += (*_def)(_i1,_j1,_k1,1); _z1 += (*_def)(_i1,_j1,_k1,2); }
+    if (_def) { _x1 += def_val(_i1,_j1,_k1,0); _y1 += def_val(_i1,_j1,_k1,1); _z1 += def_val(_i1,_j1,_k1,2); }
     break;
   case 2:
     if (_hasaff) {
@@ -475,7 +485,7 @@ void Tetrahedron::set_coordinates(int indx)
       _z2 = _a31*_i2+_a32*_j2+_a33*_k2+_a34;
     }
     else { _x2=_i2; _y2=_j2; _z2=_k2; }
-    if (_def) { _x2 += (*_def)(_i2,_j2,_k2,0); _y2 += (*_def)(_i2,_j2,_k2,1); _z2 += (*_def)(_i2,_j2,_k2,2); }
+    if (_def) { _x2 += def_val(_i2,_j2,_k2,0); _y2 += def_val(_i2,_j2,_k2,1); _z2 += def_val(_i2,_j2,_k2,2); }
     break;
   case 3:
     if (_hasaff) {
@@ -484,7 +494,7 @@ void Tetrahedron::set_coordinates(int indx)
       _z3 = _a31*_i3+_a32*_j3+_a33*_k3+_a34;
     }
     else { _x3=_i3; _y3=_j3; _z3=_k3; }
-    if (_def) { _x3 += (*_def)(_i3,_j3,_k3,0); _y3 += (*_def)(_i3,_j3,_k3,1); _z3 += (*_def)(_i3,_j3,_k3,2); }
+    if (_def) { _x3 += def_val(_i3,_j3,_k3,0); _y3 += def_val(_i3,_j3,_k3,1); _z3 += def_val(_i3,_j3,_k3,2); }
     break;
   case 4:
     if (_hasaff) {
@@ -493,7 +503,7 @@ void Tetrahedron::set_coordinates(int indx)
       _z4 = _a31*_i4+_a32*_j4+_a33*_k4+_a34;
     }
     else { _x4=_i4; _y4=_j4; _z4=_k4; }
-    if (_def) { _x4 += (*_def)(_i4,_j4,_k4,0); _y4 += (*_def)(_i4,_j4,_k4,1); _z4 += (*_def)(_i4,_j4,_k4,2); }
+    if (_def) { _x4 += def_val(_i4,_j4,_k4,0); _y4 += def_val(_i4,_j4,_k4,1); _z4 += def_val(_i4,_j4,_k4,2); }
     break;
   default:
     break;
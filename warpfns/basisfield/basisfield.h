@@ -53,13 +53,14 @@ private:
   std::shared_ptr<NEWMAT::ColumnVector>                coef;           // Basis coefficients
   std::vector<bool>                                      futd;           // If true, field accurately reflects coef
   std::vector<std::shared_ptr<NEWMAT::ColumnVector> >  field;          // Field, dfdx, dfdy, dfdz
+  unsigned long                                          version;        // Incremented every time coef changes
 
 protected:
 
   // Functions for use in this and derived classes
 
   virtual void set_update_flag(bool state, FieldIndex fi=FIELD) {futd[fi] = state;}
-  virtual void set_coef_ptr(std::shared_ptr<NEWMAT::ColumnVector>& cptr) {coef = cptr;}
+  virtual void set_coef_ptr(std::shared_ptr<NEWMAT::ColumnVector>& cptr) {coef = cptr; version++;}
   // Get smart read/write pointer to updated field
   virtual std::shared_ptr<NEWMAT::ColumnVector> get(FieldIndex fi=FIELD);
   // Get smart read/write pointers to updated fields
@@ -85,6 +86,9 @@ public:
 
   virtual unsigned int NDim() const {return(ndim);}
   virtual bool UpToDate(FieldIndex fi=FIELD) const {return(futd[fi]);}
+  // Changes every time the coefficients (and hence the field) change. Allows
+  // a client that holds on to data derived from the field to tell if it is stale.
+  virtual unsigned long Version() const {return(version);}
   virtual unsigned int CoefSz() const {return(CoefSz_x()*CoefSz_y()*CoefSz_z());}
 
   virtual unsigned int FieldSz() const {return(FieldSz_x()*FieldSz_y()*FieldSz_z());}
@@ -2,6 +2,9 @@
 //Copyright (C) 2022 University of Oxford
 /*  CCOPYRIGHT  */
 
+#include <algorithm>
+#include <functional>
+#include <thread>
 #include "newimagefns.h"
 #include "newimageio.h"
 #include "edt.h"
@@ -40,89 +43,145 @@ namespace NEWIMAGE {
     return d;
   }
 
-  template <class T>
-  volume<double> euclideanDistanceTransform(const NEWIMAGE::volume<T>& input) {
-    auto[ distanceMap, temp ] = euclideanDistanceTransform(input,input);
-    return distanceMap;
+  //Workspace for the 1D transform of lines of length n, one per thread
+  template<class F>
+  struct EdtWorkspace {
+    EdtWorkspace(int64_t n) : f(n), d(n), aux(n), newAux(n), v(n,0), z(n+1) {}
+    vector<F> f, d, aux, newAux;
+    vector<int64_t> v;
+    vector<F> z;
+  };
+
+  template<class F>
+  inline F intersection(const F* f, const int64_t& q, const int64_t& vk, const F weight) {
+    F diff = (q - vk) * weight;
+    F sum = q + vk;
+    F intersection = (f[q] - f[vk] + (diff * sum)) / (2 * diff);
+    if ( isnan(intersection) )
+      return numeric_limits<F>::infinity();
+    return intersection;
   }
 
-  template <typename T>
-  tuple<volume<double>,volume<T>> euclideanDistanceTransform(const volume<T>& binary, const volume<T>& data) {
-    binary.throwsIfNot3D();
-    volume<double> distanceMap;
-    volume<T> nearestData(data);
-    copyconvert(binary,distanceMap);
+  //Same as the 1D transform above, but on ws.f (and optionally ws.aux) in place using preallocated buffers
+  template<class F>
+  void edtLine(EdtWorkspace<F>& ws, int64_t n, const F weight, bool useAux) {
+    const F* f(ws.f.data());
+    int64_t* v(ws.v.data());
+    F* z(ws.z.data());
+    v[0] = 0;
+    z[0] = -numeric_limits<F>::infinity();
+    z[1] = numeric_limits<F>::infinity();
+    for (int64_t q(1), k(0); q < n; q++) {
+      F s(intersection(f,q,v[k],weight));
+      while ( k > 0 && s <= z[k] )
+        s = intersection(f,q,v[--k],weight);
+      v[++k] = q;
+      z[k] = s;
+      z[k+1] = numeric_limits<F>::infinity();
+    }
+    for (int64_t q(0), k(0); q < n; q++) {
+      while (z[k+1] < q)
+        k++;
+      ws.d[q] = ( weight*(q - v[k])*(q - v[k]) ) + f[v[k]];
+      if ( useAux )
+        ws.newAux[q] = ws.aux[v[k]];
+    }
+  }
 
-    //"0D" initialisation
-    for (int z=0; z<=distanceMap.maxz(); z++)
-      for (int y=0; y<=distanceMap.maxy(); y++)
-        for (int x=0; x<=distanceMap.maxx(); x++)
-          distanceMap(x,y,z) = ( distanceMap(x,y,z) == 0) ? std::numeric_limits<float>::infinity() : 0;
-
-    //1D:X
-    vector<double> f(distanceMap.xsize());
-    vector<double> aux(distanceMap.xsize());
-    for (int z=0; z<=distanceMap.maxz(); z++)
-      for (int y=0; y<=distanceMap.maxy(); y++) {
-        for (int x=0; x<=distanceMap.maxx(); x++) {
-          f[x] = distanceMap(x,y,z);
-          aux[x] = nearestData(x,y,z);
-        }
-        vector<double> dvec( euclideanDistanceTransform(f,distanceMap.xdim()*distanceMap.xdim(),aux));
-        for (int x=0; x<=distanceMap.maxx(); x++) {
-          distanceMap(x,y,z) = dvec[x];
-          nearestData(x,y,z) = aux[x];
-        }
+  //Transforms all lines along dimension dir in slabs [first,last) of distances (and nearest, if not null)
+  template<class F, class T>
+  void edtAlong(F* distance, T* nearest, const vector<int64_t>& sz, unsigned int dir, F weight, int64_t first, int64_t last) {
+    int64_t step[3] = {1, sz[0], sz[0]*sz[1]};
+    // Dimensions of line (l), within slab (m) and across slabs (s)
+    unsigned int l = dir, s = (dir==2) ? 1 : 2, m = 3 - l - s;
+    int64_t n = sz[l];
+    EdtWorkspace<F> ws(n);
+    for (int64_t si=first; si<last; si++) {
+      for (int64_t mi=0; mi<sz[m]; mi++) {
+        int64_t offset = si*step[s] + mi*step[m];
+        for (int64_t i=0; i<n; i++) ws.f[i] = distance[offset+i*step[l]];
+        if ( nearest )
+          for (int64_t i=0; i<n; i++) ws.aux[i] = static_cast<F>(nearest[offset+i*step[l]]);
+        edtLine(ws,n,weight,nearest!=nullptr);
+        for (int64_t i=0; i<n; i++) distance[offset+i*step[l]] = ws.d[i];
+        if ( nearest )
+          for (int64_t i=0; i<n; i++) nearest[offset+i*step[l]] = static_cast<T>(ws.newAux[i]);
       }
+    }
+  }
 
-    //2D:Y
-    f.resize(distanceMap.ysize());
-    aux.resize(distanceMap.ysize());
-    for (int z=0; z<=distanceMap.maxz(); z++)
-      for (int x=0; x<=distanceMap.maxx(); x++) {
-        for (int y=0; y<=distanceMap.maxy(); y++) {
-          f[y] = distanceMap(x,y,z);
-          aux[y] = nearestData(x,y,z);
-        }
-        vector<double> dvec( euclideanDistanceTransform(f,distanceMap.ydim()*distanceMap.ydim(),aux));
-        for (int y=0; y<=distanceMap.maxy(); y++) {
-          distanceMap(x,y,z) = dvec[y];
-          nearestData(x,y,z) = aux[y];
-        }
+  //Separable transform, with the lines along each dimension shared out between nthr threads
+  template<class F, class T>
+  void edt3D(F* distance, T* nearest, const vector<int64_t>& sz, const vector<F>& weights, Utilities::NoOfThreads nthr) {
+    for (unsigned int dir=0; dir<3; dir++) {
+      int64_t nslab = (dir==2) ? sz[1] : sz[2];
+      int64_t nt = std::max(int64_t(1),std::min(nthr._n,nslab));
+      if (nt == 1) edtAlong(distance,nearest,sz,dir,weights[dir],0,nslab);
+      else {
+        vector<std::thread> threads(nt-1); // + main thread makes nt
+        for (int64_t t=0; t<nt-1; t++)
+          threads[t] = std::thread(edtAlong<F,T>,distance,nearest,std::cref(sz),dir,weights[dir],(t*nslab)/nt,((t+1)*nslab)/nt);
+        edtAlong(distance,nearest,sz,dir,weights[dir],((nt-1)*nslab)/nt,nslab);
+        std::for_each(threads.begin(),threads.end(),std::mem_fn(&std::thread::join)); // Join the threads
       }
+    }
+  }
 
-    //3D:Z
-    f.resize(distanceMap.zsize());
-    aux.resize(distanceMap.zsize());
-    for (int x=0; x<=distanceMap.maxx(); x++)
-      for (int y=0; y<=distanceMap.maxy(); y++) {
-        for (int z=0; z<=distanceMap.maxz(); z++) {
-          f[z] = distanceMap(x,y,z);
-          aux[z] = nearestData(x,y,z);
-        }
-        vector<double> dvec( euclideanDistanceTransform(f,distanceMap.zdim()*distanceMap.zdim(),aux) );
-        for (int z=0; z<=distanceMap.maxz(); z++) {
-          distanceMap(x,y,z) = dvec[z];
-          nearestData(x,y,z) = aux[z];
-        }
-      }
+  template<class F, class T>
+  volume<F> distanceMapFromBinary(const volume<T>& binary, volume<T>* nearest, Utilities::NoOfThreads nthr) {
+    binary.throwsIfNot3D();
+    volume<F> distanceMap;
+    copyconvert(binary,distanceMap);
+    //"0D" initialisation
+    for (F *dp=distanceMap.nsfbegin(); dp!=distanceMap.nsfend(); ++dp)
+      *dp = ( *dp == 0 ) ? numeric_limits<float>::infinity() : 0;
+    vector<int64_t> sz = { distanceMap.xsize(), distanceMap.ysize(), distanceMap.zsize() };
+    vector<F> weights = { F(distanceMap.xdim()*distanceMap.xdim()), F(distanceMap.ydim()*distanceMap.ydim()), F(distanceMap.zdim()*distanceMap.zdim()) };
+    edt3D(distanceMap.nsfbegin(),nearest ? nearest->nsfbegin() : static_cast<T*>(nullptr),sz,weights,nthr);
+    return distanceMap;
+  }
+
+  template <class T>
+  volume<double> euclideanDistanceTransform(const NEWIMAGE::volume<T>& input, Utilities::NoOfThreads nthr) {
+    return distanceMapFromBinary<double,T>(input,nullptr,nthr);
+  }
 
+  template <class T>
+  volume<double> euclideanDistanceTransform(const NEWIMAGE::volume<T>& input) {
+    return euclideanDistanceTransform(input,Utilities::NoOfThreads(1));
+  }
+
+  template <class T>
+  volume<float> euclideanDistanceTransformFloat(const NEWIMAGE::volume<T>& input, Utilities::NoOfThreads nthr) {
+    return distanceMapFromBinary<float,T>(input,nullptr,nthr);
+  }
+
+  template <typename T>
+  tuple<volume<double>,volume<T>> euclideanDistanceTransform(const volume<T>& binary, const volume<T>& data, Utilities::NoOfThreads nthr) {
+    volume<T> nearestData(data);
+    volume<double> distanceMap(distanceMapFromBinary<double,T>(binary,&nearestData,nthr));
     return { distanceMap, nearestData };
   }
 
+  template <typename T>
+  tuple<volume<double>,volume<T>> euclideanDistanceTransform(const volume<T>& binary, const volume<T>& data) {
+    return euclideanDistanceTransform(binary,data,Utilities::NoOfThreads(1));
+  }
+
   //From a set of sparse data, defined by isSample > 0
   template<class T>
-  volume<T> sparseInterpolate(const volume<T>& sparseData, const volume<T>& isSample, const double sigma) {
+  volume<T> sparseInterpolate(const volume<T>& sparseData, const volume<T>& isSample, const double sigma, Utilities::NoOfThreads nthr) {
 
     if ( sparseData.tsize() > 1 ) {
       volume<T> iData(sparseData,TEMPLATE);
       for (int64_t t=0; t < sparseData.tsize(); t++)
-        iData[t] = sparseInterpolate(sparseData[t],isSample[t],sigma);
+        iData[t] = sparseInterpolate(sparseData[t],isSample[t],sigma,nthr);
       return iData;
     }
 
-    volume<T> dmap, iData;
-    tie(dmap,iData) = euclideanDistanceTransform(isSample,sparseData);
+    volume<double> dmap;
+    volume<T> iData;
+    tie(dmap,iData) = euclideanDistanceTransform(isSample,sparseData,nthr);
 
     auto kernel=gaussian_kernel3D(sigma,iData.xdim(),iData.ydim(),iData.zdim());
     if ( sigma > 0 )
@@ -134,11 +193,19 @@ namespace NEWIMAGE {
     return iData;
   }
 
+  template<class T>
+  volume<T> sparseInterpolate(const volume<T>& sparseData, const volume<T>& isSample, const double sigma) {
+    return sparseInterpolate(sparseData,isSample,sigma,Utilities::NoOfThreads(1));
+  }
+
   template<typename... Ts>
   auto edtInstantiate() {
     static auto instantiatedFunctions = std::tuple_cat(std::make_tuple(
       static_cast< volume<double>(*)(const volume<Ts>&)>(euclideanDistanceTransform<Ts>),
-      static_cast< tuple<volume<double>,volume<Ts>>(*)(const volume<Ts>&, const volume<Ts>&)>(euclideanDistanceTransform<Ts>)
+      static_cast< tuple<volume<double>,volume<Ts>>(*)(const volume<Ts>&, const volume<Ts>&)>(euclideanDistanceTransform<Ts>),
+      static_cast< volume<double>(*)(const volume<Ts>&, Utilities::NoOfThreads)>(euclideanDistanceTransform<Ts>),
+      static_cast< volume<float>(*)(const volume<Ts>&, Utilities::NoOfThreads)>(euclideanDistanceTransformFloat<Ts>),
+      static_cast< tuple<volume<double>,volume<Ts>>(*)(const volume<Ts>&, const volume<Ts>&, Utilities::NoOfThreads)>(euclideanDistanceTransform<Ts>)
     )...);
     return &instantiatedFunctions;
   }
@@ -146,4 +213,7 @@ namespace NEWIMAGE {
   template auto __attribute__((visibility("hidden"))) edtInstantiate<char,short,int,float,double>();
 
   template volume<double> sparseInterpolate(const volume<double>& data, const volume<double>& weights, const double sigma);
+  template volume<double> sparseInterpolate(const volume<double>& data, const volume<double>& weights, const double sigma, Utilities::NoOfThreads nthr);
+  template volume<float> sparseInterpolate(const volume<float>& data, const volume<float>& weights, const double sigma);
+  template volume<float> sparseInterpolate(const volume<float>& data, const volume<float>& weights, const double sigma, Utilities::NoOfThreads nthr);
 }
\ No newline at end of file
@@ -0,0 +1,137 @@
+#include "newimage/newimageall.h"
+#include "newimage/splinecoefcache.h"
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <boost/version.hpp>
+#if BOOST_VERSION < 108000
+#define BOOST_NO_CXX98_FUNCTION_BASE
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+
+BOOST_AUTO_TEST_SUITE(test_splinecoefcache)
+
+
+using namespace NEWIMAGE;
+
+static volume<float> make_volume()
+{
+    volume<float> v(11, 9, 7);
+    for (int k = 0; k < 7; k++) for (int j = 0; j < 9; j++) for (int i = 0; i < 11; i++) {
+        v(i, j, k) = 100.0 + 50.0*std::sin(0.3*i)*std::cos(0.2*j) + 3.0*k;
+    }
+    v.setinterpolationmethod(spline);
+    v.setsplineorder(3);
+    return v;
+}
+
+BOOST_AUTO_TEST_CASE(hash_sign_flips_do_not_cancel)
+{
+    // Negating two floats at odd indices flips bit 63 of two words, which
+    // cancelled in the word-wise FNV-1a hash that was used previously.
+    volume<float> v = make_volume();
+    uint64_t h0 = SplineCoefCache<float>::ContentHash(v);
+    uint64_t c0 = SplineCoefCache<float>::ContentCheck(v);
+    volume<float> w = v;
+    float *p = w.nsfbegin();
+    p[1] = -p[1];
+    p[3] = -p[3];
+    BOOST_CHECK(SplineCoefCache<float>::ContentHash(w) != h0);
+    BOOST_CHECK(SplineCoefCache<float>::ContentCheck(w) != c0);
+    w = v;
+    p = w.nsfbegin();
+    std::swap(p[10], p[20]);
+    BOOST_CHECK(SplineCoefCache<float>::ContentHash(w) != h0);
+    BOOST_CHECK(SplineCoefCache<float>::ContentCheck(w) != c0);
+    BOOST_CHECK_EQUAL(SplineCoefCache<float>::ContentHash(v), h0);
+    BOOST_CHECK(h0 != c0);
+}
+
+BOOST_AUTO_TEST_CASE(persistent_cache_checks_content)
+{
+    std::string dir = "/tmp/test_splinecoefcache_" + std::to_string(getpid());
+    BOOST_REQUIRE(mkdir(dir.c_str(), 0700) == 0);
+    volume<float> v = make_volume();
+    SplineCoefCache<float> wcache(SplineCoefCache<float>::DefaultMaxBytes, dir);
+    wcache.Store(v, 2.0);
+
+    // A fresh cache finds the file and gives the same coefficients
+    volume<float> v2 = make_volume();
+    SplineCoefCache<float> rcache(SplineCoefCache<float>::DefaultMaxBytes, dir);
+    BOOST_CHECK(rcache.Adopt(v2, 2.0));
+    BOOST_CHECK_EQUAL(rcache.NHits(), 1u);
+    const float *c1 = v.splinecoefficients(), *c2 = v2.splinecoefficients();
+    for (int64_t i = 0; i < v.nvoxels(); i++) BOOST_REQUIRE_EQUAL(c1[i], c2[i]);
+    BOOST_CHECK(!rcache.Adopt(v2, 3.0)); // Different tag
+
+    // A file whose stored check does not match is not used
+    std::string sfname;
+    DIR *dp = opendir(dir.c_str());
+    BOOST_REQUIRE(dp);
+    for (struct dirent *de = readdir(dp); de; de = readdir(dp)) {
+        if (std::string(de->d_name).find("splcoef_") == 0) sfname = dir + "/" + de->d_name;
+    }
+    closedir(dp);
+    BOOST_REQUIRE(sfname.size());
+    {
+        std::fstream fs(sfname.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+        uint64_t check;
+        fs.seekg(16); fs.read(reinterpret_cast<char *>(&check), sizeof(check));
+        check ^= 1;
+        fs.seekp(16); fs.write(reinterpret_cast<const char *>(&check), sizeof(check));
+    }
+    volume<float> v3 = make_volume();
+    SplineCoefCache<float> tcache(SplineCoefCache<float>::DefaultMaxBytes, dir);
+    BOOST_CHECK(!tcache.Adopt(v3, 2.0));
+    std::remove(sfname.c_str());
+    rmdir(dir.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(memory_bounded_by_bytes)
+{
+    // Room for two volumes of 11x9x7 floats
+    uint64_t vbytes = 11*9*7*sizeof(float);
+    SplineCoefCache<float> cache(2*vbytes + 100);
+    std::vector<volume<float> > vols(3, make_volume());
+    for (int i = 0; i < 3; i++) {
+        vols[i] += float(i);
+        cache.Store(vols[i], 1.0);
+        BOOST_CHECK_LE(cache.Bytes(), cache.MaxBytes());
+    }
+    BOOST_CHECK_EQUAL(cache.NEntries(), 2u);
+    BOOST_CHECK_EQUAL(cache.Bytes(), 2*vbytes);
+    volume<float> v0 = make_volume();
+    BOOST_CHECK(!cache.Adopt(v0, 1.0));   // Least recently used is gone
+    volume<float> v2 = make_volume();
+    v2 += 2.0f;
+    BOOST_CHECK(cache.Adopt(v2, 1.0));
+
+    // A volume larger than the whole budget is not kept
+    SplineCoefCache<float> small(vbytes - 1);
+    small.Store(vols[0], 1.0);
+    BOOST_CHECK_EQUAL(small.NEntries(), 0u);
+    BOOST_CHECK_EQUAL(small.Bytes(), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(threaded_store_gives_same_coefficients)
+{
+    volume<float> v1 = make_volume(), v4 = make_volume();
+    SplineCoefCache<float> cache(0);
+    cache.Store(v1, 1.0);
+    cache.Store(v4, 1.0, Utilities::NoOfThreads(4));
+    const float *c1 = v1.splinecoefficients(), *c4 = v4.splinecoefficients();
+    for (int64_t i = 0; i < v1.nvoxels(); i++) BOOST_REQUIRE_EQUAL(c1[i], c4[i]);
+}
+
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -13,6 +13,11 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <limits>
+#include <thread>
+#include <algorithm>
+#include <functional>
+#include <mutex>
 #include "armawrap/newmat.h"
 
 #ifndef EXPOSE_TREACHEROUS
@@ -25,6 +30,7 @@
 #include "basisfield/dctfield.h"
 #include "warpfns.h"
 #include "fnirt_file_reader.h"
+#include "warp_container.h"
 
 using namespace std;
 using namespace NEWMAT;
@@ -39,7 +45,7 @@ namespace NEWIMAGE {
 /////////////////////////////////////////////////////////////////////
 
 FnirtFileReader::FnirtFileReader(const FnirtFileReader& src)
-: _fname(src._fname), _type(src._type), _aff(src._aff), _coef_rep(3)
+: _fname(src._fname), _type(src._type), _aff(src._aff), _coef_rep(3), _container(src._container)
 {
   for (unsigned int i=0; i<src._coef_rep.size(); i++) {
     if (_type == FnirtSplineDispType) {
@@ -75,6 +81,7 @@ vector<unsigned int> FnirtFileReader::FieldSize() const
     ret[2] = static_cast<unsigned int>(_vol_rep->zsize());
     break;
  case FnirtSplineDispType: case FnirtDCTDispType:
+   if (_container) return(_container->FieldSize());
    ret[0] = _coef_rep[0]->FieldSz_x(); ret[1] = _coef_rep[0]->FieldSz_y(); ret[2] = _coef_rep[0]->FieldSz_z();
    break;
   default:
@@ -98,6 +105,7 @@ vector<double> FnirtFileReader::VoxelSize() const
     ret[0] = _vol_rep->xdim(); ret[1] = _vol_rep->ydim(); ret[2] = _vol_rep->zdim();
     break;
  case FnirtSplineDispType: case FnirtDCTDispType:
+   if (_container) return(_container->VoxelSize());
    ret[0] = _coef_rep[0]->Vxs_x(); ret[1] = _coef_rep[0]->Vxs_y(); ret[2] = _coef_rep[0]->Vxs_z();
    break;
   default:
@@ -115,8 +123,9 @@ vector<double> FnirtFileReader::VoxelSize() const
 vector<unsigned int> FnirtFileReader::KnotSpacing() const
 {
   if (_type == FnirtSplineDispType) {
+    if (_container) return(_container->KnotSpacing());
     vector<unsigned int>  ret(3,0);
-    const splinefield&    tmp = dynamic_cast<const splinefield&>(*(_coef_rep[0]));
+    const splinefield&    tmp = dynamic_cast<const splinefield&>(*(coef_rep()[0]));
     ret[0] = tmp.Ksp_x(); ret[1] = tmp.Ksp_y(); ret[2] = tmp.Ksp_z();
     return(ret);
   }
@@ -134,7 +143,8 @@ vector<unsigned int> FnirtFileReader::KnotSpacing() const
 unsigned int FnirtFileReader::SplineOrder() const
 {
   if (_type == FnirtSplineDispType) {
-    const splinefield&    tmp = dynamic_cast<const splinefield&>(*(_coef_rep[0]));
+    if (_container) return(_container->SplineOrder());
+    const splinefield&    tmp = dynamic_cast<const splinefield&>(*(coef_rep()[0]));
     return(tmp.Order());
   }
   else {
@@ -210,7 +220,10 @@ volume<float> FnirtFileReader::FieldAsNewimageVolume(unsigned int indx, bool inc
     break;
   case FnirtSplineDispType: case FnirtDCTDispType:
     vol.setdims(VoxelSize()[0],VoxelSize()[1],VoxelSize()[2]);
-    _coef_rep[indx]->AsVolume(vol);
+    if (_container && _container->HasField()) {   // Field straight from the mapped warp container
+      std::copy(_container->Field(indx),_container->Field(indx)+vol.nvoxels(),vol.nsfbegin());
+    }
+    else coef_rep()[indx]->AsVolume(vol);
     if (inc_aff) add_affine_part(_aff,indx,vol);
     return(vol);
     break;
@@ -242,7 +255,10 @@ volume4D<float> FnirtFileReader::FieldAsNewimageVolume4D(bool inc_aff) const
     vol.setdims(VoxelSize()[0],VoxelSize()[1],VoxelSize()[2],1.0);
     for (unsigned int i=0; i<3; i++) {
       ShadowVolume<float> voli(vol[i]);
-      _coef_rep[i]->AsVolume(voli);
+      if (_container && _container->HasField()) {  // Field straight from the mapped warp container
+        std::copy(_container->Field(i),_container->Field(i)+voli.nvoxels(),voli.nsfbegin());
+      }
+      else coef_rep()[i]->AsVolume(voli);
       if (inc_aff) add_affine_part(_aff,i,voli);
     }
     return(vol);
@@ -281,8 +297,8 @@ volume<float> FnirtFileReader::Jacobian(bool inc_aff) const
   else if (_type==FnirtSplineDispType || _type==FnirtDCTDispType) {
     volume<float>  jac(FieldSize()[0],FieldSize()[1],FieldSize()[2]);
     jac.setdims(VoxelSize()[0],VoxelSize()[1],VoxelSize()[2]);
-    if (inc_aff) deffield2jacobian(*(_coef_rep[0]),*(_coef_rep[1]),*(_coef_rep[2]),AffineMat(),jac);
-    else deffield2jacobian(*(_coef_rep[0]),*(_coef_rep[1]),*(_coef_rep[2]),jac);
+    if (inc_aff) deffield2jacobian(*(coef_rep()[0]),*(coef_rep()[1]),*(coef_rep()[2]),AffineMat(),jac);
+    else deffield2jacobian(*(coef_rep()[0]),*(coef_rep()[1]),*(coef_rep()[2]),jac);
     return(jac);
   }
   else throw FnirtFileReaderException("Jacobian: Invalid _type");
@@ -301,8 +317,8 @@ volume4D<float> FnirtFileReader::JacobianMatrix(bool inc_aff) const
   else if (_type==FnirtSplineDispType || _type==FnirtDCTDispType) {
     volume4D<float>  jac(FieldSize()[0],FieldSize()[1],FieldSize()[2],9);
     jac.setdims(VoxelSize()[0],VoxelSize()[1],VoxelSize()[2],1.0);
-    if (inc_aff) deffield2jacobian_matrix(*(_coef_rep[0]),*(_coef_rep[1]),*(_coef_rep[2]),AffineMat(),jac);
-    else deffield2jacobian_matrix(*(_coef_rep[0]),*(_coef_rep[1]),*(_coef_rep[2]),jac);
+    if (inc_aff) deffield2jacobian_matrix(*(coef_rep()[0]),*(coef_rep()[1]),*(coef_rep()[2]),AffineMat(),jac);
+    else deffield2jacobian_matrix(*(coef_rep()[0]),*(coef_rep()[1]),*(coef_rep()[2]),jac);
     return(jac);
   }
   else throw FnirtFileReaderException("Jacobian: Invalid _type");
@@ -322,13 +338,13 @@ splinefield FnirtFileReader::FieldAsSplinefield(unsigned int indx, vector<unsign
   if (indx > 2) throw FnirtFileReaderException("FieldAsSplineField: indx out of range");
   if (_type == FnirtSplineDispType) {
     if ((!ksp.size() || ksp==KnotSpacing()) && (!order || order==SplineOrder())) {
-      const splinefield& tmpref = dynamic_cast<const splinefield&>(*(_coef_rep[indx]));
+      const splinefield& tmpref = dynamic_cast<const splinefield&>(*(coef_rep()[indx]));
       return(tmpref);
     }
     else {
       if (!order || order==SplineOrder()) {  // If we are keeping the order
         order = SplineOrder();
-        std::shared_ptr<basisfield>  tmpptr = _coef_rep[indx]->ZoomField(FieldSize(),VoxelSize(),ksp);
+        std::shared_ptr<basisfield>  tmpptr = coef_rep()[indx]->ZoomField(FieldSize(),VoxelSize(),ksp);
         const splinefield&      tmpref = dynamic_cast<const splinefield&>(*tmpptr);
         return(tmpref);
       }
@@ -365,11 +381,11 @@ dctfield FnirtFileReader::FieldAsDctfield(unsigned int indx, vector<unsigned int
   std::shared_ptr<dctfield>         rvalp;
   if (_type == FnirtDCTDispType) {
     if (!order.size() || order==DCTOrder()) {
-      const dctfield& tmpref = dynamic_cast<const dctfield&>(*(_coef_rep[indx]));
+      const dctfield& tmpref = dynamic_cast<const dctfield&>(*(coef_rep()[indx]));
       return(tmpref);
     }
     else {
-      std::shared_ptr<basisfield>  tmpptr = _coef_rep[indx]->ZoomField(FieldSize(),VoxelSize(),order);
+      std::shared_ptr<basisfield>  tmpptr = coef_rep()[indx]->ZoomField(FieldSize(),VoxelSize(),order);
       const dctfield& tmpref = dynamic_cast<const dctfield&>(*tmpptr);
       return(tmpref);
     }
@@ -555,6 +571,95 @@ void deffield2jacobian_matrix(const BASISFIELD::basisfield&   dx,
   return;
 }
 
+/////////////////////////////////////////////////////////////////////
+//
+// jacobian_range calculates the same Jacobian determinants as
+// deffield2jacobian above, but reduces them to min, max and counts
+// of voxels outside [minj,maxj] as it goes along rather than
+// storing them. The derivative fields are fetched (and hence
+// calculated if they are not up to date) before the threads are
+// started, each thread then does a slab of z-planes.
+//
+/////////////////////////////////////////////////////////////////////
+
+namespace {
+
+void jacobian_range_slab(const double * const      *d,      // dxdx, dxdy, dxdz, dydx, ..., dzdz
+                         const double              (&a)[3][3],
+                         const double              (&ivxs)[3],
+                         unsigned int              first,
+                         unsigned int              last,
+                         double                    minj,
+                         double                    maxj,
+                         NEWMAT::ColumnVector&     stats)
+{
+  double mn = std::numeric_limits<double>::max();
+  double mx = -std::numeric_limits<double>::max();
+  double nlo = 0.0, nhi = 0.0;
+  for (unsigned int indx=first; indx<last; indx++) {
+    double j11 = a[0][0] + ivxs[0]*d[0][indx], j12 = a[0][1] + ivxs[1]*d[1][indx], j13 = a[0][2] + ivxs[2]*d[2][indx];
+    double j21 = a[1][0] + ivxs[0]*d[3][indx], j22 = a[1][1] + ivxs[1]*d[4][indx], j23 = a[1][2] + ivxs[2]*d[5][indx];
+    double j31 = a[2][0] + ivxs[0]*d[6][indx], j32 = a[2][1] + ivxs[1]*d[7][indx], j33 = a[2][2] + ivxs[2]*d[8][indx];
+    double jac = j11*(j22*j33-j23*j32) + j12*(j23*j31-j21*j33) + j13*(j21*j32-j22*j31);
+    if (jac < mn) mn = jac;
+    if (jac > mx) mx = jac;
+    if (jac < minj) nlo += 1.0;
+    if (jac > maxj) nhi += 1.0;
+  }
+  stats.ReSize(4);
+  stats(1) = mn; stats(2) = mx; stats(3) = nlo; stats(4) = nhi;
+}
+
+} // End anonymous namespace
+
+NEWMAT::ColumnVector jacobian_range(const BASISFIELD::basisfield&   dx,
+                                    const BASISFIELD::basisfield&   dy,
+                                    const BASISFIELD::basisfield&   dz,
+                                    const NEWMAT::Matrix&           aff,
+                                    double                          minj,
+                                    double                          maxj,
+                                    Utilities::NoOfThreads          nthr)
+{
+  const BASISFIELD::basisfield *f[3] = {&dx, &dy, &dz};
+  std::shared_ptr<ColumnVector> dptr[9];
+  const double *d[9];
+  for (unsigned int i=0; i<3; i++) {
+    for (unsigned int j=0; j<3; j++) {
+      dptr[3*i+j] = f[i]->Get(BASISFIELD::FieldIndex(j+1));
+      d[3*i+j] = static_cast<const double *>(dptr[3*i+j]->Store());
+    }
+  }
+  NEWMAT::Matrix iaff = aff.i();
+  double a[3][3];
+  for (unsigned int i=0; i<3; i++) for (unsigned int j=0; j<3; j++) a[i][j] = iaff(i+1,j+1);
+  // N.B. that deffield2jacobian scales derivatives of dx, dy and dz
+  // by the voxel size of dx, dy and dz respectively. They are
+  // always the same, so dx is used for all.
+  double ivxs[3] = {1.0/dx.Vxs_x(), 1.0/dx.Vxs_y(), 1.0/dx.Vxs_z()};
+
+  unsigned int nz = dx.FieldSz_z(), nxy = dx.FieldSz_x()*dx.FieldSz_y();
+  NEWMAT::ColumnVector stats(4);
+  stats = 0.0;
+  if (!nz || !nxy) return(stats);
+  unsigned int nt = static_cast<unsigned int>(std::max(int64_t(1),std::min(nthr._n,int64_t(nz))));
+  std::vector<unsigned int> nzs = RGT_UTILS::rows_per_thread(nz,nt);
+  std::vector<NEWMAT::ColumnVector> tstats(nt);
+  std::vector<std::thread> threads(nt-1); // + main thread makes nt
+  for (unsigned int i=0; i<nt-1; i++) {
+    threads[i] = std::thread(jacobian_range_slab,d,std::cref(a),std::cref(ivxs),nzs[i]*nxy,nzs[i+1]*nxy,minj,maxj,std::ref(tstats[i]));
+  }
+  jacobian_range_slab(d,a,ivxs,nzs[nt-1]*nxy,nzs[nt]*nxy,minj,maxj,tstats[nt-1]);
+  std::for_each(threads.begin(),threads.end(),std::mem_fn(&std::thread::join));
+  stats = tstats[0];
+  for (unsigned int i=1; i<nt; i++) {
+    if (tstats[i](1) < stats(1)) stats(1) = tstats[i](1);
+    if (tstats[i](2) > stats(2)) stats(2) = tstats[i](2);
+    stats(3) += tstats[i](3);
+    stats(4) += tstats[i](4);
+  }
+  return(stats);
+}
+
 void add_or_remove_affine_part(const NEWMAT::Matrix&     aff,
                                unsigned int              indx,
                                bool                      add,
@@ -715,6 +820,10 @@ void fin_diff_gradient2jacobian(const NEWIMAGE::volume4D<float>& xw,
 
 void FnirtFileReader::common_read(const string& fname, AbsOrRelWarps wt, bool verbose)
 {
+  // Coefficients in a warp container are recognised by their magic number
+  if (WarpContainer::IsContainer(fname)) { read_container(fname,verbose); return; }
+  _container.reset();
+
   // Read volume indicated by fname
   volume4D<float>   vol;
   read_volume4D(vol,fname);
@@ -778,6 +887,64 @@ void FnirtFileReader::common_read(const string& fname, AbsOrRelWarps wt, bool ve
   }
 }
 
+/////////////////////////////////////////////////////////////////////
+//
+// Opens a WarpContainer and keeps it. Nothing is copied out of it
+// here. If the container has the field FieldAsNewimageVolume(4D)
+// copy it straight from the mapped file, and the coefficients are
+// only decoded (by coef_rep()) when something needs them.
+//
+/////////////////////////////////////////////////////////////////////
+
+void FnirtFileReader::read_container(const string& fname, bool verbose)
+{
+  _container = std::make_shared<const WarpContainer>(fname);
+  if (verbose) {
+    vector<unsigned int> sz = _container->FieldSize();
+    vector<double>       vxs = _container->VoxelSize();
+    vector<unsigned int> ksp = _container->KnotSpacing();
+    cout << "Reading spline coefficients from warp container " << _container->FileName() << endl;
+    cout << "Matrix size: " << sz[0] << "  " << sz[1] << "  " << sz[2] << endl;
+    cout << "Voxel size: " << vxs[0] << "  " << vxs[1] << "  " << vxs[2] << endl;
+    cout << "Knot-spacing: " << ksp[0] << "  " << ksp[1] << "  " << ksp[2] << endl;
+    if (_container->HasField()) cout << "Using field stored in warp container" << endl;
+  }
+  _coef_rep = vector<std::shared_ptr<basisfield> >(3);
+  _vol_rep.reset();
+  _aff = _container->AffineMat();
+  _aor = RelativeWarps;
+  _type = FnirtSplineDispType;
+}
+
+/////////////////////////////////////////////////////////////////////
+//
+// Returns the basis-field representations, decoding them from the
+// warp container first if that is where they are.
+//
+/////////////////////////////////////////////////////////////////////
+
+const vector<std::shared_ptr<basisfield> >& FnirtFileReader::coef_rep() const
+{
+  if (!_container) return(_coef_rep);
+  static std::mutex mtx;  // The reader may be shared between threads
+  std::lock_guard<std::mutex> lg(mtx);
+  if (!_coef_rep[0]) {
+    vector<std::shared_ptr<basisfield> > fields(3);
+    for (int i=0; i<3; i++) {
+      fields[i] = std::shared_ptr<splinefield>(new splinefield(_container->FieldSize(),_container->VoxelSize(),_container->KnotSpacing(),_container->SplineOrder()));
+      if (fields[i]->CoefSz_x() != _container->CoefSize()[0] || fields[i]->CoefSz_y() != _container->CoefSize()[1] || fields[i]->CoefSz_z() != _container->CoefSize()[2]) {
+        throw FnirtFileReaderException("coef_rep: Warp container not self consistent");
+      }
+      ColumnVector coef(fields[i]->CoefSz());
+      const float *cp = _container->Coef(i);
+      for (int j=0; j<coef.Nrows(); j++) coef.element(j) = cp[j];
+      fields[i]->SetCoef(coef);
+    }
+    _coef_rep = fields;
+  }
+  return(_coef_rep);
+}
+
 vector<std::shared_ptr<basisfield> > FnirtFileReader::read_coef_file(const volume4D<float>&   vcoef,
                                                                      bool                     verbose) const
 {
@@ -20,9 +20,12 @@
 #include "basisfield/basisfield.h"
 #include "basisfield/splinefield.h"
 #include "basisfield/dctfield.h"
+#include "utils/threading.h"
 
 namespace NEWIMAGE {
 
+class WarpContainer;
+
 class FnirtFileReaderException: public std::exception
 {
 private:
@@ -75,6 +78,17 @@ void deffield2jacobian_matrix(const BASISFIELD::basisfield&   dx,
 			      const NEWMAT::Matrix&           aff,
 			      volume4D<float>&                jacmat);
 
+// Returns (min,max,#<minj,#>maxj) of the Jacobian determinant, i.e. the same
+// as deffield2jacobian followed by min(), max() etc, but without allocating a
+// volume for the Jacobians and with the work split over nthr threads.
+NEWMAT::ColumnVector jacobian_range(const BASISFIELD::basisfield&   dx,
+                                    const BASISFIELD::basisfield&   dy,
+                                    const BASISFIELD::basisfield&   dz,
+                                    const NEWMAT::Matrix&           aff,
+                                    double                          minj,
+                                    double                          maxj,
+                                    Utilities::NoOfThreads          nthr=Utilities::NoOfThreads(1));
+
 void add_affine_part(const NEWMAT::Matrix&     aff,
                      unsigned int              indx,
                      NEWIMAGE::volume<float>&  warps);
@@ -149,8 +163,10 @@ public:
 
 protected:
   void common_read(const std::string& fname, AbsOrRelWarps wt, bool verbose);
+  void read_container(const std::string& fname, bool verbose);
   std::vector<std::shared_ptr<BASISFIELD::basisfield> > read_coef_file(const NEWIMAGE::volume4D<float>&   vcoef,
                                                                          bool                               verbose) const;
+  const std::vector<std::shared_ptr<BASISFIELD::basisfield> >& coef_rep() const;
   // void add_affine_part(NEWMAT::Matrix aff, unsigned int indx, NEWIMAGE::volume<float>& warps) const;
 
 private:
@@ -160,6 +176,7 @@ private:
   NEWMAT::Matrix                                                      _aff;
   mutable std::vector<std::shared_ptr<BASISFIELD::basisfield> >       _coef_rep;
   mutable std::shared_ptr<NEWIMAGE::volume4D<float> >                 _vol_rep;
+  std::shared_ptr<const WarpContainer>                                _container;  // Mapped file, if read from a warp container
 };
 
 } // End namespace NEWIMAGE
@@ -25,6 +25,7 @@
 #include "warpfns.h"
 #include "fnirt_file_reader.h"
 #include "fnirt_file_writer.h"
+#include "warp_container.h"
 
 using namespace std;
 using namespace NiftiIO;
@@ -35,44 +36,48 @@ namespace NEWIMAGE {
 
 FnirtFileWriter::FnirtFileWriter(const string&                               fname,
                                  const vector<std::shared_ptr<basisfield> >& fields,
-                                 Matrix                                      aff)
+                                 Matrix                                      aff,
+                                 FnirtFileStorage                            storage) : maxerr(0.0)
 {
   if (fields.size() != 3 || !fields[0] || !fields[1] || !fields[2]) {
     throw FnirtFileWriterException("FnirtFileWriter: Invalid vector fields");
   }
-  common_coef_construction(fname,*(fields[0]),*(fields[1]),*(fields[2]),aff);
+  common_coef_construction(fname,*(fields[0]),*(fields[1]),*(fields[2]),aff,storage);
 }
 
 FnirtFileWriter::FnirtFileWriter(const string&              fname,
 				 const volume<float>&       fieldx,
 			         const volume<float>&       fieldy,
-			         const volume<float>&       fieldz)
+			         const volume<float>&       fieldz,
+                                 FnirtFileStorage           storage) : maxerr(0.0)
 {
   volume<float>  tmp(fieldx.xsize(),fieldx.ysize(),fieldx.zsize());
   tmp.copyproperties(fieldx);
   Matrix         aff = IdentityMatrix(4);
 
-  common_field_construction(fname,tmp,fieldx,fieldy,fieldz,aff);
+  common_field_construction(fname,tmp,fieldx,fieldy,fieldz,aff,storage);
 }
 
 FnirtFileWriter::FnirtFileWriter(const string&                fname,
                                  const volume<float>&         ref,
                                  const volume4D<float>&       vfields,
-                                 Matrix                       aff)
+                                 Matrix                       aff,
+                                 FnirtFileStorage             storage) : maxerr(0.0)
 {
   if (vfields.tsize() != 3) throw FnirtFileWriterException("FnirtFileWriter: Invalid 4D volume");
-  common_field_construction(fname,ref,vfields[0],vfields[1],vfields[2],aff);
+  common_field_construction(fname,ref,vfields[0],vfields[1],vfields[2],aff,storage);
 }
 
 FnirtFileWriter::FnirtFileWriter(const string&                fname,
-                                 const volume4D<float>&       vfields)
+                                 const volume4D<float>&       vfields,
+                                 FnirtFileStorage             storage) : maxerr(0.0)
 {
   if (vfields.tsize() != 3) throw FnirtFileWriterException("FnirtFileWriter: Invalid 4D volume");
   volume<float>  tmp(vfields[0].xsize(),vfields[0].ysize(),vfields[0].zsize());
   tmp.copyproperties(vfields[0]);
   Matrix         aff = IdentityMatrix(4);
 
-  common_field_construction(fname,tmp,vfields[0],vfields[1],vfields[2],aff);
+  common_field_construction(fname,tmp,vfields[0],vfields[1],vfields[2],aff,storage);
 }
 
 
@@ -93,8 +98,17 @@ void FnirtFileWriter::common_coef_construction(const string&            fname,
                                                const basisfield&        fieldx,
                                                const basisfield&        fieldy,
                                                const basisfield&        fieldz,
-                                               const Matrix&            aff)
+                                               const Matrix&            aff,
+                                               FnirtFileStorage         storage)
 {
+  if (storage == ContainerStorage || storage == ContainerWithFieldStorage) {
+    const splinefield *fx = dynamic_cast<const splinefield *>(&fieldx);
+    const splinefield *fy = dynamic_cast<const splinefield *>(&fieldy);
+    const splinefield *fz = dynamic_cast<const splinefield *>(&fieldz);
+    if (!fx || !fy || !fz) throw FnirtFileWriterException("common_coef_construction: Only spline coefficients can be saved in a warp container");
+    WarpContainer::Write(fname,*fx,*fy,*fz,aff,storage==ContainerWithFieldStorage);
+    return;
+  }
   volume4D<float>       coefs(fieldx.CoefSz_x(),fieldx.CoefSz_y(),fieldx.CoefSz_z(),3);
   vector<float>         ksp(3,1.0);
   try {
@@ -134,7 +148,8 @@ void FnirtFileWriter::common_coef_construction(const string&            fname,
     }
   }
 
-  save_orig_volume(coefs,fname);
+  if (storage == Int16Storage) save_volume_int16(coefs,fname,&maxerr,-1,true);
+  else save_orig_volume(coefs,fname);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////
@@ -150,8 +165,12 @@ void FnirtFileWriter::common_field_construction(const string&            fname,
                                                 const volume<float>&     fieldx,
                                                 const volume<float>&     fieldy,
                                                 const volume<float>&     fieldz,
-                                                const Matrix&            aff)
+                                                const Matrix&            aff,
+                                                FnirtFileStorage         storage)
 {
+  if (storage == ContainerStorage || storage == ContainerWithFieldStorage) {
+    throw FnirtFileWriterException("common_field_construction: Warp containers can only hold spline coefficients");
+  }
   volume4D<float>   fields(ref.xsize(),ref.ysize(),ref.zsize(),3);
   fields.copyproperties(ref);
 
@@ -217,7 +236,8 @@ void FnirtFileWriter::common_field_construction(const string&            fname,
   fields.setDisplayMinimum(0.0);
 
   // Save resulting field
-  save_volume4D(fields,fname);
+  if (storage == Int16Storage) save_volume_int16(fields,fname,&maxerr);
+  else save_volume4D(fields,fname);
 }
 
 /*
@@ -32,60 +32,82 @@ public:
   ~FnirtFileWriterException() noexcept {}
 };
 
+// How the values are stored in the file. Int16Storage uses 16 bit integers
+// scaled by scl_slope/scl_inter, which halves the size of the file and is
+// read back transparently by FnirtFileReader (and all read_volume functions).
+// ContainerStorage writes spline coefficients to a WarpContainer (see
+// warp_container.h) rather than to a NIfTI file, and ContainerWithFieldStorage
+// also stores the field in it. These are only valid for coefficient files.
+enum FnirtFileStorage {FloatStorage, Int16Storage, ContainerStorage, ContainerWithFieldStorage};
+
 class FnirtFileWriter
 {
 public:
   // Constructor for coefficient file
   FnirtFileWriter(const std::string&                                           fname,
                   const std::vector<std::shared_ptr<BASISFIELD::basisfield> >& fields,
-                  NEWMAT::Matrix                                               aff=NEWMAT::IdentityMatrix(4));
+                  NEWMAT::Matrix                                               aff=NEWMAT::IdentityMatrix(4),
+                  FnirtFileStorage                                             storage=FloatStorage);
   // "Simpler" constructor for coefficient file
   FnirtFileWriter(const std::string&                   fname,
                   const BASISFIELD::basisfield&        fieldx,
                   const BASISFIELD::basisfield&        fieldy,
                   const BASISFIELD::basisfield&        fieldz,
-                  NEWMAT::Matrix                       aff=NEWMAT::IdentityMatrix(4))
+                  NEWMAT::Matrix                       aff=NEWMAT::IdentityMatrix(4),
+                  FnirtFileStorage                     storage=FloatStorage) : maxerr(0.0)
   {
-    common_coef_construction(fname,fieldx,fieldy,fieldz,aff);
+    common_coef_construction(fname,fieldx,fieldy,fieldz,aff,storage);
   }
   // Constructor for field file
   FnirtFileWriter(const std::string&                   fname,
                   const NEWIMAGE::volume<float>&       ref,
                   const NEWIMAGE::volume4D<float>&     vfields,
-                  NEWMAT::Matrix                       aff=NEWMAT::IdentityMatrix(4));
+                  NEWMAT::Matrix                       aff=NEWMAT::IdentityMatrix(4),
+                  FnirtFileStorage                     storage=FloatStorage);
   // Another constructor for field file
   FnirtFileWriter(const std::string&                     fname,
-                  const NEWIMAGE::volume4D<float>&       vfields);
+                  const NEWIMAGE::volume4D<float>&       vfields,
+                  FnirtFileStorage                       storage=FloatStorage);
   // Another constructor for field file
   FnirtFileWriter(const std::string&                   fname,
                   const NEWIMAGE::volume<float>&       fieldx,
                   const NEWIMAGE::volume<float>&       fieldy,
-                  const NEWIMAGE::volume<float>&       fieldz);
+                  const NEWIMAGE::volume<float>&       fieldz,
+                  FnirtFileStorage                     storage=FloatStorage);
   // Another constructor for field file
   FnirtFileWriter(const std::string&                   fname,
                   const NEWIMAGE::volume<float>&       ref,
                   const NEWIMAGE::volume<float>&       fieldx,
                   const NEWIMAGE::volume<float>&       fieldy,
                   const NEWIMAGE::volume<float>&       fieldz,
-                  NEWMAT::Matrix                       aff=NEWMAT::IdentityMatrix(4))
+                  NEWMAT::Matrix                       aff=NEWMAT::IdentityMatrix(4),
+                  FnirtFileStorage                     storage=FloatStorage) : maxerr(0.0)
   {
-    common_field_construction(fname,ref,fieldx,fieldy,fieldz,aff);
+    common_field_construction(fname,ref,fieldx,fieldy,fieldz,aff,storage);
   }
 
+  // Largest difference between what was written and what will be read back. For
+  // fields that is in mm. For coefficients it is in the units of the coefficients,
+  // which is also an upper bound (in mm) for the error in the field they represent.
+  double MaxError() const { return(maxerr); }
+
 protected:
   void common_coef_construction(const std::string&                   fname,
                                 const BASISFIELD::basisfield&        fieldx,
                                 const BASISFIELD::basisfield&        fieldy,
                                 const BASISFIELD::basisfield&        fieldz,
-                                const NEWMAT::Matrix&                aff);
+                                const NEWMAT::Matrix&                aff,
+                                FnirtFileStorage                     storage);
 
   void common_field_construction(const std::string&                 fname,
                                  const NEWIMAGE::volume<float>&     ref,
                                  const NEWIMAGE::volume<float>&     fieldx,
                                  const NEWIMAGE::volume<float>&     fieldy,
                                  const NEWIMAGE::volume<float>&     fieldz,
-                                 const NEWMAT::Matrix&              aff);
+                                 const NEWMAT::Matrix&              aff,
+                                 FnirtFileStorage                   storage);
 private:
+  double  maxerr;
 };
 
 } // End namespace NEWIMAGE
@@ -5,6 +5,7 @@
 #if !defined(__newnifti_h)
 #define __newnifti_h
 
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -136,6 +137,9 @@ namespace NiftiIO {
     NiftiHeader loadExtensions(const std::string filename, std::vector<NiftiExtension>& extensions);
     NiftiHeader loadHeader(const std::string filename);
     NiftiHeader loadImage( std::string filename, char*& buffer, std::vector<NiftiExtension>& extensions, bool allocateBuffer=true);
+    //mapImage mmaps an uncompressed, native-endian, single file image. On success buffer points to the first voxel inside the
+    //(private, copy-on-write) mapping which is kept alive by mapping. If the file cannot be mapped buffer is set to NULL.
+    NiftiHeader mapImage( const std::string filename, char*& buffer, std::shared_ptr<void>& mapping, std::vector<NiftiExtension>& extensions);
     NiftiHeader loadImageROI( std::string filename, char*& buffer, std::vector<NiftiExtension>& extensions, int64_t xmin=-1, int64_t xmax=-1, int64_t ymin=-1, int64_t ymax=-1, int64_t zmin=-1, int64_t zmax=-1, int64_t tmin=-1, int64_t tmax=-1, int64_t d5min=-1, int64_t d5max=-1, int64_t d6min=-1, int64_t d6max=-1, int64_t d7min=-1, int64_t d7max=-1);
     void reportHeader(const analyzeHeader& header);
     void reportHeader(const nifti_1_header& header);
@@ -190,6 +194,46 @@ namespace NiftiIO {
   };
 
 
+  //ImageWriter writes the header and extensions of an image on construction, after which the
+  //voxel data is appended, in file order, with one or more calls to write (e.g. one slab at a time).
+  //This allows an image to be saved without it ever being resident in memory. close() throws if
+  //less data than implied by the header has been written. The destructor closes the file without
+  //checking, so an ImageWriter that goes out of scope early leaves a truncated file behind.
+  class ImageWriter
+  {
+  public:
+    ImageWriter(std::string filename, const std::vector<NiftiExtension>& extensions, NiftiHeader header, const bool useCompression=true);
+    ~ImageWriter();
+    void write(const void* buffer, size_t nBytes);
+    size_t bytesRemaining() const { return bytesLeft; }
+    void close();
+  private:
+    std::unique_ptr<fileIO> writer;
+    size_t bytesLeft;
+  };
+
+
+  //ImageReader reads the header and extensions of an image on construction, after which any part
+  //of the voxel data can be read, by byte offset from the first voxel, with calls to read (e.g.
+  //one slab at a time). The file is kept open between calls so reading an image slab by slab in
+  //file order costs no more than reading it in one go, also when it is compressed. Reading
+  //backwards in a compressed file means decompressing again from the start. Data are returned
+  //in native byte order.
+  class ImageReader
+  {
+  public:
+    ImageReader(std::string filename);
+    const NiftiHeader& header() const { return hdr; }
+    const std::vector<NiftiExtension>& extensions() const { return exts; }
+    void read(void* buffer, size_t byteOffset, size_t nBytes);
+  private:
+    std::unique_ptr<fileIO> reader;
+    NiftiHeader hdr;
+    std::vector<NiftiExtension> exts;
+    size_t position; //Current position relative to first voxel
+  };
+
+
   //Explicit specialisations declared here
   template<> void byteSwap(nifti_1_header& rawHeader);
   template<> void byteSwap(nifti_2_header& rawHeader);
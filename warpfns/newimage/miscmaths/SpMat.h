@@ -23,15 +23,20 @@
 
 #include <memory>
 #include <vector>
+#include <algorithm>
+#include <utility>
 #include <fstream>
 #include <iomanip>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <chrono>
 #include "armawrap/newmat.h"
 #include "utils/threading.h"
 #include "cg.h"
 #include "bicg.h"
 #include "miscmaths.h"
+#include "SpMatFile.h"
 
 namespace MISCMATHS {
 
@@ -57,6 +62,8 @@ class Preconditioner;
 template<class T>
 class Accumulator;
 
+template<class V> struct PipelinedCGWorkspace;
+
 //@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
 //
 // Class SpMat:
@@ -96,7 +103,8 @@ public:
   SpMat(unsigned int m, unsigned int n, Utilities::NoOfThreads nt=Utilities::NoOfThreads(1)) : _m(m), _n(n), _nz(0), _ri(n), _val(n), _pw(false), _nt(nt._n) {}
   SpMat(unsigned int m, unsigned int n, const unsigned int *irp, const unsigned int *jcp, const double *sp, Utilities::NoOfThreads nt=Utilities::NoOfThreads(1));
   SpMat(const NEWMAT::GeneralMatrix& M, Utilities::NoOfThreads nt=Utilities::NoOfThreads(1));
-  SpMat(const std::string& fname, Utilities::NoOfThreads nt=Utilities::NoOfThreads(1));
+  SpMat(const std::string& fname, Utilities::NoOfThreads nt=Utilities::NoOfThreads(1));  // Reads text or binary format
+  SpMat(const MappedSpMat<T>& M, Utilities::NoOfThreads nt=Utilities::NoOfThreads(1));
   ~SpMat() {}
 
   unsigned int Nrows() const {return(_m);}
@@ -114,8 +122,12 @@ public:
   void Print(const std::string&  fname) const {Print(fname,8);}
   void Print(unsigned int        precision) const {Print(std::string(""),precision);}
   void Print() const {Print(8);}
+  void SaveBinary(const std::string& fname) const;                                  // Saves in binary format (see SpMatFile.h)
   void WarningsOn() {_pw=true;}
   void WarningsOff() {_pw=false;}
+  void MixedPrecisionSolveOn() {_mps=true;}                                        // Float CG with double iterative refinement
+  void MixedPrecisionSolveOff() {_mps=false;}
+  bool MixedPrecisionSolve() const {return(_mps);}
   bool IsSorted() const { return(is_sorted()); }  // Returns true if all _ri arrays are sorted. For debugging.
 
   T Peek(unsigned int r, unsigned int c) const;
@@ -151,6 +163,13 @@ public:
 
   const SpMat<T> t() const;                                                        // Returns transpose(*this).
 
+  std::vector<unsigned int> RCMPermutation() const;                                // Reverse Cuthill-McKee ordering. Zero offset.
+  SpMat<T> SymmetricPermute(const std::vector<unsigned int>& perm) const;          // Returns P*(*this)*P' where perm[new]=old.
+  bool SymmetricPermuteValues(const std::vector<unsigned int>& perm,              // As SymmetricPermute, but overwrites the values of pmat, which
+                              SpMat<T>&                        pmat) const;      // must have the sparsity of P*(*this)*P'. Returns false if not.
+  uint64_t StructureHash() const;                                                  // Hash of size and positions of non-zero elements
+  unsigned int Bandwidth() const;                                                  // Returns max |r-c| over non-zero elements
+
   friend class Accumulator<T>;
 
   //@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
@@ -223,8 +242,10 @@ private:
   std::vector<std::vector<unsigned int> >   _ri;       /// Vector of vectors (one per column) of row-indicies
   std::vector<std::vector<T> >              _val;      /// Vector of vectors (one per column) of values
   bool                                      _pw;       /// Print Warnings
+  bool                                      _mps = false; /// Mixed precision solve
   unsigned int                              _nt;       /// Number of threads
 
+  void read_binary(const std::string& fname);
   bool found(const std::vector<unsigned int>&  ri, unsigned int key, int& pos) const;
   void insert(std::vector<unsigned int>& vec, int indx, unsigned int val);
   void insert(std::vector<T>& vec, int indx, const T& val);
@@ -263,6 +284,33 @@ private:
 				const SpMat<T>& M,
 				double          s,
 				unsigned int&   nz);
+  int pipelined_cg(// Input
+		   const NEWMAT::ColumnVector&  b,
+		   const std::vector<T>&        diag,      // Diagonal preconditioner
+		   // Input/Output
+		   NEWMAT::ColumnVector&        x,
+		   int&                         miter,
+		   double&                      tol) const;
+  int mixed_precision_cg(// Input
+			 const NEWMAT::ColumnVector&  b,
+			 const std::vector<T>&        diag,      // Diagonal preconditioner
+			 // Input/Output
+			 NEWMAT::ColumnVector&        x,
+			 int&                         miter,
+			 double&                      tol) const;
+  template<class V>
+  void run_pipelined_cg(PipelinedCGWorkspace<V>& ws) const;
+  template<class V>
+  void pipelined_cg_helper(unsigned int             tid,       // Thread number
+			   PipelinedCGWorkspace<V>& ws) const;
+  template<class V>
+  V sym_row_times_vec(unsigned int c, const V *xp) const {
+    const std::vector<unsigned int>&  ri = _ri[c];
+    const std::vector<T>&             val = _val[c];
+    V                                 res = 0.0;
+    for (unsigned int i=0; i<ri.size(); i++) res += static_cast<V>(val[i])*xp[ri[i]];
+    return(res);
+  }
 };
 
 //@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
@@ -327,6 +375,7 @@ public:
     return(b);
   }
   NEWMAT::ReturnMatrix trans_solve(const NEWMAT::ColumnVector& x) const {return(solve(x));}
+  const std::vector<T>& Diag() const {return(_diag);}
 
 private:
   std::vector<T>   _diag;
@@ -379,6 +428,71 @@ private:
   unsigned int                   *_occi;    // Unordered list of occupied indicies
 };
 
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+//
+// Class ThreadBarrier:
+//
+// A simple re-usable barrier. It is used by the pipelined CG below
+// to let a team of threads that lives for the duration of a solve
+// synchronise once per iteration, rather than spawning and joining
+// new threads for every matrix-vector multiplication.
+//
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+
+class ThreadBarrier
+{
+public:
+  ThreadBarrier(unsigned int n) : _n(n), _cnt(n), _gen(0) {}
+  void Wait() {
+    std::unique_lock<std::mutex> lk(_mtx);
+    unsigned long gen = _gen;
+    if (--_cnt == 0) { _gen++; _cnt = _n; _cv.notify_all(); }
+    else _cv.wait(lk,[this,gen]{ return(gen != _gen); });
+  }
+private:
+  std::mutex                  _mtx;
+  std::condition_variable     _cv;
+  unsigned int                _n;      // Number of threads in team
+  unsigned int                _cnt;    // Number of threads yet to arrive
+  unsigned long               _gen;    // Generation, to make it re-usable
+};
+
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+//
+// Struct PipelinedCGWorkspace:
+//
+// Holds the vectors and the per-thread partial dot-products used by
+// SpMat<T>::pipelined_cg. Each thread owns the range of elements
+// given by first[tid]--first[tid+1] of all vectors. The partial
+// dot-products are double buffered so that only a single barrier
+// is needed per iteration. V is the precision of the vectors, the
+// partial dot-products are always accumulated in double.
+//
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+
+template<class V>
+struct PipelinedCGWorkspace
+{
+  PipelinedCGWorkspace(unsigned int n, unsigned int nt, const std::vector<unsigned int>& rng)
+  : first(rng), iM(n), r(n), u(n), w(n), z(n,0.0), q(n,0.0), s(n,0.0), p(n,0.0), m0(n), m1(n),
+    part0(3*nt,0.0), part1(3*nt,0.0), barrier(nt), nt(nt), bp(0), xp(0), normb(1.0), tol(0.0), miter(0), niter(0), resid(0.0), status(1) {}
+  std::vector<unsigned int>  first;                    // First index for each thread (and one past last)
+  std::vector<V>             iM;                       // Inverse of diagonal preconditioner
+  std::vector<V>             r, u, w, z, q, s, p;      // Vectors of the pipelined recursions
+  std::vector<V>             m0, m1;                   // Double buffered M\w
+  std::vector<double>        part0, part1;             // Double buffered partial (r,u), (w,u) and (r,r)
+  ThreadBarrier              barrier;
+  unsigned int               nt;                       // Number of threads
+  const V                    *bp;                      // Right hand side
+  V                          *xp;                      // Solution
+  double                     normb;
+  double                     tol;                      // Requested tolerance
+  int                        miter;                    // Max # of iterations
+  int                        niter;                    // Iterations performed (set by thread 0)
+  double                     resid;                    // Achieved tolerance (set by thread 0)
+  int                        status;                   // 0 for success (set by thread 0)
+};
+
 /////////////////////////////////////////////////////////////////////
 //
 // Constructs sparse matrix from Compressed Column Storage representation
@@ -447,7 +561,8 @@ SpMat<T>::SpMat(const NEWMAT::GeneralMatrix& M, Utilities::NoOfThreads nt)
 /////////////////////////////////////////////////////////////////////
 //
 // Constructs matrix from row col val format produced by
-// Save/Print below.
+// Save/Print below, or from the binary format produced by
+// SaveBinary. The format is determined from the magic number.
 //
 /////////////////////////////////////////////////////////////////////
 
@@ -455,6 +570,7 @@ template<class T>
 SpMat<T>::SpMat(const std::string&  fname, Utilities::NoOfThreads nt)
 : _m(0), _n(0), _nz(0), _ri(0), _val(0), _pw(false), _nt(nt._n)
 {
+  if (is_spmat_binary_file(fname)) { read_binary(fname); return; }
   // First read data into (nz+1)x3 NEWMAT matrix
   NEWMAT::Matrix rcv;
   try {
@@ -501,6 +617,25 @@ SpMat<T>::SpMat(const std::string&  fname, Utilities::NoOfThreads nt)
   }
 }
 
+/////////////////////////////////////////////////////////////////////
+//
+// Constructs matrix from a memory mapped binary file. Note that
+// the data is copied, since SpMat has its own storage.
+//
+/////////////////////////////////////////////////////////////////////
+
+template<class T>
+SpMat<T>::SpMat(const MappedSpMat<T>& M, Utilities::NoOfThreads nt)
+: _m(M.Nrows()), _n(M.Ncols()), _nz(M.NZ()), _ri(M.Ncols()), _val(M.Ncols()), _pw(false), _nt(nt._n)
+{
+  const uint64_t *colptr = M.Colptr();
+  for (unsigned int c=0; c<_n; c++) {
+    if (unsigned int len = colptr[c+1]-colptr[c]) {
+      _ri[c].assign(M.Rowind()+colptr[c],M.Rowind()+colptr[c+1]);
+      _val[c].assign(M.Val()+colptr[c],M.Val()+colptr[c]+len);
+    }
+  }
+}
 
 /////////////////////////////////////////////////////////////////////
 //
@@ -544,6 +679,52 @@ void SpMat<T>::Save(const std::string&  fname,
   else Print(fname,precision);
 }
 
+/////////////////////////////////////////////////////////////////////
+//
+// Saves matrix in the binary format described in SpMatFile.h.
+// It is much faster to write and read than the row col val
+// format, and the file can be memory mapped by MappedSpMat.
+//
+/////////////////////////////////////////////////////////////////////
+
+template<class T>
+void SpMat<T>::SaveBinary(const std::string&  fname) const
+{
+  if (!fname.length()) throw SpMatException("SaveBinary: Must specify filename");
+
+  SpMatFileHeader hdr;
+  std::memset(&hdr,0,sizeof(hdr));
+  std::memcpy(hdr.magic,SpMatFileHeader::Magic(),8);
+  hdr.version = SpMatFileHeader::CurrentVersion;
+  hdr.precision = sizeof(T);
+  hdr.m = _m; hdr.n = _n; hdr.nz = _nz;
+
+  std::vector<uint64_t> colptr(_n+1,0);
+  for (unsigned int c=0; c<_n; c++) colptr[c+1] = colptr[c] + _ri[c].size();
+  if (colptr[_n] != _nz) throw SpMatException("SaveBinary: Matrix internally inconsistent");
+  const char pad[8] = {0,0,0,0,0,0,0,0};
+  uint64_t   ripad = SpMatFileHeader::padded(_nz*sizeof(uint32_t)) - _nz*sizeof(uint32_t);
+  uint64_t   valpad = SpMatFileHeader::padded(_nz*sizeof(T)) - _nz*sizeof(T);
+
+  // Checksum is calculated in the same order as data is written
+  uint64_t cs = spmat_file_checksum(colptr.data(),colptr.size()*sizeof(uint64_t));
+  for (unsigned int c=0; c<_n; c++) if (_ri[c].size()) cs = spmat_file_checksum(_ri[c].data(),_ri[c].size()*sizeof(uint32_t),cs);
+  cs = spmat_file_checksum(pad,ripad,cs);
+  for (unsigned int c=0; c<_n; c++) if (_val[c].size()) cs = spmat_file_checksum(_val[c].data(),_val[c].size()*sizeof(T),cs);
+  cs = spmat_file_checksum(pad,valpad,cs);
+  hdr.checksum = cs;
+
+  std::ofstream fs(fname.c_str(),std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!fs) throw SpMatException("SaveBinary: Failed to open file " + fname);
+  fs.write(reinterpret_cast<const char *>(&hdr),sizeof(hdr));
+  fs.write(reinterpret_cast<const char *>(colptr.data()),colptr.size()*sizeof(uint64_t));
+  for (unsigned int c=0; c<_n; c++) if (_ri[c].size()) fs.write(reinterpret_cast<const char *>(_ri[c].data()),_ri[c].size()*sizeof(uint32_t));
+  fs.write(pad,ripad);
+  for (unsigned int c=0; c<_n; c++) if (_val[c].size()) fs.write(reinterpret_cast<const char *>(_val[c].data()),_val[c].size()*sizeof(T));
+  fs.write(pad,valpad);
+  if (!fs) throw SpMatException("SaveBinary: Failed to write to file " + fname);
+}
+
 /////////////////////////////////////////////////////////////////////
 //
 // Prints matrix in a row col val format that is useful for
@@ -644,7 +825,11 @@ NEWMAT::ReturnMatrix SpMat<T>::SolveForx(const NEWMAT::ColumnVector&
 
   switch (type) {
   case SYM_POSDEF:
-    status = CG(*this,x,b,*M,liter,tol);
+    if (const DiagPrecond<T> *dM = dynamic_cast<const DiagPrecond<T> *>(M.get())) {
+      if (_mps) status = this->mixed_precision_cg(b,dM->Diag(),x,liter,tol);
+      else status = this->pipelined_cg(b,dM->Diag(),x,liter,tol);
+    }
+    else status = CG(*this,x,b,*M,liter,tol);
     break;
   case SYM:
   case ASYM:
@@ -665,6 +850,219 @@ NEWMAT::ReturnMatrix SpMat<T>::SolveForx(const NEWMAT::ColumnVector&
   return(x);
 }
 
+/////////////////////////////////////////////////////////////////////
+//
+// Pipelined, diagonally preconditioned, conjugate gradient for
+// symmetric positive definite matrices. It follows Ghysels &
+// Vanroose (Parallel Computing, 2014) and rearranges the recursions
+// so that all dot-products of one iteration can be calculated in a
+// single sweep, together with the matrix-vector multiplication and
+// the vector updates. The vectors are partitioned between a team of
+// threads that lives for the duration of the solve, and the threads
+// only synchronise once per iteration.
+// Since the matrix is assumed symmetric the matrix-vector product
+// is calculated as (*this)'*x, which means that each thread writes
+// only to its own elements and no per-thread copies are needed.
+// The convention for miter and tol on return is the same as for CG.
+//
+/////////////////////////////////////////////////////////////////////
+
+template<class T>
+int SpMat<T>::pipelined_cg(// Input
+			   const NEWMAT::ColumnVector&  b,
+			   const std::vector<T>&        diag,
+			   // Input/Output
+			   NEWMAT::ColumnVector&        x,
+			   int&                         miter,
+			   double&                      tol) const
+{
+  if (diag.size() != _n) throw SpMatException("pipelined_cg: Size mismatch between matrix and preconditioner");
+
+  unsigned int nt = std::max(1u,std::min(_nt,_n));
+  std::vector<unsigned int> rng(nt+1,0);
+  if (nt == _nt) rng = this->columns_per_thread();
+  else rng[1] = _n;
+  PipelinedCGWorkspace<double> ws(_n,nt,rng);
+  for (unsigned int i=0; i<_n; i++) ws.iM[i] = 1.0 / static_cast<double>(diag[i]);
+  ws.bp = static_cast<const double *>(b.Store());
+  ws.xp = static_cast<double *>(x.Store());
+  double normb = 0.0;
+  for (unsigned int i=0; i<_n; i++) normb += ws.bp[i]*ws.bp[i];
+  ws.normb = (normb == 0.0) ? 1.0 : std::sqrt(normb);
+  ws.tol = tol;
+  ws.miter = miter;
+
+  this->run_pipelined_cg(ws);
+
+  miter = ws.niter;
+  tol = ws.resid;
+  return(ws.status);
+}
+
+/////////////////////////////////////////////////////////////////////
+//
+// Mixed precision solver for symmetric positive definite matrices.
+// The inner solves are performed by pipelined_cg with single
+// precision vectors, which halves the memory traffic of each
+// iteration. Each inner solve is on the (scaled) residual, which is
+// calculated in double precision, and the correction is accumulated
+// into x in double precision (iterative refinement). This means that
+// tol can be reached even when it is below what single precision CG
+// can achieve on its own. Iterations of the inner solves count
+// towards miter.
+//
+/////////////////////////////////////////////////////////////////////
+
+template<class T>
+int SpMat<T>::mixed_precision_cg(// Input
+				 const NEWMAT::ColumnVector&  b,
+				 const std::vector<T>&        diag,
+				 // Input/Output
+				 NEWMAT::ColumnVector&        x,
+				 int&                         miter,
+				 double&                      tol) const
+{
+  if (diag.size() != _n) throw SpMatException("mixed_precision_cg: Size mismatch between matrix and preconditioner");
+
+  const double inner_tol = 1e-4;     // Relative reduction of residual attempted in single precision
+  const int    max_refine = 20;      // Max # of refinement steps
+
+  unsigned int nt = std::max(1u,std::min(_nt,_n));
+  std::vector<unsigned int> rng(nt+1,0);
+  if (nt == _nt) rng = this->columns_per_thread();
+  else rng[1] = _n;
+  std::vector<float> iM(_n);
+  for (unsigned int i=0; i<_n; i++) iM[i] = static_cast<float>(1.0 / static_cast<double>(diag[i]));
+
+  double normb = b.NormFrobenius();
+  if (normb == 0.0) normb = 1.0;
+  NEWMAT::ColumnVector r = b - (*this)*x;
+  double normr = r.NormFrobenius();
+  double resid = normr / normb;
+  std::vector<float> fr(_n), fd(_n);
+  int niter = 0;
+  for (int refine=0; refine<max_refine && resid > tol && niter < miter; refine++) {
+    // Solve A*d = r/|r| in single precision
+    const double *rp = static_cast<const double *>(r.Store());
+    for (unsigned int i=0; i<_n; i++) { fr[i] = static_cast<float>(rp[i]/normr); fd[i] = 0.0f; }
+    PipelinedCGWorkspace<float> ws(_n,nt,rng);
+    ws.iM = iM;
+    ws.bp = fr.data();
+    ws.xp = fd.data();
+    ws.normb = 1.0;
+    ws.tol = std::min(0.5,std::max(inner_tol,tol/resid));
+    ws.miter = miter - niter;
+    this->run_pipelined_cg(ws);
+    niter += ws.niter;
+    // Update x and the residual in double precision
+    double *xp = static_cast<double *>(x.Store());
+    for (unsigned int i=0; i<_n; i++) xp[i] += normr * static_cast<double>(fd[i]);
+    r = b - (*this)*x;
+    double new_normr = r.NormFrobenius();
+    if (!ws.niter || !(new_normr < normr)) { resid = new_normr / normb; break; } // Stagnation
+    normr = new_normr;
+    resid = normr / normb;
+  }
+  int status = (resid <= tol) ? 0 : 1;
+  miter = niter;
+  tol = resid;
+  return(status);
+}
+
+/////////////////////////////////////////////////////////////////////
+//
+// Runs pipelined_cg_helper on a team of ws.nt threads (including
+// the calling thread).
+//
+/////////////////////////////////////////////////////////////////////
+
+template<class T>
+template<class V>
+void SpMat<T>::run_pipelined_cg(PipelinedCGWorkspace<V>& ws) const
+{
+  std::vector<std::thread> threads(ws.nt-1); // + main thread makes nt
+  for (unsigned int i=0; i<ws.nt-1; i++) {
+    threads[i] = std::thread(&SpMat<T>::template pipelined_cg_helper<V>,this,i+1,std::ref(ws));
+  }
+  this->pipelined_cg_helper(0,ws);
+  std::for_each(threads.begin(),threads.end(),std::mem_fn(&std::thread::join));
+}
+
+template<class T>
+template<class V>
+void SpMat<T>::pipelined_cg_helper(unsigned int             tid,
+				   PipelinedCGWorkspace<V>& ws) const
+{
+  const unsigned int first = ws.first[tid];
+  const unsigned int last = ws.first[tid+1];
+  const V            *iM = ws.iM.data();
+  V                  *x = ws.xp;
+  V                  *r = ws.r.data(); V *u = ws.u.data(); V *w = ws.w.data();
+  V                  *z = ws.z.data(); V *q = ws.q.data(); V *s = ws.s.data(); V *p = ws.p.data();
+  V                  *mc = ws.m0.data(); V *mn = ws.m1.data();
+  double             *pc = ws.part0.data(); double *pn = ws.part1.data();
+
+  // r = b - A*x, u = M\r
+  for (unsigned int c=first; c<last; c++) {
+    r[c] = ws.bp[c] - sym_row_times_vec(c,x);
+    u[c] = iM[c]*r[c];
+  }
+  ws.barrier.Wait();
+  // w = A*u, m = M\w and first set of dot-products
+  double gamma=0.0, delta=0.0, rr=0.0;
+  for (unsigned int c=first; c<last; c++) {
+    w[c] = sym_row_times_vec(c,u);
+    mc[c] = iM[c]*w[c];
+    gamma += r[c]*u[c]; delta += w[c]*u[c]; rr += r[c]*r[c];
+  }
+  pc[3*tid] = gamma; pc[3*tid+1] = delta; pc[3*tid+2] = rr;
+  ws.barrier.Wait();
+
+  double alpha_old = 1.0, gamma_old = 1.0;
+  for (int i=0; ; i++) {
+    // Global reduction. All threads do it, in the same order, so all reach the same decision.
+    double g_gamma=0.0, g_delta=0.0, g_rr=0.0;
+    for (unsigned int t=0; t<ws.nt; t++) { g_gamma += pc[3*t]; g_delta += pc[3*t+1]; g_rr += pc[3*t+2]; }
+    double resid = std::sqrt(g_rr) / ws.normb;
+    double alpha = 0.0, beta = 0.0;
+    if (i) {
+      beta = g_gamma / gamma_old;
+      alpha = g_gamma / (g_delta - beta*g_gamma/alpha_old);
+    }
+    else alpha = g_gamma / g_delta;
+    if (resid <= ws.tol || i >= ws.miter || !std::isfinite(alpha) || !std::isfinite(beta)) {
+      if (tid == 0) {
+	ws.resid = resid;
+	ws.niter = (resid <= ws.tol) ? i : ws.miter;
+	ws.status = (resid <= ws.tol) ? 0 : 1;
+      }
+      return;
+    }
+    // Fused matrix-vector multiplication (n=A*m), vector updates and partial dot-products
+    gamma = delta = rr = 0.0;
+    const V va = static_cast<V>(alpha), vb = static_cast<V>(beta);
+    for (unsigned int c=first; c<last; c++) {
+      V n = sym_row_times_vec(c,mc);
+      z[c] = n + vb*z[c];
+      q[c] = mc[c] + vb*q[c];
+      s[c] = w[c] + vb*s[c];
+      p[c] = u[c] + vb*p[c];
+      x[c] += va*p[c];
+      r[c] -= va*s[c];
+      u[c] -= va*q[c];
+      w[c] -= va*z[c];
+      mn[c] = iM[c]*w[c];
+      gamma += r[c]*u[c]; delta += w[c]*u[c]; rr += r[c]*r[c];
+    }
+    pn[3*tid] = gamma; pn[3*tid+1] = delta; pn[3*tid+2] = rr;
+    std::swap(mc,mn);
+    std::swap(pc,pn);
+    alpha_old = alpha;
+    gamma_old = g_gamma;
+    ws.barrier.Wait();
+  }
+}
+
 /////////////////////////////////////////////////////////////////////
 //
 // Returns a sparse matrix that is the transpose of *this
@@ -699,6 +1097,179 @@ const SpMat<T> SpMat<T>::t() const
   return(t_mat);
 }
 
+/////////////////////////////////////////////////////////////////////
+//
+// Returns a Reverse Cuthill-McKee ordering of the rows/columns of
+// a square, structurally symmetric, matrix. The returned vector is
+// such that perm[i] is the (zero-offset) index of the row/column in
+// *this that should be moved to position i. Each connected component
+// is started from a pseudo-peripheral node found by repeated breadth
+// first searches, as suggested by George and Liu.
+//
+/////////////////////////////////////////////////////////////////////
+
+template<class T>
+std::vector<unsigned int> SpMat<T>::RCMPermutation() const
+{
+  if (_m != _n) throw SpMatException("RCMPermutation: Matrix must be square");
+  std::vector<unsigned int> perm; perm.reserve(_n);
+  std::vector<unsigned int> level(_n,0);      // Used for finding pseudo-peripheral nodes
+  std::vector<unsigned int> mark(_n,0);      // Ditto
+  unsigned int              stamp = 0;
+  std::vector<char>         visited(_n,0);
+  std::vector<unsigned int> nbrs;
+
+  for (unsigned int seed=0; seed<_n; seed++) {
+    if (visited[seed]) continue;
+    // Find (approximately) peripheral start node for this component
+    unsigned int start = seed;
+    unsigned int depth = 0;
+    for (unsigned int sweep=0; sweep<5; sweep++) {
+      std::vector<unsigned int> bfs(1,start);
+      stamp++;
+      level[start] = 0; mark[start] = stamp;
+      for (unsigned int i=0; i<bfs.size(); i++) {
+        unsigned int c = bfs[i];
+        for (unsigned int j=0; j<_ri[c].size(); j++) {
+          unsigned int r = _ri[c][j];
+          if (mark[r] != stamp && !visited[r]) { mark[r] = stamp; level[r] = level[c]+1; bfs.push_back(r); }
+        }
+      }
+      unsigned int last = bfs.back();
+      unsigned int cand = last;        // Min degree node in last level
+      for (int i=int(bfs.size())-1; i>=0 && level[bfs[i]]==level[last]; i--) {
+        if (_ri[bfs[i]].size() < _ri[cand].size()) cand = bfs[i];
+      }
+      if (sweep && level[last] <= depth) break;
+      depth = level[last];
+      start = cand;
+    }
+    // Cuthill-McKee from start, neighbours visited in order of increasing degree
+    unsigned int first = perm.size();
+    perm.push_back(start); visited[start] = 1;
+    for (unsigned int i=first; i<perm.size(); i++) {
+      unsigned int c = perm[i];
+      nbrs.clear();
+      for (unsigned int j=0; j<_ri[c].size(); j++) {
+        if (!visited[_ri[c][j]]) { visited[_ri[c][j]] = 1; nbrs.push_back(_ri[c][j]); }
+      }
+      std::stable_sort(nbrs.begin(),nbrs.end(),[this](unsigned int a, unsigned int b){ return(_ri[a].size() < _ri[b].size()); });
+      perm.insert(perm.end(),nbrs.begin(),nbrs.end());
+    }
+  }
+  std::reverse(perm.begin(),perm.end());
+  return(perm);
+}
+
+/////////////////////////////////////////////////////////////////////
+//
+// Returns P*(*this)*P', i.e. a symmetric permutation of rows and
+// columns where perm[i] is the row/column of *this that becomes
+// row/column i in the returned matrix.
+//
+/////////////////////////////////////////////////////////////////////
+
+template<class T>
+SpMat<T> SpMat<T>::SymmetricPermute(const std::vector<unsigned int>& perm) const
+{
+  if (_m != _n) throw SpMatException("SymmetricPermute: Matrix must be square");
+  if (perm.size() != _n) throw SpMatException("SymmetricPermute: Permutation vector has wrong size");
+  std::vector<unsigned int> iperm(_n,_n);
+  for (unsigned int i=0; i<_n; i++) {
+    if (perm[i] >= _n || iperm[perm[i]] != _n) throw SpMatException("SymmetricPermute: Invalid permutation vector");
+    iperm[perm[i]] = i;
+  }
+  SpMat<T> pmat(_n,_n,Utilities::NoOfThreads(_nt));
+  std::vector<std::pair<unsigned int,T> > col;
+  for (unsigned int c=0; c<_n; c++) {
+    const std::vector<unsigned int>& ri = _ri[perm[c]];
+    const std::vector<T>&            val = _val[perm[c]];
+    col.resize(ri.size());
+    for (unsigned int j=0; j<ri.size(); j++) col[j] = std::make_pair(iperm[ri[j]],val[j]);
+    std::sort(col.begin(),col.end(),[](const std::pair<unsigned int,T>& a, const std::pair<unsigned int,T>& b){ return(a.first < b.first); });
+    pmat._ri[c].resize(col.size());
+    pmat._val[c].resize(col.size());
+    for (unsigned int j=0; j<col.size(); j++) { pmat._ri[c][j] = col[j].first; pmat._val[c][j] = col[j].second; }
+  }
+  pmat._nz = _nz;
+  pmat._pw = _pw;
+  pmat._mps = _mps;
+
+  return(pmat);
+}
+
+/////////////////////////////////////////////////////////////////////
+//
+// Does the same as SymmetricPermute, but instead of returning a new
+// matrix it overwrites the values of pmat, which must already have
+// the sparsity of P*(*this)*P' (e.g. because it was returned by
+// SymmetricPermute(perm) for a matrix with the same sparsity as
+// *this). This saves the sorting and the allocation of a new
+// matrix when only the values have changed. Returns false if pmat
+// does not have the right sparsity, in which case its values are
+// undefined.
+//
+/////////////////////////////////////////////////////////////////////
+
+template<class T>
+bool SpMat<T>::SymmetricPermuteValues(const std::vector<unsigned int>& perm,
+                                      SpMat<T>&                        pmat) const
+{
+  if (_m != _n) throw SpMatException("SymmetricPermuteValues: Matrix must be square");
+  if (perm.size() != _n) throw SpMatException("SymmetricPermuteValues: Permutation vector has wrong size");
+  if (pmat._m != _m || pmat._n != _n || pmat._nz != _nz) return(false);
+  std::vector<unsigned int> iperm(_n,_n);
+  for (unsigned int i=0; i<_n; i++) {
+    if (perm[i] >= _n || iperm[perm[i]] != _n) throw SpMatException("SymmetricPermuteValues: Invalid permutation vector");
+    iperm[perm[i]] = i;
+  }
+  for (unsigned int c=0; c<_n; c++) {
+    const std::vector<unsigned int>& ri = _ri[perm[c]];
+    const std::vector<T>&            val = _val[perm[c]];
+    const std::vector<unsigned int>& pri = pmat._ri[c];
+    if (pri.size() != ri.size()) return(false);
+    for (unsigned int j=0; j<ri.size(); j++) {
+      std::vector<unsigned int>::const_iterator it = std::lower_bound(pri.begin(),pri.end(),iperm[ri[j]]);
+      if (it == pri.end() || *it != iperm[ri[j]]) return(false);
+      pmat._val[c][it-pri.begin()] = val[j];
+    }
+  }
+  pmat._pw = _pw;
+  pmat._mps = _mps;
+  pmat._nt = _nt;
+
+  return(true);
+}
+
+// FNV-1a style hash (one word at the time) of the size and of the
+// row-indicies of all columns
+
+template<class T>
+uint64_t SpMat<T>::StructureHash() const
+{
+  uint64_t h = 14695981039346656037ULL;
+  auto add = [&h](uint64_t v) { h ^= v; h *= 1099511628211ULL; };
+  add(_m); add(_n); add(_nz);
+  for (unsigned int c=0; c<_n; c++) {
+    add(_ri[c].size());
+    for (unsigned int j=0; j<_ri[c].size(); j++) add(_ri[c][j]);
+  }
+  return(h);
+}
+
+template<class T>
+unsigned int SpMat<T>::Bandwidth() const
+{
+  unsigned int bw = 0;
+  for (unsigned int c=0; c<_n; c++) {
+    if (_ri[c].size()) {
+      bw = std::max(bw,(c > _ri[c].front()) ? c-_ri[c].front() : _ri[c].front()-c);
+      bw = std::max(bw,(c > _ri[c].back()) ? c-_ri[c].back() : _ri[c].back()-c);
+    }
+  }
+  return(bw);
+}
+
 /////////////////////////////////////////////////////////////////////
 //
 // Takes a row- or column-vector with as many elements as there are
@@ -1323,6 +1894,41 @@ const std::vector<T>& SpMat<T>::get_val(unsigned int i) const
 ##
 ###################################################################*/
 
+/////////////////////////////////////////////////////////////////////
+//
+// Reads matrix from binary file. The file is mapped and then
+// copied column by column into *this. If the precision of the
+// file is different from T the values are converted.
+//
+/////////////////////////////////////////////////////////////////////
+
+template<class T>
+void SpMat<T>::read_binary(const std::string& fname)
+{
+  std::ifstream fs(fname.c_str(),std::ios::in | std::ios::binary);
+  SpMatFileHeader hdr;
+  if (!fs.read(reinterpret_cast<char *>(&hdr),sizeof(hdr))) throw SpMatException("read_binary: Cannot read header of " + fname);
+  fs.close();
+  if (hdr.precision == sizeof(T)) *this = SpMat<T>(MappedSpMat<T>(fname,true),Utilities::NoOfThreads(_nt));
+  else if (hdr.precision == sizeof(float)) {
+    MappedSpMat<float> M(fname,true);
+    _m = M.Nrows(); _n = M.Ncols(); _nz = M.NZ(); _ri.resize(_n); _val.resize(_n);
+    for (unsigned int c=0; c<_n; c++) {
+      _ri[c].assign(M.Rowind()+M.Colptr()[c],M.Rowind()+M.Colptr()[c+1]);
+      _val[c].assign(M.Val()+M.Colptr()[c],M.Val()+M.Colptr()[c+1]);
+    }
+  }
+  else if (hdr.precision == sizeof(double)) {
+    MappedSpMat<double> M(fname,true);
+    _m = M.Nrows(); _n = M.Ncols(); _nz = M.NZ(); _ri.resize(_n); _val.resize(_n);
+    for (unsigned int c=0; c<_n; c++) {
+      _ri[c].assign(M.Rowind()+M.Colptr()[c],M.Rowind()+M.Colptr()[c+1]);
+      _val[c].assign(M.Val()+M.Colptr()[c],M.Val()+M.Colptr()[c+1]);
+    }
+  }
+  else throw SpMatException("read_binary: Unknown precision in " + fname);
+}
+
 /////////////////////////////////////////////////////////////////////
 //
 // Binary search. Returns true if key already exists. pos contains
@@ -116,12 +116,24 @@ namespace NEWIMAGE {
 	      DataEnd = d+nElements;
 	      data_owner = d_owner;
       } else {
-	      try {
-	        Data = new T[nElements];
-	        DataEnd = Data+nElements;
-	      } catch(...) { Data=nullptr; DataEnd=nullptr;}
-	      if (Data==nullptr) { imthrow("Out of memory",99); }
-	      data_owner = true;
+	      std::shared_ptr<VolumeDataPool> pool = datapool ? datapool : VolumeDataPool::Current();
+	      if (pool && std::is_trivial<T>::value) {  // Pooled blocks are never constructed
+	        try {
+	          data_keeper = pool->Allocate(nElements*sizeof(T));
+	          Data = static_cast<T*>(data_keeper.get());
+	          DataEnd = Data+nElements;
+	        } catch(...) { Data=nullptr; DataEnd=nullptr;}
+	        if (Data==nullptr) { imthrow("Out of memory",99); }
+	        data_owner = false;  // data_keeper gives it back to the pool
+	      }
+	      else {
+	        try {
+	          Data = new T[nElements];
+	          DataEnd = Data+nElements;
+	        } catch(...) { Data=nullptr; DataEnd=nullptr;}
+	        if (Data==nullptr) { imthrow("Out of memory",99); }
+	        data_owner = true;
+	      }
       }
     }
     setdefaultproperties();
@@ -234,6 +246,7 @@ namespace NEWIMAGE {
   void volume<T>::destroy()
   {
     if ( data_owner && Data != nullptr ) delete [] Data;
+    data_keeper.reset();
     Data = nullptr;
     DataEnd = nullptr;
     data_owner=false;
@@ -304,7 +317,7 @@ namespace NEWIMAGE {
       imthrow("Attempted to copydata with non-matching sizes",2);
     }
     copy(source.Data, source.Data + nElements, nsfbegin());  // use the STL
-    data_owner = isOwner;
+    data_owner = isOwner && !data_keeper;  // Data held by data_keeper (pool or mapping) is never ours to delete
     return 0;
   }
 
@@ -1116,7 +1129,7 @@ namespace NEWIMAGE {
 
 
   template<class T>
-  void volume<T>::forcesplinecoefcalculation() const
+  void volume<T>::forcesplinecoefcalculation(Utilities::NoOfThreads nthr) const
   {
     this->throwsIfNot3D();
     std::vector<unsigned int>  dim(3,0);
@@ -1125,7 +1138,35 @@ namespace NEWIMAGE {
     dim[2] = static_cast<unsigned int>(zsize());
     std::vector<SPLINTERPOLATOR::ExtrapolationType>  ep(3,SPLINTERPOLATOR::Mirror);
     for (unsigned int i=0; i<3; i++) ep[i] = translate_extrapolation_type(getextrapolationmethod());
-    splint = SPLINTERPOLATOR::Splinterpolator<T> (this->fbegin(),dim,ep,getsplineorder(),false,Utilities::NoOfThreads(this->nthreads()));
+    splint = SPLINTERPOLATOR::Splinterpolator<T> (this->fbegin(),dim,ep,getsplineorder(),false,nthr);
+    splineuptodate = splint.Valid();
+  }
+
+  template<class T>
+  const T *volume<T>::splinecoefficients(Utilities::NoOfThreads nthr) const
+  {
+    extrapolation ep = getextrapolationmethod();
+    if (!splint.Valid() || !splineuptodate || translate_extrapolation_type(ep) != splint.Extrapolation(0)) {
+      std::lock_guard<std::mutex> lg(splinecoef_mutex);
+      if (!splint.Valid() || !splineuptodate || translate_extrapolation_type(ep) != splint.Extrapolation(0)) {
+	forcesplinecoefcalculation(nthr);
+      }
+    }
+    return(splint.CoefPtr());
+  }
+
+  template<class T>
+  void volume<T>::adoptsplinecoefficients(const T *coef) const
+  {
+    this->throwsIfNot3D();
+    if (!coef) imthrow("adoptsplinecoefficients: zero coefficient pointer",10);
+    std::vector<unsigned int>  dim(3,0);
+    dim[0] = static_cast<unsigned int>(xsize());
+    dim[1] = static_cast<unsigned int>(ysize());
+    dim[2] = static_cast<unsigned int>(zsize());
+    std::vector<SPLINTERPOLATOR::ExtrapolationType>  ep(3,translate_extrapolation_type(getextrapolationmethod()));
+    std::lock_guard<std::mutex> lg(splinecoef_mutex);
+    splint.SetCoef(coef,dim,ep,getsplineorder());
     splineuptodate = splint.Valid();
   }
 
@@ -0,0 +1,86 @@
+// Definitions for a pool of aligned memory blocks for volume data
+//
+// volumepool.cc
+//
+/*  CCOPYRIGHT  */
+
+#include <cstdlib>
+#include <new>
+#include "volumepool.h"
+
+namespace NEWIMAGE {
+
+thread_local std::shared_ptr<VolumeDataPool> VolumeDataPool::_current;
+
+std::shared_ptr<VolumeDataPool> VolumeDataPool::Create(size_t maxretained)
+{
+  return(std::shared_ptr<VolumeDataPool>(new VolumeDataPool(maxretained)));
+}
+
+VolumeDataPool::~VolumeDataPool()
+{
+  Trim();
+}
+
+// Small blocks are rounded up to a multiple of the alignment. Larger
+// ones to a multiple of a quarter of the largest power of two that
+// is not larger than the request.
+
+size_t VolumeDataPool::SizeClass(size_t nbytes)
+{
+  if (nbytes <= 4096) return(((nbytes+Alignment-1)/Alignment)*Alignment);
+  size_t pow2 = 4096;
+  while (2*pow2 <= nbytes) pow2 *= 2;
+  size_t step = pow2 / 4;
+  return(((nbytes+step-1)/step)*step);
+}
+
+std::shared_ptr<void> VolumeDataPool::Allocate(size_t nbytes)
+{
+  size_t csz = SizeClass(nbytes ? nbytes : 1);
+  void *blk = nullptr;
+  {
+    std::lock_guard<std::mutex> lg(_mtx);
+    auto it = _free.find(csz);
+    if (it != _free.end() && it->second.size()) {
+      blk = it->second.back();
+      it->second.pop_back();
+      _nret -= csz;
+      _nhit++;
+    }
+    else _nmiss++;
+  }
+  if (!blk && posix_memalign(&blk,Alignment,csz)) throw std::bad_alloc();
+  // The deleter only holds a weak pointer, so blocks that outlive the pool are simply freed
+  std::weak_ptr<VolumeDataPool> wpool = shared_from_this();
+  return(std::shared_ptr<void>(blk,[wpool,csz](void *p) {
+	std::shared_ptr<VolumeDataPool> pool = wpool.lock();
+	if (pool) pool->release(p,csz);
+	else std::free(p);
+      }));
+}
+
+void VolumeDataPool::release(void *blk, size_t csz)
+{
+  {
+    std::lock_guard<std::mutex> lg(_mtx);
+    if (_nret + csz <= _maxret) {
+      _free[csz].push_back(blk);
+      _nret += csz;
+      return;
+    }
+  }
+  std::free(blk);
+}
+
+void VolumeDataPool::Trim()
+{
+  std::lock_guard<std::mutex> lg(_mtx);
+  for (auto it=_free.begin(); it!=_free.end(); ++it) {
+    for (unsigned int i=0; i<it->second.size(); i++) std::free(it->second[i]);
+  }
+  _free.clear();
+  _nret = 0;
+}
+
+} // End namespace NEWIMAGE
@@ -0,0 +1,299 @@
+// Definitions of classes for real-to-complex 3D FFTs
+//
+// realfft3.cc
+//
+/*  CCOPYRIGHT  */
+
+#include <cmath>
+#include <thread>
+#include <algorithm>
+#include <functional>
+#include "realfft3.h"
+
+namespace NEWIMAGE {
+
+typedef std::complex<double> cd;
+
+namespace {
+
+std::shared_ptr<const RealFFT3Backend>  current_backend;
+std::mutex                              backend_mtx;
+
+// Calls func(first,last) for nthr contiguous parts of [0,n), each in its own thread
+void in_slabs(unsigned int n, Utilities::NoOfThreads nthr, const std::function<void(unsigned int, unsigned int)>& func)
+{
+  unsigned int nt = static_cast<unsigned int>(std::max(int64_t(1),std::min(nthr._n,int64_t(n))));
+  if (nt < 2) { func(0,n); return; }
+  std::vector<std::thread> threads(nt-1); // + main thread makes nt
+  for (unsigned int t=0; t<nt-1; t++) {
+    threads[t] = std::thread(func,(t*n)/nt,((t+1)*n)/nt);
+  }
+  func(((nt-1)*n)/nt,n);
+  std::for_each(threads.begin(),threads.end(),std::mem_fn(&std::thread::join));
+}
+
+} // End anonymous namespace
+
+void SetRealFFT3Backend(std::shared_ptr<const RealFFT3Backend> backend)
+{
+  std::lock_guard<std::mutex> lg(backend_mtx);
+  current_backend = backend;
+}
+
+std::shared_ptr<const RealFFT3Backend> GetRealFFT3Backend()
+{
+  std::lock_guard<std::mutex> lg(backend_mtx);
+  if (!current_backend) current_backend = std::make_shared<const BuiltinRealFFT3>();
+  return(current_backend);
+}
+
+/////////////////////////////////////////////////////////////////////
+//
+// Member functions for class FFT1DPlan. The algorithm is a recursive
+// decimation in time, with one (radix,length) pair per level.
+//
+/////////////////////////////////////////////////////////////////////
+
+FFT1DPlan::FFT1DPlan(unsigned int n) : _n(n), _tw(n)
+{
+  if (!n) throw RealFFT3Exception("FFT1DPlan: Zero length FFT");
+  for (unsigned int i=0; i<n; i++) _tw[i] = std::polar(1.0,-2.0*M_PI*double(i)/double(n));
+  unsigned int p=4, m=n;
+  do {
+    while (m % p) {
+      switch (p) {
+      case 4: p = 2; break;
+      case 2: p = 3; break;
+      default: p += 2; break;
+      }
+      if (p*p > m) p = m;  // No more factors
+    }
+    m /= p;
+    _fac.push_back(p);
+    _fac.push_back(m);
+  } while (m > 1);
+}
+
+void FFT1DPlan::Forward(const cd *in, unsigned int istride, cd *out) const
+{
+  if (_n == 1) { out[0] = in[0]; return; }
+  work(out,in,1,istride,&(_fac[0]));
+}
+
+void FFT1DPlan::work(cd *out, const cd *f, unsigned int fstride, unsigned int istride, const unsigned int *fac) const
+{
+  const unsigned int p = fac[0];
+  const unsigned int m = fac[1];
+  cd *out_beg = out;
+  const cd *out_end = out + p*m;
+  if (m == 1) {
+    do { *out = *f; f += fstride*istride; } while (++out != out_end);
+  }
+  else {
+    do { work(out,f,fstride*p,istride,fac+2); f += fstride*istride; } while ((out += m) != out_end);
+  }
+  out = out_beg;
+  switch (p) {
+  case 2: bfly2(out,fstride,m); break;
+  case 4: bfly4(out,fstride,m); break;
+  default: bflyg(out,fstride,m,p); break;
+  }
+}
+
+void FFT1DPlan::bfly2(cd *out, unsigned int fstride, unsigned int m) const
+{
+  for (unsigned int u=0; u<m; u++) {
+    cd t = out[u+m] * _tw[u*fstride];
+    out[u+m] = out[u] - t;
+    out[u] += t;
+  }
+}
+
+void FFT1DPlan::bfly4(cd *out, unsigned int fstride, unsigned int m) const
+{
+  for (unsigned int u=0; u<m; u++) {
+    cd s0 = out[u+m] * _tw[u*fstride];
+    cd s1 = out[u+2*m] * _tw[2*u*fstride];
+    cd s2 = out[u+3*m] * _tw[3*u*fstride];
+    cd s5 = out[u] - s1;
+    cd s0p1 = out[u] + s1;
+    cd s3 = s0 + s2;
+    cd s4 = s0 - s2;
+    out[u+2*m] = s0p1 - s3;
+    out[u] = s0p1 + s3;
+    out[u+m] = cd(s5.real()+s4.imag(),s5.imag()-s4.real());
+    out[u+3*m] = cd(s5.real()-s4.imag(),s5.imag()+s4.real());
+  }
+}
+
+void FFT1DPlan::bflyg(cd *out, unsigned int fstride, unsigned int m, unsigned int p) const
+{
+  std::vector<cd> scratch(p);
+  for (unsigned int u=0; u<m; u++) {
+    for (unsigned int q=0, k=u; q<p; q++, k+=m) scratch[q] = out[k];
+    for (unsigned int q1=0, k=u; q1<p; q1++, k+=m) {
+      unsigned int twi = 0;
+      cd sum = scratch[0];
+      for (unsigned int q=1; q<p; q++) {
+	twi += fstride*k;
+	if (twi >= _n) twi -= _n;
+	sum += scratch[q] * _tw[twi];
+      }
+      out[k] = sum;
+    }
+  }
+}
+
+/////////////////////////////////////////////////////////////////////
+//
+// Member functions for class BuiltinRealFFT3
+//
+/////////////////////////////////////////////////////////////////////
+
+std::shared_ptr<const FFT1DPlan> BuiltinRealFFT3::Plan(unsigned int n) const
+{
+  std::lock_guard<std::mutex> lg(_mtx);
+  std::shared_ptr<const FFT1DPlan>& plan = _plans[n];
+  if (!plan) plan = std::make_shared<const FFT1DPlan>(n);
+  return(plan);
+}
+
+void BuiltinRealFFT3::Forward(const float *in, cd *out, unsigned int nx, unsigned int ny, unsigned int nz,
+			      Utilities::NoOfThreads nthr) const
+{
+  unsigned int nh = nx/2 + 1;
+  unsigned int nrows = ny*nz;
+  std::shared_ptr<const FFT1DPlan> px = Plan(nx);
+  // x-direction, two real rows (r and r+1) in one complex transform
+  in_slabs((nrows+1)/2,nthr,[&](unsigned int first, unsigned int last) {
+      std::vector<cd> z(nx), Z(nx);
+      for (unsigned int pr=first; pr<last; pr++) {
+	unsigned int r = 2*pr;
+	bool two = (r+1 < nrows);
+	const float *a = in + size_t(r)*nx;
+	const float *b = two ? a + nx : nullptr;
+	for (unsigned int i=0; i<nx; i++) z[i] = cd(a[i], two ? b[i] : 0.0f);
+	px->Forward(&(z[0]),1,&(Z[0]));
+	cd *A = out + size_t(r)*nh;
+	cd *B = A + nh;
+	for (unsigned int k=0; k<nh; k++) {
+	  cd Zc = std::conj(Z[(nx-k)%nx]);
+	  A[k] = 0.5*(Z[k] + Zc);
+	  if (two) B[k] = cd(0.0,-0.5)*(Z[k] - Zc);
+	}
+      }
+    });
+  columns(out,nx,ny,nz,false,nthr);
+}
+
+void BuiltinRealFFT3::Inverse(cd *in, float *out, unsigned int nx, unsigned int ny, unsigned int nz,
+			      Utilities::NoOfThreads nthr) const
+{
+  unsigned int nh = nx/2 + 1;
+  unsigned int nrows = ny*nz;
+  double scale = 1.0 / (double(nx)*double(ny)*double(nz));
+  columns(in,nx,ny,nz,true,nthr);
+  std::shared_ptr<const FFT1DPlan> px = Plan(nx);
+  // x-direction. The full spectra of rows r and r+1 are A and B, with the
+  // missing halves given by Hermitian symmetry, and they are transformed
+  // as conj(A+iB), which gives conj(a+ib) as a result.
+  in_slabs((nrows+1)/2,nthr,[&](unsigned int first, unsigned int last) {
+      std::vector<cd> z(nx), Z(nx);
+      for (unsigned int pr=first; pr<last; pr++) {
+	unsigned int r = 2*pr;
+	bool two = (r+1 < nrows);
+	const cd *A = in + size_t(r)*nh;
+	const cd *B = two ? A + nh : nullptr;
+	for (unsigned int k=0; k<nx; k++) {
+	  cd a, b;
+	  if (k < nh) { a = A[k]; b = two ? B[k] : cd(0.0,0.0); }
+	  else { a = std::conj(A[nx-k]); b = two ? std::conj(B[nx-k]) : cd(0.0,0.0); }
+	  if (k == 0 || 2*k == nx) { a = cd(a.real(),0.0); b = cd(b.real(),0.0); }  // Self conjugate points
+	  Z[k] = std::conj(a + cd(0.0,1.0)*b);
+	}
+	px->Forward(&(Z[0]),1,&(z[0]));
+	float *oa = out + size_t(r)*nx;
+	for (unsigned int i=0; i<nx; i++) oa[i] = static_cast<float>(scale*z[i].real());
+	if (two) {
+	  float *ob = oa + nx;
+	  for (unsigned int i=0; i<nx; i++) ob[i] = static_cast<float>(-scale*z[i].imag());
+	}
+      }
+    });
+}
+
+// Transforms the y- and z-directions of a half spectrum in place. The
+// inverse is calculated as conj(FFT(conj(f))), without scaling.
+
+void BuiltinRealFFT3::columns(cd *data, unsigned int nx, unsigned int ny, unsigned int nz, bool inverse,
+			      Utilities::NoOfThreads nthr) const
+{
+  unsigned int nh = nx/2 + 1;
+  std::shared_ptr<const FFT1DPlan> py = Plan(ny);
+  std::shared_ptr<const FFT1DPlan> pz = Plan(nz);
+  // y-direction, one z-plane at the time
+  if (ny > 1) {
+    in_slabs(nz,nthr,[&](unsigned int first, unsigned int last) {
+	std::vector<cd> col(ny), fcol(ny);
+	for (unsigned int k=first; k<last; k++) {
+	  cd *plane = data + size_t(k)*ny*nh;
+	  for (unsigned int i=0; i<nh; i++) {
+	    for (unsigned int j=0; j<ny; j++) col[j] = inverse ? std::conj(plane[j*nh+i]) : plane[j*nh+i];
+	    py->Forward(&(col[0]),1,&(fcol[0]));
+	    for (unsigned int j=0; j<ny; j++) plane[j*nh+i] = inverse ? std::conj(fcol[j]) : fcol[j];
+	  }
+	}
+      });
+  }
+  // z-direction, one y-row at the time
+  if (nz > 1) {
+    in_slabs(ny,nthr,[&](unsigned int first, unsigned int last) {
+	std::vector<cd> col(nz), fcol(nz);
+	size_t zstride = size_t(ny)*nh;
+	for (unsigned int j=first; j<last; j++) {
+	  for (unsigned int i=0; i<nh; i++) {
+	    cd *base = data + size_t(j)*nh + i;
+	    for (unsigned int k=0; k<nz; k++) col[k] = inverse ? std::conj(base[k*zstride]) : base[k*zstride];
+	    pz->Forward(&(col[0]),1,&(fcol[0]));
+	    for (unsigned int k=0; k<nz; k++) base[k*zstride] = inverse ? std::conj(fcol[k]) : fcol[k];
+	  }
+	}
+      });
+  }
+}
+
+/////////////////////////////////////////////////////////////////////
+//
+// Member functions for class SpectralTables
+//
+/////////////////////////////////////////////////////////////////////
+
+SpectralTables::SpectralTables(unsigned int nx, unsigned int ny, unsigned int nz)
+{
+  unsigned int n[3] = {nx, ny, nz};
+  for (unsigned int d=0; d<3; d++) {
+    _cm1[d].resize(n[d]);
+    _sin[d].resize(n[d]);
+    for (unsigned int k=0; k<n[d]; k++) {
+      double arg = 2.0*M_PI*double(k)/double(n[d]);
+      _cm1[d][k] = std::cos(arg) - 1.0;
+      _sin[d][k] = std::sin(arg);
+    }
+  }
+}
+
+std::shared_ptr<const SpectralTables> SpectralTables::Get(unsigned int nx, unsigned int ny, unsigned int nz)
+{
+  // The same few sizes are used over and over, so a small cache will do
+  static std::mutex                                                        mtx;
+  static std::vector<std::pair<std::vector<unsigned int>,std::shared_ptr<const SpectralTables> > >  cache;
+  std::vector<unsigned int> key = {nx, ny, nz};
+  std::lock_guard<std::mutex> lg(mtx);
+  for (unsigned int i=0; i<cache.size(); i++) if (cache[i].first == key) return(cache[i].second);
+  std::shared_ptr<const SpectralTables> tab(new SpectralTables(nx,ny,nz));
+  if (cache.size() >= 8) cache.erase(cache.begin());
+  cache.push_back(std::make_pair(key,tab));
+  return(tab);
+}
+
+} // End namespace NEWIMAGE
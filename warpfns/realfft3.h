@@ -0,0 +1,160 @@
+// Declarations of classes for real-to-complex 3D FFTs
+//
+// realfft3.h
+//
+// integrate_gradient_field (and hence constrain_topology) does
+// nine forward and three inverse 3D FFTs of real volumes for every
+// iteration. The classes here are used for those. RealFFT3Backend
+// is the interface, and the backend that is in use can be replaced
+// with SetRealFFT3Backend (e.g. by one built on FFTW where that is
+// available). The default backend is BuiltinRealFFT3, which is a
+// mixed radix FFT that keeps a cache of plans (factorisations and
+// twiddle factors) for the sizes it has seen, uses the fact that
+// the input is real to do half the work, and splits each pass over
+// several threads.
+//
+/*  CCOPYRIGHT  */
+
+#ifndef realfft3_h
+#define realfft3_h
+
+#include <complex>
+#include <vector>
+#include <string>
+#include <memory>
+#include <map>
+#include <mutex>
+#include "utils/threading.h"
+
+namespace NEWIMAGE {
+
+class RealFFT3Exception: public std::exception
+{
+private:
+  std::string m_msg;
+public:
+  RealFFT3Exception(const std::string& msg) noexcept: m_msg(std::string("RealFFT3:: msg=") + msg) {}
+  ~RealFFT3Exception() noexcept {}
+  virtual const char * what() const noexcept { return(m_msg.c_str()); }
+};
+
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+//
+// Class RealFFT3Backend:
+//
+// Forward() transforms a real nx*ny*nz volume (x fastest) into the
+// non-redundant half of its spectrum, which is (nx/2+1)*ny*nz
+// complex values (kx fastest). Inverse() goes the other way, and is
+// scaled such that Inverse(Forward(f)) = f. Inverse() is allowed to
+// overwrite its input. Implementations must be thread safe.
+//
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+
+class RealFFT3Backend
+{
+public:
+  virtual ~RealFFT3Backend() {}
+  virtual std::string Name() const = 0;
+  virtual void Forward(const float                *in,
+                       std::complex<double>       *out,
+                       unsigned int               nx,
+                       unsigned int               ny,
+                       unsigned int               nz,
+                       Utilities::NoOfThreads     nthr=Utilities::NoOfThreads(1)) const = 0;
+  virtual void Inverse(std::complex<double>       *in,
+                       float                      *out,
+                       unsigned int               nx,
+                       unsigned int               ny,
+                       unsigned int               nz,
+                       Utilities::NoOfThreads     nthr=Utilities::NoOfThreads(1)) const = 0;
+};
+
+// Backend used by integrate_gradient_field. Passing a null pointer reinstates the default.
+void SetRealFFT3Backend(std::shared_ptr<const RealFFT3Backend> backend);
+std::shared_ptr<const RealFFT3Backend> GetRealFFT3Backend();
+
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+//
+// Class FFT1DPlan:
+//
+// Factorisation and twiddle factors for a complex 1D FFT of a given
+// length. Radix 4 and 2 butterflies are explicit, other factors use
+// a generic butterfly, so lengths with only small prime factors are
+// the fast ones.
+//
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+
+class FFT1DPlan
+{
+public:
+  explicit FFT1DPlan(unsigned int n);
+  unsigned int N() const { return(_n); }
+  // Forward (unscaled) transform of in (read with stride istride) into out (contiguous)
+  void Forward(const std::complex<double> *in, unsigned int istride, std::complex<double> *out) const;
+private:
+  unsigned int                        _n;
+  std::vector<unsigned int>           _fac;   // Pairs of (radix, remaining length)
+  std::vector<std::complex<double> >  _tw;    // exp(-2*pi*i*k/n)
+
+  void work(std::complex<double> *out, const std::complex<double> *f, unsigned int fstride,
+            unsigned int istride, const unsigned int *fac) const;
+  void bfly2(std::complex<double> *out, unsigned int fstride, unsigned int m) const;
+  void bfly4(std::complex<double> *out, unsigned int fstride, unsigned int m) const;
+  void bflyg(std::complex<double> *out, unsigned int fstride, unsigned int m, unsigned int p) const;
+};
+
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+//
+// Class BuiltinRealFFT3:
+//
+// The x-direction is done with one complex FFT of length nx for two
+// rows at a time (the "two for the price of one" trick), and the y-
+// and z-directions only for the nx/2+1 non-redundant columns.
+//
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+
+class BuiltinRealFFT3 : public RealFFT3Backend
+{
+public:
+  BuiltinRealFFT3() {}
+  virtual ~BuiltinRealFFT3() {}
+  virtual std::string Name() const { return(std::string("builtin")); }
+  virtual void Forward(const float *in, std::complex<double> *out, unsigned int nx, unsigned int ny, unsigned int nz,
+                       Utilities::NoOfThreads nthr=Utilities::NoOfThreads(1)) const;
+  virtual void Inverse(std::complex<double> *in, float *out, unsigned int nx, unsigned int ny, unsigned int nz,
+                       Utilities::NoOfThreads nthr=Utilities::NoOfThreads(1)) const;
+  // Plans are created on first use and kept for the life of the object
+  std::shared_ptr<const FFT1DPlan> Plan(unsigned int n) const;
+private:
+  mutable std::map<unsigned int,std::shared_ptr<const FFT1DPlan> >  _plans;
+  mutable std::mutex                                               _mtx;
+
+  void columns(std::complex<double> *data, unsigned int nx, unsigned int ny, unsigned int nz,
+               bool inverse, Utilities::NoOfThreads nthr) const;
+};
+
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+//
+// Class SpectralTables:
+//
+// cos(2*pi*k/n)-1 and sin(2*pi*k/n) for the three directions of a
+// volume, i.e. what is needed for the finite difference operators
+// in the Fourier domain. Get() returns cached tables for a size.
+//
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+
+class SpectralTables
+{
+public:
+  static std::shared_ptr<const SpectralTables> Get(unsigned int nx, unsigned int ny, unsigned int nz);
+  const std::vector<double>& CosM1(unsigned int dir) const { return(_cm1[dir]); }
+  const std::vector<double>& Sin(unsigned int dir) const { return(_sin[dir]); }
+private:
+  SpectralTables(unsigned int nx, unsigned int ny, unsigned int nz);
+  std::vector<double>  _cm1[3];
+  std::vector<double>  _sin[3];
+};
+
+} // End namespace NEWIMAGE
+
+#endif // End #ifndef realfft3_h
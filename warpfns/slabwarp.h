@@ -0,0 +1,469 @@
+// Declarations and definitions of functions for resampling images
+// that are too large to be held in memory.
+//
+// slabwarp.h
+//
+// apply_warp_slabwise does the same thing as apply_warp, but reads
+// the input and the displacement field from file and writes the
+// output to file, one z-slab of the output at a time. For each
+// output slab it reads the slab of the displacement field that it
+// needs, calculates the coordinates in the input that will be
+// sampled and reads the slab of the input that covers those (plus
+// the interpolation neighbourhood). The peak memory use is hence
+// set by the slab size and by how much the warp "spreads" a slab,
+// rather than by the size of the images.
+// The files are kept open between slabs, and slices that are shared
+// by consecutive slabs are kept rather than read again, so each
+// volume is read (and if compressed decompressed) about once. For
+// a 4D input that means that the displacement field is read once
+// per volume.
+//
+/*  CCOPYRIGHT  */
+
+#ifndef slabwarp_h
+#define slabwarp_h
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <memory>
+#include <utility>
+#include "warpfns.h"                // First, since it sets EXPOSE_TREACHEROUS
+#include "armawrap/newmat.h"
+#include "NewNifti/NewNifti.h"
+#include "utils/threading.h"
+#include "newimage/newimageall.h"
+
+namespace SLABWARP_UTILS {
+
+// Reads z-slabs of an image from file. The file is opened once and
+// slices that were part of the previous slab are kept, so that only
+// the new slices of each slab are read. Moving through the image in
+// file order therefore reads each slice once. With one_reader_per_volume
+// each volume has its own file handle, so that slabs of several volumes
+// (e.g. the three components of a displacement field) can be read
+// together without seeking backwards, which for a compressed file
+// means decompressing from the start. Only the slices of the latest
+// slab are kept, so the memory use is set by the slab size.
+template <class T>
+class SlabReader
+{
+public:
+  SlabReader(const std::string& fname, bool one_reader_per_volume=false);
+  const NEWIMAGE::volume<T>& Header() const { return(_hdr); }
+  // Sets slab to slices z0--z1 of volumes t0--t1
+  void Read(int64_t t0, int64_t t1, int z0, int z1, NEWIMAGE::volume<T>& slab);
+private:
+  std::string                                              _fname;
+  NEWIMAGE::volume<T>                                      _hdr;     // Header only
+  bool                                                     _flip;    // True if file is neurological
+  std::vector<std::unique_ptr<NiftiIO::ImageReader> >      _readers;
+  std::map<std::pair<int64_t,int>,std::vector<T> >         _slices;  // Keyed by (t,z)
+
+  void read_slices(int64_t t, int z0, int z1);
+};
+
+// Coordinates in the input of all voxels in rows first_j--last_j of the
+// output slab first_k--last_k. The arithmetic is the same as that of the
+// corresponding RGT_UTILS functions, so the coordinates are identical to
+// those used by raw_general_transform. dslab holds slices dz0-- of the
+// displacement field, and x, y and z are indexed relative to first_k.
+inline void slab_coordinates(// Input
+			     unsigned int                     first_j,
+			     unsigned int                     last_j,
+			     int                              first_k,
+			     int                              last_k,
+			     int                              xsz,
+			     int                              ysz,
+			     bool                             affine_only,
+			     const NEWIMAGE::volume4D<float>& dslab,
+			     int                              dz0,
+			     bool                             useiT,
+			     const NEWMAT::Matrix&            iT,
+			     const NEWMAT::Matrix&            iA,
+			     const NEWMAT::Matrix&            iM,
+			     // Output
+			     float                            *x,
+			     float                            *y,
+			     float                            *z);
+
+// Resamples rows first_j--last_j of a slab of the output from the
+// coordinates given by x, y and z. fslab holds slices fz0-- of the input.
+template <class T>
+void resample_slab(// Input
+		   unsigned int                     first_j,
+		   unsigned int                     last_j,
+		   int                              nk,
+		   int                              xsz,
+		   int                              ysz,
+		   const NEWIMAGE::volume<T>&       fslab,
+		   int                              fz0,
+		   const float                      *x,
+		   const float                      *y,
+		   const float                      *z,
+		   // Output
+		   T                                *out);
+
+} // End namespace SLABWARP_UTILS
+
+namespace NEWIMAGE {
+
+/////////////////////////////////////////////////////////////////////
+//
+// Resamples the image in inname (3D or 4D) into the space of the
+// image in refname and writes it to outname. The transform is the
+// same as for the corresponding call to apply_warp, i.e. A is an
+// affine matrix and warpname a relative displacement field in mm
+// (or an empty string for an affine only transform). Only the
+// header of refname is read.
+// Each output slab finds the input slab that it needs from its own
+// coordinates. For a 4D series the displacement field is read again,
+// one slab at a time, for each volume. Hence neither the field nor
+// the input is ever held in memory as a whole. The price is that a
+// compressed field is decompressed once per volume.
+// Only nearest neighbour and trilinear interpolation are possible,
+// and only extrapolation methods that do not need the whole volume
+// (constpad, zeropad and extraslice), since anything else would
+// give a result that depends on the slab size.
+//
+/////////////////////////////////////////////////////////////////////
+
+template <class T>
+void apply_warp_slabwise(// Input
+			 const std::string&       inname,      // Input (3D or 4D)
+			 const NEWMAT::Matrix&    A,           // 4x4 affine transform
+			 const std::string&       warpname,    // Displacement fields in mm, empty for affine only
+			 const NEWMAT::Matrix&    TT,
+			 const NEWMAT::Matrix&    M,
+			 const std::string&       refname,     // Defines the output space
+			 // Output
+			 const std::string&       outname,
+			 // Optional input
+			 interpolation            interp=trilinear,
+			 extrapolation            extrap=constpad,
+			 unsigned int             slabsz=8,    // No. of output slices per slab
+			 Utilities::NoOfThreads   nthr=Utilities::NoOfThreads(1))
+{
+  if (interp != trilinear && interp != nearestneighbour) {
+    throw WarpFnsException("NEWIMAGE::apply_warp_slabwise: Only trilinear and nearestneighbour interpolation can be used");
+  }
+  if (extrap==boundsassert || extrap==boundsexception) extrap = constpad; // As raw_general_transform
+  if (extrap != constpad && extrap != zeropad && extrap != extraslice) {
+    throw WarpFnsException("NEWIMAGE::apply_warp_slabwise: Only constpad, zeropad or extraslice extrapolation can be used");
+  }
+  if (!slabsz) throw WarpFnsException("NEWIMAGE::apply_warp_slabwise: slabsz must be positive");
+
+  // Headers only of input, output space and field
+  SLABWARP_UTILS::SlabReader<T> freader(inname);
+  const volume<T>& fhdr = freader.Header();
+  volume<T> out;
+  read_volume_hdr_only(out,refname);
+  std::unique_ptr<SLABWARP_UTILS::SlabReader<float> > dreader;
+  std::vector<int> defdir;
+  if (warpname.size()) {
+    dreader = std::make_unique<SLABWARP_UTILS::SlabReader<float> >(warpname,true);
+    defdir = {0, 1, 2};
+  }
+  volume4D<float> nofield;
+  const volume4D<float>& dhdr = dreader ? dreader->Header() : nofield;
+  const NEWMAT::Matrix *Tptr = nullptr;
+  const NEWMAT::Matrix *Mptr = nullptr;
+  if ((TT-NEWMAT::IdentityMatrix(4)).MaximumAbsoluteValue() > 1e-6) Tptr = &TT;
+  if ((M-NEWMAT::IdentityMatrix(4)).MaximumAbsoluteValue() > 1e-6) Mptr = &M;
+  std::vector<int> derivdir;
+  std::vector<unsigned int> slices;
+  volume4D<T> deriv;
+  auto [valinp,msg] = RGT_UTILS::validate_input(A,Tptr,Mptr,dhdr,defdir,derivdir,slices,out,deriv,static_cast<volume<char> *>(nullptr));
+  if (!valinp) throw WarpFnsException("NEWIMAGE::apply_warp_slabwise: "+msg);
+
+  // Matrices as in raw_general_transform
+  auto [iT,useiT] = RGT_UTILS::make_iT(dhdr,out,Tptr);
+  NEWMAT::Matrix iA = A.i();
+  if (defdir.size()) iA = iA * dhdr.sampling_mat();
+  else iA = iA * out.sampling_mat();
+  NEWMAT::Matrix iM(4,4);
+  if (Mptr) iM = fhdr.sampling_mat().i() * Mptr->i();
+  else iM = fhdr.sampling_mat().i();
+  NEWMAT::Matrix iB = iA;
+  if (!defdir.size()) iB = iM*iA*iT;  // Affine only means we can combine all three matrices into one
+
+  // Header of output, as set by raw_general_transform and save_volume
+  RGT_UTILS::set_sqform(fhdr,dhdr,defdir,iA,Tptr,Mptr,out,deriv);
+  int xs = static_cast<int>(out.xsize()), ys = static_cast<int>(out.ysize()), zs = static_cast<int>(out.zsize());
+  volume<T> hv(xs,ys,1);
+  copybasicproperties(out,hv);
+  bool flip = !out.RadiologicalFile && out.left_right_order()==FSL_RADIOLOGICAL;
+  if (flip) hv.makeneurological();
+  NiftiIO::NiftiHeader hdr;
+  set_fsl_hdr(hv,hdr);
+  hdr.dim[0] = (fhdr.tsize() > 1) ? 4 : 3;
+  hdr.dim[3] = zs;
+  hdr.dim[4] = fhdr.tsize();
+  hdr.pixdim[4] = fhdr.TR();
+  int filetype = FslGetEnvOutputType();
+  hdr.setNiftiVersion(FslNiftiVersionFileType(filetype),FslIsSingleFileType(filetype));
+  hdr.bitsPerVoxel = sizeof(T)*8;
+  if (hdr.isAnalyze()) throw WarpFnsException("NEWIMAGE::apply_warp_slabwise: Cannot write ANALYZE files");
+  NiftiIO::ImageWriter writer(make_basename(outname)+outputExtension(filetype),std::vector<NiftiIO::NiftiExtension>(),hdr,FslIsCompressedFileType(filetype));
+
+  std::vector<unsigned int> nrows = RGT_UTILS::rows_per_thread(static_cast<unsigned int>(ys),nthr._n);
+  std::vector<std::thread> threads(nthr._n-1); // + main thread makes nthr
+  volume4D<float> dslab;
+  volume<T> fslab;
+  for (int64_t t=0; t<fhdr.tsize(); t++) {
+    for (int k0=0; k0<zs; k0+=slabsz) {
+      int k1 = std::min(zs,k0+static_cast<int>(slabsz));
+      int64_t nvox = int64_t(xs)*ys*(k1-k0);
+
+      // Read the slices of the field that are needed for this slab
+      int dz0 = 0;
+      if (defdir.size()) {
+	int dz1 = k1-1;
+	if (useiT) { // Find range from corners of slab, with a margin to allow for rounding
+	  double zmin = 1e30, zmax = -1e30;
+	  for (int c=0; c<8; c++) {
+	    double i = (c&1) ? xs-1 : 0, j = (c&2) ? ys-1 : 0, k = (c&4) ? k1-1 : k0;
+	    double zz = iT(3,1)*i + iT(3,2)*j + iT(3,3)*k + iT(3,4);
+	    zmin = std::min(zmin,zz); zmax = std::max(zmax,zz);
+	  }
+	  dz0 = std::clamp(static_cast<int>(std::floor(zmin))-1,0,static_cast<int>(dhdr.zsize())-1);
+	  dz1 = std::clamp(static_cast<int>(std::floor(zmax))+2,0,static_cast<int>(dhdr.zsize())-1);
+	}
+	else dz0 = k0;
+	dreader->Read(0,2,dz0,dz1,dslab);
+	dslab.setextrapolationmethod(extraslice);
+      }
+
+      // Calculate the coordinates in the input
+      std::vector<float> x(nvox), y(nvox), z(nvox);
+      bool affine_only = !defdir.size();
+      for (unsigned int i=0; i<nthr._n-1; i++) {
+	threads[i] = std::thread(SLABWARP_UTILS::slab_coordinates,nrows[i],nrows[i+1],k0,k1,xs,ys,affine_only,std::ref(dslab),dz0,
+				 useiT,std::ref(iT),std::ref(iB),std::ref(iM),&x[0],&y[0],&z[0]);
+      }
+      SLABWARP_UTILS::slab_coordinates(nrows[nthr._n-1],nrows[nthr._n],k0,k1,xs,ys,affine_only,dslab,dz0,useiT,iT,iB,iM,&x[0],&y[0],&z[0]);
+      std::for_each(threads.begin(),threads.end(),std::mem_fn(&std::thread::join));
+
+      // Read the slices of the input that they cover
+      auto [zmin,zmax] = std::minmax_element(z.begin(),z.end());
+      int fz0 = std::clamp(static_cast<int>(std::floor(*zmin)),0,static_cast<int>(fhdr.zsize())-1);
+      int fz1 = std::clamp(static_cast<int>(std::floor(*zmax))+1,0,static_cast<int>(fhdr.zsize())-1);
+      freader.Read(t,t,fz0,fz1,fslab);
+      fslab.setinterpolationmethod(interp);
+      fslab.setextrapolationmethod(extrap);
+
+      // Resample and write
+      volume<T> oslab(xs,ys,k1-k0);
+      T *optr = oslab.nsfbegin();
+      for (unsigned int i=0; i<nthr._n-1; i++) {
+	threads[i] = std::thread(SLABWARP_UTILS::resample_slab<T>,nrows[i],nrows[i+1],k1-k0,xs,ys,std::ref(fslab),fz0,&x[0],&y[0],&z[0],optr);
+      }
+      SLABWARP_UTILS::resample_slab(nrows[nthr._n-1],nrows[nthr._n],k1-k0,xs,ys,fslab,fz0,&x[0],&y[0],&z[0],optr);
+      std::for_each(threads.begin(),threads.end(),std::mem_fn(&std::thread::join));
+      if (flip) for (int64_t r=0; r<nvox; r+=xs) std::reverse(optr+r,optr+r+xs);
+      writer.write(optr,nvox*sizeof(T));
+    }
+  }
+  writer.close();
+}
+
+} // End namespace NEWIMAGE
+
+namespace SLABWARP_UTILS {
+
+template <class T>
+SlabReader<T>::SlabReader(const std::string& fname, bool one_reader_per_volume)
+  : _fname(NEWIMAGE::return_validimagefilename(fname))
+{
+  NEWIMAGE::read_volume_hdr_only(_hdr,_fname);
+  _flip = !_hdr.RadiologicalFile && _hdr.left_right_order()==FSL_RADIOLOGICAL; // As read_volume
+  _readers.resize(one_reader_per_volume ? _hdr.tsize() : 1);
+}
+
+template <class T>
+void SlabReader<T>::Read(int64_t t0, int64_t t1, int z0, int z1, NEWIMAGE::volume<T>& slab)
+{
+  if (t0 < 0 || t1 >= _hdr.tsize() || t0 > t1 || z0 < 0 || z1 >= _hdr.zsize() || z0 > z1) {
+    throw NEWIMAGE::WarpFnsException("SlabReader::Read: Slab out of range");
+  }
+  // Drop what is not part of this slab
+  for (auto it=_slices.begin(); it!=_slices.end(); ) {
+    if (it->first.first < t0 || it->first.first > t1 || it->first.second < z0 || it->first.second > z1) it = _slices.erase(it);
+    else ++it;
+  }
+  for (int64_t t=t0; t<=t1; t++) { // Read missing slices, a run at a time
+    for (int z=z0; z<=z1; z++) {
+      if (_slices.count(std::make_pair(t,z))) continue;
+      int zl = z;
+      while (zl < z1 && !_slices.count(std::make_pair(t,zl+1))) zl++;
+      read_slices(t,z,zl);
+      z = zl;
+    }
+  }
+  int64_t nz = z1-z0+1, nt = t1-t0+1;
+  if (slab.xsize() != _hdr.xsize() || slab.ysize() != _hdr.ysize() || slab.zsize() != nz || slab.tsize() != nt) {
+    slab.reinitialize(_hdr.xsize(),_hdr.ysize(),nz,nt);
+  }
+  slab.setdims(_hdr.xdim(),_hdr.ydim(),_hdr.zdim(),_hdr.tdim());
+  int64_t ssz = _hdr.xsize()*_hdr.ysize();
+  T *sptr = slab.nsfbegin();
+  for (int64_t t=t0; t<=t1; t++) {
+    for (int z=z0; z<=z1; z++, sptr+=ssz) {
+      const std::vector<T>& s = _slices[std::make_pair(t,z)];
+      std::copy(s.begin(),s.end(),sptr);
+    }
+  }
+}
+
+template <class T>
+void SlabReader<T>::read_slices(int64_t t, int z0, int z1)
+{
+  unsigned int r = (_readers.size() > 1) ? t : 0;
+  if (!_readers[r]) {
+    try { _readers[r] = std::make_unique<NiftiIO::ImageReader>(_fname); }
+    catch (std::exception& e) { throw NEWIMAGE::WarpFnsException("SlabReader: Failed to open "+_fname+"\nError : "+e.what()); }
+  }
+  const NiftiIO::NiftiHeader& hdr = _readers[r]->header();
+  size_t ssz = _hdr.xsize()*_hdr.ysize();
+  size_t n = ssz*(z1-z0+1);
+  char *buf = new char[n*hdr.datumByteWidth()];
+  T *tbuf = nullptr;
+  try {
+    _readers[r]->read(buf,(t*_hdr.zsize()+z0)*ssz*hdr.datumByteWidth(),n*hdr.datumByteWidth());
+    NEWIMAGE::ConvertAndScaleNewNiftiBuffer(buf,tbuf,hdr,n);  // Deletes buf unless it is also tbuf
+  }
+  catch (std::exception& e) {
+    if (!tbuf) delete[] buf;
+    throw NEWIMAGE::WarpFnsException(std::string("SlabReader: Failed to read slices\nError : ")+e.what());
+  }
+  for (int z=z0; z<=z1; z++) {
+    std::vector<T>& s = _slices[std::make_pair(t,z)];
+    s.assign(tbuf+(z-z0)*ssz,tbuf+(z-z0+1)*ssz);
+    if (_flip) for (size_t i=0; i<ssz; i+=_hdr.xsize()) std::reverse(s.begin()+i,s.begin()+i+_hdr.xsize());
+  }
+  if (NEWIMAGE::dtype(tbuf) == hdr.datatype) delete[] buf;
+  else delete[] tbuf;
+}
+
+inline void slab_coordinates(// Input
+			     unsigned int                     first_j,
+			     unsigned int                     last_j,
+			     int                              first_k,
+			     int                              last_k,
+			     int                              xsz,
+			     int                              ysz,
+			     bool                             affine_only,
+			     const NEWIMAGE::volume4D<float>& dslab,
+			     int                              dz0,
+			     bool                             useiT,
+			     const NEWMAT::Matrix&            iT,
+			     const NEWMAT::Matrix&            iA,
+			     const NEWMAT::Matrix&            iM,
+			     // Output
+			     float                            *x,
+			     float                            *y,
+			     float                            *z)
+{
+  if (affine_only) { // Affine only, iA is then the combined matrix (as affine_no_derivs)
+    float B11=iA(1,1), B12=iA(1,2), B13=iA(1,3), B14=iA(1,4);
+    float B21=iA(2,1), B22=iA(2,2), B23=iA(2,3), B24=iA(2,4);
+    float B31=iA(3,1), B32=iA(3,2), B33=iA(3,3), B34=iA(3,4);
+    for (int k=first_k; k<last_k; k++) {
+      for (int j=static_cast<int>(first_j); j<static_cast<int>(last_j); j++) {
+	int64_t v = (int64_t(k-first_k)*ysz + j)*xsz;
+	float xx = j*B12 + k*B13 + B14;
+	float yy = j*B22 + k*B23 + B24;
+	float zz = j*B32 + k*B33 + B34;
+	for (int i=0; i<xsz; i++, v++) {
+	  x[v] = xx; y[v] = yy; z[v] = zz;
+	  xx += B11; yy += B21; zz += B31;
+	}
+      }
+    }
+    return;
+  }
+
+  float T11=iT(1,1), T12=iT(1,2), T13=iT(1,3), T14=iT(1,4);
+  float T21=iT(2,1), T22=iT(2,2), T23=iT(2,3), T24=iT(2,4);
+  float T31=iT(3,1), T32=iT(3,2), T33=iT(3,3), T34=iT(3,4);
+
+  float A11=iA(1,1), A12=iA(1,2), A13=iA(1,3), A14=iA(1,4);
+  float A21=iA(2,1), A22=iA(2,2), A23=iA(2,3), A24=iA(2,4);
+  float A31=iA(3,1), A32=iA(3,2), A33=iA(3,3), A34=iA(3,4);
+
+  float M11=iM(1,1), M12=iM(1,2), M13=iM(1,3), M14=iM(1,4);
+  float M21=iM(2,1), M22=iM(2,2), M23=iM(2,3), M24=iM(2,4);
+  float M31=iM(3,1), M32=iM(3,2), M33=iM(3,3), M34=iM(3,4);
+
+  const NEWIMAGE::ShadowVolume<float> d[3] = {dslab[0], dslab[1], dslab[2]};
+  float fdz0 = static_cast<float>(dz0);
+  float xv[3], xx[3];
+  for (int k=first_k; k<last_k; k++) {
+    for (int j=static_cast<int>(first_j); j<static_cast<int>(last_j); j++) {
+      int64_t v = (int64_t(k-first_k)*ysz + j)*xsz;
+      float b1 = j*A12 + k*A13 + A14;
+      float b2 = j*A22 + k*A23 + A24;
+      float b3 = j*A32 + k*A33 + A34;
+      for (int i=0; i<xsz; i++, v++) {
+	if (!useiT) { // As displacements_no_iT
+	  xx[0] = i*A11 + b1;
+	  xx[1] = i*A21 + b2;
+	  xx[2] = i*A31 + b3;
+	  for (unsigned int di=0; di<3; di++) xx[di] += dslab(i,j,k-dz0,di);
+	}
+	else { // As displacements_with_iT. N.B. xv[2]-fdz0 is exact, so same weights as for whole field
+	  xv[0] = i*T11 + j*T12 + k*T13 + T14;
+	  xv[1] = i*T21 + j*T22 + k*T23 + T24;
+	  xv[2] = i*T31 + j*T32 + k*T33 + T34;
+	  xx[0] = xv[0]*A11 + xv[1]*A12 + xv[2]*A13 + A14;
+	  xx[1] = xv[0]*A21 + xv[1]*A22 + xv[2]*A23 + A24;
+	  xx[2] = xv[0]*A31 + xv[1]*A32 + xv[2]*A33 + A34;
+	  for (unsigned int di=0; di<3; di++) xx[di] += d[di].interpolate(xv[0],xv[1],xv[2]-fdz0);
+	}
+	x[v] = xx[0]*M11 + xx[1]*M12 + xx[2]*M13 + M14;
+	y[v] = xx[0]*M21 + xx[1]*M22 + xx[2]*M23 + M24;
+	z[v] = xx[0]*M31 + xx[1]*M32 + xx[2]*M33 + M34;
+      }
+    }
+  }
+  return;
+}
+
+template <class T>
+void resample_slab(// Input
+		   unsigned int                     first_j,
+		   unsigned int                     last_j,
+		   int                              nk,
+		   int                              xsz,
+		   int                              ysz,
+		   const NEWIMAGE::volume<T>&       fslab,
+		   int                              fz0,
+		   const float                      *x,
+		   const float                      *y,
+		   const float                      *z,
+		   // Output
+		   T                                *out)
+{
+  // z-fz0 is exact, so the interpolation weights are the same as for the whole volume
+  float ffz0 = static_cast<float>(fz0);
+  RGT_UTILS::RowBuffer rb(xsz);
+  for (int k=0; k<nk; k++) {
+    for (int j=static_cast<int>(first_j); j<static_cast<int>(last_j); j++) {
+      int64_t v0 = (int64_t(k)*ysz + j)*xsz;
+      for (int i=0; i<xsz; i++) {
+	rb.x[i] = x[v0+i]; rb.y[i] = y[v0+i]; rb.z[i] = z[v0+i] - ffz0;
+      }
+      RGT_UTILS::sample_row(fslab,xsz,rb,false);
+      for (int i=0; i<xsz; i++) out[v0+i] = static_cast<T>(rb.val[i]);
+    }
+  }
+  return;
+}
+
+} // End namespace SLABWARP_UTILS
+
+#endif // End #ifndef slabwarp_h
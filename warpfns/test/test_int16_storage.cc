@@ -0,0 +1,132 @@
+#include "newimage/newimageall.h"
+#include "basisfield/splinefield.h"
+#include "warpfns/fnirt_file_reader.h"
+#include "warpfns/fnirt_file_writer.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include <boost/version.hpp>
+#if BOOST_VERSION < 108000
+#define BOOST_NO_CXX98_FUNCTION_BASE
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+
+BOOST_AUTO_TEST_SUITE(test_int16_storage)
+
+
+using namespace NEWIMAGE;
+using namespace BASISFIELD;
+
+static std::string tmpname(const std::string& name)
+{
+    return "/tmp/test_int16_storage_" + std::to_string(getpid()) + "_" + name;
+}
+
+// Three cubic spline fields with coefficients of different ranges
+static std::vector<std::shared_ptr<basisfield> > make_fields()
+{
+    std::vector<unsigned int> sz = {20, 18, 16}, ksp = {4, 4, 4};
+    std::vector<double> vxs = {2.0, 2.0, 2.5};
+    std::vector<std::shared_ptr<basisfield> > fields(3);
+    for (int i = 0; i < 3; i++) {
+        fields[i] = std::shared_ptr<basisfield>(new splinefield(sz, vxs, ksp, 3));
+        NEWMAT::ColumnVector coef(fields[i]->CoefSz());
+        for (int j = 0; j < coef.Nrows(); j++) coef.element(j) = (i+1)*4.0*std::sin(0.37*j + i) + 2.0*i;
+        fields[i]->SetCoef(coef);
+    }
+    return fields;
+}
+
+static volume4D<float> make_field_volume()
+{
+    volume4D<float> f(24, 20, 18, 3);
+    f.setdims(2.0, 2.0, 2.5, 1.0);
+    for (int t = 0; t < 3; t++) for (int k = 0; k < 18; k++) for (int j = 0; j < 20; j++) for (int i = 0; i < 24; i++) {
+        f(i, j, k, t) = 5.0*std::sin(0.2*i + t)*std::cos(0.15*j) - 3.0*t + 0.1*k;
+    }
+    return f;
+}
+
+static double maxdiff(const volume4D<float>& a, const volume4D<float>& b)
+{
+    BOOST_REQUIRE(samesize(a, b, true));
+    double d = 0.0;
+    for (int t = 0; t < a.tsize(); t++) for (int k = 0; k < a.zsize(); k++) for (int j = 0; j < a.ysize(); j++) for (int i = 0; i < a.xsize(); i++) {
+        d = std::max(d, double(std::fabs(a(i, j, k, t) - b(i, j, k, t))));
+    }
+    return d;
+}
+
+BOOST_AUTO_TEST_CASE(coefficients_within_maxerror)
+{
+    setenv("FSLOUTPUTTYPE", "NIFTI_GZ", 1);
+    std::vector<std::shared_ptr<basisfield> > fields = make_fields();
+    std::string fname = tmpname("coef"), ffname = tmpname("coef_f");
+    FnirtFileWriter wrt(fname, fields, NEWMAT::IdentityMatrix(4), Int16Storage);
+    FnirtFileWriter(ffname, fields, NEWMAT::IdentityMatrix(4), FloatStorage);
+    double maxerr = wrt.MaxError();
+    BOOST_CHECK_GT(maxerr, 0.0);
+    BOOST_CHECK_LT(maxerr, 1e-3);   // Range is ~24, so about 24/65534/2
+
+    // MaxError is relative to the coefficients as written, i.e. as float
+    FnirtFileReader rd(fname), frd(ffname);
+    BOOST_CHECK_EQUAL(rd.Type(), FnirtSplineDispType);
+    double cd = 0.0;
+    for (int i = 0; i < 3; i++) {
+        NEWMAT::ColumnVector c = *(rd.FieldAsSplinefield(i).GetCoef()) - *(frd.FieldAsSplinefield(i).GetCoef());
+        cd = std::max(cd, c.MaximumAbsoluteValue());
+    }
+    BOOST_CHECK_LE(cd, maxerr*(1.0 + 1e-6));
+    // The B-splines sum to one, so the error in the field is also bounded by MaxError
+    BOOST_CHECK_LE(maxdiff(rd.FieldAsNewimageVolume4D(true), frd.FieldAsNewimageVolume4D(true)), maxerr + 1e-5);
+    std::remove((fname + ".nii.gz").c_str());
+    std::remove((ffname + ".nii.gz").c_str());
+}
+
+BOOST_AUTO_TEST_CASE(field_within_maxerror)
+{
+    setenv("FSLOUTPUTTYPE", "NIFTI", 1);
+    volume4D<float> f = make_field_volume();
+    std::string fname = tmpname("field");
+    FnirtFileWriter wrt(fname, f[0], f, NEWMAT::IdentityMatrix(4), Int16Storage);
+    double maxerr = wrt.MaxError();
+    BOOST_CHECK_GT(maxerr, 0.0);
+    BOOST_CHECK_LT(maxerr, 1e-3);
+    FnirtFileReader rd(fname);
+    BOOST_CHECK_EQUAL(rd.Type(), FnirtFieldDispType);
+    // With the affine part, since the reader splits one out of the field
+    BOOST_CHECK_LE(maxdiff(rd.FieldAsNewimageVolume4D(true), f), maxerr + 1e-5);
+    std::remove((fname + ".nii").c_str());
+}
+
+BOOST_AUTO_TEST_CASE(non_finite_values_rejected)
+{
+    setenv("FSLOUTPUTTYPE", "NIFTI", 1);
+    std::string fname = tmpname("bad");
+    for (float bad : {std::numeric_limits<float>::quiet_NaN(), std::numeric_limits<float>::infinity()}) {
+        volume4D<float> f = make_field_volume();
+        f(3, 4, 5, 1) = bad;
+        BOOST_CHECK_THROW(save_volume_int16(f, fname), std::exception);
+        BOOST_CHECK(!fsl_imageexists(fname));
+        f(3, 4, 5, 1) = 0.0;
+        f(0, 0, 0, 0) = -bad;   // First value, which used to seed the range
+        BOOST_CHECK_THROW(FnirtFileWriter(fname, f[0], f, NEWMAT::IdentityMatrix(4), Int16Storage), std::exception);
+        BOOST_CHECK(!fsl_imageexists(fname));
+    }
+    // Float storage is unaffected
+    volume4D<float> f = make_field_volume();
+    f(3, 4, 5, 1) = std::numeric_limits<float>::quiet_NaN();
+    BOOST_CHECK_NO_THROW(FnirtFileWriter(fname, f[0], f, NEWMAT::IdentityMatrix(4), FloatStorage));
+    std::remove((fname + ".nii").c_str());
+}
+
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,109 @@
+#include "newimage/newimageall.h"
+#include "basisfield/splinefield.h"
+#include "basisfield/dctfield.h"
+#include "warpfns/fnirt_file_reader.h"
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include <boost/version.hpp>
+#if BOOST_VERSION < 108000
+#define BOOST_NO_CXX98_FUNCTION_BASE
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+
+BOOST_AUTO_TEST_SUITE(test_jacobian_range)
+
+
+using namespace NEWIMAGE;
+using namespace BASISFIELD;
+
+static const std::vector<unsigned int> SZ = {26, 22, 19};
+static const std::vector<double> VXS = {2.0, 2.0, 2.5};
+
+// Three fields with coefficients of size amp. Cubic splines if spline
+// is set, otherwise DCT.
+static std::vector<std::shared_ptr<basisfield> > make_fields(bool spline, double amp)
+{
+    std::vector<std::shared_ptr<basisfield> > fields(3);
+    for (int i = 0; i < 3; i++) {
+        if (spline) fields[i] = std::make_shared<splinefield>(SZ, VXS, std::vector<unsigned int>(3, 4), 3);
+        else fields[i] = std::make_shared<dctfield>(SZ, VXS, std::vector<unsigned int>(3, 6));
+        NEWMAT::ColumnVector coef(fields[i]->CoefSz());
+        for (int j = 0; j < coef.Nrows(); j++) coef.element(j) = amp*std::sin(0.61*j + 1.7*i) / (spline ? 1.0 : 1.0 + j % 6);
+        fields[i]->SetCoef(coef);
+    }
+    return fields;
+}
+
+static NEWMAT::Matrix make_affine()
+{
+    NEWMAT::Matrix A = NEWMAT::IdentityMatrix(4);
+    A(1, 1) = 1.06; A(1, 2) = 0.04; A(2, 1) = -0.03; A(2, 2) = 0.95; A(3, 3) = 1.02; A(1, 4) = 2.0;
+    return A;
+}
+
+// What jacobian_range should return, from the Jacobian volume
+static NEWMAT::ColumnVector reference(const std::vector<std::shared_ptr<basisfield> >& f, const NEWMAT::Matrix& A, double minj, double maxj)
+{
+    volume<float> jac(SZ[0], SZ[1], SZ[2]);
+    jac.setdims(VXS[0], VXS[1], VXS[2]);
+    deffield2jacobian(*f[0], *f[1], *f[2], A, jac);
+    NEWMAT::ColumnVector stats(4);
+    stats << jac.min() << jac.max() << 0.0 << 0.0;
+    for (int k = 0; k < jac.zsize(); k++) for (int j = 0; j < jac.ysize(); j++) for (int i = 0; i < jac.xsize(); i++) {
+        if (jac(i, j, k) < minj) stats(3) += 1.0;
+        if (jac(i, j, k) > maxj) stats(4) += 1.0;
+    }
+    return stats;
+}
+
+BOOST_AUTO_TEST_CASE(same_as_deffield2jacobian)
+{
+    for (bool spline : {true, false}) {
+        // Mild and strong (folding) fields
+        for (double amp : {1.0, 6.0}) {
+            BOOST_TEST_CONTEXT((spline ? "spline" : "dct") << ", amp = " << amp) {
+                std::vector<std::shared_ptr<basisfield> > f = make_fields(spline, amp);
+                NEWMAT::Matrix A = make_affine();
+                // Thresholds inside the range, so that the counts are tested
+                NEWMAT::ColumnVector ref = reference(f, A, 0.0, 0.0);
+                double minj = 0.75*ref(1) + 0.25*ref(2), maxj = 0.25*ref(1) + 0.75*ref(2);
+                ref = reference(f, A, minj, maxj);
+                BOOST_REQUIRE_GT(double(ref(3)), 0.0);
+                BOOST_REQUIRE_GT(double(ref(4)), 0.0);
+                for (unsigned int nt : {1u, 2u, 5u, 64u}) {
+                    BOOST_TEST_CONTEXT("nthr = " << nt) {
+                        NEWMAT::ColumnVector r = jacobian_range(*f[0], *f[1], *f[2], A, minj, maxj, Utilities::NoOfThreads(nt));
+                        BOOST_REQUIRE_EQUAL(r.Nrows(), 4);
+                        // deffield2jacobian stores the Jacobians as float
+                        BOOST_CHECK_CLOSE(double(r(1)), double(ref(1)), 1e-4);
+                        BOOST_CHECK_CLOSE(double(r(2)), double(ref(2)), 1e-4);
+                        BOOST_CHECK_EQUAL(double(r(3)), double(ref(3)));
+                        BOOST_CHECK_EQUAL(double(r(4)), double(ref(4)));
+                    }
+                }
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(identity_field)
+{
+    // Zero displacements give the determinant of inv(A) everywhere
+    std::vector<std::shared_ptr<basisfield> > f = make_fields(true, 0.0);
+    NEWMAT::Matrix A = make_affine();
+    double dA = 1.0 / A.SubMatrix(1, 3, 1, 3).Determinant();
+    NEWMAT::ColumnVector r = jacobian_range(*f[0], *f[1], *f[2], A, dA - 0.01, dA + 0.01, Utilities::NoOfThreads(3));
+    BOOST_CHECK_CLOSE(double(r(1)), dA, 1e-10);
+    BOOST_CHECK_CLOSE(double(r(2)), dA, 1e-10);
+    BOOST_CHECK_EQUAL(double(r(3)), 0.0);
+    BOOST_CHECK_EQUAL(double(r(4)), 0.0);
+    r = jacobian_range(*f[0], *f[1], *f[2], A, dA + 0.01, dA + 0.02);
+    BOOST_CHECK_EQUAL(double(r(3)), double(SZ[0]*SZ[1]*SZ[2]));
+}
+
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,133 @@
+#include "warpfns/realfft3.h"
+#include <cmath>
+#include <complex>
+#include <memory>
+#include <vector>
+
+#include <boost/version.hpp>
+#if BOOST_VERSION < 108000
+#define BOOST_NO_CXX98_FUNCTION_BASE
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+
+BOOST_AUTO_TEST_SUITE(test_realfft3)
+
+
+using namespace NEWIMAGE;
+
+typedef std::complex<double> cplx;
+
+// exp(-2*pi*i*k/n), with k reduced first so that the argument stays small
+static cplx twiddle(unsigned long k, unsigned int n)
+{
+    return(std::polar(1.0, -2.0*M_PI*double(k % n)/double(n)));
+}
+
+static std::vector<cplx> naive_dft(const std::vector<cplx>& in)
+{
+    unsigned int n = in.size();
+    std::vector<cplx> out(n, cplx(0.0, 0.0));
+    for (unsigned int k = 0; k < n; k++) for (unsigned int j = 0; j < n; j++) out[k] += in[j]*twiddle(static_cast<unsigned long>(j)*k, n);
+    return(out);
+}
+
+// Non-redundant half of the 3D DFT of a real volume, kx fastest
+static std::vector<cplx> naive_dft3(const std::vector<float>& in, unsigned int nx, unsigned int ny, unsigned int nz)
+{
+    unsigned int hx = nx/2 + 1;
+    std::vector<cplx> out(hx*ny*nz, cplx(0.0, 0.0));
+    for (unsigned int kz = 0; kz < nz; kz++) for (unsigned int ky = 0; ky < ny; ky++) for (unsigned int kx = 0; kx < hx; kx++) {
+        cplx s(0.0, 0.0);
+        for (unsigned int z = 0; z < nz; z++) for (unsigned int y = 0; y < ny; y++) {
+            cplx tyz = twiddle(static_cast<unsigned long>(ky)*y, ny) * twiddle(static_cast<unsigned long>(kz)*z, nz);
+            const float *ip = &in[(z*ny + y)*nx];
+            for (unsigned int x = 0; x < nx; x++) s += double(ip[x]) * twiddle(static_cast<unsigned long>(kx)*x, nx) * tyz;
+        }
+        out[(kz*ny + ky)*hx + kx] = s;
+    }
+    return(out);
+}
+
+static std::vector<float> make_volume(unsigned int nx, unsigned int ny, unsigned int nz)
+{
+    std::vector<float> v(nx*ny*nz);
+    for (unsigned int i = 0; i < v.size(); i++) v[i] = float(std::sin(0.7*i) + 0.3*std::cos(1.9*i) + 0.1*(i % 5));
+    return(v);
+}
+
+// Largest difference relative to the largest value of b
+static double reldiff(const std::vector<cplx>& a, const std::vector<cplx>& b)
+{
+    BOOST_REQUIRE_EQUAL(a.size(), b.size());
+    double md = 0.0, mb = 0.0;
+    for (unsigned int i = 0; i < a.size(); i++) { md = std::max(md, std::abs(a[i]-b[i])); mb = std::max(mb, std::abs(b[i])); }
+    return(md / mb);
+}
+
+BOOST_AUTO_TEST_CASE(plan_same_as_naive_dft)
+{
+    // Powers of 2 and 4, other small primes, mixed radices and large primes
+    for (unsigned int n : {1u, 2u, 3u, 4u, 5u, 7u, 8u, 12u, 16u, 30u, 49u, 64u, 97u, 120u, 182u, 256u}) {
+        BOOST_TEST_CONTEXT("n = " << n) {
+            std::vector<cplx> in(2*n), out(n);
+            for (unsigned int i = 0; i < 2*n; i++) in[i] = cplx(std::sin(0.3*i + 0.1), std::cos(1.7*i));
+            FFT1DPlan plan(n);
+            BOOST_CHECK_EQUAL(plan.N(), n);
+            plan.Forward(in.data(), 1, out.data());
+            BOOST_CHECK_SMALL(reldiff(out, naive_dft(std::vector<cplx>(in.begin(), in.begin()+n))), 1e-12);
+            // Strided input
+            std::vector<cplx> strided(n);
+            for (unsigned int i = 0; i < n; i++) strided[i] = in[2*i];
+            plan.Forward(in.data(), 2, out.data());
+            BOOST_CHECK_SMALL(reldiff(out, naive_dft(strided)), 1e-12);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(forward_same_as_naive_dft)
+{
+    BuiltinRealFFT3 fft;
+    unsigned int sizes[][3] = {{8, 6, 4}, {7, 9, 5}, {16, 12, 10}, {15, 1, 6}, {1, 10, 3}, {2, 2, 2}};
+    for (auto& sz : sizes) {
+        BOOST_TEST_CONTEXT("size = " << sz[0] << "x" << sz[1] << "x" << sz[2]) {
+            std::vector<float> in = make_volume(sz[0], sz[1], sz[2]);
+            std::vector<cplx> ref = naive_dft3(in, sz[0], sz[1], sz[2]);
+            for (unsigned int nt : {1u, 3u}) {
+                std::vector<cplx> out(ref.size());
+                fft.Forward(in.data(), out.data(), sz[0], sz[1], sz[2], Utilities::NoOfThreads(nt));
+                BOOST_CHECK_SMALL(reldiff(out, ref), 1e-12);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(inverse_inverts_forward)
+{
+    BuiltinRealFFT3 fft;
+    unsigned int sizes[][3] = {{8, 6, 4}, {7, 9, 5}, {16, 12, 10}, {15, 1, 6}};
+    for (auto& sz : sizes) {
+        BOOST_TEST_CONTEXT("size = " << sz[0] << "x" << sz[1] << "x" << sz[2]) {
+            std::vector<float> in = make_volume(sz[0], sz[1], sz[2]), back(in.size());
+            std::vector<cplx> spec = naive_dft3(in, sz[0], sz[1], sz[2]);
+            fft.Inverse(spec.data(), back.data(), sz[0], sz[1], sz[2], Utilities::NoOfThreads(2));
+            double md = 0.0;
+            for (unsigned int i = 0; i < in.size(); i++) md = std::max(md, double(std::fabs(back[i] - in[i])));
+            BOOST_CHECK_SMALL(md, 1e-6);   // Output is float
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(backend_can_be_replaced)
+{
+    BOOST_CHECK_EQUAL(GetRealFFT3Backend()->Name(), std::string("builtin"));
+    class Other : public BuiltinRealFFT3 { public: std::string Name() const { return(std::string("other")); } };
+    SetRealFFT3Backend(std::make_shared<Other>());
+    BOOST_CHECK_EQUAL(GetRealFFT3Backend()->Name(), std::string("other"));
+    SetRealFFT3Backend(nullptr);
+    BOOST_CHECK_EQUAL(GetRealFFT3Backend()->Name(), std::string("builtin"));
+}
+
+
+BOOST_AUTO_TEST_SUITE_END()
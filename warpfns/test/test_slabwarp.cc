@@ -0,0 +1,129 @@
+#include "warpfns/slabwarp.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+
+#include <boost/version.hpp>
+#if BOOST_VERSION < 108000
+#define BOOST_NO_CXX98_FUNCTION_BASE
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+
+BOOST_AUTO_TEST_SUITE(test_slabwarp)
+
+
+using namespace NEWIMAGE;
+
+static std::string tmpname(const std::string& name)
+{
+    return "/tmp/test_slabwarp_" + std::to_string(getpid()) + "_" + name;
+}
+
+// A 4D series of smooth, but not trivial, images with 2mm voxels. If
+// neurological is set the sform has a positive determinant, so that
+// the data are flipped in x when read.
+static volume4D<float> make_input(int nt, bool neurological)
+{
+    volume4D<float> in(23, 19, 17, nt);
+    in.setdims(2.0, 2.0, 2.0, 2.5);
+    NEWMAT::Matrix S = in.sampling_mat();
+    if (neurological) S(1, 4) = -20.0;
+    else { S(1, 1) = -2.0; S(1, 4) = 44.0; }
+    in.set_sform(NiftiIO::NIFTI_XFORM_MNI_152, S);
+    in.set_qform(NiftiIO::NIFTI_XFORM_MNI_152, S);
+    for (int t = 0; t < nt; t++) for (int k = 0; k < 17; k++) for (int j = 0; j < 19; j++) for (int i = 0; i < 23; i++) {
+        in(i, j, k, t) = 100.0 + 50.0*std::sin(0.3*i)*std::cos(0.2*j) + 3.0*k + 0.5*i + 10.0*t;
+    }
+    return in;
+}
+
+// Displacement field (mm) of about two voxels in the space of in
+static volume4D<float> make_field(const volume4D<float>& in)
+{
+    volume4D<float> d(in.xsize(), in.ysize(), in.zsize(), 3);
+    copybasicproperties(in[0], d);
+    for (int t = 0; t < 3; t++) for (int k = 0; k < in.zsize(); k++) for (int j = 0; j < in.ysize(); j++) for (int i = 0; i < in.xsize(); i++) {
+        d(i, j, k, t) = 4.0*std::sin(0.2*i + t)*std::cos(0.3*k) + 0.5*j - 4.0;
+    }
+    return d;
+}
+
+// Resamples inname with apply_warp_slabwise and compares to apply_warp
+// (affine_transform for affine only) of each volume read into memory.
+static void check_slabwise(const std::string& type, int nt, bool neurological, bool affine_only,
+                           interpolation interp, unsigned int slabsz)
+{
+    setenv("FSLOUTPUTTYPE", type.c_str(), 1);
+    std::string inname = tmpname("in"), warpname = tmpname("warp"), outname = tmpname("out");
+    save_volume4D(make_input(nt, neurological), inname);
+    if (!affine_only) save_volume4D(make_field(make_input(1, neurological)), warpname);
+
+    NEWMAT::IdentityMatrix I(4);
+    NEWMAT::Matrix A = I;
+    double a = 0.1;
+    A(1, 1) = std::cos(a); A(1, 3) = -std::sin(a); A(3, 1) = std::sin(a); A(3, 3) = std::cos(a);
+    A(1, 4) = 2.3; A(2, 4) = -1.1;
+    apply_warp_slabwise<float>(inname, A, affine_only ? std::string("") : warpname, I, I, inname, outname,
+                               interp, constpad, slabsz, Utilities::NoOfThreads(2));
+
+    volume4D<float> in, d, out;
+    read_volume4D(in, inname);
+    if (!affine_only) read_volume4D(d, warpname);
+    read_volume4D(out, outname);
+    BOOST_REQUIRE_EQUAL(out.tsize(), nt);
+    BOOST_CHECK_CLOSE(out.TR(), 2.5, 1e-4);
+    for (int t = 0; t < nt; t++) {
+        volume<float> it = in[t];
+        it.setinterpolationmethod(interp);
+        volume<float> ref = in[0];
+        if (affine_only) affine_transform(it, A, ref);
+        else apply_warp(it, A, d, I, I, ref);
+        BOOST_REQUIRE(samesize(ref, out[t]));
+        BOOST_CHECK_EQUAL(ref.sform_code(), out.sform_code());
+        BOOST_CHECK_SMALL((ref.sform_mat() - out.sform_mat()).MaximumAbsoluteValue(), 1e-4);
+        double maxdiff = 0.0;
+        for (int k = 0; k < ref.zsize(); k++) for (int j = 0; j < ref.ysize(); j++) for (int i = 0; i < ref.xsize(); i++) {
+            maxdiff = std::max(maxdiff, double(std::fabs(ref(i, j, k) - out(i, j, k, t))));
+        }
+        BOOST_CHECK_EQUAL(maxdiff, 0.0);
+    }
+    std::string ext = (type == "NIFTI_GZ") ? ".nii.gz" : ".nii";
+    std::remove((inname + ext).c_str());
+    std::remove((warpname + ext).c_str());
+    std::remove((outname + ext).c_str());
+}
+
+BOOST_AUTO_TEST_CASE(slabwise_same_as_apply_warp)
+{
+    check_slabwise("NIFTI", 1, false, false, trilinear, 4);
+    check_slabwise("NIFTI", 1, false, false, trilinear, 1);
+    check_slabwise("NIFTI", 1, false, false, nearestneighbour, 5);
+}
+
+BOOST_AUTO_TEST_CASE(slabwise_affine_only)
+{
+    check_slabwise("NIFTI", 1, false, true, trilinear, 3);
+}
+
+BOOST_AUTO_TEST_CASE(slabwise_neurological_input)
+{
+    check_slabwise("NIFTI", 1, true, false, trilinear, 4);
+}
+
+BOOST_AUTO_TEST_CASE(slabwise_compressed_4D)
+{
+    // Field and input both read slab by slab, the field once per volume
+    check_slabwise("NIFTI_GZ", 3, false, false, trilinear, 2);
+}
+
+BOOST_AUTO_TEST_CASE(slabwise_larger_than_image)
+{
+    check_slabwise("NIFTI", 2, false, false, trilinear, 100);
+}
+
+
+BOOST_AUTO_TEST_SUITE_END()
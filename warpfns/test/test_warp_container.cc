@@ -0,0 +1,149 @@
+#include "newimage/newimageall.h"
+#include "basisfield/splinefield.h"
+#include "warpfns/fnirt_file_reader.h"
+#include "warpfns/fnirt_file_writer.h"
+#include "warpfns/warp_container.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include <boost/version.hpp>
+#if BOOST_VERSION < 108000
+#define BOOST_NO_CXX98_FUNCTION_BASE
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+
+BOOST_AUTO_TEST_SUITE(test_warp_container)
+
+
+using namespace NEWIMAGE;
+using namespace BASISFIELD;
+
+static std::string tmpname(const std::string& name)
+{
+    return "/tmp/test_warp_container_" + std::to_string(getpid()) + "_" + name;
+}
+
+// Three cubic spline fields with smoothly varying coefficients
+static std::vector<std::shared_ptr<basisfield> > make_fields()
+{
+    std::vector<unsigned int> sz = {20, 18, 16}, ksp = {4, 4, 4};
+    std::vector<double> vxs = {2.0, 2.0, 2.5};
+    std::vector<std::shared_ptr<basisfield> > fields(3);
+    for (int i = 0; i < 3; i++) {
+        fields[i] = std::shared_ptr<basisfield>(new splinefield(sz, vxs, ksp, 3));
+        NEWMAT::ColumnVector coef(fields[i]->CoefSz());
+        for (int j = 0; j < coef.Nrows(); j++) coef.element(j) = 3.0*std::sin(0.37*j + i) + 0.1*i;
+        fields[i]->SetCoef(coef);
+    }
+    return fields;
+}
+
+static NEWMAT::Matrix make_affine()
+{
+    NEWMAT::Matrix A = NEWMAT::IdentityMatrix(4);
+    A(1, 2) = 0.05; A(2, 4) = -3.0; A(3, 3) = 1.1;
+    return A;
+}
+
+static double maxdiff(const volume4D<float>& a, const volume4D<float>& b)
+{
+    BOOST_REQUIRE(samesize(a, b, true));
+    double d = 0.0;
+    for (int t = 0; t < a.tsize(); t++) for (int k = 0; k < a.zsize(); k++) for (int j = 0; j < a.ysize(); j++) for (int i = 0; i < a.xsize(); i++) {
+        d = std::max(d, double(std::fabs(a(i, j, k, t) - b(i, j, k, t))));
+    }
+    return d;
+}
+
+BOOST_AUTO_TEST_CASE(container_round_trip)
+{
+    setenv("FSLOUTPUTTYPE", "NIFTI", 1);
+    std::vector<std::shared_ptr<basisfield> > fields = make_fields();
+    NEWMAT::Matrix A = make_affine();
+    std::string niiname = tmpname("coef"), fwcname = tmpname("coef_c"), fwcfname = tmpname("coef_cf");
+    FnirtFileWriter(niiname, fields, A, FloatStorage);
+    FnirtFileWriter(fwcname, fields, A, ContainerStorage);
+    FnirtFileWriter(fwcfname, fields, A, ContainerWithFieldStorage);
+    BOOST_REQUIRE(WarpContainer::IsContainer(fwcname));
+    BOOST_REQUIRE(WarpContainer::IsContainer(fwcfname + WarpContainer::Extension()));
+    BOOST_CHECK(!WarpContainer::IsContainer(niiname + ".nii"));
+
+    FnirtFileReader nii(niiname);
+    FnirtFileReader fwc(fwcname);
+    FnirtFileReader fwcf(fwcfname + WarpContainer::Extension());
+    for (const FnirtFileReader *r : {&fwc, &fwcf}) {
+        BOOST_CHECK_EQUAL(r->Type(), FnirtSplineDispType);
+        BOOST_CHECK(r->FieldSize() == nii.FieldSize());
+        BOOST_CHECK(r->VoxelSize() == nii.VoxelSize());
+        BOOST_CHECK(r->KnotSpacing() == nii.KnotSpacing());
+        BOOST_CHECK_EQUAL(r->SplineOrder(), nii.SplineOrder());
+        BOOST_CHECK_SMALL((r->AffineMat() - A).MaximumAbsoluteValue(), 1e-12);
+    }
+    // Coefficients are float in both formats, the affine and voxel size are
+    // float in the NIfTI header only, so the fields differ by rounding only
+    volume4D<float> fnii = nii.FieldAsNewimageVolume4D(true);
+    BOOST_CHECK_SMALL(maxdiff(fnii, fwc.FieldAsNewimageVolume4D(true)), 1e-5);
+    BOOST_CHECK_SMALL(maxdiff(fnii, fwcf.FieldAsNewimageVolume4D(true)), 1e-5);
+    BOOST_CHECK_EQUAL(maxdiff(fwc.FieldAsNewimageVolume4D(true), fwcf.FieldAsNewimageVolume4D(true)), 0.0);
+    volume4D<float> f1(fnii);
+    f1 = fwcf.FieldAsNewimageVolume(1);
+    BOOST_CHECK_SMALL(maxdiff(nii.FieldAsNewimageVolume4D()[1], f1), 1e-5);
+    BOOST_CHECK_SMALL(maxdiff(nii.Jacobian(), fwcf.Jacobian()), 1e-6);
+    splinefield sf = fwc.FieldAsSplinefield(2);
+    for (unsigned int j = 0; j < sf.CoefSz(); j++) BOOST_REQUIRE_EQUAL(float(sf.GetCoef()->element(j)), float(fields[2]->GetCoef()->element(j)));
+
+    // A copy keeps the container alive after the original is gone
+    std::unique_ptr<FnirtFileReader> tmp(new FnirtFileReader(fwcf.FileName()));
+    FnirtFileReader copy(*tmp);
+    tmp.reset();
+    BOOST_CHECK_EQUAL(maxdiff(fwcf.FieldAsNewimageVolume4D(true), copy.FieldAsNewimageVolume4D(true)), 0.0);
+
+    std::remove((niiname + ".nii").c_str());
+    std::remove((fwcname + WarpContainer::Extension()).c_str());
+    std::remove((fwcfname + WarpContainer::Extension()).c_str());
+}
+
+BOOST_AUTO_TEST_CASE(container_checksums_on_request)
+{
+    std::vector<std::shared_ptr<basisfield> > fields = make_fields();
+    std::string fname = tmpname("bad") + WarpContainer::Extension();
+    FnirtFileWriter(fname, fields, make_affine(), ContainerWithFieldStorage);
+    {
+        WarpContainer wc(fname, true);
+        wc.Verify();
+    }
+    WarpContainerHeader hdr;
+    {
+        std::fstream fs(fname.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+        fs.read(reinterpret_cast<char *>(&hdr), sizeof(hdr));
+        char c;
+        fs.seekg(hdr.field_offset + 100); fs.read(&c, 1);
+        c ^= 0x10;
+        fs.seekp(hdr.field_offset + 100); fs.write(&c, 1);
+    }
+    // Opening does not read the sections, verifying does
+    WarpContainer wc(fname);
+    BOOST_CHECK_THROW(wc.Verify(), WarpContainerException);
+    BOOST_CHECK_THROW(WarpContainer(fname, true), WarpContainerException);
+    BOOST_CHECK_NO_THROW(FnirtFileReader r(fname));
+
+    // ... but a damaged header is always caught
+    {
+        std::fstream fs(fname.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+        hdr.ksp[0]++;
+        fs.write(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+    }
+    BOOST_CHECK_THROW(WarpContainer wc2(fname), WarpContainerException);
+    std::remove(fname.c_str());
+}
+
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,289 @@
+#include "newimage/newimageall.h"
+#include "basisfield/splinefield.h"
+#include "warpfns/warpfns.h"
+#include "warpfns/fnirt_file_reader.h"
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include <boost/version.hpp>
+#if BOOST_VERSION < 108000
+#define BOOST_NO_CXX98_FUNCTION_BASE
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+
+BOOST_AUTO_TEST_SUITE(test_warp_sources)
+
+
+using namespace NEWIMAGE;
+using namespace BASISFIELD;
+
+// Compares SplineDisplacementSource, WarpSamplingPlan/apply_warp_4D and
+// CompositeWarp to apply_warp with the field as a volume4D<float>, which
+// is the reference implementation.
+
+static const int FSZ[3] = {24, 22, 20};
+
+static double peek(const splinefield& f, double x, double y, double z) { return(f.Peek(x, y, z)); }
+
+// Three cubic spline fields (mm) with displacements of a few mm
+static std::vector<std::shared_ptr<splinefield> > make_fields()
+{
+    std::vector<unsigned int> sz = {24, 22, 20}, ksp = {4, 4, 4};
+    std::vector<double> vxs = {2.0, 2.0, 2.0};
+    std::vector<std::shared_ptr<splinefield> > fields(3);
+    for (int i = 0; i < 3; i++) {
+        fields[i] = std::make_shared<splinefield>(sz, vxs, ksp, 3);
+        NEWMAT::ColumnVector coef(fields[i]->CoefSz());
+        for (int j = 0; j < coef.Nrows(); j++) coef.element(j) = 2.5*std::sin(0.41*j + 1.3*i) + 0.3*i;
+        fields[i]->SetCoef(coef);
+    }
+    return fields;
+}
+
+// The same field as a volume4D
+static volume4D<float> field_volume(const std::vector<std::shared_ptr<splinefield> >& fields)
+{
+    volume4D<float> d(FSZ[0], FSZ[1], FSZ[2], 3);
+    d.setdims(2.0, 2.0, 2.0, 1.0);
+    for (int t = 0; t < 3; t++) {
+        for (int k = 0; k < FSZ[2]; k++) for (int j = 0; j < FSZ[1]; j++) for (int i = 0; i < FSZ[0]; i++) {
+            d(i, j, k, t) = peek(*fields[t], i, j, k);
+        }
+    }
+    return d;
+}
+
+// The field evaluated (exactly) at the voxel centres of out, given that
+// out maps onto the field by TT. Points outside the field get the value
+// at the nearest point on its edge, as in SplineDisplacementSource.
+static volume4D<float> field_on_grid(const std::vector<std::shared_ptr<splinefield> >& fields,
+                                     const volume4D<float>& d, const NEWMAT::Matrix& TT, const volume<float>& out)
+{
+    volume4D<float> od(out.xsize(), out.ysize(), out.zsize(), 3);
+    od.setdims(out.xdim(), out.ydim(), out.zdim(), 1.0);
+    NEWMAT::Matrix iT = d.sampling_mat().i() * TT.i() * out.sampling_mat();
+    for (int k = 0; k < out.zsize(); k++) for (int j = 0; j < out.ysize(); j++) for (int i = 0; i < out.xsize(); i++) {
+        double v[3];
+        for (int r = 0; r < 3; r++) {
+            v[r] = iT(r+1, 1)*i + iT(r+1, 2)*j + iT(r+1, 3)*k + iT(r+1, 4);
+            v[r] = std::min(std::max(v[r], 0.0), double(FSZ[r]-1));
+        }
+        for (int t = 0; t < 3; t++) od(i, j, k, t) = peek(*fields[t], v[0], v[1], v[2]);
+    }
+    return od;
+}
+
+// Smooth input with some structure, on a grid different from the field
+static volume4D<float> make_input(int nt)
+{
+    volume4D<float> f(30, 27, 25, nt);
+    f.setdims(1.8, 1.8, 1.8, 1.0);
+    for (int t = 0; t < nt; t++) for (int k = 0; k < 25; k++) for (int j = 0; j < 27; j++) for (int i = 0; i < 30; i++) {
+        f(i, j, k, t) = 100.0 + 40.0*std::sin(0.3*i + t)*std::cos(0.25*j) + 2.0*k + ((i/6 + j/6 + k/6) % 2)*30.0;
+    }
+    return f;
+}
+
+static NEWMAT::Matrix make_affine()
+{
+    NEWMAT::Matrix A = NEWMAT::IdentityMatrix(4);
+    A(1, 1) = 1.04; A(1, 2) = 0.03; A(2, 1) = -0.02; A(2, 2) = 0.97; A(3, 3) = 1.02;
+    A(1, 4) = 1.5; A(2, 4) = -2.0; A(3, 4) = 0.7;
+    return A;
+}
+
+// Rotation by 10 degrees around z (and a shift), mm->mm
+static NEWMAT::Matrix make_rotation()
+{
+    NEWMAT::Matrix R = NEWMAT::IdentityMatrix(4);
+    double a = 10.0*M_PI/180.0;
+    R(1, 1) = std::cos(a); R(1, 2) = -std::sin(a); R(2, 1) = std::sin(a); R(2, 2) = std::cos(a);
+    R(1, 4) = 3.0; R(2, 4) = -4.0; R(3, 4) = 1.0;
+    return R;
+}
+
+static volume<float> make_output(int nx, int ny, int nz, double vxs)
+{
+    volume<float> out(nx, ny, nz);
+    out.setdims(vxs, vxs, vxs);
+    out = 0.0f;
+    return out;
+}
+
+// Largest difference in the voxels where mask (if given) is set, relative to the range of ref
+static double reldiff(const volume<float>& a, const volume<float>& ref, const volume<char> *mask=nullptr)
+{
+    BOOST_REQUIRE(samesize(a, ref));
+    double md = 0.0;
+    for (int k = 0; k < a.zsize(); k++) for (int j = 0; j < a.ysize(); j++) for (int i = 0; i < a.xsize(); i++) {
+        if (mask && !(*mask)(i, j, k)) continue;
+        md = std::max(md, std::fabs(double(a(i, j, k)) - double(ref(i, j, k))));
+    }
+    return md / (ref.max() - ref.min());
+}
+
+static unsigned int nset(const volume<char>& mask)
+{
+    unsigned int n = 0;
+    for (int k = 0; k < mask.zsize(); k++) for (int j = 0; j < mask.ysize(); j++) for (int i = 0; i < mask.xsize(); i++) n += mask(i, j, k) ? 1 : 0;
+    return n;
+}
+
+BOOST_AUTO_TEST_CASE(spline_source_on_field_grid)
+{
+    std::vector<std::shared_ptr<splinefield> > fields = make_fields();
+    volume4D<float> d = field_volume(fields);
+    SplineDisplacementSource sd(*fields[0], *fields[1], *fields[2], d.sampling_mat());
+    volume<float> f = make_input(1)[0];
+    NEWMAT::Matrix A = make_affine(), I = NEWMAT::IdentityMatrix(4);
+    volume<float> ref = make_output(FSZ[0], FSZ[1], FSZ[2], 2.0), out = ref;
+    apply_warp(f, A, d, I, I, ref);
+    apply_warp(f, A, sd, I, I, out, Utilities::NoOfThreads(3));
+    BOOST_CHECK_SMALL(reldiff(out, ref), 1e-5);
+}
+
+BOOST_AUTO_TEST_CASE(spline_source_rotated_finer_grid)
+{
+    // A rotated output space means that the points of a row differ in y
+    // and z in the field, so Row() has to evaluate full tensor products.
+    // The reference is apply_warp with the field evaluated on the output
+    // grid, which gives the same coordinates if the rotation is moved into
+    // the affine.
+    std::vector<std::shared_ptr<splinefield> > fields = make_fields();
+    volume4D<float> d = field_volume(fields);
+    SplineDisplacementSource sd(*fields[0], *fields[1], *fields[2], d.sampling_mat());
+    volume<float> f = make_input(1)[0];
+    NEWMAT::Matrix A = make_affine(), R = make_rotation(), I = NEWMAT::IdentityMatrix(4);
+    volume<float> ref = make_output(33, 30, 28, 1.4), out = ref;
+    volume4D<float> od = field_on_grid(fields, d, R, ref);
+    apply_warp(f, R*A, od, I, I, ref);
+    apply_warp(f, A, sd, R, I, out, Utilities::NoOfThreads(2));
+    BOOST_CHECK_SMALL(reldiff(out, ref), 1e-5);
+    // Unrotated but finer grid, i.e. points in a row share y and z
+    volume<float> ref2 = make_output(33, 30, 28, 1.4), out2 = ref2;
+    apply_warp(f, A, field_on_grid(fields, d, I, ref2), I, I, ref2);
+    apply_warp(f, A, sd, I, I, out2);
+    BOOST_CHECK_SMALL(reldiff(out2, ref2), 1e-5);
+}
+
+BOOST_AUTO_TEST_CASE(spline_source_slice_subset)
+{
+    std::vector<std::shared_ptr<splinefield> > fields = make_fields();
+    volume4D<float> d = field_volume(fields);
+    SplineDisplacementSource sd(*fields[0], *fields[1], *fields[2], d.sampling_mat());
+    volume<float> f = make_input(1)[0];
+    NEWMAT::Matrix A = make_affine(), I = NEWMAT::IdentityMatrix(4);
+    std::vector<unsigned int> slices = {0, 3, 7, 8, 19};
+    volume<float> ref = make_output(FSZ[0], FSZ[1], FSZ[2], 2.0), out = ref;
+    volume<char> refmask, mask;
+    apply_warp(f, A, d, I, I, slices, ref, refmask);
+    apply_warp(f, A, sd, I, I, slices, out, mask);
+    BOOST_CHECK_SMALL(reldiff(out, ref), 1e-5);
+    BOOST_CHECK_EQUAL(nset(mask), nset(refmask));
+    BOOST_CHECK_GT(nset(mask), 0u);
+    for (int k = 0; k < FSZ[2]; k++) {
+        bool insubset = std::find(slices.begin(), slices.end(), static_cast<unsigned int>(k)) != slices.end();
+        if (!insubset) BOOST_CHECK_EQUAL(out(5, 5, k), 0.0f);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sampling_plan_same_as_apply_warp)
+{
+    std::vector<std::shared_ptr<splinefield> > fields = make_fields();
+    volume4D<float> d = field_volume(fields);
+    volume4D<float> f = make_input(3);
+    NEWMAT::Matrix A = make_affine(), R = make_rotation(), I = NEWMAT::IdentityMatrix(4);
+    for (interpolation interp : {trilinear, nearestneighbour}) {
+        BOOST_TEST_CONTEXT("interp = " << interp) {
+            f.setinterpolationmethod(interp);
+            // On the field grid, and on a rotated finer grid
+            for (int g = 0; g < 2; g++) {
+                volume<float> o = g ? make_output(33, 30, 28, 1.4) : make_output(FSZ[0], FSZ[1], FSZ[2], 2.0);
+                const NEWMAT::Matrix& TT = g ? R : I;
+                volume4D<float> out(o.xsize(), o.ysize(), o.zsize(), f.tsize());
+                out.setdims(o.xdim(), o.ydim(), o.zdim(), 1.0);
+                apply_warp_4D(f, A, d, TT, I, out, Utilities::NoOfThreads(2));
+                for (int t = 0; t < f.tsize(); t++) {
+                    volume<float> ref = o;
+                    apply_warp(f[t], A, d, TT, I, ref);
+                    BOOST_CHECK_SMALL(reldiff(out[t], ref), 1e-6);
+                }
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(composite_single_stage_same_as_apply_warp)
+{
+    // An affine M from the input onto the space the warp was estimated
+    // in, followed by the warp, is what apply_warp does with M.
+    std::vector<std::shared_ptr<splinefield> > fields = make_fields();
+    volume4D<float> d = field_volume(fields);
+    SplineDisplacementSource sd(*fields[0], *fields[1], *fields[2], d.sampling_mat());
+    volume<float> f = make_input(1)[0];
+    NEWMAT::Matrix A = make_affine(), M = make_rotation(), I = NEWMAT::IdentityMatrix(4);
+    CompositeWarp wv, ws;
+    wv.AddAffine(M); wv.AddWarp(d, A);
+    ws.AddAffine(M); ws.AddWarp(sd, A);
+    BOOST_CHECK_EQUAL(wv.NStages(), 2u);
+    // Field grid and finer grid (volume field interpolated in both)
+    for (int g = 0; g < 2; g++) {
+        volume<float> ref = g ? make_output(33, 30, 28, 1.4) : make_output(FSZ[0], FSZ[1], FSZ[2], 2.0);
+        volume<float> outv = ref, outs = ref, refs = ref;
+        apply_warp(f, A, d, I, M, ref);
+        apply_warp(f, wv, outv, Utilities::NoOfThreads(2));
+        BOOST_CHECK_SMALL(reldiff(outv, ref), 1e-5);
+        apply_warp(f, A, sd, I, M, refs);
+        apply_warp(f, ws, outs);
+        BOOST_CHECK_SMALL(reldiff(outs, refs), 1e-5);
+    }
+    // Slice subset, with mask
+    std::vector<unsigned int> slices = {1, 2, 11, 19};
+    volume<float> ref = make_output(FSZ[0], FSZ[1], FSZ[2], 2.0), out = ref;
+    volume<char> refmask, mask;
+    volume<float> jac;
+    apply_warp(f, A, d, I, M, slices, ref, refmask);
+    apply_warp(f, wv, slices, out, mask, jac);
+    BOOST_CHECK_SMALL(reldiff(out, ref), 1e-5);
+    BOOST_CHECK_EQUAL(nset(mask), nset(refmask));
+}
+
+BOOST_AUTO_TEST_CASE(composite_jacobian_same_as_deffield2jacobian)
+{
+    std::vector<std::shared_ptr<splinefield> > fields = make_fields();
+    volume4D<float> d = field_volume(fields);
+    SplineDisplacementSource sd(*fields[0], *fields[1], *fields[2], d.sampling_mat());
+    volume<float> f = make_input(1)[0];
+    NEWMAT::Matrix A = make_affine();
+    volume<float> refjac(FSZ[0], FSZ[1], FSZ[2]);
+    refjac.setdims(2.0, 2.0, 2.0);
+    deffield2jacobian(*fields[0], *fields[1], *fields[2], A, refjac);
+    BOOST_REQUIRE_GT(refjac.max() - refjac.min(), 0.1);   // Make sure the field is not trivial
+
+    // Single warp stage. An affine stage in front of it multiplies the
+    // determinant by that of the affine.
+    NEWMAT::Matrix M = make_rotation();
+    M(1, 1) *= 1.1;
+    for (int withM = 0; withM < 2; withM++) {
+        CompositeWarp w;
+        if (withM) w.AddAffine(M);
+        w.AddWarp(sd, A);
+        volume<float> out = make_output(FSZ[0], FSZ[1], FSZ[2], 2.0);
+        volume<char> mask;
+        volume<float> jac;
+        std::vector<unsigned int> slices;
+        apply_warp(f, w, slices, out, mask, jac);
+        double s = withM ? 1.0/M.SubMatrix(1, 3, 1, 3).Determinant() : 1.0;
+        double md = 0.0;
+        for (int k = 0; k < FSZ[2]; k++) for (int j = 0; j < FSZ[1]; j++) for (int i = 0; i < FSZ[0]; i++) {
+            md = std::max(md, std::fabs(jac(i, j, k) - s*refjac(i, j, k)));
+        }
+        BOOST_CHECK_SMALL(md, 1e-4);
+    }
+}
+
+
+BOOST_AUTO_TEST_SUITE_END()
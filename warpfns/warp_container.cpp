@@ -0,0 +1,229 @@
+// Definitions of class used to read and write
+// spline coefficient files in a compact binary
+// container that can be memory mapped.
+//
+// warp_container.cpp
+//
+/*  CCOPYRIGHT  */
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "armawrap/newmat.h"
+#include "newimage/newimageall.h"
+#include "basisfield/splinefield.h"
+#include "warp_container.h"
+
+using namespace std;
+using namespace NEWMAT;
+using namespace BASISFIELD;
+
+namespace NEWIMAGE {
+
+static const char     WarpContainerMagic[8] = {'F','S','L','W','A','R','P','C'};
+static const uint32_t WarpContainerEndian = 0x01020304;
+static const uint64_t WarpContainerAlign = 64;
+
+static_assert(sizeof(WarpContainerHeader) == 320, "WarpContainerHeader has unexpected size");
+
+static uint32_t container_crc(const void *data, uint64_t n)
+{
+  uLong crc = crc32(0L,Z_NULL,0);
+  const Bytef *p = static_cast<const Bytef *>(data);
+  while (n) { // crc32 takes a uInt length
+    uInt chunk = static_cast<uInt>(std::min<uint64_t>(n,1u<<30));
+    crc = crc32(crc,p,chunk);
+    p += chunk; n -= chunk;
+  }
+  return(static_cast<uint32_t>(crc));
+}
+
+static uint64_t container_align(uint64_t offset) { return(((offset+WarpContainerAlign-1)/WarpContainerAlign)*WarpContainerAlign); }
+
+static bool has_container_magic(const string& fname)
+{
+  ifstream fs(fname.c_str(),ios::in|ios::binary);
+  char magic[8];
+  if (!fs.read(magic,8)) return(false);
+  return(memcmp(magic,WarpContainerMagic,8) == 0);
+}
+
+string WarpContainer::FileName(const string& fname)
+{
+  if (has_container_magic(fname)) return(fname);
+  if (has_container_magic(fname+Extension())) return(fname+Extension());
+  return(string(""));
+}
+
+void WarpContainer::Write(const string&        fname,
+                          const splinefield&   fx,
+                          const splinefield&   fy,
+                          const splinefield&   fz,
+                          const Matrix&        aff,
+                          bool                 with_field)
+{
+  const splinefield *f[3] = {&fx, &fy, &fz};
+  for (unsigned int i=1; i<3; i++) {
+    if (f[i]->Order() != fx.Order() || f[i]->Ksp_x() != fx.Ksp_x() || f[i]->Ksp_y() != fx.Ksp_y() || f[i]->Ksp_z() != fx.Ksp_z() ||
+        f[i]->FieldSz_x() != fx.FieldSz_x() || f[i]->FieldSz_y() != fx.FieldSz_y() || f[i]->FieldSz_z() != fx.FieldSz_z()) {
+      throw WarpContainerException("Write: Fields must all have the same size and knot-spacing");
+    }
+  }
+  if (aff.Nrows() != 4 || aff.Ncols() != 4) throw WarpContainerException("Write: aff must be a 4x4 matrix");
+
+  WarpContainerHeader hdr;
+  memset(&hdr,0,sizeof(hdr));
+  memcpy(hdr.magic,WarpContainerMagic,8);
+  hdr.endian = WarpContainerEndian;
+  hdr.version = Version;
+  hdr.hdr_size = sizeof(WarpContainerHeader);
+  hdr.order = fx.Order();
+  hdr.fsz[0] = fx.FieldSz_x(); hdr.fsz[1] = fx.FieldSz_y(); hdr.fsz[2] = fx.FieldSz_z();
+  hdr.ksp[0] = fx.Ksp_x(); hdr.ksp[1] = fx.Ksp_y(); hdr.ksp[2] = fx.Ksp_z();
+  hdr.csz[0] = fx.CoefSz_x(); hdr.csz[1] = fx.CoefSz_y(); hdr.csz[2] = fx.CoefSz_z();
+  hdr.vxs[0] = fx.Vxs_x(); hdr.vxs[1] = fx.Vxs_y(); hdr.vxs[2] = fx.Vxs_z();
+  for (unsigned int r=0; r<4; r++) for (unsigned int c=0; c<4; c++) hdr.aff[4*r+c] = aff(r+1,c+1);
+
+  // Coefficients as float
+  uint64_t ncoef = uint64_t(hdr.csz[0])*hdr.csz[1]*hdr.csz[2];
+  vector<float> coef(3*ncoef);
+  for (unsigned int i=0; i<3; i++) {
+    std::shared_ptr<ColumnVector> c = f[i]->GetCoef();
+    if (static_cast<uint64_t>(c->Nrows()) != ncoef) throw WarpContainerException("Write: Coefficients not self consistent");
+    for (uint64_t j=0; j<ncoef; j++) coef[i*ncoef+j] = static_cast<float>(c->element(j));
+  }
+  hdr.coef_offset = container_align(sizeof(WarpContainerHeader));
+  hdr.coef_size = coef.size()*sizeof(float);
+  hdr.coef_crc = container_crc(&coef[0],hdr.coef_size);
+
+  // Field, evaluated from the stored (float) coefficients the same way as
+  // by FnirtFileReader::FieldAsNewimageVolume4D(), so that it is identical
+  // to what a reader of a container without field would calculate.
+  volume4D<float> field;
+  if (with_field) {
+    field.reinitialize(hdr.fsz[0],hdr.fsz[1],hdr.fsz[2],3);
+    field.setdims(hdr.vxs[0],hdr.vxs[1],hdr.vxs[2],1.0);
+    for (unsigned int i=0; i<3; i++) {
+      ShadowVolume<float> fieldi(field[i]);
+      splinefield tmp(*f[i]);
+      ColumnVector c(ncoef);
+      for (uint64_t j=0; j<ncoef; j++) c.element(j) = coef[i*ncoef+j];
+      tmp.SetCoef(c);
+      tmp.AsVolume(fieldi);
+    }
+    hdr.flags |= 1;
+    hdr.field_offset = container_align(hdr.coef_offset + hdr.coef_size);
+    hdr.field_size = 3*uint64_t(field.nvoxels())*sizeof(float);
+    hdr.field_crc = container_crc(field.fbegin(),hdr.field_size);
+  }
+  hdr.hdr_crc = container_crc(&hdr,offsetof(WarpContainerHeader,hdr_crc));
+
+  string oname = fname;
+  if (oname.size() < Extension().size() || oname.compare(oname.size()-Extension().size(),Extension().size(),Extension()) != 0) oname += Extension();
+  ofstream fs(oname.c_str(),ios::out|ios::binary|ios::trunc);
+  if (!fs) throw WarpContainerException("Write: Unable to open "+oname+" for writing");
+  vector<char> zeros(WarpContainerAlign,0);
+  fs.write(reinterpret_cast<const char *>(&hdr),sizeof(hdr));
+  fs.write(&zeros[0],hdr.coef_offset-sizeof(hdr));
+  fs.write(reinterpret_cast<const char *>(&coef[0]),hdr.coef_size);
+  if (with_field) {
+    fs.write(&zeros[0],hdr.field_offset-(hdr.coef_offset+hdr.coef_size));
+    fs.write(reinterpret_cast<const char *>(field.fbegin()),hdr.field_size);
+  }
+  if (!fs) throw WarpContainerException("Write: Error writing "+oname);
+}
+
+WarpContainer::WarpContainer(const string& fname, bool verify)
+  : _fname(FileName(fname)), _map(nullptr), _len(0), _mapped(false)
+{
+  if (!_fname.size()) throw WarpContainerException("WarpContainer: "+fname+" is not a warp container");
+  int fd = open(_fname.c_str(),O_RDONLY);
+  if (fd < 0) throw WarpContainerException("WarpContainer: Unable to open "+_fname);
+  struct stat st;
+  if (fstat(fd,&st) != 0) { close(fd); throw WarpContainerException("WarpContainer: Unable to stat "+_fname); }
+  _len = static_cast<size_t>(st.st_size);
+  if (_len < sizeof(WarpContainerHeader)) { close(fd); throw WarpContainerException("WarpContainer: "+_fname+" is truncated"); }
+  void *map = mmap(nullptr,_len,PROT_READ,MAP_PRIVATE,fd,0);
+  if (map != MAP_FAILED) { _map = static_cast<const char *>(map); _mapped = true; }
+  else { // Read it instead
+    _buf.resize(_len);
+    size_t nread = 0;
+    while (nread < _len) {
+      ssize_t n = read(fd,&_buf[nread],_len-nread);
+      if (n <= 0) { close(fd); throw WarpContainerException("WarpContainer: Error reading "+_fname); }
+      nread += static_cast<size_t>(n);
+    }
+    _map = &_buf[0];
+  }
+  close(fd);
+
+  try {
+    memcpy(&_hdr,_map,sizeof(_hdr));
+    if (_hdr.endian != WarpContainerEndian) throw WarpContainerException("WarpContainer: "+_fname+" was written with a different byte order");
+    if (_hdr.version > Version) throw WarpContainerException("WarpContainer: "+_fname+" is of a newer version than this reader");
+    if (_hdr.hdr_size != sizeof(WarpContainerHeader)) throw WarpContainerException("WarpContainer: Unexpected header size in "+_fname);
+    if (container_crc(&_hdr,offsetof(WarpContainerHeader,hdr_crc)) != _hdr.hdr_crc) throw WarpContainerException("WarpContainer: Header checksum mismatch in "+_fname);
+    for (unsigned int i=0; i<3; i++) {
+      if (!_hdr.fsz[i] || !_hdr.ksp[i] || !_hdr.csz[i]) throw WarpContainerException("WarpContainer: Invalid sizes in "+_fname);
+    }
+    check_section(_hdr.coef_offset,_hdr.coef_size,3*uint64_t(_hdr.csz[0])*_hdr.csz[1]*_hdr.csz[2]*sizeof(float),"coefficients");
+    if (HasField()) check_section(_hdr.field_offset,_hdr.field_size,3*uint64_t(_hdr.fsz[0])*_hdr.fsz[1]*_hdr.fsz[2]*sizeof(float),"field");
+    if (verify) Verify();
+  }
+  catch (...) {
+    if (_mapped) munmap(const_cast<char *>(_map),_len);
+    throw;
+  }
+}
+
+WarpContainer::~WarpContainer()
+{
+  if (_mapped) munmap(const_cast<char *>(_map),_len);
+}
+
+void WarpContainer::check_section(uint64_t offset, uint64_t size, uint64_t expected, const string& name) const
+{
+  if (size != expected) throw WarpContainerException("WarpContainer: Size of "+name+" inconsistent with header in "+_fname);
+  if (offset % WarpContainerAlign || offset < sizeof(WarpContainerHeader) || offset+size > _len) {
+    throw WarpContainerException("WarpContainer: "+_fname+" is truncated or has invalid "+name+" offset");
+  }
+}
+
+void WarpContainer::Verify() const
+{
+  if (container_crc(_map+_hdr.coef_offset,_hdr.coef_size) != _hdr.coef_crc) {
+    throw WarpContainerException("WarpContainer: Checksum mismatch for coefficients in "+_fname);
+  }
+  if (HasField() && container_crc(_map+_hdr.field_offset,_hdr.field_size) != _hdr.field_crc) {
+    throw WarpContainerException("WarpContainer: Checksum mismatch for field in "+_fname);
+  }
+}
+
+Matrix WarpContainer::AffineMat() const
+{
+  Matrix aff(4,4);
+  for (unsigned int r=0; r<4; r++) for (unsigned int c=0; c<4; c++) aff(r+1,c+1) = _hdr.aff[4*r+c];
+  return(aff);
+}
+
+const float *WarpContainer::Coef(unsigned int i) const
+{
+  if (i > 2) throw WarpContainerException("Coef: i out of range");
+  return(reinterpret_cast<const float *>(_map+_hdr.coef_offset) + i*uint64_t(_hdr.csz[0])*_hdr.csz[1]*_hdr.csz[2]);
+}
+
+const float *WarpContainer::Field(unsigned int i) const
+{
+  if (i > 2) throw WarpContainerException("Field: i out of range");
+  if (!HasField()) throw WarpContainerException("Field: "+_fname+" has no field section");
+  return(reinterpret_cast<const float *>(_map+_hdr.field_offset) + i*uint64_t(_hdr.fsz[0])*_hdr.fsz[1]*_hdr.fsz[2]);
+}
+
+} // End namespace NEWIMAGE
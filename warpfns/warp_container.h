@@ -0,0 +1,142 @@
+// Declarations of class used to read and write
+// spline coefficient files in a compact binary
+// container that can be memory mapped.
+//
+// warp_container.h
+//
+// A coefficient file in NIfTI format stores the knot-spacing, spline
+// order, field size and affine in header fields that were never meant
+// for them, and has to be decompressed and decoded in full before it
+// can be used. The container is a fixed size header with the same
+// information stated explicitly, followed by the coefficients as
+// floats and, optionally, the displacement field evaluated at every
+// voxel so that readers that need the field do not have to calculate
+// it. Each section has a CRC32 checksum, which is checked on request
+// (the header checksum is always checked). All sections start on 64
+// byte boundaries and are read straight from a memory mapping of the
+// file.
+// Files are written in native byte order and the reader refuses files
+// with the other byte order.
+//
+/*  CCOPYRIGHT  */
+
+#ifndef warp_container_h
+#define warp_container_h
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "armawrap/newmat.h"
+#include "basisfield/splinefield.h"
+
+namespace NEWIMAGE {
+
+class WarpContainerException: public std::exception
+{
+private:
+  std::string m_msg;
+public:
+  WarpContainerException(const std::string& msg) noexcept: m_msg(std::string("WarpContainer:: msg=") + msg) {}
+  virtual const char * what() const noexcept { return(m_msg.c_str()); }
+  ~WarpContainerException() noexcept {}
+};
+
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+//
+// Layout of the header, which is at the start of the file. The
+// coefficients (and the field) are stored as three consecutive
+// volumes (x-, y- and z-displacements), x fastest, i.e. in the
+// same order as the coefficients of a splinefield.
+//
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+
+struct WarpContainerHeader
+{
+  char      magic[8];       // "FSLWARPC"
+  uint32_t  endian;         // 0x01020304 in the byte order of the writer
+  uint32_t  version;        // Format version
+  uint32_t  hdr_size;       // sizeof(WarpContainerHeader)
+  uint32_t  order;          // Spline order
+  uint32_t  fsz[3];         // Field size
+  uint32_t  ksp[3];         // Knot-spacing
+  uint32_t  csz[3];         // Coefficient size
+  uint32_t  flags;          // Bit 0 set if there is a field section
+  double    vxs[3];         // Voxel size of field
+  double    aff[16];        // Affine part of transform, row by row
+  uint64_t  coef_offset;    // Offset (bytes) of coefficients from start of file
+  uint64_t  coef_size;      // Size (bytes) of coefficients
+  uint64_t  field_offset;   // Offset of field, zero if there is none
+  uint64_t  field_size;     // Size of field
+  uint32_t  coef_crc;       // CRC32 of coefficients
+  uint32_t  field_crc;      // CRC32 of field
+  uint32_t  reserved[14];
+  uint32_t  hdr_crc;        // CRC32 of all of the above
+  uint32_t  pad;
+};
+
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+//
+// Class WarpContainer:
+//
+// Opening a container maps the file and checks the header and that
+// the sections are where it says, after which Coef() and Field()
+// point directly into the mapping. Checking the section checksums
+// means reading all of the file, so it is only done if verify is
+// set or when Verify() is called. The mapping is released when the object goes out
+// of scope, so it has to outlive any use of those pointers.
+// Write() creates a container from three splinefields.
+//
+//@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
+
+class WarpContainer
+{
+public:
+  static const uint32_t Version = 1;
+  // The file that fname refers to (fname itself or fname with the
+  // container extension added) if it is a container, otherwise "".
+  static std::string FileName(const std::string& fname);
+  static bool IsContainer(const std::string& fname) { return(FileName(fname).size() != 0); }
+  static std::string Extension() { return(std::string(".fwc")); }
+  // Writes fx, fy and fz and the affine aff to fname (with the container
+  // extension added if not already there). If with_field is true the
+  // displacement field is also evaluated and stored.
+  static void Write(const std::string&               fname,
+                    const BASISFIELD::splinefield&   fx,
+                    const BASISFIELD::splinefield&   fy,
+                    const BASISFIELD::splinefield&   fz,
+                    const NEWMAT::Matrix&            aff,
+                    bool                             with_field=false);
+
+  explicit WarpContainer(const std::string& fname, bool verify=false);
+  ~WarpContainer();
+  WarpContainer(const WarpContainer&) = delete;
+  WarpContainer& operator=(const WarpContainer&) = delete;
+
+  std::string FileName() const { return(_fname); }
+  unsigned int SplineOrder() const { return(_hdr.order); }
+  std::vector<unsigned int> FieldSize() const { return(std::vector<unsigned int>(_hdr.fsz,_hdr.fsz+3)); }
+  std::vector<double> VoxelSize() const { return(std::vector<double>(_hdr.vxs,_hdr.vxs+3)); }
+  std::vector<unsigned int> KnotSpacing() const { return(std::vector<unsigned int>(_hdr.ksp,_hdr.ksp+3)); }
+  std::vector<unsigned int> CoefSize() const { return(std::vector<unsigned int>(_hdr.csz,_hdr.csz+3)); }
+  NEWMAT::Matrix AffineMat() const;
+  // Coefficients/field for displacements in direction i (0, 1 or 2)
+  const float *Coef(unsigned int i) const;
+  bool HasField() const { return(_hdr.field_offset != 0); }
+  const float *Field(unsigned int i) const;
+  // Throws if the checksum of any section does not match
+  void Verify() const;
+
+private:
+  std::string                  _fname;
+  WarpContainerHeader          _hdr;
+  const char                   *_map;     // Start of file contents
+  size_t                       _len;      // Length of file
+  bool                         _mapped;   // True if _map is a mapping, false if it points into _buf
+  std::vector<char>            _buf;      // Used when the file cannot be mapped
+
+  void check_section(uint64_t offset, uint64_t size, uint64_t expected, const std::string& name) const;
+};
+
+} // End namespace NEWIMAGE
+
+#endif // End #ifndef warp_container_h
@@ -23,6 +23,7 @@
 #include "basisfield/splinefield.h"
 #include "basisfield/dctfield.h"
 #include "warpfns.h"
+#include "realfft3.h"
 
 using namespace std;
 using namespace NEWMAT;
@@ -318,28 +319,23 @@ volume<float> calc_sigloss(volume4D<float>& lrgrad, float te, float gammabar)
 
 // topology preservation code
 
-void jacobian_check(volume4D<float>& jvol,
-		    ColumnVector& jacobian_stats,
-		    const volume4D<float>& warp,
-		    float minJ, float maxJ, bool use_vol)
+// Does the work of jacobian_check for slices zfirst to (one past) zlast.
+// Each slab gets its own stats, which are then combined by the caller.
+static void jacobian_check_slab(int zfirst, int zlast,
+				volume4D<float>& jvol,
+				ColumnVector& jacobian_stats,
+				const volume4D<float>& warp,
+				float minJ, float maxJ, bool use_vol)
 {
-  // set up jacobian stats to contain: min, max, num < minJ, num > maxJ
-  if (jacobian_stats.Nrows()!=4) { jacobian_stats.ReSize(4); }
+  jacobian_stats.ReSize(4);
   jacobian_stats = 0.0;
   jacobian_stats(1)=1.0; jacobian_stats(2)=1.0;
-  if (use_vol) {
-    if ((jvol.tsize()!=8) || !samesize(jvol[0],warp[0])) {
-      jvol = warp;  // set up all the right properties
-      jvol = 0.0f;
-      for (int n=1; n<=5; n++) { jvol.addvolume(jvol[0]); }
-    }
-  }
   float Jfff, Jbff, Jfbf, Jffb, Jbbf, Jbfb, Jfbb, Jbbb;
   float wx000=0,wx001=0,wx010=0,wx011=0,wx100=0,wx101=0,wx110=0,wx111=0;
   float wy000=0,wy001=0,wy010=0,wy011=0,wy100=0,wy101=0,wy110=0,wy111=0;
   float wz000=0,wz001=0,wz010=0,wz011=0,wz100=0,wz101=0,wz110=0,wz111=0;
   float volscale=1.0/(warp.xdim() * warp.ydim() * warp.zdim());
-  for (int z=warp.minz(); z<=warp.maxz()-1; z++) {
+  for (int z=zfirst; z<zlast; z++) {
     for (int y=warp.miny(); y<=warp.maxy()-1; y++) {
       for (int x=warp.minx(); x<=warp.maxx()-1; x++) {
 	warp[0].getneighbours(x,y,z,wx000,wx001,wx010,wx011,
@@ -452,6 +448,43 @@ void jacobian_check(volume4D<float>& jvol,
   }
 }
 
+void jacobian_check(volume4D<float>& jvol,
+		    ColumnVector& jacobian_stats,
+		    const volume4D<float>& warp,
+		    float minJ, float maxJ, bool use_vol,
+		    Utilities::NoOfThreads nthr)
+{
+  // set up jacobian stats to contain: min, max, num < minJ, num > maxJ
+  if (jacobian_stats.Nrows()!=4) { jacobian_stats.ReSize(4); }
+  jacobian_stats = 0.0;
+  jacobian_stats(1)=1.0; jacobian_stats(2)=1.0;
+  if (use_vol) {
+    if ((jvol.tsize()!=8) || !samesize(jvol[0],warp[0])) {
+      jvol = warp;  // set up all the right properties
+      jvol = 0.0f;
+      for (int n=1; n<=5; n++) { jvol.addvolume(jvol[0]); }
+    }
+  }
+  int nz = warp.maxz() - warp.minz();   // Number of slices with a Jacobian
+  if (nz <= 0) return;
+  unsigned int nt = static_cast<unsigned int>(std::max(int64_t(1),std::min(nthr._n,int64_t(nz))));
+  std::vector<unsigned int> nzs = RGT_UTILS::rows_per_thread(static_cast<unsigned int>(nz),nt);
+  std::vector<ColumnVector> stats(nt);
+  std::vector<std::thread> threads(nt-1); // + main thread makes nt
+  for (unsigned int i=0; i<nt-1; i++) {
+    threads[i] = std::thread(jacobian_check_slab,warp.minz()+int(nzs[i]),warp.minz()+int(nzs[i+1]),std::ref(jvol),
+			     std::ref(stats[i]),std::ref(warp),minJ,maxJ,use_vol);
+  }
+  jacobian_check_slab(warp.minz()+int(nzs[nt-1]),warp.minz()+int(nzs[nt]),jvol,stats[nt-1],warp,minJ,maxJ,use_vol);
+  std::for_each(threads.begin(),threads.end(),std::mem_fn(&std::thread::join));
+  for (unsigned int i=0; i<nt; i++) {
+    if (stats[i](1)<jacobian_stats(1)) jacobian_stats(1) = stats[i](1);
+    if (stats[i](2)>jacobian_stats(2)) jacobian_stats(2) = stats[i](2);
+    jacobian_stats(3) += stats[i](3);
+    jacobian_stats(4) += stats[i](4);
+  }
+}
+
 
 volume4D<float> jacobian_check(ColumnVector& jacobian_stats,
 			       const volume4D<float>& warp,
@@ -464,11 +497,11 @@ volume4D<float> jacobian_check(ColumnVector& jacobian_stats,
 
 
 ColumnVector jacobian_quick_check(const volume4D<float>& warp,
-				  float minJ, float maxJ)
+				  float minJ, float maxJ, Utilities::NoOfThreads nthr)
 {
   volume4D<float> dummy;
   ColumnVector jacobian_stats;
-  jacobian_check(dummy,jacobian_stats,warp,minJ,maxJ,false);
+  jacobian_check(dummy,jacobian_stats,warp,minJ,maxJ,false,nthr);
   return jacobian_stats;
 }
 
@@ -545,164 +578,19 @@ void grad_calc(volume4D<float>& gradvols, const volume4D<float>& warp)
   }
 }
 
-///////////////////////////////////////////////////////////////////////////////////////////////
-//
-// I am using warpfns_ifft3 and warpfns_fft3 in lieu of the more general ifft3 and fft3 that
-// are a part of the NEWIMAGE namespace. This is because by sacrificing "generality" I can
-// make them ~30% faster, which I considered worth it since they are potentially called many
-// times as part of projecting a deformation field onto a "Jacobian-limited surface".
-//
-// Note also that I have already tried _lots_ of ways to speed them up further by e.g.
-// using pointers into NEWMAT and NEWIMAGE data and by using NEWMAT::RealFFT and
-// NEWMAT::RealFFTI for the first and last dimension transforms respectively. In neither
-// case was the speed up sufficient to motivate the increased complexity of the code.
-//
-///////////////////////////////////////////////////////////////////////////////////////////////
-
-void warpfns_ifft3(const NEWIMAGE::volume<float>&    rein,
-                   const NEWIMAGE::volume<float>&    imin,
-                   NEWIMAGE::volume<float>&          out)
-{
-  if (!samesize(rein,out)) out = rein;
-
-  NEWIMAGE::volume<float>  retmp(rein.xsize(),rein.ysize(),rein.zsize());
-  NEWIMAGE::volume<float>  imtmp(rein.xsize(),rein.ysize(),rein.zsize());
-  out = 0.0; retmp = 0.0; imtmp = 0.0;
-  // In x-direction
-  NEWMAT::ColumnVector reinv(rein.xsize());
-  NEWMAT::ColumnVector iminv(rein.xsize());
-  NEWMAT::ColumnVector reoutv(rein.xsize());
-  NEWMAT::ColumnVector imoutv(rein.xsize());
-  for (int k=0; k<rein.zsize(); k++) {
-    for (int j=0; j<rein.ysize(); j++) {
-      for (int i=0; i<rein.xsize(); i++) {
-        reinv(i+1) = rein(i,j,k);
-        iminv(i+1) = imin(i,j,k);
-      }
-      FFTI(reinv,iminv,reoutv,imoutv);
-      for (int i=0; i<rein.xsize(); i++) {
-        retmp(i,j,k) = reoutv(i+1);
-        imtmp(i,j,k) = imoutv(i+1);
-      }
-    }
-  }
-  // Y-direction
-  reinv.ReSize(rein.ysize());
-  iminv.ReSize(rein.ysize());
-  reoutv.ReSize(rein.ysize());
-  imoutv.ReSize(rein.ysize());
-  for (int k=0; k<rein.zsize(); k++) {
-    for (int i=0; i<rein.xsize(); i++) {
-      for (int j=0; j<rein.ysize(); j++) {
-        reinv(j+1) = retmp(i,j,k);
-        iminv(j+1) = imtmp(i,j,k);
-      }
-      FFTI(reinv,iminv,reoutv,imoutv);
-      for (int j=0; j<rein.ysize(); j++) {
-        retmp(i,j,k) = reoutv(j+1);
-        imtmp(i,j,k) = imoutv(j+1);
-      }
-    }
-  }
-  // And z-direction
-  reinv.ReSize(rein.zsize());
-  iminv.ReSize(rein.zsize());
-  reoutv.ReSize(rein.zsize());
-  imoutv.ReSize(rein.zsize());
-  for (int j=0; j<rein.ysize(); j++) {
-    for (int i=0; i<rein.xsize(); i++) {
-      for (int k=0; k<rein.zsize(); k++) {
-        reinv(k+1) = retmp(i,j,k);
-        iminv(k+1) = imtmp(i,j,k);
-      }
-      FFTI(reinv,iminv,reoutv,imoutv);
-      for (int k=0; k<rein.zsize(); k++) {
-        out(i,j,k) = reoutv(k+1);
-      }
-    }
-  }
-  return;
-}
-
-void warpfns_fft3(const NEWIMAGE::volume<float>&    in,
-                  NEWIMAGE::volume<float>&          reout,
-                  NEWIMAGE::volume<float>&          imout)
-{
-  if (!samesize(in,reout)) reout = in;
-  if (!samesize(in,imout)) imout = in;
-  reout = 0.0;
-  imout = 0.0;
-  // cout << "x-direction" << endl;
-  // In x-direction
-  NEWMAT::ColumnVector reinv(in.xsize());
-  NEWMAT::ColumnVector iminv(in.xsize());
-  NEWMAT::ColumnVector reoutv(in.xsize());
-  NEWMAT::ColumnVector imoutv(in.xsize());
-  reinv = 0.0; iminv = 0.0;
-  for (int k=0; k<in.zsize(); k++) {
-    for (int j=0; j<in.ysize(); j++) {
-      for (int i=0; i<in.xsize(); i++) {
-        reinv(i+1) = in(i,j,k);
-      }
-      FFT(reinv,iminv,reoutv,imoutv);
-      for (int i=0; i<in.xsize(); i++) {
-        reout(i,j,k) = reoutv(i+1);
-        imout(i,j,k) = imoutv(i+1);
-      }
-    }
-  }
-  // In y-direction
-  // cout << "y-direction" << endl;
-  reinv.ReSize(in.ysize());
-  iminv.ReSize(in.ysize());
-  reoutv.ReSize(in.ysize());
-  imoutv.ReSize(in.ysize());
-  reinv = 0.0; iminv = 0.0;
-  for (int k=0; k<in.zsize(); k++) {
-    for (int i=0; i<in.xsize(); i++) {
-      for (int j=0; j<in.ysize(); j++) {
-        reinv(j+1) = reout(i,j,k);
-        iminv(j+1) = imout(i,j,k);
-      }
-      FFT(reinv,iminv,reoutv,imoutv);
-      for (int j=0; j<in.ysize(); j++) {
-        reout(i,j,k) = reoutv(j+1);
-        imout(i,j,k) = imoutv(j+1);
-      }
-    }
-  }
-  // And z-direction
-  // cout << "z-direction" << endl;
-  reinv.ReSize(in.zsize());
-  iminv.ReSize(in.zsize());
-  reoutv.ReSize(in.zsize());
-  imoutv.ReSize(in.zsize());
-  reinv = 0.0; iminv = 0.0;
-  for (int j=0; j<in.ysize(); j++) {
-    for (int i=0; i<in.xsize(); i++) {
-      for (int k=0; k<in.zsize(); k++) {
-        reinv(k+1) = reout(i,j,k);
-        iminv(k+1) = imout(i,j,k);
-      }
-      FFT(reinv,iminv,reoutv,imoutv);
-      for (int k=0; k<in.zsize(); k++) {
-        reout(i,j,k) = reoutv(k+1);
-        imout(i,j,k) = imoutv(k+1);
-      }
-    }
-  }
-  return;
-}
-
 void integrate_gradient_field(volume4D<float>& newwarp,
 			      const volume4D<float>& grad,
-			      float warpmeanx, float warpmeany, float warpmeanz)
+			      float warpmeanx, float warpmeany, float warpmeanz,
+			      Utilities::NoOfThreads nthr)
 {
   // enforces integrability constraints and returns the integrated grad field
   // Note that the mean of the newwarp will be equal to warpmean{x,y,z}
   //  pass in: oldwarp[0].mean(), oldwarp[1].mean(), oldwarp[2].mean()
+  // The FFTs are done by whatever RealFFT3Backend is current (see realfft3.h)
+  // and use only the non-redundant half of the spectrum. The finite difference
+  // operators are tabulated once per size (SpectralTables).
 
-  int Nx, Ny, Nz;
+  unsigned int Nx, Ny, Nz;
   Nx = grad.xsize();
   Ny = grad.ysize();
   Nz = grad.zsize();
@@ -711,53 +599,34 @@ void integrate_gradient_field(volume4D<float>& newwarp,
     for (int n=8; n>2; n--) { newwarp.deletevolume(n); }
     newwarp = 0.0f;
   }
-  volume4D<float> gradkre(newwarp), gradkim(newwarp);
-  float gradkrealx, gradkimagx, gradkrealy, gradkimagy, gradkrealz, gradkimagz;
+  std::shared_ptr<const RealFFT3Backend> fft = GetRealFFT3Backend();
+  std::shared_ptr<const SpectralTables> tab = SpectralTables::Get(Nx,Ny,Nz);
+  const std::vector<double>& cm1x = tab->CosM1(0); const std::vector<double>& sinx = tab->Sin(0);
+  const std::vector<double>& cm1y = tab->CosM1(1); const std::vector<double>& siny = tab->Sin(1);
+  const std::vector<double>& cm1z = tab->CosM1(2); const std::vector<double>& sinz = tab->Sin(2);
+  unsigned int Nh = Nx/2 + 1;
+  std::vector<std::complex<double> > gradk[3];
+  for (unsigned int d=0; d<3; d++) gradk[d].resize(size_t(Nh)*Ny*Nz);
   // enforce things separately for gradients of warp[0], warp[1] and warp[2]
   for (int n=0; n<3; n++) {
     // take FFT of the x,y,z gradient fields (of warp[n])
-    ShadowVolume<float> gradkre0(gradkre[0]),gradkre1(gradkre[1]),gradkre2(gradkre[2]);
-    ShadowVolume<float> gradkim0(gradkim[0]),gradkim1(gradkim[1]),gradkim2(gradkim[2]);
-    warpfns_fft3(grad[n*3+0],gradkre0,gradkim0);
-    warpfns_fft3(grad[n*3+1],gradkre1,gradkim1);
-    warpfns_fft3(grad[n*3+2],gradkre2,gradkim2);
-    for (int z=grad.minz(); z<=grad.maxz(); z++) {
-      float argz=2.0*M_PI*z/Nz;
-      float cosz=cos(argz), sinz=sin(argz);
-      for (int y=grad.miny(); y<=grad.maxy(); y++) {
-        float argy=2.0*M_PI*y/Ny;
-        float cosy=cos(argy), siny=sin(argy);
-	for (int x=grad.minx(); x<=grad.maxx(); x++) {
-	  float argx=2.0*M_PI*x/Nx;
-          float cosx=cos(argx), sinx=sin(argx);
-	  float norm = 6.0 - 2.0*cosz - 2.0*cosy - 2.0*cosx;
-	  gradkrealx = gradkre(x,y,z,0);
-	  gradkimagx = gradkim(x,y,z,0);
-	  gradkrealy = gradkre(x,y,z,1);
-	  gradkimagy = gradkim(x,y,z,1);
-	  gradkrealz = gradkre(x,y,z,2);
-	  gradkimagz = gradkim(x,y,z,2);
-	  float dotprodre = gradkrealx * (cosx-1) + gradkimagx * sinx;
-	  float dotprodim = gradkimagx * (cosx-1) - gradkrealx * sinx;
-	  dotprodre += gradkrealy * (cosy-1) + gradkimagy * siny;
-	  dotprodim += gradkimagy * (cosy-1) - gradkrealy * siny;
-	  dotprodre += gradkrealz * (cosz-1) + gradkimagz * sinz;
-	  dotprodim += gradkimagz * (cosz-1) - gradkrealz * sinz;
-	  // write back values into gradkre[0] and gradkim[0]
-	  if (fabs(norm)>1e-12) {
-	    gradkre(x,y,z,0) = dotprodre / norm;
-	    gradkim(x,y,z,0) = dotprodim / norm;
-	  } else {
-	    gradkre(x,y,z,0) = 0;
-	    gradkim(x,y,z,0) = 0;
-	  }
+    for (unsigned int d=0; d<3; d++) fft->Forward(grad.fbegin(n*3+d),&(gradk[d][0]),Nx,Ny,Nz,nthr);
+    // Project onto the gradient of a scalar field, and integrate. The result goes into gradk[0].
+    for (unsigned int z=0; z<Nz; z++) {
+      for (unsigned int y=0; y<Ny; y++) {
+	size_t offs = (size_t(z)*Ny + y)*Nh;
+	for (unsigned int x=0; x<Nh; x++) {
+	  // (cos-1) - i*sin, i.e. exp(-i*arg) - 1, is the forward difference operator
+	  std::complex<double> opx(cm1x[x],-sinx[x]), opy(cm1y[y],-siny[y]), opz(cm1z[z],-sinz[z]);
+	  double norm = -2.0*(cm1x[x] + cm1y[y] + cm1z[z]);  // = 6 - 2cos(x) - 2cos(y) - 2cos(z)
+	  std::complex<double> dotprod = gradk[0][offs+x]*opx + gradk[1][offs+x]*opy + gradk[2][offs+x]*opz;
+	  if (fabs(norm)>1e-12) gradk[0][offs+x] = dotprod / norm;
+	  else gradk[0][offs+x] = 0.0;
 	}
       }
     }
     // take IFFT to get the integrated gradient field
-    volume<float> dummy1, dummy2;
-    ShadowVolume<float> newwarpn(newwarp[n]);
-    warpfns_ifft3(gradkre0,gradkim0,newwarpn);
+    fft->Inverse(&(gradk[0][0]),newwarp.nsfbegin()+size_t(n)*newwarp.nvoxels(),Nx,Ny,Nz,nthr);
   }
   // rescale newwarp by the voxel dimensions
   newwarp[0] *= grad.xdim();
@@ -881,19 +750,20 @@ void limit_grad(volume4D<float>& grad, const volume4D<float>& jvol,
 
 }
 
-void constrain_topology(volume4D<float>& warp, float minJ, float maxJ)
+void constrain_topology(volume4D<float>& warp, float minJ, float maxJ,
+			Utilities::NoOfThreads nthr)
 {
   ColumnVector jstats(4);
-  jstats=jacobian_quick_check(warp,minJ,maxJ);
+  jstats=jacobian_quick_check(warp,minJ,maxJ,nthr);
   volume4D<float> grad, jvol;
   int n=1, maxit=10;
   while ( (n++<maxit) && ( (jstats(3)>0.5) || (jstats(4)>0.5) ) ) {
     grad_calc(grad,warp);
-    jacobian_check(jvol,jstats,warp,minJ,maxJ);
+    jacobian_check(jvol,jstats,warp,minJ,maxJ,true,nthr);
     // cout << "Jacobian stats of (min,max,#<min,#>max): "<<jstats.t()<<endl;
     limit_grad(grad,jvol,minJ,maxJ);
-    integrate_gradient_field(warp,grad,warp[0].mean(),warp[1].mean(),warp[2].mean());
-    jstats=jacobian_quick_check(warp,minJ,maxJ);
+    integrate_gradient_field(warp,grad,warp[0].mean(),warp[1].mean(),warp[2].mean(),nthr);
+    jstats=jacobian_quick_check(warp,minJ,maxJ,nthr);
     // cout << "Jacobian quick stats of (min,max,#<min,#>max): "<<jstats.t()<<endl;
   }
 }
@@ -903,6 +773,340 @@ void constrain_topology(volume4D<float>& warp)
   constrain_topology(warp,0.01,100.0);  // mainly just enforcing positivity
 }
 
+/////////////////////////////////////////////////////////////////////
+//
+// Here starts the definitions of SplineDisplacementSource
+//
+/////////////////////////////////////////////////////////////////////
+
+SplineDisplacementSource::SplineDisplacementSource(const BASISFIELD::splinefield& dx,
+						   const BASISFIELD::splinefield& dy,
+						   const BASISFIELD::splinefield& dz)
+{
+  Matrix smat = IdentityMatrix(4);
+  smat(1,1) = dx.Vxs_x(); smat(2,2) = dx.Vxs_y(); smat(3,3) = dx.Vxs_z();
+  common_construction(dx,dy,dz,smat);
+}
+
+SplineDisplacementSource::SplineDisplacementSource(const BASISFIELD::splinefield& dx,
+						   const BASISFIELD::splinefield& dy,
+						   const BASISFIELD::splinefield& dz,
+						   const NEWMAT::Matrix&          smat)
+{
+  common_construction(dx,dy,dz,smat);
+}
+
+void SplineDisplacementSource::common_construction(const BASISFIELD::splinefield& dx,
+						   const BASISFIELD::splinefield& dy,
+						   const BASISFIELD::splinefield& dz,
+						   const NEWMAT::Matrix&          smat)
+{
+  const BASISFIELD::splinefield *f[3] = {&dx, &dy, &dz};
+  for (unsigned int i=1; i<3; i++) {
+    if (f[i]->Order() != dx.Order() || f[i]->Ksp_x() != dx.Ksp_x() || f[i]->Ksp_y() != dx.Ksp_y() || f[i]->Ksp_z() != dx.Ksp_z() ||
+	f[i]->FieldSz_x() != dx.FieldSz_x() || f[i]->FieldSz_y() != dx.FieldSz_y() || f[i]->FieldSz_z() != dx.FieldSz_z()) {
+      throw WarpFnsException("SplineDisplacementSource: Fields must all have the same size and knot-spacing");
+    }
+  }
+  if (smat.Nrows() != 4 || smat.Ncols() != 4) throw WarpFnsException("SplineDisplacementSource: smat must be a 4x4 matrix");
+  _fsz[0] = dx.FieldSz_x(); _fsz[1] = dx.FieldSz_y(); _fsz[2] = dx.FieldSz_z();
+  _csz[0] = dx.CoefSz_x(); _csz[1] = dx.CoefSz_y(); _csz[2] = dx.CoefSz_z();
+  _vxs[0] = dx.Vxs_x(); _vxs[1] = dx.Vxs_y(); _vxs[2] = dx.Vxs_z();
+  _smat = smat;
+  unsigned int ksp[3] = {dx.Ksp_x(), dx.Ksp_y(), dx.Ksp_z()};
+  for (unsigned int i=0; i<3; i++) {
+    _sp.push_back(BASISFIELD::Spline1D<double>(dx.Order(),ksp[i],0));
+    _dsp.push_back(BASISFIELD::Spline1D<double>(dx.Order(),ksp[i],1));
+    _coef[i] = f[i]->GetCoef();
+    _cp[i] = static_cast<const double *>(_coef[i]->Store());
+  }
+}
+
+// Values of the splines in direction dir that have support at x.
+// Returns the number of splines, the first of which is first.
+unsigned int SplineDisplacementSource::weights(unsigned int dir, float x, double *w, unsigned int& first) const
+{
+  unsigned int last;
+  _sp[dir].RangeOfSplines(x,_csz[dir],first,last);
+  if (last > first+MAXS) throw WarpFnsException("SplineDisplacementSource::weights: Too many splines at point");
+  for (unsigned int c=first; c<last; c++) w[c-first] = _sp[dir].SplineValueAtVoxel(x,c);
+  return((last>first) ? last-first : 0);
+}
+
+void SplineDisplacementSource::Row(unsigned int n, const float *x, const float *y, const float *z,
+				   float *dx, float *dy, float *dz, RowCache& cache) const
+{
+  float *d[3] = {dx, dy, dz};
+  bool flat = true;
+  for (unsigned int i=1; i<n && flat; i++) flat = (y[i] == y[0] && z[i] == z[0]);
+
+  if (!flat) { // Full tensor product for every point
+    double wx[MAXS], wy[MAXS], wz[MAXS];
+    unsigned int fx, fy, fz;
+    for (unsigned int i=0; i<n; i++) {
+      unsigned int nx = weights(0,clamp(x[i],0),wx,fx);
+      unsigned int ny = weights(1,clamp(y[i],1),wy,fy);
+      unsigned int nz = weights(2,clamp(z[i],2),wz,fz);
+      double v[3] = {0.0, 0.0, 0.0};
+      for (unsigned int kk=0; kk<nz; kk++) {
+	for (unsigned int jj=0; jj<ny; jj++) {
+	  double wzy = wz[kk]*wy[jj];
+	  size_t offs = (size_t(fz+kk)*_csz[1] + fy+jj)*_csz[0] + fx;
+	  for (unsigned int ii=0; ii<nx; ii++) {
+	    double b = wzy*wx[ii];
+	    for (unsigned int f=0; f<3; f++) v[f] += b*_cp[f][offs+ii];
+	  }
+	}
+      }
+      for (unsigned int f=0; f<3; f++) d[f][i] = static_cast<float>(v[f]);
+    }
+    return;
+  }
+
+  // Collapse coefficients over z, unless already done for this z
+  float zc = clamp(z[0],2);
+  if (!cache._zok || cache._zkey != zc) {
+    double w[MAXS];
+    unsigned int first;
+    unsigned int nw = weights(2,zc,w,first);
+    size_t nxy = size_t(_csz[0])*_csz[1];
+    for (unsigned int f=0; f<3; f++) {
+      cache._cz[f].assign(nxy,0.0);
+      double *cz = &(cache._cz[f][0]);
+      for (unsigned int m=0; m<nw; m++) {
+	const double *cp = _cp[f] + (first+m)*nxy;
+	for (size_t l=0; l<nxy; l++) cz[l] += w[m]*cp[l];
+      }
+    }
+    cache._zok = true; cache._zkey = zc; cache._yok = false;
+  }
+  // And then over y
+  float yc = clamp(y[0],1);
+  if (!cache._yok || cache._ykey != yc) {
+    double w[MAXS];
+    unsigned int first;
+    unsigned int nw = weights(1,yc,w,first);
+    for (unsigned int f=0; f<3; f++) {
+      cache._cyz[f].assign(_csz[0],0.0);
+      double *cyz = &(cache._cyz[f][0]);
+      for (unsigned int m=0; m<nw; m++) {
+	const double *cz = &(cache._cz[f][(first+m)*_csz[0]]);
+	for (unsigned int l=0; l<_csz[0]; l++) cyz[l] += w[m]*cz[l];
+      }
+    }
+    cache._yok = true; cache._ykey = yc;
+  }
+  // Weights in x, unless we already have them for these points
+  if (cache._xkey.size() != n || !std::equal(x,x+n,cache._xkey.begin())) {
+    cache._xfirst.resize(n); cache._xn.resize(n); cache._xw.resize(size_t(n)*MAXS);
+    for (unsigned int i=0; i<n; i++) cache._xn[i] = weights(0,clamp(x[i],0),&(cache._xw[size_t(i)*MAXS]),cache._xfirst[i]);
+    cache._xkey.assign(x,x+n);
+  }
+  const double *cyz[3] = {&(cache._cyz[0][0]), &(cache._cyz[1][0]), &(cache._cyz[2][0])};
+  for (unsigned int i=0; i<n; i++) {
+    const double *w = &(cache._xw[size_t(i)*MAXS]);
+    unsigned int first = cache._xfirst[i];
+    double v[3] = {0.0, 0.0, 0.0};
+    for (unsigned int m=0; m<cache._xn[i]; m++) {
+      for (unsigned int f=0; f<3; f++) v[f] += w[m]*cyz[f][first+m];
+    }
+    for (unsigned int f=0; f<3; f++) d[f][i] = static_cast<float>(v[f]);
+  }
+}
+
+void SplineDisplacementSource::RowWithDerivatives(unsigned int n, const float *x, const float *y, const float *z,
+						  float *dx, float *dy, float *dz, float *jac) const
+{
+  float *d[3] = {dx, dy, dz};
+  const float *c[3] = {x, y, z};
+  double w[3][MAXS], dw[3][MAXS];
+  unsigned int first[3], nw[3];
+  for (unsigned int i=0; i<n; i++) {
+    bool inside[3];
+    for (unsigned int dir=0; dir<3; dir++) {
+      float cc = clamp(c[dir][i],dir);
+      inside[dir] = (cc == c[dir][i]);
+      nw[dir] = weights(dir,cc,w[dir],first[dir]);
+      for (unsigned int m=0; m<nw[dir]; m++) dw[dir][m] = _dsp[dir].SplineValueAtVoxel(cc,first[dir]+m);
+    }
+    double v[3][4] = {{0.0}};  // Value and derivatives in x, y and z for each of the three fields
+    for (unsigned int kk=0; kk<nw[2]; kk++) {
+      for (unsigned int jj=0; jj<nw[1]; jj++) {
+	double wzy = w[2][kk]*w[1][jj], dwzy = w[2][kk]*dw[1][jj], wzdy = dw[2][kk]*w[1][jj];
+	size_t offs = (size_t(first[2]+kk)*_csz[1] + first[1]+jj)*_csz[0] + first[0];
+	for (unsigned int ii=0; ii<nw[0]; ii++) {
+	  double b = wzy*w[0][ii], bx = wzy*dw[0][ii], by = dwzy*w[0][ii], bz = wzdy*w[0][ii];
+	  for (unsigned int f=0; f<3; f++) {
+	    double cf = _cp[f][offs+ii];
+	    v[f][0] += cf*b; v[f][1] += cf*bx; v[f][2] += cf*by; v[f][3] += cf*bz;
+	  }
+	}
+      }
+    }
+    for (unsigned int f=0; f<3; f++) {
+      d[f][i] = static_cast<float>(v[f][0]);
+      for (unsigned int dir=0; dir<3; dir++) jac[9*i+3*f+dir] = (inside[dir]) ? static_cast<float>(v[f][dir+1]) : 0.0f;
+    }
+  }
+}
+
+/////////////////////////////////////////////////////////////////////
+//
+// Here starts the definitions of CompositeWarp
+//
+/////////////////////////////////////////////////////////////////////
+
+void CompositeWarp::AddAffine(const NEWMAT::Matrix& A)
+{
+  add_stage(A,nullptr,nullptr,IdentityMatrix(4));
+}
+
+void CompositeWarp::AddWarp(const SplineDisplacementSource& d, const NEWMAT::Matrix& A)
+{
+  add_stage(A,&d,nullptr,d.sampling_mat());
+}
+
+void CompositeWarp::AddWarp(const volume4D<float>& d, const NEWMAT::Matrix& A)
+{
+  if (d.tsize() != 3) throw WarpFnsException("CompositeWarp::AddWarp: Displacement field must have three volumes");
+  add_stage(A,nullptr,&d,d.sampling_mat());
+}
+
+void CompositeWarp::add_stage(const NEWMAT::Matrix& A, const SplineDisplacementSource *sp, const volume4D<float> *vf, const NEWMAT::Matrix& smat)
+{
+  if (A.Nrows() != 4 || A.Ncols() != 4) throw WarpFnsException("CompositeWarp: A must be a 4x4 matrix");
+  Stage s;
+  Matrix iA = A.i();
+  Matrix im = smat.i();
+  for (unsigned int r=0; r<3; r++) {
+    for (unsigned int c=0; c<4; c++) { s.iA[r][c] = iA(r+1,c+1); s.im[r][c] = im(r+1,c+1); }
+  }
+  s.sp = sp;
+  s.vf = vf;
+  if (sp) { s.sz[0] = sp->xsize(); s.sz[1] = sp->ysize(); s.sz[2] = sp->zsize(); }
+  else if (vf) { s.sz[0] = vf->xsize(); s.sz[1] = vf->ysize(); s.sz[2] = vf->zsize(); }
+  else { s.sz[0] = s.sz[1] = s.sz[2] = 0; }
+  _stages.push_back(s);
+}
+
+// Trilinear interpolation in a volume4D field, with the value at the
+// nearest point inside the field for points outside it. If jac is
+// non-null it gets the derivatives (mm/voxel) as for
+// SplineDisplacementSource::RowWithDerivatives().
+void CompositeWarp::volume_row(const Stage& s, unsigned int n, const float *x, const float *y, const float *z,
+			       float *dx, float *dy, float *dz, float *jac) const
+{
+  float *d[3] = {dx, dy, dz};
+  const float *c[3] = {x, y, z};
+  int64_t stride[3] = {1, s.sz[0], int64_t(s.sz[0])*s.sz[1]};
+  int64_t nvox = stride[2]*s.sz[2];
+  const float *fp = s.vf->fbegin();
+  for (unsigned int i=0; i<n; i++) {
+    int64_t offs = 0;
+    float fr[3];
+    int64_t step[3];
+    bool inside[3];
+    for (unsigned int dir=0; dir<3; dir++) {
+      float cc = std::min(std::max(c[dir][i],0.0f),static_cast<float>(s.sz[dir]-1));
+      inside[dir] = (cc == c[dir][i]);
+      int i0 = std::min(static_cast<int>(std::floor(cc)),std::max(s.sz[dir]-2,0));
+      fr[dir] = cc - i0;
+      step[dir] = (s.sz[dir] > 1) ? stride[dir] : 0;
+      offs += i0*stride[dir];
+    }
+    for (unsigned int f=0; f<3; f++) {
+      const float *p = fp + f*nvox + offs;
+      float v000 = p[0], v100 = p[step[0]];
+      float v010 = p[step[1]], v110 = p[step[0]+step[1]];
+      float v001 = p[step[2]], v101 = p[step[0]+step[2]];
+      float v011 = p[step[1]+step[2]], v111 = p[step[0]+step[1]+step[2]];
+      // Interpolate in x, then y, then z
+      float v00 = v000 + fr[0]*(v100-v000), v10 = v010 + fr[0]*(v110-v010);
+      float v01 = v001 + fr[0]*(v101-v001), v11 = v011 + fr[0]*(v111-v011);
+      float v0 = v00 + fr[1]*(v10-v00), v1 = v01 + fr[1]*(v11-v01);
+      d[f][i] = v0 + fr[2]*(v1-v0);
+      if (jac) {
+	float ddx0 = (v100-v000) + fr[1]*((v110-v010)-(v100-v000));
+	float ddx1 = (v101-v001) + fr[1]*((v111-v011)-(v101-v001));
+	jac[9*i+3*f] = (inside[0]) ? ddx0 + fr[2]*(ddx1-ddx0) : 0.0f;
+	jac[9*i+3*f+1] = (inside[1]) ? (v10-v00) + fr[2]*((v11-v01)-(v10-v00)) : 0.0f;
+	jac[9*i+3*f+2] = (inside[2]) ? v1-v0 : 0.0f;
+      }
+    }
+  }
+}
+
+void CompositeWarp::Row(unsigned int n, float *x, float *y, float *z, char *valid, float *jac,
+			const std::vector<bool>& epvalid, RowCache& cache) const
+{
+  if (cache._sc.size() != _stages.size()) cache._sc.resize(_stages.size());
+  for (unsigned int dir=0; dir<3; dir++) { cache._v[dir].resize(n); cache._d[dir].resize(n); }
+  if (valid) std::fill(valid,valid+n,1);
+  if (jac) {
+    cache._dj.resize(size_t(9)*n);
+    cache._J.assign(size_t(9)*n,0.0);
+    for (unsigned int i=0; i<n; i++) cache._J[9*i] = cache._J[9*i+4] = cache._J[9*i+8] = 1.0;
+  }
+  float *p[3] = {x, y, z};
+  float *v[3] = {&(cache._v[0][0]), &(cache._v[1][0]), &(cache._v[2][0])};
+  float *d[3] = {&(cache._d[0][0]), &(cache._d[1][0]), &(cache._d[2][0])};
+  const double tol = 1e-8;
+  // The stages are traversed from output to input
+  for (int si=static_cast<int>(_stages.size())-1; si>=0; si--) {
+    const Stage& s = _stages[si];
+    bool field = (s.sp || s.vf);
+    if (field) {
+      for (unsigned int i=0; i<n; i++) {
+	for (unsigned int r=0; r<3; r++) v[r][i] = static_cast<float>(s.im[r][0]*x[i] + s.im[r][1]*y[i] + s.im[r][2]*z[i] + s.im[r][3]);
+      }
+      float *dj = (jac) ? &(cache._dj[0]) : nullptr;
+      if (s.sp && jac) s.sp->RowWithDerivatives(n,v[0],v[1],v[2],d[0],d[1],d[2],dj);
+      else if (s.sp) s.sp->Row(n,v[0],v[1],v[2],d[0],d[1],d[2],cache._sc[si]);
+      else volume_row(s,n,v[0],v[1],v[2],d[0],d[1],d[2],dj);
+      if (valid) {
+	for (unsigned int i=0; i<n; i++) {
+	  for (unsigned int dir=0; dir<3; dir++) {
+	    if (!epvalid[dir] && (v[dir][i]+tol < 0.0 || v[dir][i] > s.sz[dir]-1+tol)) valid[i] = 0;
+	  }
+	}
+      }
+    }
+    for (unsigned int i=0; i<n; i++) {
+      double q[3];
+      for (unsigned int r=0; r<3; r++) {
+	q[r] = s.iA[r][0]*x[i] + s.iA[r][1]*y[i] + s.iA[r][2]*z[i] + s.iA[r][3];
+	if (field) q[r] += d[r][i];
+      }
+      for (unsigned int r=0; r<3; r++) p[r][i] = static_cast<float>(q[r]);
+    }
+    if (jac) { // J <- Js * J, where Js = iA + dd/dv * im
+      for (unsigned int i=0; i<n; i++) {
+	double Js[3][3], J[9];
+	for (unsigned int r=0; r<3; r++) {
+	  for (unsigned int c=0; c<3; c++) {
+	    Js[r][c] = s.iA[r][c];
+	    if (field) {
+	      const float *dj = &(cache._dj[9*size_t(i)+3*r]);
+	      Js[r][c] += dj[0]*s.im[0][c] + dj[1]*s.im[1][c] + dj[2]*s.im[2][c];
+	    }
+	  }
+	}
+	double *Jt = &(cache._J[9*size_t(i)]);
+	for (unsigned int r=0; r<3; r++) {
+	  for (unsigned int c=0; c<3; c++) J[3*r+c] = Js[r][0]*Jt[c] + Js[r][1]*Jt[3+c] + Js[r][2]*Jt[6+c];
+	}
+	std::copy(J,J+9,Jt);
+      }
+    }
+  }
+  if (jac) {
+    for (unsigned int i=0; i<n; i++) {
+      const double *J = &(cache._J[9*size_t(i)]);
+      jac[i] = static_cast<float>(J[0]*(J[4]*J[8]-J[5]*J[7]) - J[1]*(J[3]*J[8]-J[5]*J[6]) + J[2]*(J[3]*J[7]-J[4]*J[6]));
+    }
+  }
+}
+
 } // End namespace NEWIMAGE
 
 namespace RGT_UTILS { // raw_general_transform utilities
@@ -27,6 +27,8 @@
 #include "utils/threading.h"
 #include "newimage/newimageall.h"
 #include "basisfield/basisfield.h"
+#include "basisfield/fsl_splines.h"
+#include "basisfield/splinefield.h"
 
 namespace RGT_UTILS { // raw_general_transform utilities
 
@@ -58,6 +60,16 @@ std::tuple<NEWMAT::Matrix,bool> make_iT(const NEWIMAGE::volume4D<float>& d,
 std::vector<unsigned int> rows_per_thread(unsigned int nrows,
 					  unsigned int nthr);
 
+/// Scratch space for resampling one row of the output volume
+struct RowBuffer;
+
+/// Samples a volume (and optionally its three partials) at all points of a row
+template <class T>
+void sample_row(const NEWIMAGE::volume<T>& f,
+		unsigned int               n,
+		RowBuffer&                 rb,
+		bool                       derivs);
+
 template <class T>
 void affine_no_derivs(// Input
 		      unsigned int                     first_j,
@@ -82,14 +94,14 @@ void affine_with_derivs(// Input
 			NEWIMAGE::volume4D<T>&           deriv,
 			NEWIMAGE::volume<char>           *valid);
 
-template <class T>
+template <class T, class D>
 void displacements_no_iT(// Input
 			 unsigned int                     first_j,
 			 unsigned int                     last_j,
 			 const NEWIMAGE::volume<T>&       f,
 			 const std::vector<unsigned int>& slices,
 			 const NEWMAT::Matrix&            A,
-			 const NEWIMAGE::volume4D<float>& d,
+			 const D&                         d,        // volume4D<float> or DisplacementFieldView
 			 const std::vector<int>&          defdir,
 			 const NEWMAT::Matrix&            M,
 			 const std::vector<int>&          derivdir,
@@ -98,6 +110,58 @@ void displacements_no_iT(// Input
 			 NEWIMAGE::volume<T>&             deriv,
 			 NEWIMAGE::volume<char>           *valid);
 
+/// Voxel coordinates in f of all voxels in rows first_j--last_j of out
+template <class T>
+void sampling_coordinates(// Input
+			  unsigned int                     first_j,
+			  unsigned int                     last_j,
+			  const NEWIMAGE::volume<T>&       f,
+			  const NEWIMAGE::volume4D<float>& d,
+			  const std::vector<int>&          defdir,
+			  bool                             useiT,
+			  const NEWMAT::Matrix&            iT,
+			  const NEWMAT::Matrix&            iA,
+			  const NEWMAT::Matrix&            iM,
+			  const int                        (&osz)[3],
+			  // Output
+			  float                            *x,
+			  float                            *y,
+			  float                            *z,
+			  char                             *valid);
+
+/// Resampling with displacements evaluated from spline coefficients
+template <class T, class S>
+void displacements_from_source(// Input
+			       unsigned int                     first_j,
+			       unsigned int                     last_j,
+			       const NEWIMAGE::volume<T>&       f,
+			       const std::vector<unsigned int>& slices,
+			       const NEWMAT::Matrix&            iT,
+			       const NEWMAT::Matrix&            A,
+			       const S&                         d,
+			       const NEWMAT::Matrix&            M,
+			       const std::vector<int>&          derivdir,
+			       // Output
+			       NEWIMAGE::volume<T>&             out,
+			       NEWIMAGE::volume<T>&             deriv,
+			       NEWIMAGE::volume<char>           *valid);
+
+/// Resampling through a chain of affines and warps (W is a CompositeWarp)
+template <class T, class W>
+void displacements_from_composite(// Input
+				  unsigned int                     first_j,
+				  unsigned int                     last_j,
+				  const NEWIMAGE::volume<T>&       f,
+				  const std::vector<unsigned int>& slices,
+				  const W&                         w,
+				  const NEWMAT::Matrix&            M,
+				  const std::vector<int>&          derivdir,
+				  // Output
+				  NEWIMAGE::volume<T>&             out,
+				  NEWIMAGE::volume<T>&             deriv,
+				  NEWIMAGE::volume<char>           *valid,
+				  NEWIMAGE::volume<float>          *jac);
+
 template <class T>
 void displacements_with_iT(// Input
 			   unsigned int                     first_j,
@@ -173,17 +237,21 @@ public:
   void jacobian_check(volume4D<float>&      jvol,
                       NEWMAT::ColumnVector& jacobian_stats,
                       const volume4D<float>& warp,
-                      float minJ, float maxJ, bool use_vol=true);
+                      float minJ, float maxJ, bool use_vol=true,
+                      Utilities::NoOfThreads nthr=Utilities::NoOfThreads(1));
 
   volume4D<float> jacobian_check(NEWMAT::ColumnVector& jacobian_stats,
                                  const volume4D<float>& warp,
                                  float minJ, float maxJ);
 
   NEWMAT::ColumnVector jacobian_quick_check(const volume4D<float>& warp,
-                                            float minJ, float maxJ);
+                                            float minJ, float maxJ,
+                                            Utilities::NoOfThreads nthr=Utilities::NoOfThreads(1));
 
 
-  void constrain_topology(volume4D<float>& warp, float minJ, float maxJ);
+  // The Jacobian checks are done in nthr threads. The result does not depend on nthr.
+  void constrain_topology(volume4D<float>& warp, float minJ, float maxJ,
+                          Utilities::NoOfThreads nthr=Utilities::NoOfThreads(1));
 
   void constrain_topology(volume4D<float>& warp);
 
@@ -676,6 +744,235 @@ NEWMAT::ColumnVector inv_coord(const volume4D<float>&      warp,
   return newcoord;
 }
 
+  ///////////////////////////////////////////////////////////////////////////
+  //
+  // Class DisplacementFieldView
+  //
+  // Read-only view of a displacement field (in mm) that is kept as three
+  // basisfield objects, e.g. by fnirt. It can be passed to
+  // raw_general_transform in place of a volume4D<float> when resampling
+  // into the space of the field, which saves making a float copy of the
+  // field every time the coefficients change. The view shares the field
+  // data with the basisfields, and raw_general_transform uses the
+  // basisfield version counters to refuse a view that has gone stale.
+  //
+  ///////////////////////////////////////////////////////////////////////////
+
+  class DisplacementFieldView
+  {
+  public:
+    DisplacementFieldView(const BASISFIELD::basisfield& dx,
+			  const BASISFIELD::basisfield& dy,
+			  const BASISFIELD::basisfield& dz) : _bf{&dx, &dy, &dz}
+    {
+      _sz[0] = dx.FieldSz_x(); _sz[1] = dx.FieldSz_y(); _sz[2] = dx.FieldSz_z();
+      _vxs[0] = dx.Vxs_x(); _vxs[1] = dx.Vxs_y(); _vxs[2] = dx.Vxs_z();
+      for (unsigned int i=0; i<3; i++) {
+	if (_bf[i]->FieldSz_x() != _sz[0] || _bf[i]->FieldSz_y() != _sz[1] || _bf[i]->FieldSz_z() != _sz[2]) {
+	  throw WarpFnsException("DisplacementFieldView: Fields must all have the same size");
+	}
+	_field[i] = _bf[i]->Get(BASISFIELD::FIELD);  // Updates field if needed
+	_fp[i] = static_cast<const double *>(_field[i]->Store());
+	_version[i] = _bf[i]->Version();
+      }
+    }
+    int xsize() const { return(static_cast<int>(_sz[0])); }
+    int ysize() const { return(static_cast<int>(_sz[1])); }
+    int zsize() const { return(static_cast<int>(_sz[2])); }
+    double xdim() const { return(_vxs[0]); }
+    double ydim() const { return(_vxs[1]); }
+    double zdim() const { return(_vxs[2]); }
+    // Displacement (mm) in direction di at voxel i,j,k. No bounds-checking.
+    float operator()(int i, int j, int k, int di) const {
+      return(static_cast<float>(_fp[di][(static_cast<size_t>(k)*_sz[1]+j)*_sz[0]+i]));
+    }
+    // True if none of the fields have changed since the view was made
+    bool Current() const {
+      for (unsigned int i=0; i<3; i++) if (_bf[i]->Version() != _version[i] || !_bf[i]->UpToDate(BASISFIELD::FIELD)) return(false);
+      return(true);
+    }
+  private:
+    const BASISFIELD::basisfield            *_bf[3];
+    std::shared_ptr<NEWMAT::ColumnVector>   _field[3];   // Keeps the data alive
+    const double                            *_fp[3];
+    unsigned long                           _version[3];
+    unsigned int                            _sz[3];
+    double                                  _vxs[3];
+  };
+
+  ///////////////////////////////////////////////////////////////////////////
+  //
+  // Class SplineDisplacementSource
+  //
+  // A displacement field (in mm) that is evaluated directly from the
+  // coefficients of three splinefields, e.g. as read from a coefficient
+  // file by FnirtFileReader. It can be passed to raw_general_transform
+  // in place of a volume4D<float>, which means that the field is never
+  // expanded into a full volume. That saves both the time for the
+  // expansion and the memory for the field, which can be considerable
+  // for a 1mm output space.
+  // The field is evaluated along a row of points at the time. When the
+  // points of a row have the same y- and z-coordinates (which is the
+  // case unless the output space is rotated relative to the field) the
+  // coefficients are first collapsed over z (once per slice) and then
+  // over y (once per row), leaving a 1D sum along x. The weights along
+  // x are reused for as long as the x-coordinates are the same, i.e.
+  // typically for the whole volume. Other points are evaluated as full
+  // tensor products. The work-space for all this is in a RowCache,
+  // and each thread needs its own.
+  // Points outside the field are given the value at the nearest point
+  // on the edge of the field.
+  //
+  ///////////////////////////////////////////////////////////////////////////
+
+  class SplineDisplacementSource
+  {
+  public:
+    // Work-space for Row(). Must not be shared between threads.
+    class RowCache
+    {
+    public:
+      RowCache() : _zok(false), _yok(false) {}
+    private:
+      friend class SplineDisplacementSource;
+      bool                       _zok, _yok;     // True if _cz/_cyz are valid for _zkey/_ykey
+      float                      _zkey, _ykey;
+      std::vector<double>        _cz[3];         // Coefficients collapsed over z
+      std::vector<double>        _cyz[3];        // Coefficients collapsed over y and z
+      std::vector<float>         _xkey;          // x-coordinates for which _xw is valid
+      std::vector<unsigned int>  _xfirst, _xn;   // First spline and # of splines for each point
+      std::vector<double>        _xw;            // Spline values, MAXS per point
+    };
+
+    SplineDisplacementSource(const BASISFIELD::splinefield& dx,
+			     const BASISFIELD::splinefield& dy,
+			     const BASISFIELD::splinefield& dz);
+    // smat is the voxel->mm matrix of the field, as given by sampling_mat()
+    // of the corresponding volume. By default that of a volume with the
+    // voxel size of the field and no s/qform.
+    SplineDisplacementSource(const BASISFIELD::splinefield& dx,
+			     const BASISFIELD::splinefield& dy,
+			     const BASISFIELD::splinefield& dz,
+			     const NEWMAT::Matrix&          smat);
+    int xsize() const { return(static_cast<int>(_fsz[0])); }
+    int ysize() const { return(static_cast<int>(_fsz[1])); }
+    int zsize() const { return(static_cast<int>(_fsz[2])); }
+    double xdim() const { return(_vxs[0]); }
+    double ydim() const { return(_vxs[1]); }
+    double zdim() const { return(_vxs[2]); }
+    const NEWMAT::Matrix& sampling_mat() const { return(_smat); }
+    // Displacements (mm) in x, y and z at the n points given by x, y and z (voxel coordinates in the field)
+    void Row(unsigned int n, const float *x, const float *y, const float *z,
+	     float *dx, float *dy, float *dz, RowCache& cache) const;
+    // As Row(), but also returns the derivatives (mm/voxel) of the displacements in jac,
+    // where jac[9*i+3*f+dir] is the derivative of displacement f in direction dir at
+    // point i. The derivative is zero in a direction in which the point is outside the field.
+    // Every point is evaluated as a full tensor product.
+    void RowWithDerivatives(unsigned int n, const float *x, const float *y, const float *z,
+			    float *dx, float *dy, float *dz, float *jac) const;
+    // Same meaning as volume<T>::valid(), with extrapolation validity given by epvalid
+    bool Valid(float x, float y, float z, const std::vector<bool>& epvalid) const {
+      const double tol = 1e-8;
+      return((epvalid[0] || (x+tol >= 0.0 && x <= _fsz[0]-1+tol)) &&
+	     (epvalid[1] || (y+tol >= 0.0 && y <= _fsz[1]-1+tol)) &&
+	     (epvalid[2] || (z+tol >= 0.0 && z <= _fsz[2]-1+tol)));
+    }
+  private:
+    static const unsigned int MAXS = 6;     // Max # of splines with support at a point, in one direction
+    unsigned int                                  _fsz[3];   // Field size
+    unsigned int                                  _csz[3];   // Coefficient size
+    double                                        _vxs[3];   // Voxel size
+    NEWMAT::Matrix                                _smat;     // Voxel->mm
+    std::shared_ptr<NEWMAT::ColumnVector>         _coef[3];  // Keeps the coefficients alive
+    const double                                  *_cp[3];
+    std::vector<BASISFIELD::Spline1D<double> >    _sp;       // Splines in x-, y- and z-directions
+    std::vector<BASISFIELD::Spline1D<double> >    _dsp;      // Derivatives of the same
+
+    void common_construction(const BASISFIELD::splinefield& dx,
+			     const BASISFIELD::splinefield& dy,
+			     const BASISFIELD::splinefield& dz,
+			     const NEWMAT::Matrix&          smat);
+    float clamp(float x, unsigned int dir) const { return(std::min(std::max(x,0.0f),static_cast<float>(_fsz[dir]-1))); }
+    unsigned int weights(unsigned int dir, float x, double *w, unsigned int& first) const;
+  };
+
+  ///////////////////////////////////////////////////////////////////////////
+  //
+  // Class CompositeWarp
+  //
+  // A chain of affine transforms and displacement fields that is
+  // evaluated point by point, so that e.g. func->struct (affine),
+  // struct->MNI (fnirt) and MNI->template (fnirt) can be applied in a
+  // single resampling without first composing the fields into a new
+  // field (as convertwarp would do).
+  // Stages are added in the order input->output, i.e. in the order of
+  // the registrations above, and each is specified the same way as for
+  // raw_general_transform. An affine stage is a matrix mapping its
+  // input onto its output space (mm->mm, e.g. a flirt matrix). A warp
+  // stage is a displacement field (in mm) that is defined in its output
+  // space, and the affine matrix that it was estimated on top of (e.g.
+  // FnirtFileReader::AffineMat(), or identity for a field that already
+  // includes it). A point p in the output space of a warp stage maps to
+  //
+  // q = inv(A) * p + d(p)
+  //
+  // in its input space. Row() takes mm-coordinates in the output space
+  // of the last stage and passes them backwards through the chain to
+  // give mm-coordinates in the input space of the first stage. It can
+  // also give the Jacobian determinant of that mapping, which is
+  // calculated with the chain rule from the analytical derivatives of
+  // each stage.
+  // Fields are evaluated at the nearest point inside the field for
+  // points that fall outside it, and volume4D fields are interpolated
+  // trilinearly. The fields are referenced, not copied, and must not
+  // go out of scope or change before the CompositeWarp.
+  //
+  ///////////////////////////////////////////////////////////////////////////
+
+  class CompositeWarp
+  {
+  public:
+    // Work-space for Row(). Must not be shared between threads.
+    class RowCache
+    {
+    public:
+      RowCache() {}
+    private:
+      friend class CompositeWarp;
+      std::vector<SplineDisplacementSource::RowCache>  _sc;        // One per stage
+      std::vector<float>                              _v[3];      // Voxel coordinates in field
+      std::vector<float>                              _d[3];      // Displacements
+      std::vector<float>                              _dj;        // Derivatives of displacements
+      std::vector<double>                             _J;         // Accumulated Jacobian, 9 per point
+    };
+
+    CompositeWarp() {}
+    void AddAffine(const NEWMAT::Matrix& A);
+    void AddWarp(const SplineDisplacementSource& d, const NEWMAT::Matrix& A=NEWMAT::IdentityMatrix(4));
+    void AddWarp(const volume4D<float>& d, const NEWMAT::Matrix& A=NEWMAT::IdentityMatrix(4));
+    unsigned int NStages() const { return(static_cast<unsigned int>(_stages.size())); }
+    // Maps the n points x, y and z (mm in output space) to mm in input space, in place.
+    // If valid is non-null it is set to zero for points that fall outside any of the fields
+    // (as volume<T>::valid() with extrapolation validity given by epvalid). If jac is
+    // non-null it is set to the Jacobian determinant of the mapping.
+    void Row(unsigned int n, float *x, float *y, float *z, char *valid, float *jac,
+	     const std::vector<bool>& epvalid, RowCache& cache) const;
+  private:
+    struct Stage
+    {
+      double                            iA[3][4];   // Inverse of affine
+      const SplineDisplacementSource    *sp;        // Spline field, or
+      const volume4D<float>             *vf;        // volume field, or neither for an affine stage
+      double                            im[3][4];   // mm->voxel of field
+      int                               sz[3];      // Size of field
+    };
+    std::vector<Stage>                  _stages;
+
+    void add_stage(const NEWMAT::Matrix& A, const SplineDisplacementSource *sp, const volume4D<float> *vf, const NEWMAT::Matrix& smat);
+    void volume_row(const Stage& s, unsigned int n, const float *x, const float *y, const float *z,
+		    float *dx, float *dy, float *dz, float *jac) const;
+  };
+
   ///////////////////////////////////////////////////////////////////////////
   // IMAGE PROCESSING ROUTINES
   ///////////////////////////////////////////////////////////////////////////
@@ -820,7 +1117,7 @@ void raw_general_transform(// Input
   else { // We have displacements in at least one direction
     if (!useiT) { // If the final space is the same as that of the displacement field
       for (unsigned int i=0; i<nthr._n-1; i++) {
-	threads[i] = std::thread(RGT_UTILS::displacements_no_iT<T>,nrows[i],nrows[i+1],std::ref(f),std::ref(slices),std::ref(iA),
+	threads[i] = std::thread(RGT_UTILS::displacements_no_iT<T,volume4D<float> >,nrows[i],nrows[i+1],std::ref(f),std::ref(slices),std::ref(iA),
 				 std::ref(d),std::ref(defdir),std::ref(iM),std::ref(derivdir),std::ref(out),std::ref(deriv),valid);
       }
       RGT_UTILS::displacements_no_iT(nrows[nthr._n-1],nrows[nthr._n],f,slices,iA,d,defdir,iM,derivdir,out,deriv,valid);
@@ -848,6 +1145,195 @@ void raw_general_transform(// Input
 }
 
 
+/////////////////////////////////////////////////////////////////////
+//
+// As above, but with the displacements given by a DisplacementFieldView.
+// Displacements are in all three directions, and the output volume
+// must be in the space of the field (same matrix and voxel size).
+// There are no TT or M matrices and the field is not interpolated,
+// since output voxels coincide with field voxels.
+//
+/////////////////////////////////////////////////////////////////////
+
+template <class T>
+void raw_general_transform(// Input
+			   const volume<T>&               f,        // Input volume
+			   const NEWMAT::Matrix&          A,        // 4x4 affine transformation matrix
+			   const DisplacementFieldView&   d,        // Displacement fields in mm, in space of out
+			   const std::vector<int>&        derivdir, // Directions of derivatives
+			   // Output
+			   volume<T>&                     out,      // Output volume
+			   volume4D<T>&                   deriv,    // Partial derivatives. Note that the derivatives are in units "per voxel"
+			   volume<char>                   *valid,   // Mask indicating what voxels fell inside original fov
+			   // Optional input
+			   Utilities::NoOfThreads         nthr=Utilities::NoOfThreads(1)) // No. of threads. N.B. threading in y-direction
+{
+  // Validate input
+  std::vector<int> defdir = {0, 1, 2};
+  std::vector<unsigned int> slices;
+  volume4D<float> nofield;
+  if (out.xsize() != d.xsize() || out.ysize() != d.ysize() || out.zsize() != d.zsize()) {
+    throw WarpFnsException("NEWIMAGE::raw_general_transform: Size mismatch between out and displacement field");
+  }
+  if (std::fabs(out.xdim()-d.xdim()) > 1e-6 || std::fabs(out.ydim()-d.ydim()) > 1e-6 || std::fabs(out.zdim()-d.zdim()) > 1e-6) {
+    throw WarpFnsException("NEWIMAGE::raw_general_transform: Voxel-size mismatch between out and displacement field");
+  }
+  if (!d.Current()) throw WarpFnsException("NEWIMAGE::raw_general_transform: Displacement field has changed since view was created");
+  auto [valinp,msg] = RGT_UTILS::validate_input(A,nullptr,nullptr,nofield,std::vector<int>(),derivdir,slices,out,deriv,valid);
+  if (!valinp) throw WarpFnsException("NEWIMAGE::raw_general_transform: "+msg);
+  slices.resize(out.zsize()); std::iota(slices.begin(),slices.end(),0);
+
+  // Save old extrapolation settings and set new
+  extrapolation oldex = f.getextrapolationmethod();
+  if ((oldex==boundsassert) || (oldex==boundsexception)) f.setextrapolationmethod(constpad);
+
+  // Voxel coordinates in out -> mm-coordinates in i, and
+  // mm-coordinates in i -> voxel coordinates in f.
+  NEWMAT::Matrix iA = A.i() * out.sampling_mat();
+  NEWMAT::Matrix iM = f.sampling_mat().i();
+
+  std::vector<unsigned int> nrows = RGT_UTILS::rows_per_thread(static_cast<unsigned int>(out.ysize()),nthr._n);
+  std::vector<std::thread> threads(nthr._n-1); // + main thread makes nthr
+  for (unsigned int i=0; i<nthr._n-1; i++) {
+    threads[i] = std::thread(RGT_UTILS::displacements_no_iT<T,DisplacementFieldView>,nrows[i],nrows[i+1],std::ref(f),std::ref(slices),std::ref(iA),
+			     std::ref(d),std::ref(defdir),std::ref(iM),std::ref(derivdir),std::ref(out),std::ref(deriv),valid);
+  }
+  RGT_UTILS::displacements_no_iT(nrows[nthr._n-1],nrows[nthr._n],f,slices,iA,d,defdir,iM,derivdir,out,deriv,valid);
+  std::for_each(threads.begin(),threads.end(),std::mem_fn(&std::thread::join)); // Join the threads
+
+  // out is in the space of the field, so it is expected to already have its s/qform set
+  RGT_UTILS::set_sqform(f,nofield,defdir,iA,nullptr,nullptr,out,deriv);
+
+  f.setextrapolationmethod(oldex);
+}
+
+
+/////////////////////////////////////////////////////////////////////
+//
+// As the first version, but with the displacements evaluated from
+// spline coefficients by a SplineDisplacementSource. Displacements
+// are in all three directions, and the output volume can be in any
+// space (given by TT) and any subset of slices.
+//
+/////////////////////////////////////////////////////////////////////
+
+template <class T>
+void raw_general_transform(// Input
+			   const volume<T>&                  f,        // Input volume
+			   const NEWMAT::Matrix&             A,        // 4x4 affine transformation matrix
+			   const SplineDisplacementSource&   d,        // Displacement fields in mm (also defines space of t)
+			   const std::vector<int>&           derivdir, // Directions of derivatives
+			   std::vector<unsigned int>         slices,   // Vector of slices (in out) that should be resampled (N.B. copy is intentional)
+			   const NEWMAT::Matrix              *TT,      // Mapping of out onto t
+			   const NEWMAT::Matrix              *M,       // Mapping of in onto s
+			   // Output
+			   volume<T>&                        out,      // Output volume
+			   volume4D<T>&                      deriv,    // Partial derivatives. Note that the derivatives are in units "per voxel"
+			   volume<char>                      *valid,   // Mask indicating what voxels fell inside original fov
+			   // Optional input
+			   Utilities::NoOfThreads            nthr=Utilities::NoOfThreads(1)) // No. of threads. N.B. threading in y-direction
+{
+  // Validate input
+  std::vector<int> defdir = {0, 1, 2};
+  volume4D<float> nofield;
+  auto [valinp,msg] = RGT_UTILS::validate_input(A,TT,M,nofield,std::vector<int>(),derivdir,slices,out,deriv,valid);
+  if (!valinp) throw WarpFnsException("NEWIMAGE::raw_general_transform: "+msg);
+
+  // Assume we should resample all slices if slices vector is empty
+  if (slices.size()==0) { slices.resize(out.zsize()); std::iota(slices.begin(),slices.end(),0); }
+
+  // Save old extrapolation settings and set new
+  extrapolation oldex = f.getextrapolationmethod();
+  if ((oldex==boundsassert) || (oldex==boundsexception)) f.setextrapolationmethod(constpad);
+
+  // Voxel coordinates in out -> voxel coordinates in the field,
+  // voxel coordinates in the field -> mm-coordinates in i and
+  // mm-coordinates in i -> voxel coordinates in f.
+  NEWMAT::Matrix iT = d.sampling_mat().i() * out.sampling_mat();
+  if (TT) iT = d.sampling_mat().i() * TT->i() * out.sampling_mat();
+  NEWMAT::Matrix iA = A.i() * d.sampling_mat();
+  NEWMAT::Matrix iM(4,4);
+  if (M) iM = f.sampling_mat().i() * M->i();
+  else iM = f.sampling_mat().i();
+
+  std::vector<unsigned int> nrows = RGT_UTILS::rows_per_thread(static_cast<unsigned int>(out.ysize()),nthr._n);
+  std::vector<std::thread> threads(nthr._n-1); // + main thread makes nthr
+  for (unsigned int i=0; i<nthr._n-1; i++) {
+    threads[i] = std::thread(RGT_UTILS::displacements_from_source<T,SplineDisplacementSource>,nrows[i],nrows[i+1],std::ref(f),std::ref(slices),
+			     std::ref(iT),std::ref(iA),std::ref(d),std::ref(iM),std::ref(derivdir),std::ref(out),std::ref(deriv),valid);
+  }
+  RGT_UTILS::displacements_from_source(nrows[nthr._n-1],nrows[nthr._n],f,slices,iT,iA,d,iM,derivdir,out,deriv,valid);
+  std::for_each(threads.begin(),threads.end(),std::mem_fn(&std::thread::join)); // Join the threads
+
+  // Coefficient files carry no s/qform for the field, so nofield is as good as any
+  RGT_UTILS::set_sqform(f,nofield,defdir,iA,TT,M,out,deriv);
+
+  f.setextrapolationmethod(oldex);
+}
+
+
+/////////////////////////////////////////////////////////////////////
+//
+// Resampling through a CompositeWarp, i.e. through any number of
+// affines and displacement fields in one go. The space of out is
+// the output space of the last stage of w, and f is in the input
+// space of the first stage. If jac is non-null it is set to the
+// Jacobian determinant of the composed mapping.
+//
+/////////////////////////////////////////////////////////////////////
+
+template <class T>
+void raw_general_transform(// Input
+			   const volume<T>&                  f,        // Input volume
+			   const CompositeWarp&              w,        // Chain of affines and warps
+			   const std::vector<int>&           derivdir, // Directions of derivatives
+			   std::vector<unsigned int>         slices,   // Vector of slices (in out) that should be resampled (N.B. copy is intentional)
+			   // Output
+			   volume<T>&                        out,      // Output volume
+			   volume4D<T>&                      deriv,    // Partial derivatives. Note that the derivatives are in units "per voxel"
+			   volume<char>                      *valid,   // Mask indicating what voxels fell inside original fov
+			   volume<float>                     *jac,     // Jacobian determinant of the mapping
+			   // Optional input
+			   Utilities::NoOfThreads            nthr=Utilities::NoOfThreads(1)) // No. of threads. N.B. threading in y-direction
+{
+  // Validate input
+  std::vector<int> defdir = {0, 1, 2};
+  volume4D<float> nofield;
+  NEWMAT::Matrix I = NEWMAT::IdentityMatrix(4);
+  auto [valinp,msg] = RGT_UTILS::validate_input(I,nullptr,nullptr,nofield,std::vector<int>(),derivdir,slices,out,deriv,valid);
+  if (!valinp) throw WarpFnsException("NEWIMAGE::raw_general_transform: "+msg);
+  if (jac && !samesize(out,*jac)) throw WarpFnsException("NEWIMAGE::raw_general_transform: vout and jac must have same dimensions");
+
+  // Assume we should resample all slices if slices vector is empty
+  if (slices.size()==0) { slices.resize(out.zsize()); std::iota(slices.begin(),slices.end(),0); }
+
+  // Save old extrapolation settings and set new
+  extrapolation oldex = f.getextrapolationmethod();
+  if ((oldex==boundsassert) || (oldex==boundsexception)) f.setextrapolationmethod(constpad);
+
+  // mm-coordinates in i -> voxel coordinates in f
+  NEWMAT::Matrix iM = f.sampling_mat().i();
+
+  std::vector<unsigned int> nrows = RGT_UTILS::rows_per_thread(static_cast<unsigned int>(out.ysize()),nthr._n);
+  std::vector<std::thread> threads(nthr._n-1); // + main thread makes nthr
+  for (unsigned int i=0; i<nthr._n-1; i++) {
+    threads[i] = std::thread(RGT_UTILS::displacements_from_composite<T,CompositeWarp>,nrows[i],nrows[i+1],std::ref(f),std::ref(slices),
+			     std::ref(w),std::ref(iM),std::ref(derivdir),std::ref(out),std::ref(deriv),valid,jac);
+  }
+  RGT_UTILS::displacements_from_composite(nrows[nthr._n-1],nrows[nthr._n],f,slices,w,iM,derivdir,out,deriv,valid,jac);
+  std::for_each(threads.begin(),threads.end(),std::mem_fn(&std::thread::join)); // Join the threads
+
+  // out is already in its final space, so it keeps whatever s/qform it has
+  RGT_UTILS::set_sqform(f,nofield,defdir,I,nullptr,nullptr,out,deriv);
+  if (jac) {
+    jac->set_sform(out.sform_code(),out.sform_mat());
+    jac->set_qform(out.qform_code(),out.qform_mat());
+  }
+
+  f.setextrapolationmethod(oldex);
+}
+
+
 /////////////////////////////////////////////////////////////////////
 //
 // The following two routines are slightly simplified interfaces
@@ -983,6 +1469,359 @@ void raw_general_transform(// Input
   }
 
 
+  // As above, but with the displacements evaluated from spline coefficients.
+  // A is typically the affine part of a coefficient file (FnirtFileReader::AffineMat()).
+
+  template<class T>
+  void apply_warp(// Input
+		  const volume<T>&                   vin,         // Input volume
+		  const NEWMAT::Matrix&              A,           // 4x4 affine transform
+		  const SplineDisplacementSource&    d,           // Displacement fields
+		  const NEWMAT::Matrix&              TT,
+		  const NEWMAT::Matrix&              M,
+		  // Output
+		  volume<T>&                         vout,        // Resampled output volume
+		  // Optional input
+		  Utilities::NoOfThreads             nthreads=Utilities::NoOfThreads(1))
+  {
+    std::vector<int>          derivdir;
+    std::vector<unsigned int> slices; // Means all slices will be resampled
+    volume4D<T>               deriv;
+    const NEWMAT::Matrix      *Tptr = nullptr;
+    const NEWMAT::Matrix      *Mptr = nullptr;
+
+    if ((TT-NEWMAT::IdentityMatrix(4)).MaximumAbsoluteValue() > 1e-6) Tptr = &TT;
+    if ((M-NEWMAT::IdentityMatrix(4)).MaximumAbsoluteValue() > 1e-6) Mptr = &M;
+
+    raw_general_transform(vin,A,d,derivdir,slices,Tptr,Mptr,vout,deriv,nullptr,nthreads);
+  }
+
+  template<class T>
+  void apply_warp(// Input
+		  const volume<T>&                   vin,         // Input volume
+		  const NEWMAT::Matrix&              A,           // 4x4 affine transform
+		  const SplineDisplacementSource&    d,           // Displacement fields
+		  const NEWMAT::Matrix&              TT,
+		  const NEWMAT::Matrix&              M,
+		  const std::vector<unsigned int>&   slices,
+		  // Output
+		  volume<T>&                         vout,        // Resampled output volume
+		  volume<char>&                      mask,        // Set when inside original volume
+		  // Optional input
+		  Utilities::NoOfThreads             nthreads=Utilities::NoOfThreads(1))
+  {
+    std::vector<int>          derivdir;
+    volume4D<T>               deriv;
+    const NEWMAT::Matrix      *Tptr = nullptr;
+    const NEWMAT::Matrix      *Mptr = nullptr;
+
+    if (!samesize(vout,mask)) { // Just to be certain
+      mask.reinitialize(vout.xsize(),vout.ysize(),vout.zsize());
+      copybasicproperties(vout,mask);
+      mask = 0;
+    }
+
+    if ((TT-NEWMAT::IdentityMatrix(4)).MaximumAbsoluteValue() > 1e-6) Tptr = &TT;
+    if ((M-NEWMAT::IdentityMatrix(4)).MaximumAbsoluteValue() > 1e-6) Mptr = &M;
+
+    raw_general_transform(vin,A,d,derivdir,slices,Tptr,Mptr,vout,deriv,&mask,nthreads);
+  }
+
+
+  // Resampling through a chain of affines and warps, see CompositeWarp.
+  // The size and s/qform of vout define the output space.
+
+  template<class T>
+  void apply_warp(// Input
+		  const volume<T>&                   vin,         // Input volume
+		  const CompositeWarp&               w,           // Chain of affines and warps
+		  // Output
+		  volume<T>&                         vout,        // Resampled output volume
+		  // Optional input
+		  Utilities::NoOfThreads             nthreads=Utilities::NoOfThreads(1))
+  {
+    std::vector<int>          derivdir;
+    std::vector<unsigned int> slices; // Means all slices will be resampled
+    volume4D<T>               deriv;
+
+    raw_general_transform(vin,w,derivdir,slices,vout,deriv,nullptr,nullptr,nthreads);
+  }
+
+  template<class T>
+  void apply_warp(// Input
+		  const volume<T>&                   vin,         // Input volume
+		  const CompositeWarp&               w,           // Chain of affines and warps
+		  const std::vector<unsigned int>&   slices,
+		  // Output
+		  volume<T>&                         vout,        // Resampled output volume
+		  volume<char>&                      mask,        // Set when inside original volume
+		  volume<float>&                     jac,         // Jacobian determinant of the mapping
+		  // Optional input
+		  Utilities::NoOfThreads             nthreads=Utilities::NoOfThreads(1))
+  {
+    std::vector<int>          derivdir;
+    volume4D<T>               deriv;
+
+    if (!samesize(vout,mask)) {
+      mask.reinitialize(vout.xsize(),vout.ysize(),vout.zsize());
+      copybasicproperties(vout,mask);
+      mask = 0;
+    }
+    if (!samesize(vout,jac)) {
+      jac.reinitialize(vout.xsize(),vout.ysize(),vout.zsize());
+      copybasicproperties(vout,jac);
+      jac = 0.0;
+    }
+
+    raw_general_transform(vin,w,derivdir,slices,vout,deriv,&mask,&jac,nthreads);
+  }
+
+
+/////////////////////////////////////////////////////////////////////
+//
+// Class WarpSamplingPlan
+//
+// When the same warp is applied to all volumes of a 4D series the
+// coordinates at which the input is sampled are the same for every
+// volume. The plan calculates them once (exactly as they would be
+// calculated by raw_general_transform) and stores, for each output
+// voxel, the linear index of the "lower" neighbour and the trilinear
+// weights. Apply() then resamples all volumes of a series with the
+// plan, split over threads in the t-direction, which is a pure
+// gather. Voxels whose neighbourhood is not entirely inside the
+// input, and all voxels when the interpolation method is not
+// trilinear, are resampled through volume<T>::interpolate from their
+// stored coordinates so that extrapolation etc is unchanged.
+// The input passed to the constructor provides the geometry and
+// interpolation/extrapolation settings that the series is expected
+// to have, and out the size and geometry of the output space.
+//
+/////////////////////////////////////////////////////////////////////
+
+  template <class T>
+  class WarpSamplingPlan
+  {
+  public:
+    WarpSamplingPlan(const volume<T>&          f,        // Input (only geometry and interpolation used)
+		     const NEWMAT::Matrix&     A,        // 4x4 affine transformation matrix
+		     const volume4D<float>&    d,        // Displacement fields in mm (empty for affine only)
+		     const NEWMAT::Matrix      *TT,      // Mapping of out onto t
+		     const NEWMAT::Matrix      *M,       // Mapping of in onto s
+		     const volume<T>&          out,      // Defines output space
+		     Utilities::NoOfThreads    nthr=Utilities::NoOfThreads(1));
+    // Resamples all volumes of in. out must have the xyz-size of the output space.
+    void Apply(const volume<T>&        in,
+	       volume<T>&              out,
+	       Utilities::NoOfThreads  nthr=Utilities::NoOfThreads(1)) const;
+    // Mask indicating what voxels fell inside the original fov
+    void Valid(volume<char>& mask) const;
+    int64_t NVoxels() const { return(static_cast<int64_t>(_indx.size())); }
+  private:
+    struct Fallback { int64_t vox; float x, y, z; };
+    int                       _isz[3];   // Size of input
+    int                       _osz[3];   // Size of output
+    interpolation             _interp;   // Interpolation method of input at time of planning
+    std::vector<int64_t>      _indx;     // Index of "lower" neighbour in input, -1 if a fallback
+    std::vector<float>        _w;        // Trilinear weights, three per voxel
+    std::vector<char>         _valid;
+    std::vector<Fallback>     _fb;       // Voxels that are resampled through interpolate()
+    // What is needed for setting the s/qform of the output
+    std::vector<int>          _defdir;
+    volume4D<float>           _dhdr;     // 1x1x1 with the s/qform of d
+    NEWMAT::Matrix            _iA;
+    NEWMAT::Matrix            _TT, _M;
+    bool                      _hasTT, _hasM;
+
+    void apply_range(const volume<T>& in, T *optr, int64_t first_t, int64_t last_t) const;
+  };
+
+  template <class T>
+  WarpSamplingPlan<T>::WarpSamplingPlan(const volume<T>&          f,
+					const NEWMAT::Matrix&     A,
+					const volume4D<float>&    d,
+					const NEWMAT::Matrix      *TT,
+					const NEWMAT::Matrix      *M,
+					const volume<T>&          out,
+					Utilities::NoOfThreads    nthr)
+  : _defdir(d.tsize()), _hasTT(TT!=nullptr), _hasM(M!=nullptr)
+  {
+    std::iota(_defdir.begin(),_defdir.end(),0);
+    std::vector<int> derivdir;
+    std::vector<unsigned int> slices;
+    volume4D<T> deriv;
+    auto [valinp,msg] = RGT_UTILS::validate_input(A,TT,M,d,_defdir,derivdir,slices,out,deriv,static_cast<volume<char> *>(nullptr));
+    if (!valinp) throw WarpFnsException("NEWIMAGE::WarpSamplingPlan: "+msg);
+
+    _isz[0] = f.xsize(); _isz[1] = f.ysize(); _isz[2] = f.zsize();
+    _osz[0] = out.xsize(); _osz[1] = out.ysize(); _osz[2] = out.zsize();
+    _interp = f.getinterpolationmethod();
+    if (TT) _TT = *TT;
+    if (M) _M = *M;
+    _dhdr.reinitialize(1,1,1);
+    if (d.tsize()) {
+      _dhdr.set_sform(d.sform_code(),d.sform_mat());
+      _dhdr.set_qform(d.qform_code(),d.qform_mat());
+    }
+
+    // Matrices as in raw_general_transform
+    auto [oldex,d_oldex,d_old_epvalidity] = RGT_UTILS::set_extrapolation(f,d);
+    auto [iT,useiT] = RGT_UTILS::make_iT(d,out,TT);
+    _iA = A.i();
+    if (d.tsize()) _iA = _iA * d[0].sampling_mat();
+    else _iA = _iA * out.sampling_mat();
+    NEWMAT::Matrix iM(4,4);
+    if (M) iM = f.sampling_mat().i() * M->i();
+    else iM = f.sampling_mat().i();
+
+    // Calculate coordinates in f of all output voxels
+    int64_t nvox = out.nvoxels();
+    std::vector<float> x(nvox), y(nvox), z(nvox);
+    _valid.resize(nvox);
+    std::vector<unsigned int> nrows = RGT_UTILS::rows_per_thread(static_cast<unsigned int>(_osz[1]),nthr._n);
+    std::vector<std::thread> threads(nthr._n-1); // + main thread makes nthr
+    for (unsigned int i=0; i<nthr._n-1; i++) {
+      threads[i] = std::thread(RGT_UTILS::sampling_coordinates<T>,nrows[i],nrows[i+1],std::ref(f),std::ref(d),std::ref(_defdir),useiT,
+			       std::ref(iT),std::ref(_iA),std::ref(iM),std::ref(_osz),&x[0],&y[0],&z[0],&_valid[0]);
+    }
+    RGT_UTILS::sampling_coordinates(nrows[nthr._n-1],nrows[nthr._n],f,d,_defdir,useiT,iT,_iA,iM,_osz,&x[0],&y[0],&z[0],&_valid[0]);
+    std::for_each(threads.begin(),threads.end(),std::mem_fn(&std::thread::join));
+
+    f.setextrapolationmethod(oldex);
+    if (d.tsize()) {
+      d.setextrapolationmethod(d_oldex);
+      d.setextrapolationvalidity(d_old_epvalidity[0],d_old_epvalidity[1],d_old_epvalidity[2]);
+    }
+
+    // Turn them into indicies and weights. N.B. that the weights are
+    // calculated as in RGT_UTILS::sample_row, so that the results are
+    // identical to those of raw_general_transform.
+    _indx.resize(nvox);
+    _w.resize(3*nvox);
+    const int64_t xs = _isz[0], ys = _isz[1], zs = _isz[2], xys = xs*ys;
+    for (int64_t v=0; v<nvox; v++) {
+      int64_t ix = static_cast<int64_t>(std::floor(x[v]));
+      int64_t iy = static_cast<int64_t>(std::floor(y[v]));
+      int64_t iz = static_cast<int64_t>(std::floor(z[v]));
+      bool inside = _interp==trilinear && ix>=0 && iy>=0 && iz>=0 && ix<xs-1 && iy<ys-1 && iz<zs-1;
+      if (inside) {
+	_indx[v] = iz*xys + iy*xs + ix;
+	_w[3*v] = x[v] - static_cast<float>(ix);
+	_w[3*v+1] = y[v] - static_cast<float>(iy);
+	_w[3*v+2] = z[v] - static_cast<float>(iz);
+      }
+      else {
+	_indx[v] = -1;
+	_fb.push_back(Fallback{v,x[v],y[v],z[v]});
+      }
+    }
+  }
+
+  template <class T>
+  void WarpSamplingPlan<T>::Apply(const volume<T>&        in,
+				  volume<T>&              out,
+				  Utilities::NoOfThreads  nthr) const
+  {
+    if (in.xsize() != _isz[0] || in.ysize() != _isz[1] || in.zsize() != _isz[2]) {
+      throw WarpFnsException("NEWIMAGE::WarpSamplingPlan::Apply: Size mismatch between plan and input");
+    }
+    if (in.getinterpolationmethod() != _interp) {
+      throw WarpFnsException("NEWIMAGE::WarpSamplingPlan::Apply: Input has different interpolation method from when plan was made");
+    }
+    if (out.xsize() != _osz[0] || out.ysize() != _osz[1] || out.zsize() != _osz[2]) {
+      throw WarpFnsException("NEWIMAGE::WarpSamplingPlan::Apply: Size mismatch between plan and output");
+    }
+    if (out.tsize() != in.tsize()) {
+      volume<T> tmp(_osz[0],_osz[1],_osz[2],in.tsize());
+      copybasicproperties(out,tmp);
+      out = tmp;
+    }
+    out.setTR(in.TR());
+
+    extrapolation oldex = in.getextrapolationmethod();
+    if ((oldex==boundsassert) || (oldex==boundsexception)) in.setextrapolationmethod(constpad);
+
+    // The kernel (sinc) interpolators share scratch space between all
+    // copies of a volume, so they cannot be used from several threads.
+    int64_t nt = std::max(int64_t(1),std::min(static_cast<int64_t>(nthr._n),in.tsize()));
+    if (_interp==sinc || _interp==userkernel) nt = 1;
+    std::vector<unsigned int> tpt = RGT_UTILS::rows_per_thread(static_cast<unsigned int>(in.tsize()),static_cast<unsigned int>(nt));
+    T *optr = out.nsfbegin();
+    std::vector<std::thread> threads(nt-1); // + main thread makes nt
+    for (int64_t i=0; i<nt-1; i++) {
+      threads[i] = std::thread(&WarpSamplingPlan<T>::apply_range,this,std::ref(in),optr,tpt[i],tpt[i+1]);
+    }
+    apply_range(in,optr,tpt[nt-1],tpt[nt]);
+    std::for_each(threads.begin(),threads.end(),std::mem_fn(&std::thread::join));
+
+    in.setextrapolationmethod(oldex);
+    volume4D<T> deriv;
+    RGT_UTILS::set_sqform(in,_dhdr,_defdir,_iA,_hasTT ? &_TT : nullptr,_hasM ? &_M : nullptr,out,deriv);
+  }
+
+  template <class T>
+  void WarpSamplingPlan<T>::apply_range(const volume<T>& in, T *optr, int64_t first_t, int64_t last_t) const
+  {
+    const int64_t xs = _isz[0], xys = int64_t(_isz[0])*_isz[1];
+    const int64_t nvox = static_cast<int64_t>(_indx.size());
+    for (int64_t t=first_t; t<last_t; t++) {
+      const T *data = in.fbegin(t);
+      T *o = optr + t*nvox;
+      for (int64_t v=0; v<nvox; v++) {
+	if (_indx[v] < 0) continue;
+	const T *p = data + _indx[v];
+	float v000 = static_cast<float>(p[0]), v100 = static_cast<float>(p[1]);
+	float v010 = static_cast<float>(p[xs]), v110 = static_cast<float>(p[xs+1]);
+	float v001 = static_cast<float>(p[xys]), v101 = static_cast<float>(p[xys+1]);
+	float v011 = static_cast<float>(p[xys+xs]), v111 = static_cast<float>(p[xys+xs+1]);
+	float dx = _w[3*v], dy = _w[3*v+1], dz = _w[3*v+2];
+	float temp1 = (v100 - v000)*dx + v000;
+	float temp2 = (v101 - v001)*dx + v001;
+	float temp3 = (v110 - v010)*dx + v010;
+	float temp4 = (v111 - v011)*dx + v011;
+	float temp5 = (temp3 - temp1)*dy + temp1;
+	float temp6 = (temp4 - temp2)*dy + temp2;
+	o[v] = static_cast<T>((temp6 - temp5)*dz + temp5);
+      }
+      if (_fb.size()) {
+	const ShadowVolume<T> ft = in[t];
+	for (const Fallback& fb : _fb) o[fb.vox] = static_cast<T>(ft.interpolate(fb.x,fb.y,fb.z));
+      }
+    }
+  }
+
+  template <class T>
+  void WarpSamplingPlan<T>::Valid(volume<char>& mask) const
+  {
+    if (mask.xsize() != _osz[0] || mask.ysize() != _osz[1] || mask.zsize() != _osz[2] || mask.tsize() != 1) {
+      mask.reinitialize(_osz[0],_osz[1],_osz[2]);
+    }
+    std::copy(_valid.begin(),_valid.end(),mask.nsfbegin());
+  }
+
+  // Resamples all volumes of the 4D series vin with the same warp
+  template<class T>
+  void apply_warp_4D(// Input
+		     const volume<T>&        vin,         // Input 4D series
+		     const NEWMAT::Matrix&   A,           // 4x4 affine transform
+		     const volume4D<float>&  d,           // Displacement fields
+		     const NEWMAT::Matrix&   TT,
+		     const NEWMAT::Matrix&   M,
+		     // Output
+		     volume<T>&              vout,        // Resampled output series. Must have the xyz-size of the output space.
+		     // Optional input
+		     Utilities::NoOfThreads  nthreads=Utilities::NoOfThreads(1))
+  {
+    const NEWMAT::Matrix      *Tptr = nullptr;
+    const NEWMAT::Matrix      *Mptr = nullptr;
+
+    if ((TT-NEWMAT::IdentityMatrix(4)).MaximumAbsoluteValue() > 1e-6) Tptr = &TT;
+    if ((M-NEWMAT::IdentityMatrix(4)).MaximumAbsoluteValue() > 1e-6) Mptr = &M;
+
+    WarpSamplingPlan<T> plan(vin,A,d,Tptr,Mptr,vout,nthreads);
+    plan.Apply(vin,vout,nthreads);
+  }
+
+
 /////////////////////////////////////////////////////////////////////
 //
 // The following three routines are interfaces to mimick the old
@@ -1294,6 +2133,72 @@ void raw_general_transform(// Input
     raw_general_transform(vin,aff,df,dir,dir,vout,deriv,invol,nthreads);
   }
 
+  template <class T>
+  void general_transform(// Input
+			 const volume<T>&               vin,
+			 const NEWMAT::Matrix&          aff,
+			 const DisplacementFieldView&   df,
+			 // Output
+			 volume<T>&                     vout,
+			 // Optional input
+			 Utilities::NoOfThreads         nthreads=Utilities::NoOfThreads(1))
+  {
+    std::vector<int>  pderivdir;
+    volume4D<T>       pderiv;
+
+    raw_general_transform(vin,aff,df,pderivdir,vout,pderiv,nullptr,nthreads);
+  }
+
+  template <class T>
+  void general_transform(// Input
+			 const volume<T>&               vin,
+			 const NEWMAT::Matrix&          aff,
+			 const DisplacementFieldView&   df,
+			 // Output
+			 volume<T>&                     vout,
+			 volume<char>&                  invol,
+			 // Optional input
+			 Utilities::NoOfThreads         nthreads=Utilities::NoOfThreads(1))
+  {
+    std::vector<int>  pderivdir;
+    volume4D<T>       pderiv;
+
+    raw_general_transform(vin,aff,df,pderivdir,vout,pderiv,&invol,nthreads);
+  }
+
+  template <class T>
+  void general_transform_3partial(// Input
+				  const volume<T>&               vin,
+				  const NEWMAT::Matrix&          aff,
+				  const DisplacementFieldView&   df,
+				  // Output
+				  volume<T>&                     vout,
+				  volume4D<T>&                   deriv,
+				  // Optional input
+				  Utilities::NoOfThreads         nthreads=Utilities::NoOfThreads(1))
+  {
+    std::vector<int>   dir = {0, 1, 2};
+
+    raw_general_transform(vin,aff,df,dir,vout,deriv,nullptr,nthreads);
+  }
+
+  template <class T>
+  void general_transform_3partial(// Input
+				  const volume<T>&               vin,
+				  const NEWMAT::Matrix&          aff,
+				  const DisplacementFieldView&   df,
+				  // Output
+				  volume<T>&                     vout,
+				  volume4D<T>&                   deriv,
+				  volume<char>&                  invol,
+				  // Optional input
+				  Utilities::NoOfThreads         nthreads=Utilities::NoOfThreads(1))
+  {
+    std::vector<int>   dir = {0, 1, 2};
+
+    raw_general_transform(vin,aff,df,dir,vout,deriv,&invol,nthreads);
+  }
+
   //
   // This routine mimics some of the code in raw_general_transform.
   // Ideally they should be re-written to allow for code re-use
@@ -1408,6 +2313,96 @@ std::tuple<NEWMAT::Matrix,bool> make_iT(const NEWIMAGE::volume4D<float>& d,
   return(std::make_tuple(iT,useiT));
 }
 
+/// Scratch space for resampling one row of the output volume. x, y and z
+/// are filled with voxel coordinates in f before calling sample_row, which
+/// returns values in val and (if asked for) partials in dfdx, dfdy and dfdz.
+struct RowBuffer
+{
+  RowBuffer(unsigned int n) : x(n), y(n), z(n), val(n), dfdx(n), dfdy(n), dfdz(n), wx(n), wy(n), wz(n), indx(n) {}
+  std::vector<float>    x, y, z;               // Input coordinates
+  std::vector<float>    val, dfdx, dfdy, dfdz; // Output
+  std::vector<float>    wx, wy, wz;            // Fractional parts of coordinates
+  std::vector<int64_t>  indx;                  // Linear index of "lower" neighbour, -1 if (partly) outside
+};
+
+// Tri-linear interpolation is done in two passes over the row. The first
+// computes weights and linear indicies (and is simple enough for the
+// compiler to vectorise), the second gathers the eight neighbours straight
+// from the data and combines them, using the same arithmetic as
+// volume<T>::interpolate and volume<T>::interp3partial. Points whose
+// neighbourhood is not entirely inside f, and all other interpolation
+// methods, are handed to the volume<T> member functions.
+template <class T>
+void sample_row(const NEWIMAGE::volume<T>& f,
+		unsigned int               n,
+		RowBuffer&                 rb,
+		bool                       derivs)
+{
+  if (f.getinterpolationmethod() != NEWIMAGE::trilinear) {
+    for (unsigned int i=0; i<n; i++) {
+      if (derivs) rb.val[i] = f.interp3partial(rb.x[i],rb.y[i],rb.z[i],&rb.dfdx[i],&rb.dfdy[i],&rb.dfdz[i]);
+      else rb.val[i] = f.interpolate(rb.x[i],rb.y[i],rb.z[i]);
+    }
+    return;
+  }
+
+  const int64_t xs = f.xsize(), ys = f.ysize(), zs = f.zsize();
+  const int64_t xys = xs*ys;
+  for (unsigned int i=0; i<n; i++) {
+    int64_t ix = static_cast<int64_t>(std::floor(rb.x[i]));
+    int64_t iy = static_cast<int64_t>(std::floor(rb.y[i]));
+    int64_t iz = static_cast<int64_t>(std::floor(rb.z[i]));
+    rb.wx[i] = rb.x[i] - static_cast<float>(ix);
+    rb.wy[i] = rb.y[i] - static_cast<float>(iy);
+    rb.wz[i] = rb.z[i] - static_cast<float>(iz);
+    bool inside = ix>=0 && iy>=0 && iz>=0 && ix<xs-1 && iy<ys-1 && iz<zs-1;
+    rb.indx[i] = inside ? iz*xys + iy*xs + ix : -1;
+  }
+
+  const T *data = f.fbegin();
+  for (unsigned int i=0; i<n; i++) {
+    if (rb.indx[i] < 0) {
+      if (derivs) rb.val[i] = f.interp3partial(rb.x[i],rb.y[i],rb.z[i],&rb.dfdx[i],&rb.dfdy[i],&rb.dfdz[i]);
+      else rb.val[i] = f.interpolate(rb.x[i],rb.y[i],rb.z[i]);
+      continue;
+    }
+    const T *p = data + rb.indx[i];
+    float v000 = static_cast<float>(p[0]), v100 = static_cast<float>(p[1]);
+    float v010 = static_cast<float>(p[xs]), v110 = static_cast<float>(p[xs+1]);
+    float v001 = static_cast<float>(p[xys]), v101 = static_cast<float>(p[xys+1]);
+    float v011 = static_cast<float>(p[xys+xs]), v111 = static_cast<float>(p[xys+xs+1]);
+    float dx = rb.wx[i], dy = rb.wy[i], dz = rb.wz[i];
+    if (!derivs) { // As q_tri_interpolation
+      float temp1 = (v100 - v000)*dx + v000;
+      float temp2 = (v101 - v001)*dx + v001;
+      float temp3 = (v110 - v010)*dx + v010;
+      float temp4 = (v111 - v011)*dx + v011;
+      float temp5 = (temp3 - temp1)*dy + temp1;
+      float temp6 = (temp4 - temp2)*dy + temp2;
+      rb.val[i] = (temp6 - temp5)*dz + temp5;
+    }
+    else { // As interp3partial
+      float onemdz = 1.0-dz;
+      float onemdy = 1.0-dy;
+      float tmp11 = onemdz*v000 + dz*v001;
+      float tmp12 = onemdz*v010 + dz*v011;
+      float tmp13 = onemdz*v100 + dz*v101;
+      float tmp14 = onemdz*v110 + dz*v111;
+      rb.dfdx[i] = onemdy*(tmp13-tmp11) + dy*(tmp14-tmp12);
+      rb.dfdy[i] = (1.0-dx)*(tmp12-tmp11) + dx*(tmp14-tmp13);
+      tmp11 = onemdy*v000 + dy*v010;
+      tmp12 = onemdy*v001 + dy*v011;
+      tmp13 = onemdy*v100 + dy*v110;
+      tmp14 = onemdy*v101 + dy*v111;
+      float tmp21 = (1.0-dx)*tmp11 + dx*tmp13;
+      float tmp22 = (1.0-dx)*tmp12 + dx*tmp14;
+      rb.dfdz[i] = tmp22 - tmp21;
+      rb.val[i] = onemdz*tmp21 + dz*tmp22;
+    }
+  }
+  return;
+}
+
 // This function is used for resampling using an affine transform
 // only when no derivates are needed. The parallellisation is along
 // the y-direction.
@@ -1426,6 +2421,7 @@ void affine_no_derivs(// Input
   float A21=A(2,1), A22=A(2,2), A23=A(2,3), A24=A(2,4);
   float A31=A(3,1), A32=A(3,2), A33=A(3,3), A34=A(3,4);
 
+  RowBuffer rb(out.xsize());
   for (unsigned int si=0; si<slices.size(); si++) {
     int k = static_cast<int>(slices[si]);
     for (int j=static_cast<int>(first_j); j<static_cast<int>(last_j); j++) {
@@ -1433,10 +2429,14 @@ void affine_no_derivs(// Input
       float y = j*A22 + k*A23 + A24;
       float z = j*A32 + k*A33 + A34;
       for (int i=0; i<out.xsize(); i++) {
-	out(i,j,k) = static_cast<T>(f.interpolate(x,y,z));
-	if (valid != nullptr) (*valid)(i,j,k) = f.valid(x,y,z) ? 1 : 0;
+	rb.x[i] = x; rb.y[i] = y; rb.z[i] = z;
 	x += A11; y += A21; z += A31;
       }
+      sample_row(f,out.xsize(),rb,false);
+      for (int i=0; i<out.xsize(); i++) {
+	out(i,j,k) = static_cast<T>(rb.val[i]);
+	if (valid != nullptr) (*valid)(i,j,k) = f.valid(rb.x[i],rb.y[i],rb.z[i]) ? 1 : 0;
+      }
     }
   }
 
@@ -1463,25 +2463,30 @@ void affine_with_derivs(// Input
   float A21=A(2,1), A22=A(2,2), A23=A(2,3), A24=A(2,4);
   float A31=A(3,1), A32=A(3,2), A33=A(3,3), A34=A(3,4);
 
+  RowBuffer rb(out.xsize());
   for (unsigned int si=0; si<slices.size(); si++) {
     int k = static_cast<int>(slices[si]);
     for (int j=static_cast<int>(first_j); j<static_cast<int>(last_j); j++) {
       float x = j*A12 + k*A13 + A14;
       float y = j*A22 + k*A23 + A24;
       float z = j*A32 + k*A33 + A34;
+      for (int i=0; i<out.xsize(); i++) {
+	rb.x[i] = x; rb.y[i] = y; rb.z[i] = z;
+	x += A11; y += A21; z += A31;
+      }
+      if (derivdir.size() > 1) sample_row(f,out.xsize(),rb,true);  // Derivative in more than one direction
       for (int i=0; i<out.xsize(); i++) {
 	if (derivdir.size() == 1) { // Derivative in just a single direction
 	  float tmp;
-	  out(i,j,k) = static_cast<T>(f.interp1partial(x,y,z,derivdir[0],&tmp));
+	  out(i,j,k) = static_cast<T>(f.interp1partial(rb.x[i],rb.y[i],rb.z[i],derivdir[0],&tmp));
 	  deriv(i,j,k,0) = static_cast<T>(tmp);
 	}
-	else { // Derivative in more than one direction
-	  float tmp[3];
-	  out(i,j,k) = static_cast<T>(f.interp3partial(x,y,z,&tmp[0],&tmp[1],&tmp[2]));
-	  for (unsigned int di=0; di<derivdir.size(); di++) deriv(i,j,k,di) = static_cast<T>(tmp[derivdir[di]]);
+	else {
+	  float *tmp[3] = {&rb.dfdx[i], &rb.dfdy[i], &rb.dfdz[i]};
+	  out(i,j,k) = static_cast<T>(rb.val[i]);
+	  for (unsigned int di=0; di<derivdir.size(); di++) deriv(i,j,k,di) = static_cast<T>(*tmp[derivdir[di]]);
 	}
-	if (valid != nullptr) (*valid)(i,j,k) = static_cast<char>(f.valid(x,y,z));
-	x += A11; y += A21; z += A31;
+	if (valid != nullptr) (*valid)(i,j,k) = static_cast<char>(f.valid(rb.x[i],rb.y[i],rb.z[i]));
       }
     }
   }
@@ -1490,16 +2495,17 @@ void affine_with_derivs(// Input
 
 // This function is used for resampling using a displacement field
 // when the final target volume is in the same space as the displacement
-// field.
+// field. D is anything that returns the displacement (in mm) in direction
+// di at voxel i,j,k through d(i,j,k,di).
 // The parallellisation is along the y-direction.
-template <class T>
+template <class T, class D>
 void displacements_no_iT(// Input
 			 unsigned int                     first_j,
 			 unsigned int                     last_j,
 			 const NEWIMAGE::volume<T>&       f,
 			 const std::vector<unsigned int>& slices,
 			 const NEWMAT::Matrix&            A,
-			 const NEWIMAGE::volume4D<float>& d,
+			 const D&                         d,        // volume4D<float> or DisplacementFieldView
 			 const std::vector<int>&          defdir,
 			 const NEWMAT::Matrix&            M,
 			 const std::vector<int>&          derivdir,
@@ -1516,30 +2522,38 @@ void displacements_no_iT(// Input
   float M21=M(2,1), M22=M(2,2), M23=M(2,3), M24=M(2,4);
   float M31=M(3,1), M32=M(3,2), M33=M(3,3), M34=M(3,4);
 
-  float x[3], xx[3];
+  float x[3];
+  RowBuffer rb(out.xsize());
   for (unsigned int si=0; si<slices.size(); si++) {
     int k = static_cast<int>(slices[si]);
     for (int j=static_cast<int>(first_j); j<static_cast<int>(last_j); j++) {
+      // Affine part that is constant along the row
+      float b1 = j*A12 + k*A13 + A14;
+      float b2 = j*A22 + k*A23 + A24;
+      float b3 = j*A32 + k*A33 + A34;
       for (int i=0; i<out.xsize(); i++) {
-	x[0] = i*A11 + j*A12 + k*A13 + A14;
-	x[1] = i*A21 + j*A22 + k*A23 + A24;
-	x[2] = i*A31 + j*A32 + k*A33 + A34;
+	x[0] = i*A11 + b1;
+	x[1] = i*A21 + b2;
+	x[2] = i*A31 + b3;
 	for (unsigned int di=0; di<defdir.size(); di++) x[defdir[di]] += d(i,j,k,di);
-	xx[0] = x[0]*M11 + x[1]*M12 + x[2]*M13 + M14;
-	xx[1] = x[0]*M21 + x[1]*M22 + x[2]*M23 + M24;
-	xx[2] = x[0]*M31 + x[1]*M32 + x[2]*M33 + M34;
-	if (derivdir.size() == 0) out(i,j,k) = static_cast<T>(f.interpolate(xx[0],xx[1],xx[2]));
+	rb.x[i] = x[0]*M11 + x[1]*M12 + x[2]*M13 + M14;
+	rb.y[i] = x[0]*M21 + x[1]*M22 + x[2]*M23 + M24;
+	rb.z[i] = x[0]*M31 + x[1]*M32 + x[2]*M33 + M34;
+      }
+      if (derivdir.size() != 1) sample_row(f,out.xsize(),rb,derivdir.size()>1);
+      for (int i=0; i<out.xsize(); i++) {
+	if (derivdir.size() == 0) out(i,j,k) = static_cast<T>(rb.val[i]);
 	else if (derivdir.size() == 1) {
 	  float tmp;
-	  out(i,j,k) = static_cast<T>(f.interp1partial(xx[0],xx[1],xx[2],derivdir[0],&tmp));
+	  out(i,j,k) = static_cast<T>(f.interp1partial(rb.x[i],rb.y[i],rb.z[i],derivdir[0],&tmp));
 	  deriv(i,j,k,0) = static_cast<T>(tmp);
 	}
 	else {
-	  float tmp[3];
-	  out(i,j,k) = static_cast<T>(f.interp3partial(xx[0],xx[1],xx[2],&tmp[0],&tmp[1],&tmp[2]));
-	  for (unsigned int di=0; di<derivdir.size(); di++) deriv(i,j,k,di) = tmp[derivdir[di]];
+	  float *tmp[3] = {&rb.dfdx[i], &rb.dfdy[i], &rb.dfdz[i]};
+	  out(i,j,k) = static_cast<T>(rb.val[i]);
+	  for (unsigned int di=0; di<derivdir.size(); di++) deriv(i,j,k,di) = *tmp[derivdir[di]];
 	}
-	if (valid != nullptr) (*valid)(i,j,k) = static_cast<char>(f.valid(xx[0],xx[1],xx[2]));
+	if (valid != nullptr) (*valid)(i,j,k) = static_cast<char>(f.valid(rb.x[i],rb.y[i],rb.z[i]));
       }
     }
   }
@@ -1614,6 +2628,252 @@ void displacements_with_iT(// Input
   return;
 }
 
+// This function calculates the coordinates in f that raw_general_transform
+// would sample for all voxels in rows first_j--last_j of the output. It
+// uses the same arithmetic as affine_no_derivs, displacements_no_iT and
+// displacements_with_iT so that the coordinates are identical. The output
+// is indexed by the linear index of the output voxel.
+template <class T>
+void sampling_coordinates(// Input
+			  unsigned int                     first_j,
+			  unsigned int                     last_j,
+			  const NEWIMAGE::volume<T>&       f,
+			  const NEWIMAGE::volume4D<float>& d,
+			  const std::vector<int>&          defdir,
+			  bool                             useiT,
+			  const NEWMAT::Matrix&            iT,
+			  const NEWMAT::Matrix&            iA,
+			  const NEWMAT::Matrix&            iM,
+			  const int                        (&osz)[3],
+			  // Output
+			  float                            *x,
+			  float                            *y,
+			  float                            *z,
+			  char                             *valid)
+{
+  if (!defdir.size()) { // Affine only
+    NEWMAT::Matrix B = iM*iA*iT;
+    float B11=B(1,1), B12=B(1,2), B13=B(1,3), B14=B(1,4);
+    float B21=B(2,1), B22=B(2,2), B23=B(2,3), B24=B(2,4);
+    float B31=B(3,1), B32=B(3,2), B33=B(3,3), B34=B(3,4);
+    for (int k=0; k<osz[2]; k++) {
+      for (int j=static_cast<int>(first_j); j<static_cast<int>(last_j); j++) {
+	int64_t v = (int64_t(k)*osz[1] + j)*osz[0];
+	float xx = j*B12 + k*B13 + B14;
+	float yy = j*B22 + k*B23 + B24;
+	float zz = j*B32 + k*B33 + B34;
+	for (int i=0; i<osz[0]; i++, v++) {
+	  x[v] = xx; y[v] = yy; z[v] = zz;
+	  xx += B11; yy += B21; zz += B31;
+	  valid[v] = f.valid(x[v],y[v],z[v]) ? 1 : 0;
+	}
+      }
+    }
+    return;
+  }
+
+  float T11=iT(1,1), T12=iT(1,2), T13=iT(1,3), T14=iT(1,4);
+  float T21=iT(2,1), T22=iT(2,2), T23=iT(2,3), T24=iT(2,4);
+  float T31=iT(3,1), T32=iT(3,2), T33=iT(3,3), T34=iT(3,4);
+
+  float A11=iA(1,1), A12=iA(1,2), A13=iA(1,3), A14=iA(1,4);
+  float A21=iA(2,1), A22=iA(2,2), A23=iA(2,3), A24=iA(2,4);
+  float A31=iA(3,1), A32=iA(3,2), A33=iA(3,3), A34=iA(3,4);
+
+  float M11=iM(1,1), M12=iM(1,2), M13=iM(1,3), M14=iM(1,4);
+  float M21=iM(2,1), M22=iM(2,2), M23=iM(2,3), M24=iM(2,4);
+  float M31=iM(3,1), M32=iM(3,2), M33=iM(3,3), M34=iM(3,4);
+
+  float xv[3], xx[3];
+  for (int k=0; k<osz[2]; k++) {
+    for (int j=static_cast<int>(first_j); j<static_cast<int>(last_j); j++) {
+      int64_t v = (int64_t(k)*osz[1] + j)*osz[0];
+      float b1 = j*A12 + k*A13 + A14;
+      float b2 = j*A22 + k*A23 + A24;
+      float b3 = j*A32 + k*A33 + A34;
+      for (int i=0; i<osz[0]; i++, v++) {
+	char dvalid = 1;
+	if (!useiT) { // As displacements_no_iT
+	  xx[0] = i*A11 + b1;
+	  xx[1] = i*A21 + b2;
+	  xx[2] = i*A31 + b3;
+	  for (unsigned int di=0; di<defdir.size(); di++) xx[defdir[di]] += d(i,j,k,di);
+	}
+	else { // As displacements_with_iT
+	  xv[0] = i*T11 + j*T12 + k*T13 + T14;
+	  xv[1] = i*T21 + j*T22 + k*T23 + T24;
+	  xv[2] = i*T31 + j*T32 + k*T33 + T34;
+	  xx[0] = xv[0]*A11 + xv[1]*A12 + xv[2]*A13 + A14;
+	  xx[1] = xv[0]*A21 + xv[1]*A22 + xv[2]*A23 + A24;
+	  xx[2] = xv[0]*A31 + xv[1]*A32 + xv[2]*A33 + A34;
+	  for (unsigned int di=0; di<defdir.size(); di++) xx[defdir[di]] += d[di].interpolate(xv[0],xv[1],xv[2]);
+	  dvalid = static_cast<char>(d.valid(xv[0],xv[1],xv[2]));
+	}
+	x[v] = xx[0]*M11 + xx[1]*M12 + xx[2]*M13 + M14;
+	y[v] = xx[0]*M21 + xx[1]*M22 + xx[2]*M23 + M24;
+	z[v] = xx[0]*M31 + xx[1]*M32 + xx[2]*M33 + M34;
+	valid[v] = static_cast<char>(f.valid(x[v],y[v],z[v]) && dvalid);
+      }
+    }
+  }
+  return;
+}
+
+// This function is used for resampling with displacements that are
+// evaluated from spline coefficients (S is a SplineDisplacementSource).
+// It covers both the case where out is in the space of the field and
+// where it is not, since the field is evaluated at the exact points
+// in either case. The parallellisation is along the y-direction.
+template <class T, class S>
+void displacements_from_source(// Input
+			       unsigned int                     first_j,
+			       unsigned int                     last_j,
+			       const NEWIMAGE::volume<T>&       f,
+			       const std::vector<unsigned int>& slices,
+			       const NEWMAT::Matrix&            iT,
+			       const NEWMAT::Matrix&            A,
+			       const S&                         d,
+			       const NEWMAT::Matrix&            M,
+			       const std::vector<int>&          derivdir,
+			       // Output
+			       NEWIMAGE::volume<T>&             out,
+			       NEWIMAGE::volume<T>&             deriv,
+			       NEWIMAGE::volume<char>           *valid)
+{
+  float T11=iT(1,1), T12=iT(1,2), T13=iT(1,3), T14=iT(1,4);
+  float T21=iT(2,1), T22=iT(2,2), T23=iT(2,3), T24=iT(2,4);
+  float T31=iT(3,1), T32=iT(3,2), T33=iT(3,3), T34=iT(3,4);
+
+  float A11=A(1,1), A12=A(1,2), A13=A(1,3), A14=A(1,4);
+  float A21=A(2,1), A22=A(2,2), A23=A(2,3), A24=A(2,4);
+  float A31=A(3,1), A32=A(3,2), A33=A(3,3), A34=A(3,4);
+
+  float M11=M(1,1), M12=M(1,2), M13=M(1,3), M14=M(1,4);
+  float M21=M(2,1), M22=M(2,2), M23=M(2,3), M24=M(2,4);
+  float M31=M(3,1), M32=M(3,2), M33=M(3,3), M34=M(3,4);
+
+  unsigned int n = out.xsize();
+  std::vector<float> x(n), y(n), z(n), dx(n), dy(n), dz(n);
+  std::vector<bool> epvalid = f.getextrapolationvalidity();
+  typename S::RowCache cache;
+  RowBuffer rb(n);
+  for (unsigned int si=0; si<slices.size(); si++) {
+    int k = static_cast<int>(slices[si]);
+    for (int j=static_cast<int>(first_j); j<static_cast<int>(last_j); j++) {
+      // Voxel coordinates in the field
+      float b1 = j*T12 + k*T13 + T14;
+      float b2 = j*T22 + k*T23 + T24;
+      float b3 = j*T32 + k*T33 + T34;
+      for (unsigned int i=0; i<n; i++) {
+	x[i] = i*T11 + b1;
+	y[i] = i*T21 + b2;
+	z[i] = i*T31 + b3;
+      }
+      d.Row(n,&x[0],&y[0],&z[0],&dx[0],&dy[0],&dz[0],cache);
+      for (unsigned int i=0; i<n; i++) {
+	float xx[3];
+	xx[0] = x[i]*A11 + y[i]*A12 + z[i]*A13 + A14 + dx[i];
+	xx[1] = x[i]*A21 + y[i]*A22 + z[i]*A23 + A24 + dy[i];
+	xx[2] = x[i]*A31 + y[i]*A32 + z[i]*A33 + A34 + dz[i];
+	rb.x[i] = xx[0]*M11 + xx[1]*M12 + xx[2]*M13 + M14;
+	rb.y[i] = xx[0]*M21 + xx[1]*M22 + xx[2]*M23 + M24;
+	rb.z[i] = xx[0]*M31 + xx[1]*M32 + xx[2]*M33 + M34;
+      }
+      if (derivdir.size() != 1) sample_row(f,n,rb,derivdir.size()>1);
+      for (unsigned int i=0; i<n; i++) {
+	if (derivdir.size() == 0) out(i,j,k) = static_cast<T>(rb.val[i]);
+	else if (derivdir.size() == 1) {
+	  float tmp;
+	  out(i,j,k) = static_cast<T>(f.interp1partial(rb.x[i],rb.y[i],rb.z[i],derivdir[0],&tmp));
+	  deriv(i,j,k,0) = static_cast<T>(tmp);
+	}
+	else {
+	  float *tmp[3] = {&rb.dfdx[i], &rb.dfdy[i], &rb.dfdz[i]};
+	  out(i,j,k) = static_cast<T>(rb.val[i]);
+	  for (unsigned int di=0; di<derivdir.size(); di++) deriv(i,j,k,di) = *tmp[derivdir[di]];
+	}
+	if (valid != nullptr) (*valid)(i,j,k) = static_cast<char>(d.Valid(x[i],y[i],z[i],epvalid) && f.valid(rb.x[i],rb.y[i],rb.z[i]));
+      }
+    }
+  }
+  return;
+}
+
+// This function is used for resampling through a CompositeWarp. The
+// mm-coordinates of each row of out are passed through the chain by
+// w.Row(), which leaves them as mm-coordinates in the space of f.
+// The parallellisation is along the y-direction.
+template <class T, class W>
+void displacements_from_composite(// Input
+				  unsigned int                     first_j,
+				  unsigned int                     last_j,
+				  const NEWIMAGE::volume<T>&       f,
+				  const std::vector<unsigned int>& slices,
+				  const W&                         w,
+				  const NEWMAT::Matrix&            M,
+				  const std::vector<int>&          derivdir,
+				  // Output
+				  NEWIMAGE::volume<T>&             out,
+				  NEWIMAGE::volume<T>&             deriv,
+				  NEWIMAGE::volume<char>           *valid,
+				  NEWIMAGE::volume<float>          *jac)
+{
+  NEWMAT::Matrix S = out.sampling_mat();
+  float S11=S(1,1), S12=S(1,2), S13=S(1,3), S14=S(1,4);
+  float S21=S(2,1), S22=S(2,2), S23=S(2,3), S24=S(2,4);
+  float S31=S(3,1), S32=S(3,2), S33=S(3,3), S34=S(3,4);
+
+  float M11=M(1,1), M12=M(1,2), M13=M(1,3), M14=M(1,4);
+  float M21=M(2,1), M22=M(2,2), M23=M(2,3), M24=M(2,4);
+  float M31=M(3,1), M32=M(3,2), M33=M(3,3), M34=M(3,4);
+
+  unsigned int n = out.xsize();
+  std::vector<float> x(n), y(n), z(n), jrow;
+  std::vector<char> vrow;
+  if (valid != nullptr) vrow.resize(n);
+  if (jac != nullptr) jrow.resize(n);
+  std::vector<bool> epvalid = f.getextrapolationvalidity();
+  typename W::RowCache cache;
+  RowBuffer rb(n);
+  for (unsigned int si=0; si<slices.size(); si++) {
+    int k = static_cast<int>(slices[si]);
+    for (int j=static_cast<int>(first_j); j<static_cast<int>(last_j); j++) {
+      // mm-coordinates in out
+      float b1 = j*S12 + k*S13 + S14;
+      float b2 = j*S22 + k*S23 + S24;
+      float b3 = j*S32 + k*S33 + S34;
+      for (unsigned int i=0; i<n; i++) {
+	x[i] = i*S11 + b1;
+	y[i] = i*S21 + b2;
+	z[i] = i*S31 + b3;
+      }
+      w.Row(n,&x[0],&y[0],&z[0],(valid) ? &vrow[0] : nullptr,(jac) ? &jrow[0] : nullptr,epvalid,cache);
+      for (unsigned int i=0; i<n; i++) {
+	rb.x[i] = x[i]*M11 + y[i]*M12 + z[i]*M13 + M14;
+	rb.y[i] = x[i]*M21 + y[i]*M22 + z[i]*M23 + M24;
+	rb.z[i] = x[i]*M31 + y[i]*M32 + z[i]*M33 + M34;
+      }
+      if (derivdir.size() != 1) sample_row(f,n,rb,derivdir.size()>1);
+      for (unsigned int i=0; i<n; i++) {
+	if (derivdir.size() == 0) out(i,j,k) = static_cast<T>(rb.val[i]);
+	else if (derivdir.size() == 1) {
+	  float tmp;
+	  out(i,j,k) = static_cast<T>(f.interp1partial(rb.x[i],rb.y[i],rb.z[i],derivdir[0],&tmp));
+	  deriv(i,j,k,0) = static_cast<T>(tmp);
+	}
+	else {
+	  float *tmp[3] = {&rb.dfdx[i], &rb.dfdy[i], &rb.dfdz[i]};
+	  out(i,j,k) = static_cast<T>(rb.val[i]);
+	  for (unsigned int di=0; di<derivdir.size(); di++) deriv(i,j,k,di) = *tmp[derivdir[di]];
+	}
+	if (valid != nullptr) (*valid)(i,j,k) = static_cast<char>(vrow[i] && f.valid(rb.x[i],rb.y[i],rb.z[i]));
+	if (jac != nullptr) (*jac)(i,j,k) = jrow[i];
+      }
+    }
+  }
+  return;
+}
+
 //
 // Set the sform and qform appropriately.
 // 1. If the outvol has it's codes set, then leave it.